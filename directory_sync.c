@@ -1,25 +1,196 @@
 /**
  * Directory Synchronizer
  * A client-server application for synchronizing local directory changes to a remote folder
- * Windows-compatible version
+ * Builds on Windows (Winsock) and Linux (POSIX, with an io_uring I/O backend)
  */
-
+ 
+ #ifndef _WIN32
+ #define _GNU_SOURCE                 // pread/pwrite, fstatat, st_mtim, MAP_POPULATE
+ #define _FILE_OFFSET_BITS 64
+ #endif
+ 
  #include <stdio.h>
  #include <stdlib.h>
  #include <string.h>
+ #include <stdint.h>
  #include <time.h>
- #include <windows.h>
+ #include <limits.h>
+ 
+ #ifdef _WIN32
  #include <winsock2.h>
  #include <ws2tcpip.h>
+ #include <windows.h>
  #include <direct.h>
  #include <io.h>
  
  // Link with Winsock library
  #pragma comment(lib, "ws2_32.lib")
  
- #define BUFFER_SIZE 1024
+ #define PATH_SEP '\\'
+ #define OTHER_PATH_SEP '/'
+ #define path_compare _stricmp       // NTFS paths are case-insensitive
+ #define fseek64 _fseeki64
+ #define ftell64 _ftelli64
+ #define SEND_FLAGS 0
+ typedef HANDLE file_handle;
+ #define INVALID_FILE INVALID_HANDLE_VALUE
+ typedef HANDLE thread_handle;
+ typedef CRITICAL_SECTION mutex_t;
+ typedef CONDITION_VARIABLE cond_t;
+ typedef DWORD thread_result;
+ #define THREAD_CALL WINAPI
+ #define THREAD_LOCAL __declspec(thread)
+ #define counter_load(p) (*(volatile unsigned long long *)(p))
+ #define counter_store(p, v) (*(volatile unsigned long long *)(p) = (v))
+ #else
+ #include <errno.h>
+ #include <fcntl.h>
+ #include <unistd.h>
+ #include <dirent.h>
+ #include <signal.h>
+ #include <pthread.h>
+ #include <sys/stat.h>
+ #include <sys/mman.h>
+ #include <sys/uio.h>
+ #include <sys/socket.h>
+ #include <netinet/in.h>
+ #include <arpa/inet.h>
+ #ifdef __linux__
+ #include <sys/ioctl.h>
+ #include <linux/fs.h>               // FICLONE
+ #endif
+ 
+ #define PATH_SEP '/'
+ #define OTHER_PATH_SEP '\\'
+ #define path_compare strcmp
+ #define fseek64 fseeko
+ #define ftell64 ftello
+ #define _strdup strdup
+ #define SEND_FLAGS MSG_NOSIGNAL     // A closed connection should fail the send, not kill us
+ typedef int SOCKET;
+ #define INVALID_SOCKET (-1)
+ #define SOCKET_ERROR (-1)
+ #define closesocket close
+ #define WSAGetLastError() errno
+ typedef int file_handle;
+ #define INVALID_FILE (-1)
+ typedef pthread_t thread_handle;
+ typedef pthread_mutex_t mutex_t;
+ typedef pthread_cond_t cond_t;
+ typedef void *thread_result;
+ #define THREAD_CALL
+ #define THREAD_LOCAL __thread
+ #define counter_load(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+ #define counter_store(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+ 
+ // io_uring backend; build with -DDSYNC_NO_IO_URING to always use plain POSIX calls
+ #if defined(__linux__) && !defined(DSYNC_NO_IO_URING)
+ #include <sys/syscall.h>
+ #include <linux/io_uring.h>
+ #define DSYNC_IO_URING 1
+ #endif
+ #endif
+ 
+ // Optional zstd codec, build with -DDSYNC_WITH_ZSTD and link libzstd on both ends
+ #ifdef DSYNC_WITH_ZSTD
+ #include <zstd.h>
+ #define ZSTD_AVAILABLE 1
+ #else
+ #define ZSTD_AVAILABLE 0
+ #endif
+ 
+ #define BUFFER_SIZE (64 * 1024) // File data is streamed in chunks of this size
+ #define ENCODED_BUFFER_SIZE (BUFFER_SIZE + BUFFER_SIZE / 128 + 1024) // Worst-case codec output
  #define MAX_PATH_LENGTH 256
  #define SERVER_PORT 8888
+ #define HASH_CACHE_FILE "dsync_hashcache.bin"
+ #define HASH_CACHE_MAGIC 0x43485344u // "DSHC"
+ #define HASH_CACHE_VERSION 1
+ #define HASH_READ_SIZE (64 * 1024)
+ #define SNAPSHOT_FILE "dsync_snapshot.idx"
+ #define SNAPSHOT_MAGIC 0x58444953u // "SIDX"
+ #define SNAPSHOT_VERSION 2
+ #define SNAPSHOT_DIRECTORY 0x1
+ #define SNAPSHOT_HAS_HASH 0x2
+ #define SNAPSHOT_DELETED 0x4        // Tombstone of a two-way replica index
+ #define COMPRESS_SAMPLE_SIZE 4096
+ #define COMPRESS_MAX_WORKERS 16
+ #define INCOMPRESSIBLE_RATIO 0.90   // Sample must shrink below this to bother compressing
+ #define ZSTD_PREFERRED_RATIO 0.50   // Samples this compressible get zstd in auto mode
+ #define ZSTD_LEVEL 3
+ #define CHUNK_ABORT 0xFFu           // Chunk codec marking a file the sender could not read
+ #define CHUNK_HOLE 0xFEu            // Chunk codec for raw_size bytes of zeros, sent without payload
+ #define HOLE_FRAME_MAX (1 << 30)    // Longer holes take several frames
+ #define CHUNK_INDEX_FILE "dsync_chunks.idx"
+ #define CHUNK_INDEX_MAGIC 0x58494344u // "DCIX"
+ #define CHUNK_INDEX_VERSION 1
+ #define CHUNK_HASH_SEED 0x5EEDC0DEULL
+ #define CDC_MIN_SIZE (2 * 1024)
+ #define CDC_AVG_SIZE (8 * 1024)
+ #define CDC_MAX_SIZE BUFFER_SIZE    // A chunk always fits in one transfer frame
+ #define CDC_MASK_S 0x0003590703530000ULL // 15 bits, used below the average size
+ #define CDC_MASK_L 0x0000D90003530000ULL // 11 bits, used above it
+ #define DEDUP_MIN_FILE_SIZE (64 * 1024) // Smaller files are not worth the extra round trip
+ #define DEDUP_MAX_CHUNKS (1 << 24)
+ #define WRITE_DEPTH 4               // Server chunk writes in flight
+ #define IO_QUEUE_DEPTH 64
+ #define MAX_STREAMS 8               // Files in flight on one connection
+ #define LARGE_STREAMS 2             // ...of which at most this many large ones, leaving room for small files
+ #define SMALL_FILE_LIMIT (1024 * 1024)
+ #define AGING_TURN 8                // Every Nth burst serves the lowest priority so it never starves
+ #define COMMIT_BATCH_FILES 64       // Received files made durable together
+ #define COMMIT_BATCH_BYTES (256LL * 1024 * 1024)
+ #define COMMIT_BATCH_DIRS 128
+ #define PARALLEL_MIN_SIZE (32LL * 1024 * 1024) // Streamed files this large go out as ranges
+ #define PARALLEL_RANGE_SIZE (8LL * 1024 * 1024)
+ #define PARALLEL_MAX_CONNECTIONS 8
+ #define PARALLEL_RETRIES 3          // Attempts per range before its file is given up
+ #define PARALLEL_WINDOW_NS 250000000LL // Throughput is measured over windows this long
+ #define PARALLEL_GAIN 1.10          // A new connection stays worthwhile while it adds this much
+ #define RANGE_WAIT_MS 10000         // How long a range may wait for the record of its file
+ #define MAX_DESTINATIONS 32         // Servers one client replicates to
+ #define FANOUT_BLOCK_SIZE (256 * 1024)
+ #define FANOUT_BLOCKS 64            // Shared buffer of a fanned-out session, 16 MB
+ #define FANOUT_STALL_MS 2000        // A server holding the others back this long is left to catch up later
+ #define IGNORE_FILE ".dsyncignore"  // Ignore rules read from the watched directory by default
+ #define MAX_IGNORE_PATTERNS 64
+ #define REPLICA_FILE "dsync_replica.idx" // Server side of two-way sync: versions of target_dir
+ #define VERSION_SLOTS 4             // Replicas a file's version vector remembers
+ #define MERKLE_SEED 0x4D45524BULL
+ #define MERKLE_MAX_DEPTH 16         // 4 bits of the path hash per level
+ #define MERKLE_LEAF_ENTRIES 32      // Nodes this small are settled by exchanging their entries
+ #define MERKLE_BATCH_NODES 4096     // Nodes asked about in one message
+ #define RECONCILE_MAX_ITEMS (1 << 20) // Bound on any list one message of a two-way session carries
+ #define BENCH_WORK_DIR "dsync_bench"
+ #define BENCH_RETRIES 3
+ #define BENCH_DEEP_LEVELS 8
+ #define BENCH_DEEP_FILES 16
+ #define PROFILE_SUB_BITS 4          // 16 histogram buckets per power of two: within 6.25%
+ #define PROFILE_BUCKETS ((64 - PROFILE_SUB_BITS + 1) << PROFILE_SUB_BITS)
+ 
+ // Completion state of one asynchronous I/O request
+ typedef struct {
+     volatile int done;
+     long long result;            // Bytes transferred, or negative on error
+ } io_request;
+ 
+ // Batched asynchronous I/O: io_uring where available, synchronous calls everywhere else
+ typedef struct {
+     int ring_fd;                 // -1 when running on the synchronous fallback
+     int fixed_buffers;           // Buffers are registered, so reads/writes use the *_FIXED ops
+ #ifdef DSYNC_IO_URING
+     unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+     unsigned *cq_head, *cq_tail, *cq_mask;
+     struct io_uring_sqe *sqes;
+     struct io_uring_cqe *cqes;
+     void *sq_ring;
+     void *cq_ring;
+     size_t sq_ring_size, cq_ring_size, sqes_size;
+     unsigned sq_entries;
+     unsigned queued;             // SQEs written but not yet handed to the kernel
+     unsigned in_flight;
+ #endif
+ } io_engine;
  
  // File action operations
  typedef enum {
@@ -32,585 +203,8367 @@
  typedef struct {
      char path[MAX_PATH_LENGTH];
      time_t last_modified;
-     long size;
+     long long mtime_ns;          // Full-resolution modification time
+     long long size;
+     unsigned long long inode;    // File identity, used as the hash cache key
+     uint64_t content_hash;       // Only meaningful when has_hash is set
+     int has_hash;
      int is_directory;
  } file_info;
  
+ // Chunk codecs
+ typedef enum {
+     CODEC_NONE,
+     CODEC_LZ4,
+     CODEC_ZSTD,
+     CODEC_COUNT,
+     CODEC_AUTO = CODEC_COUNT     // Client setting only: choose per chunk from a sample
+ } compression_codec;
+ 
  // Synchronization record
+ // File contents of a CREATE/MODIFY record follow as chunk frames on the record's stream,
+ // ended by a frame with raw_size 0. Frames of different streams may interleave.
  typedef struct {
      sync_operation operation;
      file_info file;
-     char data[BUFFER_SIZE];
-     size_t data_size;
+     long long data_size;         // File size when the change was sent
+     uint64_t transfer_id;        // Names a TRANSFER_RANGES file on the range connections
+     int32_t transfer_mode;       // TRANSFER_STREAM, TRANSFER_DEDUP or TRANSFER_RANGES
+     int32_t stream;              // Stream carrying the file data, below MAX_STREAMS
  } sync_record;
  
+ // A sync_record on the wire. Fixed-width fields only: time_t and long differ in size between
+ // Windows and Linux, so the in-memory record cannot be sent as it is.
+ typedef struct {
+     char path[MAX_PATH_LENGTH];  // Relative, '/' separated
+     int64_t size;
+     int64_t last_modified;       // Seconds since the epoch
+     int64_t mtime_ns;
+     uint64_t content_hash;       // Only meaningful with RECORD_HAS_HASH
+     int64_t data_size;
+     uint64_t transfer_id;
+     uint32_t operation;          // A sync_operation
+     uint32_t flags;              // RECORD_DIRECTORY | RECORD_HAS_HASH
+     int32_t transfer_mode;
+     int32_t stream;
+ } wire_record;
+ 
+ // wire_record flags
+ enum {
+     RECORD_DIRECTORY = 1,
+     RECORD_HAS_HASH = 2
+ };
+ 
+ // Message types on a sync connection; every message starts with one
+ enum {
+     MSG_RECORD = 1,              // A wire_record, opening a stream if file data follows
+     MSG_CHUNK,                   // The rest of a chunk_header, then its payload
+     MSG_DONE,                    // End of the session
+     MSG_ACK,                     // Server reply to MSG_DONE: a session_ack
+     MSG_RANGE,                   // On a range connection: a range_header, payload and xxh64
+     MSG_RECONCILE,               // Opens a two-way session: the rest of a reconcile_hello
+     MSG_MERKLE,                  // A count and merkle_node_ids; answered with 16 merkle_summary each
+     MSG_ENTRIES,                 // A count and merkle_node_ids; answered with a count and version_entries
+     MSG_HASH,                    // A count and wire paths; answered with an xxh64 of each file's content
+     MSG_PLAN,                    // Renames and files for the server to send back; a reconcile_plan
+     MSG_VERSIONS                 // A count and the version_entries both sides now hold; answered with an ack
+ };
+ 
+ // Sent once everything applied in the session is durable
+ typedef struct {
+     uint32_t type;               // MSG_ACK
+     uint32_t applied;
+     uint32_t failed;             // Changes the server could not apply; the client resends them
+     uint32_t reserved;
+ } session_ack;
+ 
+ // Header of one range of a TRANSFER_RANGES file; length bytes and their xxh64 follow, and the
+ // server answers with a uint32_t that is 1 once the range is verified and written
+ typedef struct {
+     uint32_t type;               // MSG_RANGE
+     uint32_t reserved;
+     uint64_t transfer_id;
+     int64_t offset;
+     int64_t length;
+ } range_header;
+ 
+ // One replica's entry in a version vector: its hybrid logical clock when it last changed the
+ // file. A clock is physical milliseconds shifted left by 16, plus a counter in the low bits.
+ typedef struct {
+     uint64_t replica;            // 0 marks a free slot
+     uint64_t clock;
+ } version_slot;
+ 
+ typedef struct {
+     version_slot slots[VERSION_SLOTS];
+ } version_vector;
+ 
+ // Start of a two-way session, sent by both sides: who they are, their clock, and the root of
+ // the Merkle tree over their replica index
+ typedef struct {
+     uint32_t type;               // MSG_RECONCILE
+     uint32_t codec;              // Client: codec for the files the server sends back
+     uint64_t replica;
+     uint64_t clock;
+     uint64_t root_digest;
+     uint32_t entry_count;
+     uint32_t reserved;
+ } reconcile_hello;
+ 
+ // A node of the Merkle tree: the entries whose path hash starts with prefix, depth nibbles long
+ typedef struct {
+     uint64_t prefix;
+     uint32_t depth;
+     uint32_t reserved;
+ } merkle_node_id;
+ 
+ typedef struct {
+     uint64_t digest;             // Sum of the entry digests below the node
+     uint32_t count;
+     uint32_t reserved;
+ } merkle_summary;
+ 
+ // A replica index entry on the wire
+ typedef struct {
+     char path[MAX_PATH_LENGTH];  // Relative, '/' separated
+     int64_t size;
+     uint32_t flags;              // SNAPSHOT_DIRECTORY | SNAPSHOT_DELETED
+     uint32_t reserved;
+     version_vector version;
+ } version_entry;
+ 
+ // Header of MSG_PLAN: rename_count pairs of wire paths (from, to) the server renames, then
+ // send_count wire paths of files it sends back as a session of its own
+ typedef struct {
+     uint32_t type;               // MSG_PLAN
+     uint32_t rename_count;
+     uint32_t send_count;
+     uint32_t reserved;
+ } reconcile_plan;
+ 
+ // How file contents follow a record
+ enum {
+     TRANSFER_STREAM,             // All data as chunk frames
+     TRANSFER_DEDUP,              // Chunk manifest, server reply, then only the missing chunks
+     TRANSFER_RANGES              // Ranges over parallel connections, then an end frame
+ };
+ 
+ // A content-defined chunk of a file
+ typedef struct {
+     uint64_t hash[2];
+     long long offset;
+     uint32_t length;
+ } cdc_chunk;
+ 
+ // Manifest entry on the wire
+ typedef struct {
+     uint64_t hash[2];
+     uint32_t length;
+     uint32_t reserved;
+ } dedup_entry;
+ 
+ // Where the server already holds a chunk (path_id -1 marks an entry found to be stale)
+ typedef struct {
+     uint64_t hash[2];
+     int64_t offset;
+     uint32_t length;             // 0 marks a free slot
+     int32_t path_id;
+ } chunk_location;
+ 
+ // Server-side index from chunk hash to a local copy of that chunk
+ typedef struct {
+     chunk_location *entries;     // Open addressing on the chunk hash
+     int capacity;
+     int count;
+     char (*paths)[MAX_PATH_LENGTH];
+     int path_count;
+     int path_capacity;
+     int *path_slots;             // Open addressing from path to path id, -1 when free
+     int path_slot_capacity;
+     int dirty;
+ } chunk_index;
+ 
+ // A file being received; its chunk frames arrive interleaved with those of other streams
+ typedef struct receive_stream {
+     int active;
+     int dedup;
+     int opened;                  // Streamed files are created on their first frame
+     int aborted;                 // Remaining frames are consumed and dropped
+     int failed;                  // A write to the file failed
+     int ranged;                  // Data arrives on range connections, the stream only ends it
+     char target_path[MAX_PATH_LENGTH];
+     char temp_path[MAX_PATH_LENGTH + 16];
+     file_handle file;
+     long long offset;
+     long long hole_bytes;        // Skipped over for hole frames; the temp file is sparse there
+     dedup_entry *entries;        // Manifest of a deduplicated file...
+     chunk_location *plan;        // ...where its chunks already are locally...
+     unsigned char *need;         // ...and which ones are on the way
+     uint32_t count;
+     uint32_t next;               // Next manifest entry to write
+ } receive_stream;
+ 
+ // Ring of registered buffers whose writes are still in flight
+ typedef struct {
+     unsigned char *buffers[WRITE_DEPTH];
+     io_request requests[WRITE_DEPTH];
+     uint32_t lengths[WRITE_DEPTH];
+     receive_stream *owners[WRITE_DEPTH]; // Stream a pending write belongs to, NULL when free
+     int next;
+ } file_writer;
+ 
+ // Keeps the last local source file open while a file is assembled from mostly one source
+ typedef struct {
+     int path_id;
+     file_handle file;
+ } local_reader;
+ 
+ // How the server makes applied changes durable
+ typedef enum {
+     DURABILITY_BATCH,            // Sync all files of a batch together, then their directories
+     DURABILITY_SYNCFS,           // One syncfs before and one after the batch's renames
+     DURABILITY_NONE              // Leave it to the OS
+ } durability_mode;
+ 
+ // A received file waiting for its batch to reach the disk before it replaces the target
+ typedef struct {
+     char temp_path[MAX_PATH_LENGTH + 16];
+     char target_path[MAX_PATH_LENGTH];
+     file_handle file;            // Kept open so the batch can sync it
+     dedup_entry *entries;        // Chunks to index once it is in place, if deduplicated
+     uint32_t count;
+     io_request sync_req;
+ } pending_file;
+ 
+ // A ranged file's temp file, shared with the range connections writing into it
+ typedef struct {
+     int active;
+     uint64_t id;
+     file_handle file;
+     long long size;
+     unsigned char *done;         // Ranges written and verified
+     int range_count;
+     int received;
+     int writers;                 // Range connections writing into the file right now
+ } range_transfer;
+ 
+ // A path in a replica index: its state when last seen, and which version that state is
+ typedef struct {
+     file_info file;
+     version_vector version;
+     int deleted;                 // Tombstone, kept so the deletion reaches the other side
+ } replica_entry;
+ 
+ // One side of a two-way sync: its entries sorted by path, its id and its clock
+ typedef struct {
+     replica_entry *entries;
+     int count;
+     uint64_t id;
+     uint64_t clock;
+ } replica_index;
+ 
+ // State the server keeps across connections
+ typedef struct {
+     const char *target_dir;
+     const char *replica_path;    // Replica index for two-way sessions
+     durability_mode durability;
+     chunk_index index;
+     io_engine io;
+     file_writer writer;
+     receive_stream streams[MAX_STREAMS];
+     local_reader reader;
+     int no_copy_range;           // In-kernel copies failed once, copy local chunks by hand
+     unsigned char *encoded;      // Receive buffer for encoded chunks
+     unsigned char *scratch;      // Buffer for validating local chunks
+     pending_file *pending;       // Finished files of the current batch
+     int pending_count;
+     long long pending_bytes;
+     char (*dirty_dirs)[MAX_PATH_LENGTH]; // Directories whose entries changed in the batch
+     int dirty_dir_count;
+     uint32_t applied;            // Session totals for the acknowledgement
+     uint32_t failed;
+     mutex_t session_lock;        // Sessions take turns; range connections run beside them
+     mutex_t lock;                // Guards ranges and connections
+     cond_t changed;              // Signalled when either changes
+     range_transfer ranges[MAX_STREAMS]; // By stream id
+     int connections;             // Connection threads still running
+ } server_context;
+ 
+ // Header of one chunk frame on the wire
+ typedef struct {
+     uint32_t type;               // MSG_CHUNK
+     uint32_t stream;
+     uint32_t codec;              // compression_codec, CHUNK_HOLE or CHUNK_ABORT
+     uint32_t raw_size;
+     uint32_t encoded_size;
+ } chunk_header;
+ 
+ // Per-codec transfer counters
+ typedef struct {
+     long long chunks;
+     long long skipped;           // Chunks sent raw because the sample did not compress
+     long long raw_bytes;
+     long long wire_bytes;
+     long long busy_ns;           // Time spent compressing
+ } codec_stats;
+ 
+ // One chunk moving through the compression pipeline
+ typedef struct {
+     unsigned char raw[BUFFER_SIZE];
+     unsigned char encoded[ENCODED_BUFFER_SIZE];
+     int raw_size;
+     compression_codec requested;
+     int sparse;                  // An all-zero chunk may go out as a hole
+     int hole;                    // Carries a hole found by the reader, nothing to read or compress
+     chunk_header header;         // Filled in once compressed
+     const unsigned char *payload; // Either raw or encoded
+     int skipped;
+     long long busy_ns;
+     int done;
+     int state;                   // SLOT_IDLE, SLOT_READING, SLOT_COMPRESSING or SLOT_SENDING
+     size_t expected;             // Bytes requested by the pending read
+     io_request read_req;
+     io_request header_req;
+     io_request send_req;
+ } transfer_slot;
+ 
+ enum {
+     SLOT_IDLE,
+     SLOT_READING,
+     SLOT_COMPRESSING,
+     SLOT_SENDING
+ };
+ 
+ // Client transfer pipeline: asynchronous reads, worker threads compressing, asynchronous sends
+ typedef struct {
+     compression_codec codec;
+     int worker_count;
+     thread_handle workers[COMPRESS_MAX_WORKERS];
+     transfer_slot *slots;
+     int slot_count;
+     transfer_slot **queue;       // Ring of slots waiting for a worker
+     int queue_head;
+     int queue_count;
+     int shutting_down;
+     mutex_t lock;
+     cond_t work_ready;
+     cond_t work_done;
+     io_engine io;
+     codec_stats stats[CODEC_COUNT];
+     long long dedup_chunks;      // Chunks offered through manifests
+     long long dedup_sent;        // ...and how many the server actually needed
+     long long dedup_bytes;
+     long long dedup_sent_bytes;
+     long long hole_bytes;        // Zeros that went out as hole frames
+ } compress_pool;
+ 
+ // Client configuration parsed from the command line
+ typedef struct {
+     int interval;
+     int content_hash;            // Detect modifications by content, not just metadata
+     const char *hash_cache_path;
+     const char *snapshot_path;   // Last acknowledged state, reloaded on restart
+     compression_codec codec;
+     int compress_threads;
+     int dedup;                   // Offer chunk manifests so the server can reuse data it has
+     long long bandwidth;         // Upload cap in bytes per second, 0 for unlimited
+     int parallel;                // Connections for sending large files as ranges, 0 to disable
+     const char *ignore_file;     // Ignore rules, NULL for .dsyncignore in the watched directory
+     const char *ignore_patterns[MAX_IGNORE_PATTERNS]; // --ignore patterns, applied after the file
+     int ignore_count;
+     int two_way;                 // Also take changes made on the server, keeping conflicts as side copies
+ } client_options;
+ 
+ // Priority classes of queued changes, served in this order
+ enum {
+     PRIORITY_METADATA,           // Deletes, directories and empty files
+     PRIORITY_SMALL,
+     PRIORITY_LARGE,
+     PRIORITY_COUNT
+ };
+ 
+ // A queued change; the queue is a heap on (priority, size, arrival)
+ typedef struct {
+     sync_record record;
+     int priority;
+     long long seq;
+     long long queued_ns;
+ } sync_job;
+ 
+ // A file the scheduler is sending
+ typedef struct {
+     int active;
+     int priority;
+     sync_record record;
+     long long queued_ns;
+     file_handle file;
+     cdc_chunk *chunks;           // Dedup manifest...
+     unsigned char *need;         // ...and which of its chunks the server asked for
+     int chunk_count;
+     int next_chunk;
+     long long position;
+     long long data_end;          // End of the data extent being read
+     int skip_streak;
+     int eof;
+     int read_error;
+ } send_stream;
+ 
+ // Token bucket in bytes; a send may take the bucket into debt and the next one waits it out.
+ // The range connections share it with the main connection.
+ typedef struct {
+     double rate;                 // Bytes per second, 0 for unlimited
+     double burst;
+     double tokens;
+     long long last_ns;
+     mutex_t lock;
+ } token_bucket;
+ 
+ // A range of a large file waiting for a connection
+ typedef struct {
+     int file;                    // Stream id of the file
+     uint64_t id;                 // Its transfer id, so a range never outlives its file
+     long long offset;
+     long long length;
+     int attempts;
+ } range_task;
+ 
+ // A large file going out as ranges
+ typedef struct {
+     int active;
+     uint64_t id;
+     file_handle file;            // The stream's handle, read with pread from every connection
+     int ranges_left;
+     int failed;                  // A range ran out of attempts or could not be read
+     int readers;                 // Connections reading from the file right now
+ } range_file;
+ 
+ // Sends the ranges of large files over extra connections, one worker thread each. It starts
+ // with one and adds another while each addition still raises the throughput.
+ typedef struct {
+     const char *server_ip;       // Server of the current session
+     int max_connections;
+     token_bucket *bucket;
+     mutex_t lock;
+     cond_t work_ready;
+     cond_t progress;             // A range finished, or a file lost its last reader
+     thread_handle workers[PARALLEL_MAX_CONNECTIONS];
+     int connections;             // Workers started this session
+     int stopping;
+     range_file files[MAX_STREAMS]; // By stream id
+     range_task *tasks;           // FIFO of ranges waiting for a connection
+     int task_head;
+     int task_end;
+     int task_capacity;
+     uint64_t next_id;
+     int growing;                 // Still trying more connections
+     double best_rate;            // Best throughput seen so far this session, bytes per second
+     long long window_start_ns;
+     long long window_bytes;
+     long long ranges;            // Counters for the session report
+     long long bytes;
+     long long retries;
+     int peak_connections;
+ } range_sender;
+ 
+ // Client transfer scheduler: metadata first, then small files, then large ones, with chunks
+ // of the open streams interleaved in bursts
+ typedef struct {
+     sync_job *jobs;
+     int job_count;
+     int job_capacity;
+     long long seq;
+     send_stream streams[MAX_STREAMS];
+     int next_stream;             // Round-robin position within a priority
+     long long bursts;
+     token_bucket bucket;
+     range_sender ranges;
+     long long files[PRIORITY_COUNT];
+     long long latency_ns[PRIORITY_COUNT]; // Queue-to-done time, summed
+     long long max_latency_ns[PRIORITY_COUNT];
+ } sync_scheduler;
+ 
+ // Persistent hash cache entry, valid while (inode, size, mtime_ns) are unchanged
+ typedef struct {
+     unsigned long long inode;
+     long long size;
+     long long mtime_ns;
+     uint64_t hash;
+ } hash_cache_entry;
+ 
+ // Open-addressing table of cache entries keyed by inode (inode 0 marks a free slot)
+ typedef struct {
+     hash_cache_entry *entries;
+     unsigned char *seen;         // Entries touched by the latest scan
+     int capacity;
+     int count;
+     int dirty;
+ } hash_cache;
+ 
+ // On-disk snapshot layout: header, sorted fixed-size records, then a string pool of paths
+ typedef struct {
+     uint32_t magic;
+     uint32_t version;
+     uint32_t record_count;
+     uint32_t pool_size;
+     uint64_t root_hash;          // Hash of the watched directory the snapshot belongs to
+     uint64_t replica;            // Two-way sync: this replica's id and clock, 0 otherwise
+     uint64_t clock;
+ } snapshot_header;
+ 
+ typedef struct {
+     uint32_t path_offset;        // Offset of the NUL-terminated path in the string pool
+     uint32_t path_length;
+     int64_t mtime_ns;
+     int64_t size;
+     uint64_t inode;
+     uint64_t content_hash;
+     uint32_t flags;              // SNAPSHOT_DIRECTORY | SNAPSHOT_HAS_HASH | SNAPSHOT_DELETED
+     uint32_t reserved;
+     version_vector version;      // Empty outside two-way sync
+ } snapshot_record;
+ 
+ // A memory-mapped snapshot file
+ typedef struct {
+     file_handle file;
+ #ifdef _WIN32
+     HANDLE mapping;
+ #endif
+     unsigned char *base;
+     size_t size;
+     snapshot_header *header;
+     snapshot_record *records;
+     const char *pool;
+ } snapshot_index;
+ 
+ // An edge of the ignore automaton, matching one path segment: literal edges sit in a hash
+ // table keyed by (parent, segment), glob edges in a list per parent
+ typedef struct {
+     uint64_t hash;
+     int parent;
+     int child;                   // -1 marks a free table slot
+     int next;                    // Next glob edge of the same parent, -1 at the end
+     char *segment;
+ } ignore_edge;
+ 
+ // A state of the ignore automaton: some leading segments of one or more patterns matched
+ typedef struct {
+     int star;                    // State after a "**" segment, -1 if no pattern has one here
+     int globs;                   // First glob edge leaving this state, -1 if none
+     int accept;                  // Last rule that matches a path ending here, -1 if none
+     int accept_dir;              // ...and the last one that only matches directories
+     int is_star;                 // Reached over "**", so any further segment loops back here
+ } ignore_node;
+ 
+ // Ignore rules in gitignore syntax, compiled into one automaton over path segments. The scan
+ // steps it once per directory entry, so the cost does not grow with the number of rules.
+ typedef struct {
+     ignore_node *nodes;
+     int node_count;
+     int node_capacity;
+     ignore_edge *literals;
+     int literal_count;
+     int literal_capacity;        // Power of two
+     ignore_edge *globs;
+     int glob_count;
+     int glob_capacity;
+     unsigned char *negated;      // Per rule: a "!" pattern that includes what it matches again
+     int rule_count;
+ } ignore_rules;
+ 
+ // A sync connection in progress; the watcher keeps scanning while the scheduler drains
+ typedef struct {
+     const char *dir_path;
+     const char *root;            // Normalized dir_path, wire paths are relative to it
+     const client_options *opts;
+     const ignore_rules *ignore;
+     hash_cache *cache;
+     file_info *files;            // Latest scan; every difference to the baseline has been queued
+     int file_count;
+     sync_record *changes;        // Everything queued this session, for the snapshot
+     int change_count;
+     long long next_scan_ns;
+     int fanout;                  // The stream goes to several servers, so none of them can be asked anything
+ } sync_session;
+ 
+ // A scan that servers acknowledged; servers that are in step share one
+ typedef struct {
+     file_info *files;
+     int file_count;
+     int refs;
+ } sync_baseline;
+ 
+ // A server the client replicates to, with the state it last acknowledged
+ typedef struct {
+     const char *server_ip;
+     char snapshot_path[MAX_PATH_LENGTH];
+     snapshot_index snapshot;
+     sync_baseline *baseline;
+ } sync_destination;
+ 
+ // Client side of the sync: the servers, what each last acknowledged, and everything needed
+ // to send them changes
+ typedef struct {
+     const char *dir_path;
+     char *server_list;           // Comma-separated addresses, split in place
+     sync_destination destinations[MAX_DESTINATIONS];
+     int destination_count;
+     const client_options *opts;
+     char *root;                  // Normalized dir_path
+     uint64_t root_hash;
+     ignore_rules ignore;
+     hash_cache cache;
+     compress_pool pool;
+     sync_scheduler sched;
+     replica_index replica;       // Two-way sync: this side's versions...
+     server_context inbound;      // ...and where the server's changes are applied
+     char inbound_index_path[MAX_PATH_LENGTH];
+ } sync_client;
+ 
+ // Stages of the sync that are timed, on whichever thread runs them
+ typedef enum {
+     STAGE_SCAN,                  // Walking the watched directory
+     STAGE_HASH,                  // Hashing contents (--hash)
+     STAGE_DIFF,                  // Comparing a scan with the baseline
+     STAGE_COMPRESS,              // One chunk, on a compression worker or inline
+     STAGE_SEND,                  // A burst of chunks, or a record without data
+     STAGE_APPLY,                 // A received record (server)
+     STAGE_RECEIVE,               // A received chunk, up to its write being queued (server)
+     STAGE_COMMIT,                // Making a batch durable (server)
+     STAGE_COUNT
+ } profile_stage;
+ 
+ // Latencies of one stage, as an HDR histogram: buckets are linear within each power of two,
+ // so every value is kept to PROFILE_SUB_BITS significant bits whatever its size
+ typedef struct {
+     unsigned long long count;
+     unsigned long long total_ns;
+     unsigned long long max_ns;
+     unsigned long long buckets[PROFILE_BUCKETS];
+ } stage_histogram;
+ 
+ // One thread's histograms. Only the thread holding the block writes it, so recording takes no
+ // lock; a report adds up every block. Blocks are never freed, a finished thread hands its block
+ // (counts included) to the next thread that starts.
+ typedef struct profile_block {
+     stage_histogram stages[STAGE_COUNT];
+     struct profile_block *next;
+     int in_use;
+ } profile_block;
+ 
  // Function prototypes
- void scan_directory(const char *dir_path, file_info **files, int *file_count);
+ void scan_directory(const char *dir_path, const ignore_rules *rules, file_info **files, int *file_count);
+ void ignore_rules_init(ignore_rules *rules);
+ int ignore_rules_add(ignore_rules *rules, const char *line);
+ int ignore_rules_load(ignore_rules *rules, const char *path);
+ void ignore_rules_free(ignore_rules *rules);
+ int ignore_rules_match(const ignore_rules *rules, const char *wire_path, int is_directory);
  int file_exists(const char *path);
  void compare_directories(file_info *old_files, int old_count, 
                          file_info *new_files, int new_count,
                          sync_record **changes, int *change_count);
- void apply_changes(sync_record *changes, int change_count, const char *target_dir);
- int send_changes_to_server(sync_record *changes, int change_count, const char *server_ip);
- void watch_directory(const char *dir_path, int interval, const char *server_ip);
+ int apply_change(sync_record *change, SOCKET data_socket, server_context *ctx);
+ int server_context_init(server_context *ctx, const char *target_dir, const char *index_path,
+                         durability_mode durability);
+ void server_commit(server_context *ctx);
+ void server_end_session(server_context *ctx);
+ int receive_chunk(server_context *ctx, SOCKET sock, const chunk_header *header);
+ void server_context_destroy(server_context *ctx);
+ SOCKET server_listen(unsigned long address);
+ int server_session(server_context *ctx, SOCKET client_socket, uint32_t type, const char *index_path);
+ void server_reconcile(server_context *ctx, SOCKET sock, const char *index_path);
+ void server_run(server_context *ctx, SOCKET listen_socket, const char *index_path, volatile int *stop);
+ int send_all(SOCKET sock, const void *buffer, int length);
+ int recv_all(SOCKET sock, void *buffer, int length);
+ SOCKET connect_server(const char *server_ip);
+ int send_queued_changes(sync_scheduler *sched, SOCKET sock, sync_session *session, compress_pool *pool,
+                         session_ack *ack);
+ int send_changes_to_server(sync_scheduler *sched, const char *server_ip, sync_session *session,
+                            compress_pool *pool);
+ int session_rescan(sync_session *session, sync_scheduler *sched, SOCKET sock);
+ int fanout_changes_to_servers(sync_scheduler *sched, sync_destination **destinations, int count,
+                               sync_session *session, compress_pool *pool, int *acked);
+ void scheduler_init(sync_scheduler *sched, long long bandwidth, int parallel);
+ int scheduler_enqueue(sync_scheduler *sched, SOCKET sock, sync_record *changes, int count);
+ void scheduler_reset(sync_scheduler *sched);
+ void scheduler_report(sync_scheduler *sched);
+ void scheduler_destroy(sync_scheduler *sched);
+ int sync_client_init(sync_client *client, const char *dir_path, const char *server_list,
+                      const client_options *opts, int *resumed);
+ int sync_client_pass(sync_client *client);
+ void sync_client_destroy(sync_client *client);
+ void watch_directory(const char *dir_path, const char *server_ip, const client_options *opts);
+ int bench_main(int argc, char *argv[]);
  char* normalize_path(const char* path);
+ uint64_t xxh64(const void *input, size_t len, uint64_t seed);
+ int hash_file(const char *path, uint64_t *hash);
+ void hash_cache_load(hash_cache *cache, const char *cache_path);
+ int hash_cache_save(hash_cache *cache, const char *cache_path);
+ void hash_cache_free(hash_cache *cache);
+ void hash_files(file_info *files, int file_count, hash_cache *cache);
+ int snapshot_open(snapshot_index *index, const char *snapshot_path, uint64_t root_hash);
+ void snapshot_close(snapshot_index *index);
+ int snapshot_load_files(const snapshot_index *index, file_info **files, int *file_count);
+ int snapshot_load_entries(const snapshot_index *index, replica_index *replica);
+ int snapshot_commit(snapshot_index *index, const char *snapshot_path, uint64_t root_hash,
+                     file_info *files, int file_count,
+                     sync_record *changes, int change_count);
+ int replica_load(replica_index *replica, const char *path, uint64_t root_hash);
+ int replica_save(const replica_index *replica, const char *path, uint64_t root_hash);
+ int replica_refresh(replica_index *replica, const file_info *files, int file_count);
+ int replica_apply(replica_index *replica, const char *root, const version_entry *finals, int count);
+ const char *codec_name(uint32_t codec);
+ int lz4_compress(const unsigned char *src, int src_size, unsigned char *dst, int dst_capacity);
+ int lz4_decompress(const unsigned char *src, int src_size, unsigned char *dst, int dst_capacity);
+ int compress_pool_init(compress_pool *pool, compression_codec codec, int worker_count);
+ void compress_pool_destroy(compress_pool *pool);
+ void compress_pool_report(compress_pool *pool);
+ int cdc_build_manifest(const char *path, cdc_chunk **chunks, int *chunk_count);
+ void chunk_index_load(chunk_index *index, const char *index_path);
+ int chunk_index_save(chunk_index *index, const char *index_path);
+ void chunk_index_free(chunk_index *index);
+ int io_engine_init(io_engine *io, unsigned depth);
+ void io_engine_register_buffers(io_engine *io, unsigned char **buffers, size_t length, int count);
+ void io_engine_destroy(io_engine *io);
+ void io_submit_read(io_engine *io, file_handle file, int buffer_index, void *buffer,
+                     size_t length, long long offset, io_request *req);
+ void io_submit_write(io_engine *io, file_handle file, int buffer_index, const void *buffer,
+                      size_t length, long long offset, io_request *req);
+ void io_submit_send(io_engine *io, SOCKET sock, const void *buffer, size_t length,
+                     int link, io_request *req);
+ void io_submit_fsync(io_engine *io, file_handle file, io_request *req);
+ void io_flush(io_engine *io);
+ void io_wait(io_engine *io, io_request *req);
  
- // Client main function
- int client_main(int argc, char *argv[]) {
-     if (argc < 4) {
-         printf("Usage: %s client <directory_to_watch> <server_ip> [interval_seconds]\n", argv[0]);
-         return 1;
-     }
-     
-     const char *dir_path = argv[2];
-     const char *server_ip = argv[3];
-     int interval = (argc > 4) ? atoi(argv[4]) : 60; // Default to 60 seconds
-     
+ // Platform layer: the few OS services the sync code needs, for Windows and POSIX
+ 
+ static unsigned long last_error(void) {
+ #ifdef _WIN32
+     return GetLastError();
+ #else
+     return (unsigned long)errno;
+ #endif
+ }
+ 
+ static int net_startup(void) {
+ #ifdef _WIN32
      // Initialize Winsock
      WSADATA wsaData;
      if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
          printf("WSAStartup failed\n");
-         return 1;
+         return 0;
      }
+ #else
+     // Writes to a dropped connection are reported as errors instead
+     signal(SIGPIPE, SIG_IGN);
+ #endif
+     return 1;
+ }
+ 
+ static void net_cleanup(void) {
+ #ifdef _WIN32
+     WSACleanup();
+ #endif
+ }
+ 
+ // Two connected stream sockets, for passing a byte stream between threads
+ static int socket_pair(SOCKET pair[2]) {
+ #ifdef _WIN32
+     // No socketpair on Windows, connect two sockets over loopback instead
+     struct sockaddr_in addr;
+     int length = sizeof(addr);
+     SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
      
-     printf("Starting directory sync client\n");
-     printf("Watching directory: %s\n", dir_path);
-     printf("Server IP: %s\n", server_ip);
-     printf("Sync interval: %d seconds\n", interval);
+     pair[0] = pair[1] = INVALID_SOCKET;
+     memset(&addr, 0, sizeof(addr));
+     addr.sin_family = AF_INET;
+     addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+     if (listener != INVALID_SOCKET && bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+         getsockname(listener, (struct sockaddr *)&addr, &length) == 0 && listen(listener, 1) == 0) {
+         pair[0] = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+         if (pair[0] != INVALID_SOCKET && connect(pair[0], (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+             pair[1] = accept(listener, NULL, NULL);
+         }
+     }
+     if (listener != INVALID_SOCKET) closesocket(listener);
+     if (pair[1] == INVALID_SOCKET) {
+         if (pair[0] != INVALID_SOCKET) closesocket(pair[0]);
+         return 0;
+     }
+     return 1;
+ #else
+     int fds[2];
+     if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return 0;
+     pair[0] = fds[0];
+     pair[1] = fds[1];
+     return 1;
+ #endif
+ }
+ 
+ // Signal the end of what we send; the peer still gets everything sent so far
+ static void socket_shutdown_send(SOCKET sock) {
+ #ifdef _WIN32
+     shutdown(sock, SD_SEND);
+ #else
+     shutdown(sock, SHUT_WR);
+ #endif
+ }
+ 
+ // Cut a connection, failing sends and receives blocked on it in other threads
+ static void socket_shutdown(SOCKET sock) {
+ #ifdef _WIN32
+     shutdown(sock, SD_BOTH);
+ #else
+     shutdown(sock, SHUT_RDWR);
+ #endif
+ }
+ 
+ // Receive whatever is already buffered on the socket without waiting, 0 if nothing is
+ static int recv_available(SOCKET sock, void *buffer, int length) {
+ #ifdef _WIN32
+     u_long available = 0;
+     if (ioctlsocket(sock, FIONREAD, &available) != 0 || available == 0) return 0;
+     if (available < (u_long)length) length = (int)available;
+     int received = recv(sock, (char *)buffer, length, 0);
+ #else
+     int received = (int)recv(sock, buffer, length, MSG_DONTWAIT);
+ #endif
+     return received > 0 ? received : 0;
+ }
+ 
+ static void sleep_seconds(int seconds) {
+ #ifdef _WIN32
+     Sleep(seconds * 1000);
+ #else
+     sleep(seconds);
+ #endif
+ }
+ 
+ static void sleep_ms(int ms) {
+ #ifdef _WIN32
+     Sleep(ms);
+ #else
+     struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000L };
+     while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+ #endif
+ }
+ 
+ // Monotonic time in nanoseconds
+ static long long now_ns(void) {
+ #ifdef _WIN32
+     static LARGE_INTEGER frequency;
+     LARGE_INTEGER counter;
+     if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+     QueryPerformanceCounter(&counter);
+     return (long long)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+ #else
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+ #endif
+ }
+ 
+ // Clock for the self-profile: CLOCK_MONOTONIC_RAW is read in user space and never slewed
+ static long long profile_now(void) {
+ #ifdef _WIN32
+     return now_ns();
+ #else
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+     return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+ #endif
+ }
+ 
+ // CPU time of the whole process, all threads, in nanoseconds
+ static long long process_cpu_ns(void) {
+ #ifdef _WIN32
+     FILETIME created, exited, kernel, user;
+     ULARGE_INTEGER k, u;
+     if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) return 0;
+     k.LowPart = kernel.dwLowDateTime;
+     k.HighPart = kernel.dwHighDateTime;
+     u.LowPart = user.dwLowDateTime;
+     u.HighPart = user.dwHighDateTime;
+     return (long long)(k.QuadPart + u.QuadPart) * 100;
+ #else
+     struct timespec ts;
+     clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+     return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+ #endif
+ }
+ 
+ static file_handle file_open_read(const char *path) {
+ #ifdef _WIN32
+     return CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+ #else
+     return open(path, O_RDONLY | O_CLOEXEC);
+ #endif
+ }
+ 
+ // Create or truncate a file for writing
+ static file_handle file_create(const char *path) {
+ #ifdef _WIN32
+     return CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+ #else
+     return open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+ #endif
+ }
+ 
+ static void file_close(file_handle file) {
+ #ifdef _WIN32
+     CloseHandle(file);
+ #else
+     close(file);
+ #endif
+ }
+ 
+ // Positional read; returns bytes read (short only at end of file) or -1
+ static long long file_pread(file_handle file, void *buffer, size_t length, long long offset) {
+     size_t total = 0;
+     while (total < length) {
+ #ifdef _WIN32
+         OVERLAPPED ov;
+         DWORD n = 0;
+         memset(&ov, 0, sizeof(ov));
+         ov.Offset = (DWORD)(offset + total);
+         ov.OffsetHigh = (DWORD)((unsigned long long)(offset + total) >> 32);
+         if (!ReadFile(file, (char *)buffer + total, (DWORD)(length - total), &n, &ov)) {
+             if (GetLastError() == ERROR_HANDLE_EOF) break;
+             return -1;
+         }
+ #else
+         ssize_t n = pread(file, (char *)buffer + total, length - total, (off_t)(offset + total));
+         if (n < 0 && errno == EINTR) continue;
+         if (n < 0) return -1;
+ #endif
+         if (n == 0) break;
+         total += (size_t)n;
+     }
+     return (long long)total;
+ }
+ 
+ // Positional write of the whole buffer; returns bytes written or -1
+ static long long file_pwrite(file_handle file, const void *buffer, size_t length, long long offset) {
+     size_t total = 0;
+     while (total < length) {
+ #ifdef _WIN32
+         OVERLAPPED ov;
+         DWORD n = 0;
+         memset(&ov, 0, sizeof(ov));
+         ov.Offset = (DWORD)(offset + total);
+         ov.OffsetHigh = (DWORD)((unsigned long long)(offset + total) >> 32);
+         if (!WriteFile(file, (const char *)buffer + total, (DWORD)(length - total), &n, &ov)) return -1;
+ #else
+         ssize_t n = pwrite(file, (const char *)buffer + total, length - total, (off_t)(offset + total));
+         if (n < 0 && errno == EINTR) continue;
+         if (n <= 0) return -1;
+ #endif
+         total += (size_t)n;
+     }
+     return (long long)total;
+ }
+ 
+ // Find the data extent at or after offset. Past the last one *data_start is the file size;
+ // where holes cannot be queried the whole file counts as data.
+ static void file_next_data(file_handle file, long long offset, long long *data_start, long long *data_end) {
+ #if !defined(_WIN32) && defined(SEEK_DATA)
+     off_t start = lseek(file, offset, SEEK_DATA);
+     if (start >= 0) {
+         off_t end = lseek(file, start, SEEK_HOLE);
+         if (end > start) {
+             *data_start = start;
+             *data_end = end;
+             return;
+         }
+     } else if (errno == ENXIO) {
+         off_t size = lseek(file, 0, SEEK_END);
+         *data_start = *data_end = size > offset ? size : offset;
+         return;
+     }
+ #endif
+     (void)file;
+     *data_start = offset;
+     *data_end = INT64_MAX;
+ }
+ 
+ // Let ranges that are never written stay unallocated; POSIX files are sparse already
+ static int file_make_sparse(file_handle file) {
+ #ifdef _WIN32
+     DWORD returned;
+     return DeviceIoControl(file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned, NULL) != 0;
+ #else
+     (void)file;
+     return 1;
+ #endif
+ }
+ 
+ static int file_set_size(file_handle file, long long size) {
+ #ifdef _WIN32
+     LARGE_INTEGER position;
+     position.QuadPart = size;
+     return SetFilePointerEx(file, position, NULL, FILE_BEGIN) && SetEndOfFile(file);
+ #else
+     return ftruncate(file, (off_t)size) == 0;
+ #endif
+ }
+ 
+ // Copy a range between files inside the kernel, sharing the extents on filesystems with
+ // reflinks. Returns the bytes copied, or -1 if this kind of copy is not supported here.
+ static long long file_copy_range(file_handle from, long long from_offset, file_handle to,
+                                  long long to_offset, long long length) {
+ #ifdef __linux__
+     struct stat st;
      
-     watch_directory(dir_path, interval, server_ip);
+     // A whole file becomes a clone of its source in one call
+ #ifdef FICLONE
+     if (from_offset == 0 && to_offset == 0 && fstat(from, &st) == 0 && st.st_size == length &&
+         ioctl(to, FICLONE, from) == 0) {
+         return length;
+     }
+ #endif
      
-     // Cleanup Winsock
-     WSACleanup();
+     long long copied = 0;
+     while (copied < length) {
+         loff_t in = (loff_t)(from_offset + copied), out = (loff_t)(to_offset + copied);
+         ssize_t n = copy_file_range(from, &in, to, &out, (size_t)(length - copied), 0);
+         if (n < 0 && errno == EINTR) continue;
+         if (n < 0) return copied > 0 ? copied : -1;
+         if (n == 0) break;
+         copied += n;
+     }
+     (void)st;
+     return copied;
+ #else
+     (void)from; (void)from_offset; (void)to; (void)to_offset; (void)length;
+     return -1;
+ #endif
+ }
+ 
+ // Flush a file's data to the disk
+ static int file_sync(file_handle file) {
+ #ifdef _WIN32
+     return FlushFileBuffers(file) != 0;
+ #else
+     return fdatasync(file) == 0;
+ #endif
+ }
+ 
+ // Make a directory's entries durable, so renames and deletes in it survive a crash
+ static int dir_sync(const char *path) {
+ #ifdef _WIN32
+     (void)path; // NTFS journals metadata; renames use MOVEFILE_WRITE_THROUGH
+     return 1;
+ #else
+     int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     if (fd < 0) return 0;
+     int ok = fsync(fd) == 0;
+     close(fd);
+     return ok;
+ #endif
+ }
+ 
+ // Flush everything on the filesystem holding path; returns 0 where that is not supported
+ static int fs_sync(const char *path) {
+ #ifdef __linux__
+     int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     if (fd < 0) return 0;
+     int ok = syncfs(fd) == 0;
+     close(fd);
+     return ok;
+ #else
+     (void)path;
      return 0;
+ #endif
  }
  
- // Server main function
- int server_main(int argc, char *argv[]) {
-     if (argc < 3) {
-         printf("Usage: %s server <target_directory>\n", argv[0]);
-         return 1;
+ // Atomically replace to with from
+ static int file_replace(const char *from, const char *to) {
+ #ifdef _WIN32
+     return MoveFileEx(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+ #else
+     return rename(from, to) == 0;
+ #endif
+ }
+ 
+ static int file_delete(const char *path) {
+ #ifdef _WIN32
+     return DeleteFile(path) != 0;
+ #else
+     return unlink(path) == 0;
+ #endif
+ }
+ 
+ // Create a directory; an existing one is not an error
+ static int make_dir(const char *path) {
+ #ifdef _WIN32
+     return _mkdir(path) == 0;
+ #else
+     return mkdir(path, 0755) == 0;
+ #endif
+ }
+ 
+ static int remove_dir(const char *path) {
+ #ifdef _WIN32
+     return RemoveDirectory(path) != 0;
+ #else
+     return rmdir(path) == 0;
+ #endif
+ }
+ 
+ static int thread_start(thread_handle *thread, thread_result (THREAD_CALL *fn)(void *), void *arg) {
+ #ifdef _WIN32
+     *thread = CreateThread(NULL, 0, fn, arg, 0, NULL);
+     return *thread != NULL;
+ #else
+     return pthread_create(thread, NULL, fn, arg) == 0;
+ #endif
+ }
+ 
+ static void thread_join(thread_handle thread) {
+ #ifdef _WIN32
+     WaitForSingleObject(thread, INFINITE);
+     CloseHandle(thread);
+ #else
+     pthread_join(thread, NULL);
+ #endif
+ }
+ 
+ // Let a thread clean up after itself; nobody joins it
+ static void thread_detach(thread_handle thread) {
+ #ifdef _WIN32
+     CloseHandle(thread);
+ #else
+     pthread_detach(thread);
+ #endif
+ }
+ 
+ #ifdef _WIN32
+ static void mutex_init(mutex_t *m) { InitializeCriticalSection(m); }
+ static void mutex_destroy(mutex_t *m) { DeleteCriticalSection(m); }
+ static void mutex_lock(mutex_t *m) { EnterCriticalSection(m); }
+ static void mutex_unlock(mutex_t *m) { LeaveCriticalSection(m); }
+ static void cond_init(cond_t *c) { InitializeConditionVariable(c); }
+ static void cond_destroy(cond_t *c) { (void)c; }
+ static void cond_wait(cond_t *c, mutex_t *m) { SleepConditionVariableCS(c, m, INFINITE); }
+ static void cond_wait_ms(cond_t *c, mutex_t *m, int ms) { SleepConditionVariableCS(c, m, (DWORD)ms); }
+ static void cond_signal(cond_t *c) { WakeConditionVariable(c); }
+ static void cond_broadcast(cond_t *c) { WakeAllConditionVariable(c); }
+ #else
+ static void mutex_init(mutex_t *m) { pthread_mutex_init(m, NULL); }
+ static void mutex_destroy(mutex_t *m) { pthread_mutex_destroy(m); }
+ static void mutex_lock(mutex_t *m) { pthread_mutex_lock(m); }
+ static void mutex_unlock(mutex_t *m) { pthread_mutex_unlock(m); }
+ static void cond_init(cond_t *c) { pthread_cond_init(c, NULL); }
+ static void cond_destroy(cond_t *c) { pthread_cond_destroy(c); }
+ static void cond_wait(cond_t *c, mutex_t *m) { pthread_cond_wait(c, m); }
+ static void cond_wait_ms(cond_t *c, mutex_t *m, int ms) {
+     struct timespec deadline;
+     clock_gettime(CLOCK_REALTIME, &deadline);
+     deadline.tv_sec += ms / 1000;
+     deadline.tv_nsec += (ms % 1000) * 1000000L;
+     if (deadline.tv_nsec >= 1000000000L) {
+         deadline.tv_sec++;
+         deadline.tv_nsec -= 1000000000L;
      }
+     pthread_cond_timedwait(c, m, &deadline);
+ }
+ static void cond_signal(cond_t *c) { pthread_cond_signal(c); }
+ static void cond_broadcast(cond_t *c) { pthread_cond_broadcast(c); }
+ #endif
+ 
+ // Self-profile: per-stage latency histograms, reported on SIGUSR1 (Ctrl+Break on Windows)
+ // and when the process is stopped
+ 
+ static mutex_t profile_lock;         // Guards the block list, not the blocks
+ static profile_block *profile_blocks;
+ static THREAD_LOCAL profile_block *profile_mine;
+ static long long profile_start_ns;
+ static long long profile_start_cpu_ns;
+ static const char *profile_stage_names[STAGE_COUNT] = {
+     "scan", "hash", "diff", "compress", "send", "apply", "receive", "commit"
+ };
+ 
+ static void profile_init(void) {
+     mutex_init(&profile_lock);
+     profile_start_ns = profile_now();
+     profile_start_cpu_ns = process_cpu_ns();
+ }
+ 
+ // Take a free block for this thread, or add one
+ static profile_block *profile_claim(void) {
+     profile_block *block;
      
-     // Initialize Winsock
-     WSADATA wsaData;
-     if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-         printf("WSAStartup failed\n");
-         return 1;
+     mutex_lock(&profile_lock);
+     for (block = profile_blocks; block && block->in_use; block = block->next) {}
+     if (!block) {
+         block = (profile_block *)calloc(1, sizeof(profile_block));
+         if (block) {
+             block->next = profile_blocks;
+             profile_blocks = block;
+         }
      }
+     if (block) block->in_use = 1;
+     mutex_unlock(&profile_lock);
+     profile_mine = block;
+     return block;
+ }
+ 
+ // A thread that is about to end gives its block back
+ static void profile_release(void) {
+     if (!profile_mine) return;
+     mutex_lock(&profile_lock);
+     profile_mine->in_use = 0;
+     mutex_unlock(&profile_lock);
+     profile_mine = NULL;
+ }
+ 
+ // Bucket of a duration: values below 2^PROFILE_SUB_BITS have one each, larger ones are
+ // grouped by their highest bit and split by the PROFILE_SUB_BITS bits after it
+ static int profile_bucket(unsigned long long ns) {
+     int shift = -PROFILE_SUB_BITS;
      
-     const char *target_dir = argv[2];
-     SOCKET server_socket, client_socket;
-     struct sockaddr_in server_addr, client_addr;
-     int client_len = sizeof(client_addr);
-     sync_record changes[100]; // Arbitrary limit for simplicity
-     int change_count = 0;
-     int recv_result;
-     
-     // Create socket
-     server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-     if (server_socket == INVALID_SOCKET) {
-         printf("Error creating socket: %d\n", WSAGetLastError());
-         WSACleanup();
-         return 1;
-     }
+     if (ns < (1ULL << PROFILE_SUB_BITS)) return (int)ns;
+     for (unsigned long long v = ns; v > 1; v >>= 1) shift++;
+     return ((shift + 1) << PROFILE_SUB_BITS) + (int)((ns >> shift) & ((1ULL << PROFILE_SUB_BITS) - 1));
+ }
+ 
+ // Largest duration that falls in a bucket
+ static unsigned long long profile_bucket_high(int bucket) {
+     int group = bucket >> PROFILE_SUB_BITS;
+     unsigned long long sub = bucket & ((1 << PROFILE_SUB_BITS) - 1);
+     if (group == 0) return sub;
+     return (((1ULL << PROFILE_SUB_BITS) + sub + 1) << (group - 1)) - 1;
+ }
+ 
+ // Record a stage that began at start, on this thread's block. Returns when it ended, so a
+ // following stage can start from there without reading the clock again.
+ static long long profile_end(profile_stage stage, long long start) {
+     long long end = profile_now();
+     profile_block *block = profile_mine ? profile_mine : profile_claim();
+     if (!block) return end;
      
-     // Configure server address
-     memset(&server_addr, 0, sizeof(server_addr));
-     server_addr.sin_family = AF_INET;
-     server_addr.sin_addr.s_addr = INADDR_ANY;
-     server_addr.sin_port = htons(SERVER_PORT);
+     stage_histogram *h = &block->stages[stage];
+     unsigned long long ns = end > start ? (unsigned long long)(end - start) : 0;
+     int bucket = profile_bucket(ns);
+     counter_store(&h->buckets[bucket], h->buckets[bucket] + 1);
+     counter_store(&h->total_ns, h->total_ns + ns);
+     if (ns > h->max_ns) counter_store(&h->max_ns, ns);
+     counter_store(&h->count, h->count + 1);
+     return end;
+ }
+ 
+ static void format_ns(char *text, size_t size, double ns) {
+     if (ns < 1e3) snprintf(text, size, "%.0fns", ns);
+     else if (ns < 1e6) snprintf(text, size, "%.1fus", ns / 1e3);
+     else if (ns < 1e9) snprintf(text, size, "%.1fms", ns / 1e6);
+     else snprintf(text, size, "%.2fs", ns / 1e9);
+ }
+ 
+ // Write the process's CPU time against the wall clock, then every stage's latency percentiles
+ // summed over all threads. Safe to call while the stages run.
+ static void profile_report(FILE *out) {
+     static const double quantiles[4] = { 0.50, 0.90, 0.99, 0.999 };
+     static stage_histogram sum;      // Too big for the stack of a small thread; reports take profile_lock
+     double wall_ns = (double)(profile_now() - profile_start_ns);
+     double cpu_ns = (double)(process_cpu_ns() - profile_start_cpu_ns);
+     int threads = 0;
      
-     // Bind socket
-     if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
-         printf("Error binding socket: %d\n", WSAGetLastError());
-         closesocket(server_socket);
-         WSACleanup();
+     mutex_lock(&profile_lock);
+     for (profile_block *block = profile_blocks; block; block = block->next) threads++;
+     fprintf(out, "Self-profile over %.1f s: %.3f%% of a CPU (%.1f ms of CPU time), %d thread blocks\n",
+             wall_ns / 1e9, wall_ns > 0 ? 100.0 * cpu_ns / wall_ns : 0.0, cpu_ns / 1e6, threads);
+     fprintf(out, "  %-8s %10s %8s %8s %8s %8s %8s %8s %8s\n",
+             "stage", "count", "mean", "p50", "p90", "p99", "p99.9", "max", "total s");
+     for (int stage = 0; stage < STAGE_COUNT; stage++) {
+         memset(&sum, 0, sizeof(sum));
+         for (profile_block *block = profile_blocks; block; block = block->next) {
+             const stage_histogram *h = &block->stages[stage];
+             unsigned long long max_ns = counter_load(&h->max_ns);
+             sum.count += counter_load(&h->count);
+             sum.total_ns += counter_load(&h->total_ns);
+             if (max_ns > sum.max_ns) sum.max_ns = max_ns;
+             for (int b = 0; b < PROFILE_BUCKETS; b++) sum.buckets[b] += counter_load(&h->buckets[b]);
+         }
+         if (sum.count == 0) continue;
+         
+         // Percentiles are the top of their bucket, so they never understate
+         char text[6][16];
+         unsigned long long seen = 0;
+         int next = 0;
+         format_ns(text[0], sizeof(text[0]), (double)sum.total_ns / sum.count);
+         for (int b = 0; b < PROFILE_BUCKETS && next < 4; b++) {
+             seen += sum.buckets[b];
+             while (next < 4 && seen > 0 && (double)seen >= quantiles[next] * sum.count) {
+                 unsigned long long high = profile_bucket_high(b);
+                 format_ns(text[1 + next], sizeof(text[0]), (double)(high < sum.max_ns ? high : sum.max_ns));
+                 next++;
+             }
+         }
+         while (next < 4) snprintf(text[1 + next++], sizeof(text[0]), "-");
+         format_ns(text[5], sizeof(text[0]), (double)sum.max_ns);
+         fprintf(out, "  %-8s %10llu %8s %8s %8s %8s %8s %8s %8.3f\n", profile_stage_names[stage], sum.count,
+                 text[0], text[1], text[2], text[3], text[4], text[5], sum.total_ns / 1e9);
+     }
+     mutex_unlock(&profile_lock);
+     fflush(out);
+ }
+ 
+ #ifdef _WIN32
+ // Ctrl+Break reports and carries on; Ctrl+C and closing the console report on the way out
+ static BOOL WINAPI profile_console_handler(DWORD event) {
+     profile_report(stderr);
+     return event == CTRL_BREAK_EVENT;
+ }
+ 
+ static void profile_watch(void) {
+     SetConsoleCtrlHandler(profile_console_handler, TRUE);
+ }
+ #else
+ static sigset_t profile_signals;
+ 
+ // SIGUSR1 reports; SIGINT and SIGTERM report and then end the process as they would have.
+ // The signals are blocked everywhere and taken here with sigwait, so the report is written
+ // from a thread of its own rather than from a signal handler.
+ static thread_result THREAD_CALL profile_signal_thread(void *arg) {
+     int sig;
+     
+     (void)arg;
+     while (sigwait(&profile_signals, &sig) == 0) {
+         profile_report(stderr);
+         if (sig == SIGUSR1) continue;
+         
+         // Keep what the process printed before it goes
+         sigset_t ending;
+         fflush(stdout);
+         sigemptyset(&ending);
+         sigaddset(&ending, sig);
+         signal(sig, SIG_DFL);
+         pthread_sigmask(SIG_UNBLOCK, &ending, NULL);
+         raise(sig);
+     }
+     return (thread_result)0;
+ }
+ 
+ // Call before any other thread starts, so they all inherit the blocked signals
+ static void profile_watch(void) {
+     thread_handle thread;
+     
+     sigemptyset(&profile_signals);
+     sigaddset(&profile_signals, SIGUSR1);
+     sigaddset(&profile_signals, SIGINT);
+     sigaddset(&profile_signals, SIGTERM);
+     pthread_sigmask(SIG_BLOCK, &profile_signals, NULL);
+     if (thread_start(&thread, profile_signal_thread, NULL)) thread_detach(thread);
+ }
+ #endif
+ 
+ // I/O engine. On Linux requests go through an io_uring: submissions are batched into a single
+ // io_uring_enter and completions are reaped from the shared ring. Without io_uring every request
+ // runs synchronously inside the submit call, so callers use one code path either way.
+ 
+ #ifdef DSYNC_IO_URING
+ static int io_uring_enter_call(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+     return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+ }
+ 
+ static void io_engine_unmap(io_engine *io) {
+     if (io->sqes && io->sqes != MAP_FAILED) munmap(io->sqes, io->sqes_size);
+     if (io->cq_ring && io->cq_ring != MAP_FAILED && io->cq_ring != io->sq_ring) munmap(io->cq_ring, io->cq_ring_size);
+     if (io->sq_ring && io->sq_ring != MAP_FAILED) munmap(io->sq_ring, io->sq_ring_size);
+ }
+ #endif
+ 
+ // Set up the engine; failing to get an io_uring just selects the synchronous fallback
+ int io_engine_init(io_engine *io, unsigned depth) {
+     memset(io, 0, sizeof(*io));
+     io->ring_fd = -1;
+     
+ #ifdef DSYNC_IO_URING
+     struct io_uring_params params;
+     memset(&params, 0, sizeof(params));
+     
+     int ring_fd = (int)syscall(__NR_io_uring_setup, depth, &params);
+     if (ring_fd < 0) {
+         printf("io_uring unavailable (%d), using synchronous I/O\n", errno);
          return 1;
      }
      
-     // Listen for connections
-     if (listen(server_socket, 5) == SOCKET_ERROR) {
-         printf("Error listening: %d\n", WSAGetLastError());
-         closesocket(server_socket);
-         WSACleanup();
+     io->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+     io->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+     if (params.features & IORING_FEAT_SINGLE_MMAP) {
+         if (io->cq_ring_size > io->sq_ring_size) io->sq_ring_size = io->cq_ring_size;
+         io->cq_ring_size = io->sq_ring_size;
+     }
+     
+     io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring_fd, IORING_OFF_SQ_RING);
+     if (params.features & IORING_FEAT_SINGLE_MMAP) {
+         io->cq_ring = io->sq_ring;
+     } else {
+         io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring_fd, IORING_OFF_CQ_RING);
+     }
+     io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+     io->sqes = (struct io_uring_sqe *)mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+     
+     if (io->sq_ring == MAP_FAILED || io->cq_ring == MAP_FAILED || io->sqes == MAP_FAILED) {
+         printf("Error mapping io_uring (%d), using synchronous I/O\n", errno);
+         io_engine_unmap(io);
+         close(ring_fd);
+         memset(io, 0, sizeof(*io));
+         io->ring_fd = -1;
+         return 1;
+     }
+     
+     char *sq = (char *)io->sq_ring;
+     char *cq = (char *)io->cq_ring;
+     io->sq_head = (unsigned *)(sq + params.sq_off.head);
+     io->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+     io->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+     io->sq_array = (unsigned *)(sq + params.sq_off.array);
+     io->cq_head = (unsigned *)(cq + params.cq_off.head);
+     io->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+     io->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+     io->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+     io->sq_entries = params.sq_entries;
+     io->ring_fd = ring_fd;
+ #else
+     (void)depth;
+ #endif
+     return 1;
+ }
+ 
+ // Pin buffers in the kernel so reads and writes into them skip the per-request page mapping
+ void io_engine_register_buffers(io_engine *io, unsigned char **buffers, size_t length, int count) {
+ #ifdef DSYNC_IO_URING
+     if (io->ring_fd < 0 || count <= 0) return;
+     
+     struct iovec *iov = (struct iovec *)malloc(count * sizeof(struct iovec));
+     if (!iov) return;
+     for (int i = 0; i < count; i++) {
+         iov[i].iov_base = buffers[i];
+         iov[i].iov_len = length;
+     }
+     
+     if (syscall(__NR_io_uring_register, io->ring_fd, IORING_REGISTER_BUFFERS, iov, count) == 0) {
+         io->fixed_buffers = 1;
+     } else {
+         // Usually RLIMIT_MEMLOCK; plain reads and writes still work
+         printf("Could not register I/O buffers (%d)\n", errno);
+     }
+     free(iov);
+ #else
+     (void)io;
+     (void)buffers;
+     (void)length;
+     (void)count;
+ #endif
+ }
+ 
+ void io_engine_destroy(io_engine *io) {
+ #ifdef DSYNC_IO_URING
+     if (io->ring_fd >= 0) {
+         io_engine_unmap(io);
+         close(io->ring_fd);
+     }
+ #endif
+     memset(io, 0, sizeof(*io));
+     io->ring_fd = -1;
+ }
+ 
+ #ifdef DSYNC_IO_URING
+ // Reap every completion currently in the ring, returns how many were reaped
+ static int io_reap(io_engine *io) {
+     int reaped = 0;
+     unsigned head = *io->cq_head;
+     unsigned tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+     
+     while (head != tail) {
+         struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+         io_request *req = (io_request *)(uintptr_t)cqe->user_data;
+         req->result = cqe->res;
+         req->done = 1;
+         head++;
+         io->in_flight--;
+         reaped++;
+     }
+     __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+     return reaped;
+ }
+ 
+ // Next free submission entry, making room first if the rings are full
+ static struct io_uring_sqe *io_get_sqe(io_engine *io) {
+     // Keep completions bounded by the ring size so the CQ can never overflow
+     while (io->in_flight + io->queued >= io->sq_entries) {
+         io_flush(io);
+         if (io_reap(io) == 0 && io_uring_enter_call(io->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+             errno != EINTR) {
+             printf("io_uring wait failed: %d\n", errno);
+             break;
+         }
+     }
+     
+     unsigned tail = *io->sq_tail;
+     unsigned index = tail & *io->sq_mask;
+     struct io_uring_sqe *sqe = &io->sqes[index];
+     memset(sqe, 0, sizeof(*sqe));
+     io->sq_array[index] = index;
+     return sqe;
+ }
+ 
+ // Publish a filled entry; it is handed to the kernel on the next flush
+ static void io_queue_sqe(io_engine *io) {
+     __atomic_store_n(io->sq_tail, *io->sq_tail + 1, __ATOMIC_RELEASE);
+     io->queued++;
+ }
+ #endif
+ 
+ void io_submit_read(io_engine *io, file_handle file, int buffer_index, void *buffer,
+                     size_t length, long long offset, io_request *req) {
+     req->done = 0;
+ #ifdef DSYNC_IO_URING
+     if (io->ring_fd >= 0) {
+         struct io_uring_sqe *sqe = io_get_sqe(io);
+         int fixed = io->fixed_buffers && buffer_index >= 0;
+         sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+         sqe->fd = file;
+         sqe->addr = (uintptr_t)buffer;
+         sqe->len = (unsigned)length;
+         sqe->off = (unsigned long long)offset;
+         sqe->buf_index = fixed ? (unsigned short)buffer_index : 0;
+         sqe->user_data = (uintptr_t)req;
+         io_queue_sqe(io);
+         return;
+     }
+ #endif
+     (void)io;
+     (void)buffer_index;
+     req->result = file_pread(file, buffer, length, offset);
+     req->done = 1;
+ }
+ 
+ void io_submit_write(io_engine *io, file_handle file, int buffer_index, const void *buffer,
+                      size_t length, long long offset, io_request *req) {
+     req->done = 0;
+ #ifdef DSYNC_IO_URING
+     if (io->ring_fd >= 0) {
+         struct io_uring_sqe *sqe = io_get_sqe(io);
+         int fixed = io->fixed_buffers && buffer_index >= 0;
+         sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+         sqe->fd = file;
+         sqe->addr = (uintptr_t)buffer;
+         sqe->len = (unsigned)length;
+         sqe->off = (unsigned long long)offset;
+         sqe->buf_index = fixed ? (unsigned short)buffer_index : 0;
+         sqe->user_data = (uintptr_t)req;
+         io_queue_sqe(io);
+         return;
+     }
+ #endif
+     (void)io;
+     (void)buffer_index;
+     req->result = file_pwrite(file, buffer, length, offset);
+     req->done = 1;
+ }
+ 
+ // Queue an fdatasync; submitted together, the kernel flushes a whole batch of files at once
+ void io_submit_fsync(io_engine *io, file_handle file, io_request *req) {
+     req->done = 0;
+ #ifdef DSYNC_IO_URING
+     if (io->ring_fd >= 0) {
+         struct io_uring_sqe *sqe = io_get_sqe(io);
+         sqe->opcode = IORING_OP_FSYNC;
+         sqe->fd = file;
+         sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+         sqe->user_data = (uintptr_t)req;
+         io_queue_sqe(io);
+         return;
+     }
+ #endif
+     (void)io;
+     req->result = file_sync(file) ? 0 : -1;
+     req->done = 1;
+ }
+ 
+ // Queue a send; with link set the next request only starts once this one has completed,
+ // which keeps frames on one socket in order
+ void io_submit_send(io_engine *io, SOCKET sock, const void *buffer, size_t length,
+                     int link, io_request *req) {
+     req->done = 0;
+ #ifdef DSYNC_IO_URING
+     if (io->ring_fd >= 0) {
+         struct io_uring_sqe *sqe = io_get_sqe(io);
+         sqe->opcode = IORING_OP_SEND;
+         sqe->fd = sock;
+         sqe->addr = (uintptr_t)buffer;
+         sqe->len = (unsigned)length;
+         sqe->msg_flags = MSG_WAITALL | SEND_FLAGS;
+         sqe->flags = link ? IOSQE_IO_LINK : 0;
+         sqe->user_data = (uintptr_t)req;
+         io_queue_sqe(io);
+         return;
+     }
+ #endif
+     (void)io;
+     (void)link;
+     req->result = send_all(sock, buffer, (int)length) ? (long long)length : -1;
+     req->done = 1;
+ }
+ 
+ // Hand all queued requests to the kernel in one system call
+ void io_flush(io_engine *io) {
+ #ifdef DSYNC_IO_URING
+     while (io->ring_fd >= 0 && io->queued > 0) {
+         int submitted = io_uring_enter_call(io->ring_fd, io->queued, 0, 0);
+         if (submitted < 0) {
+             if (errno == EINTR) continue;
+             if (errno == EAGAIN || errno == EBUSY) {
+                 // Completions need reaping before the kernel takes more
+                 io_reap(io);
+                 io_uring_enter_call(io->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+                 continue;
+             }
+             printf("io_uring submit failed: %d\n", errno);
+             return;
+         }
+         io->queued -= (unsigned)submitted;
+         io->in_flight += (unsigned)submitted;
+     }
+ #else
+     (void)io;
+ #endif
+ }
+ 
+ // Block until a request has completed
+ void io_wait(io_engine *io, io_request *req) {
+ #ifdef DSYNC_IO_URING
+     if (io->ring_fd < 0) return;
+     
+     io_flush(io);
+     while (!req->done) {
+         if (io_reap(io) > 0) continue;
+         if (io->in_flight == 0) {
+             // Never made it to the kernel
+             req->result = -1;
+             req->done = 1;
+             break;
+         }
+         if (io_uring_enter_call(io->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+             printf("io_uring wait failed: %d\n", errno);
+             req->result = -1;
+             req->done = 1;
+         }
+     }
+ #else
+     (void)io;
+     (void)req;
+ #endif
+ }
+ 
+ // Defaults for everything the client command line can set
+ static void client_options_init(client_options *opts) {
+     opts->interval = 60; // Default to 60 seconds
+     opts->content_hash = 0;
+     opts->hash_cache_path = HASH_CACHE_FILE;
+     opts->snapshot_path = SNAPSHOT_FILE;
+     opts->codec = CODEC_NONE;
+     opts->compress_threads = 2;
+     opts->dedup = 0;
+     opts->bandwidth = 0;
+     opts->parallel = PARALLEL_MAX_CONNECTIONS;
+     opts->ignore_file = NULL;
+     opts->ignore_count = 0;
+     opts->two_way = 0;
+ }
+ 
+ // Apply the client option at argv[*i]; returns 1 if it was one, 0 if not, -1 if it is invalid
+ static int parse_client_option(client_options *opts, int argc, char *argv[], int *i) {
+     if (strcmp(argv[*i], "--hash") == 0) {
+         opts->content_hash = 1;
+     } else if (strcmp(argv[*i], "--dedup") == 0) {
+         opts->dedup = 1;
+     } else if (strcmp(argv[*i], "--hash-cache") == 0 && *i + 1 < argc) {
+         opts->hash_cache_path = argv[++*i];
+     } else if (strcmp(argv[*i], "--snapshot") == 0 && *i + 1 < argc) {
+         opts->snapshot_path = argv[++*i];
+     } else if (strcmp(argv[*i], "--compress") == 0 && *i + 1 < argc) {
+         const char *name = argv[++*i];
+         if (strcmp(name, "none") == 0) opts->codec = CODEC_NONE;
+         else if (strcmp(name, "lz4") == 0) opts->codec = CODEC_LZ4;
+         else if (strcmp(name, "zstd") == 0) opts->codec = CODEC_ZSTD;
+         else if (strcmp(name, "auto") == 0) opts->codec = CODEC_AUTO;
+         else {
+             printf("Unknown codec: %s\n", name);
+             return -1;
+         }
+         if (opts->codec == CODEC_ZSTD && !ZSTD_AVAILABLE) {
+             printf("zstd support not compiled in (build with -DDSYNC_WITH_ZSTD)\n");
+             return -1;
+         }
+     } else if (strcmp(argv[*i], "--compress-threads") == 0 && *i + 1 < argc) {
+         opts->compress_threads = atoi(argv[++*i]);
+         if (opts->compress_threads < 0) opts->compress_threads = 0;
+         if (opts->compress_threads > COMPRESS_MAX_WORKERS) opts->compress_threads = COMPRESS_MAX_WORKERS;
+     } else if (strcmp(argv[*i], "--bandwidth") == 0 && *i + 1 < argc) {
+         opts->bandwidth = atoll(argv[++*i]) * 1024;
+         if (opts->bandwidth < 0) opts->bandwidth = 0;
+     } else if (strcmp(argv[*i], "--parallel") == 0 && *i + 1 < argc) {
+         opts->parallel = atoi(argv[++*i]);
+         if (opts->parallel < 0) opts->parallel = 0;
+         if (opts->parallel > PARALLEL_MAX_CONNECTIONS) opts->parallel = PARALLEL_MAX_CONNECTIONS;
+     } else if (strcmp(argv[*i], "--ignore") == 0 && *i + 1 < argc) {
+         if (opts->ignore_count == MAX_IGNORE_PATTERNS) {
+             printf("At most %d --ignore patterns are supported, use --ignore-file\n", MAX_IGNORE_PATTERNS);
+             return -1;
+         }
+         opts->ignore_patterns[opts->ignore_count++] = argv[++*i];
+     } else if (strcmp(argv[*i], "--ignore-file") == 0 && *i + 1 < argc) {
+         opts->ignore_file = argv[++*i];
+     } else if (strcmp(argv[*i], "--two-way") == 0) {
+         opts->two_way = 1;
+     } else {
+         return 0;
+     }
+     return 1;
+ }
+ 
+ // Client main function
+ int client_main(int argc, char *argv[]) {
+     if (argc < 4) {
+         printf("Usage: %s client <directory_to_watch> <server_ip>[,<server_ip>...] [interval_seconds] "
+                "[--hash] [--hash-cache <file>] [--snapshot <file>] "
+                "[--compress none|lz4|zstd|auto] [--compress-threads <n>] [--dedup] "
+                "[--bandwidth <KB/s>] [--parallel <connections>] [--ignore <pattern>]... "
+                "[--ignore-file <file>] [--two-way]\n", argv[0]);
+         return 1;
+     }
+     
+     const char *dir_path = argv[2];
+     const char *server_ip = argv[3];
+     client_options opts;
+     client_options_init(&opts);
+     
+     for (int i = 4; i < argc; i++) {
+         int taken = parse_client_option(&opts, argc, argv, &i);
+         if (taken < 0) return 1;
+         if (taken) continue;
+         
+         if (argv[i][0] != '-') {
+             opts.interval = atoi(argv[i]);
+         } else {
+             printf("Unknown option: %s\n", argv[i]);
+             return 1;
+         }
+     }
+     
+     // Initialize networking
+     if (!net_startup()) {
+         return 1;
+     }
+     
+     printf("Starting directory sync client\n");
+     printf("Watching directory: %s\n", dir_path);
+     printf("Server IP: %s\n", server_ip);
+     printf("Sync interval: %d seconds\n", opts.interval);
+     if (opts.content_hash) {
+         printf("Content hashing enabled (cache: %s)\n", opts.hash_cache_path);
+     }
+     if (opts.codec != CODEC_NONE) {
+         printf("Compression: %s with %d worker threads\n",
+                codec_name(opts.codec), opts.compress_threads);
+     }
+     if (opts.dedup) {
+         printf("Chunk deduplication enabled\n");
+     }
+     if (opts.bandwidth > 0) {
+         printf("Bandwidth limit: %lld KB/s\n", opts.bandwidth / 1024);
+     }
+     if (opts.parallel > 0) {
+         printf("Files of %lld MB and more go out as ranges over up to %d connections\n",
+                PARALLEL_MIN_SIZE / (1024 * 1024), opts.parallel);
+     }
+     if (opts.two_way) {
+         printf("Two-way sync: changes on the server come back, conflicts are kept as side copies\n");
+     }
+     
+     watch_directory(dir_path, server_ip, &opts);
+     
+     // Cleanup networking
+     net_cleanup();
+     return 0;
+ }
+ 
+ // Parse a --sync mode name
+ static int parse_durability(const char *name, durability_mode *mode) {
+     if (strcmp(name, "batch") == 0) {
+         *mode = DURABILITY_BATCH;
+     } else if (strcmp(name, "syncfs") == 0) {
+         *mode = DURABILITY_SYNCFS;
+     } else if (strcmp(name, "none") == 0) {
+         *mode = DURABILITY_NONE;
+     } else {
+         printf("Unknown sync mode: %s\n", name);
+         return 0;
+     }
+     return 1;
+ }
+ 
+ // Server main function
+ int server_main(int argc, char *argv[]) {
+     if (argc < 3) {
+         printf("Usage: %s server <target_directory> [--chunk-index <file>] [--sync batch|syncfs|none] "
+                "[--replica-index <file>]\n", argv[0]);
+         return 1;
+     }
+     
+     const char *index_path = CHUNK_INDEX_FILE;
+     const char *replica_path = REPLICA_FILE;
+     durability_mode durability = DURABILITY_BATCH;
+     for (int i = 3; i < argc; i++) {
+         if (strcmp(argv[i], "--chunk-index") == 0 && i + 1 < argc) {
+             index_path = argv[++i];
+         } else if (strcmp(argv[i], "--replica-index") == 0 && i + 1 < argc) {
+             replica_path = argv[++i];
+         } else if (strcmp(argv[i], "--sync") == 0 && i + 1 < argc) {
+             if (!parse_durability(argv[++i], &durability)) return 1;
+         } else {
+             printf("Unknown option: %s\n", argv[i]);
+             return 1;
+         }
+     }
+     
+     // Initialize networking
+     if (!net_startup()) {
+         return 1;
+     }
+     
+     SOCKET server_socket;
+     server_context ctx;
+     volatile int stop = 0;
+     
+     if (!server_context_init(&ctx, argv[2], index_path, durability)) {
+         net_cleanup();
+         return 1;
+     }
+     const char *target_dir = ctx.target_dir;
+     ctx.replica_path = replica_path;
+     
+     server_socket = server_listen(INADDR_ANY);
+     if (server_socket == INVALID_SOCKET) {
+         net_cleanup();
          return 1;
      }
      
      printf("Directory sync server started\n");
      printf("Target directory: %s\n", target_dir);
      printf("Listening on port %d\n", SERVER_PORT);
+     printf("Chunk index: %s (%d chunks)\n", index_path, ctx.index.count);
+     printf("I/O backend: %s\n", ctx.io.ring_fd >= 0 ? "io_uring" : "synchronous");
+     printf("Durability: %s\n", durability == DURABILITY_BATCH ? "batched fsync" :
+                                durability == DURABILITY_SYNCFS ? "syncfs" : "none");
      
-     while (1) {
-         // Accept client connection
-         client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
-         if (client_socket == INVALID_SOCKET) {
-             printf("Error accepting connection: %d\n", WSAGetLastError());
-             continue;
+     // Serve clients; range connections of a large file run beside its session
+     server_run(&ctx, server_socket, index_path, &stop);
+     
+     server_context_destroy(&ctx);
+     closesocket(server_socket);
+     net_cleanup();
+     return 0;
+ }
+ 
+ // Convert path separators to the native one (backslashes on Windows, slashes elsewhere)
+ char* normalize_path(const char* path) {
+     char* normalized = _strdup(path);
+     char* p = normalized;
+     
+     while (*p) {
+         if (*p == OTHER_PATH_SEP) *p = PATH_SEP;
+         p++;
+     }
+     
+     return normalized;
+ }
+ 
+ // Order file_info entries by path, matching the case-insensitive comparison used for diffs
+ static int compare_file_paths(const void *a, const void *b) {
+     return path_compare(((const file_info *)a)->path, ((const file_info *)b)->path);
+ }
+ 
+ // Ignore patterns compare like the file system compares names
+ static unsigned char ignore_fold(char c) {
+ #ifdef _WIN32
+     if (c >= 'A' && c <= 'Z') return (unsigned char)(c - 'A' + 'a');
+ #endif
+     return (unsigned char)c;
+ }
+ 
+ static uint64_t ignore_segment_hash(const char *segment) {
+     unsigned char folded[MAX_PATH_LENGTH];
+     size_t length = 0;
+     while (segment[length] && length < sizeof(folded)) {
+         folded[length] = ignore_fold(segment[length]);
+         length++;
+     }
+     return xxh64(folded, length, 0);
+ }
+ 
+ // Key of a literal edge, so one hash of the entry name serves every state it is looked up from
+ static uint64_t ignore_edge_hash(int parent, uint64_t segment_hash) {
+     uint64_t h = segment_hash ^ ((uint64_t)(parent + 1) * 0x9E3779B97F4A7C15ULL);
+     h ^= h >> 29;
+     return h * 0xBF58476D1CE4E5B9ULL;
+ }
+ 
+ static int ignore_find_literal(const ignore_rules *rules, int parent, const char *segment, uint64_t segment_hash) {
+     if (rules->literal_capacity == 0) return -1;
+     uint64_t hash = ignore_edge_hash(parent, segment_hash);
+     int mask = rules->literal_capacity - 1;
+     for (int slot = (int)(hash & mask); rules->literals[slot].child >= 0; slot = (slot + 1) & mask) {
+         const ignore_edge *e = &rules->literals[slot];
+         if (e->hash == hash && e->parent == parent && path_compare(e->segment, segment) == 0) return e->child;
+     }
+     return -1;
+ }
+ 
+ static int ignore_new_node(ignore_rules *rules, int is_star) {
+     if (rules->node_count == rules->node_capacity) {
+         int capacity = rules->node_capacity ? rules->node_capacity * 2 : 16;
+         ignore_node *grown = (ignore_node *)realloc(rules->nodes, capacity * sizeof(ignore_node));
+         if (!grown) return -1;
+         rules->nodes = grown;
+         rules->node_capacity = capacity;
+     }
+     ignore_node *node = &rules->nodes[rules->node_count];
+     node->star = -1;
+     node->globs = -1;
+     node->accept = -1;
+     node->accept_dir = -1;
+     node->is_star = is_star;
+     return rules->node_count++;
+ }
+ 
+ static void ignore_insert_literal(ignore_rules *rules, const ignore_edge *edge) {
+     int mask = rules->literal_capacity - 1;
+     int slot = (int)(edge->hash & mask);
+     while (rules->literals[slot].child >= 0) slot = (slot + 1) & mask;
+     rules->literals[slot] = *edge;
+ }
+ 
+ static int ignore_literal_child(ignore_rules *rules, int parent, const char *segment) {
+     uint64_t segment_hash = ignore_segment_hash(segment);
+     int child = ignore_find_literal(rules, parent, segment, segment_hash);
+     if (child >= 0) return child;
+     
+     // Keep the table at most half full
+     if ((rules->literal_count + 1) * 2 > rules->literal_capacity) {
+         int capacity = rules->literal_capacity ? rules->literal_capacity * 2 : 64;
+         ignore_edge *old = rules->literals;
+         int old_capacity = rules->literal_capacity;
+         rules->literals = (ignore_edge *)malloc(capacity * sizeof(ignore_edge));
+         if (!rules->literals) {
+             rules->literals = old;
+             return -1;
          }
+         for (int i = 0; i < capacity; i++) rules->literals[i].child = -1;
+         rules->literal_capacity = capacity;
+         for (int i = 0; i < old_capacity; i++) {
+             if (old[i].child >= 0) ignore_insert_literal(rules, &old[i]);
+         }
+         free(old);
+     }
+     
+     ignore_edge edge;
+     edge.hash = ignore_edge_hash(parent, segment_hash);
+     edge.parent = parent;
+     edge.next = -1;
+     edge.segment = _strdup(segment);
+     edge.child = edge.segment ? ignore_new_node(rules, 0) : -1;
+     if (edge.child < 0) {
+         free(edge.segment);
+         return -1;
+     }
+     ignore_insert_literal(rules, &edge);
+     rules->literal_count++;
+     return edge.child;
+ }
+ 
+ static int ignore_glob_child(ignore_rules *rules, int parent, const char *segment) {
+     for (int e = rules->nodes[parent].globs; e >= 0; e = rules->globs[e].next) {
+         if (strcmp(rules->globs[e].segment, segment) == 0) return rules->globs[e].child;
+     }
+     
+     if (rules->glob_count == rules->glob_capacity) {
+         int capacity = rules->glob_capacity ? rules->glob_capacity * 2 : 16;
+         ignore_edge *grown = (ignore_edge *)realloc(rules->globs, capacity * sizeof(ignore_edge));
+         if (!grown) return -1;
+         rules->globs = grown;
+         rules->glob_capacity = capacity;
+     }
+     
+     ignore_edge *edge = &rules->globs[rules->glob_count];
+     edge->hash = 0;
+     edge->parent = parent;
+     edge->segment = _strdup(segment);
+     edge->child = edge->segment ? ignore_new_node(rules, 0) : -1;
+     if (edge->child < 0) {
+         free(edge->segment);
+         return -1;
+     }
+     edge->next = rules->nodes[parent].globs;
+     rules->nodes[parent].globs = rules->glob_count++;
+     return edge->child;
+ }
+ 
+ static int ignore_star_child(ignore_rules *rules, int parent) {
+     if (rules->nodes[parent].star < 0) {
+         int child = ignore_new_node(rules, 1);
+         if (child < 0) return -1;
+         rules->nodes[parent].star = child;
+     }
+     return rules->nodes[parent].star;
+ }
+ 
+ // A segment with unescaped wildcards needs a glob edge; any other one is matched literally
+ // once its escapes are removed
+ static int ignore_is_glob(char *segment) {
+     for (const char *p = segment; *p; p++) {
+         if (*p == '\\' && p[1]) p++;
+         else if (*p == '*' || *p == '?' || *p == '[') return 1;
+     }
+     
+     char *out = segment;
+     for (const char *p = segment; *p; p++) {
+         if (*p == '\\' && p[1]) p++;
+         *out++ = *p;
+     }
+     *out = '\0';
+     return 0;
+ }
+ 
+ void ignore_rules_init(ignore_rules *rules) {
+     memset(rules, 0, sizeof(*rules));
+ }
+ 
+ void ignore_rules_free(ignore_rules *rules) {
+     for (int i = 0; i < rules->literal_capacity; i++) {
+         if (rules->literals[i].child >= 0) free(rules->literals[i].segment);
+     }
+     for (int i = 0; i < rules->glob_count; i++) free(rules->globs[i].segment);
+     free(rules->literals);
+     free(rules->globs);
+     free(rules->nodes);
+     free(rules->negated);
+     memset(rules, 0, sizeof(*rules));
+ }
+ 
+ // Compile one line of gitignore syntax. A pattern without a slash matches at any depth, one
+ // with a slash is relative to the watched directory; a trailing slash limits it to
+ // directories, "**" spans any number of directories and "!" includes again what an earlier
+ // rule excluded. Returns 1 if a rule was added, 0 for blank and comment lines, -1 on failure.
+ int ignore_rules_add(ignore_rules *rules, const char *line) {
+     char pattern[MAX_PATH_LENGTH];
+     size_t length = strlen(line);
+     
+     // Line ends and unescaped trailing blanks are not part of the pattern
+     while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) length--;
+     while (length > 0 && (line[length - 1] == ' ' || line[length - 1] == '\t') &&
+            !(length > 1 && line[length - 2] == '\\')) {
+         length--;
+     }
+     if (length == 0 || line[0] == '#') return 0;
+     if (length >= sizeof(pattern)) {
+         printf("Ignore pattern too long: %.40s...\n", line);
+         return 0;
+     }
+     memcpy(pattern, line, length);
+     pattern[length] = '\0';
+     
+     char *p = pattern;
+     int negated = 0;
+     if (*p == '!') {
+         negated = 1;
+         p++;
+     } else if (*p == '\\' && (p[1] == '!' || p[1] == '#')) {
+         p++;
+     }
+     
+     length = strlen(p);
+     int dir_only = 0;
+     while (length > 0 && p[length - 1] == '/') {
+         p[--length] = '\0';
+         dir_only = 1;
+     }
+     int anchored = strchr(p, '/') != NULL;
+     while (*p == '/') p++;
+     if (*p == '\0') return 0;
+     
+     if (rules->node_count == 0 && ignore_new_node(rules, 0) < 0) {
+         printf("Memory allocation failed\n");
+         return -1;
+     }
+     
+     unsigned char *grown = (unsigned char *)realloc(rules->negated, rules->rule_count + 1);
+     if (!grown) {
+         printf("Memory allocation failed\n");
+         return -1;
+     }
+     rules->negated = grown;
+     
+     // Unanchored patterns hang below a "**" off the root, so they share its state
+     int node = anchored ? 0 : ignore_star_child(rules, 0);
+     while (node >= 0) {
+         char *end = strchr(p, '/');
+         if (end) *end = '\0';
          
-         char client_ip[INET_ADDRSTRLEN];
-         strcpy(client_ip, inet_ntoa(client_addr.sin_addr));
-         
-        printf("Connection accepted from %s\n", client_ip);
+         if (*p == '\0') {
+             // Doubled slash, nothing to match
+         } else if (strcmp(p, "**") == 0) {
+             // A trailing "**" matches everything inside; it never has to match zero
+             // segments, since a directory the rule matched itself would not be descended
+             node = end ? ignore_star_child(rules, node) : ignore_glob_child(rules, node, "*");
+         } else if (ignore_is_glob(p)) {
+             node = ignore_glob_child(rules, node, p);
+         } else {
+             node = ignore_literal_child(rules, node, p);
+         }
          
-         // Receive changes
-         recv_result = recv(client_socket, (char*)&change_count, sizeof(change_count), 0);
-         if (recv_result == SOCKET_ERROR || recv_result == 0) {
-             printf("Error receiving change count: %d\n", WSAGetLastError());
-             closesocket(client_socket);
+         if (!end) break;
+         p = end + 1;
+     }
+     if (node < 0) {
+         printf("Memory allocation failed\n");
+         return -1;
+     }
+     
+     int rule = rules->rule_count++;
+     rules->negated[rule] = (unsigned char)negated;
+     if (dir_only) rules->nodes[node].accept_dir = rule;
+     else rules->nodes[node].accept = rule;
+     return 1;
+ }
+ 
+ // Add every rule of an ignore file. Returns the number added, -1 if the file cannot be read.
+ int ignore_rules_load(ignore_rules *rules, const char *path) {
+     char line[1024];
+     int added = 0;
+     
+     FILE *file = fopen(path, "r");
+     if (!file) return -1;
+     while (fgets(line, sizeof(line), file)) {
+         int result = ignore_rules_add(rules, line);
+         if (result < 0) {
+             added = -1;
+             break;
+         }
+         added += result;
+     }
+     fclose(file);
+     return added;
+ }
+ 
+ // Match a character class at pattern ("[...]", or "[!...]" to negate). Returns the pattern
+ // after the class; an unterminated "[" is an ordinary character.
+ static const char *ignore_match_class(const char *pattern, char c, int *matched) {
+     const char *p = pattern + 1;
+     int negate = (*p == '!' || *p == '^');
+     if (negate) p++;
+     
+     const char *first = p;
+     int found = 0;
+     while (*p && (*p != ']' || p == first)) {
+         char low = *p;
+         if (low == '\\' && p[1]) low = *++p;
+         char high = low;
+         if (p[1] == '-' && p[2] && p[2] != ']') {
+             p += 2;
+             high = *p;
+             if (high == '\\' && p[1]) high = *++p;
+         }
+         if (ignore_fold(c) >= ignore_fold(low) && ignore_fold(c) <= ignore_fold(high)) found = 1;
+         p++;
+     }
+     
+     if (*p != ']') {
+         *matched = c == '[';
+         return pattern + 1;
+     }
+     *matched = found != negate;
+     return p + 1;
+ }
+ 
+ // Match one path segment against a glob, backtracking only to the last "*"
+ static int ignore_glob_match(const char *pattern, const char *name) {
+     const char *star = NULL, *resume = NULL;
+     
+     while (*name) {
+         if (*pattern == '*') {
+             star = ++pattern;
+             resume = name;
+             continue;
+         }
+         
+         int matched = 0;
+         const char *next = pattern;
+         if (*pattern == '?') {
+             matched = 1;
+             next = pattern + 1;
+         } else if (*pattern == '[') {
+             next = ignore_match_class(pattern, *name, &matched);
+         } else if (*pattern) {
+             if (*next == '\\' && next[1]) next++;
+             matched = ignore_fold(*next) == ignore_fold(*name);
+             next++;
+         }
+         
+         if (matched) {
+             pattern = next;
+             name++;
+         } else if (star) {
+             pattern = star;
+             name = ++resume;
+         } else {
+             return 0;
+         }
+     }
+     
+     while (*pattern == '*') pattern++;
+     return *pattern == '\0';
+ }
+ 
+ // Scratch space for stepping the automaton
+ typedef struct {
+     const ignore_rules *rules;
+     unsigned *mark;              // Generation in which a state was last added to a set
+     unsigned generation;
+ } ignore_cursor;
+ 
+ static int ignore_cursor_init(ignore_cursor *cursor, const ignore_rules *rules) {
+     cursor->rules = rules;
+     cursor->generation = 0;
+     cursor->mark = (unsigned *)calloc(rules->node_count, sizeof(unsigned));
+     return cursor->mark != NULL;
+ }
+ 
+ static void ignore_cursor_next(ignore_cursor *cursor) {
+     if (++cursor->generation == 0) {
+         memset(cursor->mark, 0, cursor->rules->node_count * sizeof(unsigned));
+         cursor->generation = 1;
+     }
+ }
+ 
+ // Add a state to the set along with the "**" states that can follow it without consuming
+ // a segment
+ static int ignore_add_state(ignore_cursor *cursor, int *states, int count, int node) {
+     while (node >= 0 && cursor->mark[node] != cursor->generation) {
+         cursor->mark[node] = cursor->generation;
+         states[count++] = node;
+         node = cursor->rules->nodes[node].star;
+     }
+     return count;
+ }
+ 
+ // States at the watched directory itself. states must have room for every state.
+ static int ignore_start(ignore_cursor *cursor, int *states) {
+     ignore_cursor_next(cursor);
+     return ignore_add_state(cursor, states, 0, 0);
+ }
+ 
+ // Take the edge into child: note the rule it completes and add it to the next set
+ static int ignore_enter(ignore_cursor *cursor, int child, int is_directory, int *best, int *next, int count) {
+     const ignore_node *target = &cursor->rules->nodes[child];
+     if (target->accept > *best) *best = target->accept;
+     if (is_directory && target->accept_dir > *best) *best = target->accept_dir;
+     return ignore_add_state(cursor, next, count, child);
+ }
+ 
+ // Step from a directory's states over one of its entries. Fills next with the states the
+ // entry's own children start from and returns 1 if the entry is ignored.
+ static int ignore_step(ignore_cursor *cursor, const int *states, int count, const char *name,
+                        int is_directory, int *next, int *next_count) {
+     const ignore_rules *rules = cursor->rules;
+     uint64_t name_hash = rules->literal_count > 0 ? ignore_segment_hash(name) : 0;
+     int best = -1;
+     int n = 0;
+     
+     ignore_cursor_next(cursor);
+     for (int i = 0; i < count; i++) {
+         const ignore_node *node = &rules->nodes[states[i]];
+         
+         // Below a "**" any entry keeps the state
+         if (node->is_star) n = ignore_add_state(cursor, next, n, states[i]);
+         
+         int child = ignore_find_literal(rules, states[i], name, name_hash);
+         if (child >= 0) n = ignore_enter(cursor, child, is_directory, &best, next, n);
+         for (int e = node->globs; e >= 0; e = rules->globs[e].next) {
+             if (ignore_glob_match(rules->globs[e].segment, name)) {
+                 n = ignore_enter(cursor, rules->globs[e].child, is_directory, &best, next, n);
+             }
+         }
+     }
+     
+     *next_count = n;
+     return best >= 0 && !rules->negated[best];
+ }
+ 
+ // A directory waiting to be read, with the automaton states its entries are matched from
+ typedef struct {
+     char path[MAX_PATH_LENGTH];
+     int state_offset;            // Into directory_scan.states
+     int state_count;
+ } scan_pending;
+ 
+ // One scan of the watched tree. Directories are read depth first from a stack; their
+ // automaton states are stacked the same way so a directory's set is always on top when it
+ // is popped.
+ typedef struct {
+     file_info *files;
+     int file_count;
+     int capacity;
+     scan_pending *pending;
+     int pending_count;
+     int pending_capacity;
+     int *states;
+     int state_count;
+     int state_capacity;
+     int matching;                // There are ignore rules to apply
+     ignore_cursor cursor;
+     int *next;                   // States of the entry just matched
+     int next_count;
+ } directory_scan;
+ 
+ static file_info *scan_add(directory_scan *scan) {
+     if (scan->file_count == scan->capacity) {
+         int capacity = scan->capacity ? scan->capacity * 2 : 64;
+         file_info *grown = (file_info *)realloc(scan->files, capacity * sizeof(file_info));
+         if (!grown) {
+             printf("Memory allocation failed\n");
+             return NULL;
+         }
+         scan->files = grown;
+         scan->capacity = capacity;
+     }
+     return &scan->files[scan->file_count++];
+ }
+ 
+ // Queue a directory to be read, starting from the states of the last match
+ static int scan_push(directory_scan *scan, const char *path) {
+     if (scan->pending_count == scan->pending_capacity) {
+         int capacity = scan->pending_capacity ? scan->pending_capacity * 2 : 16;
+         scan_pending *grown = (scan_pending *)realloc(scan->pending, capacity * sizeof(scan_pending));
+         if (!grown) return 0;
+         scan->pending = grown;
+         scan->pending_capacity = capacity;
+     }
+     if (scan->state_count + scan->next_count > scan->state_capacity) {
+         int capacity = scan->state_capacity ? scan->state_capacity * 2 : 64;
+         while (capacity < scan->state_count + scan->next_count) capacity *= 2;
+         int *grown = (int *)realloc(scan->states, capacity * sizeof(int));
+         if (!grown) return 0;
+         scan->states = grown;
+         scan->state_capacity = capacity;
+     }
+     
+     scan_pending *dir = &scan->pending[scan->pending_count++];
+     snprintf(dir->path, MAX_PATH_LENGTH, "%s", path);
+     dir->state_offset = scan->state_count;
+     dir->state_count = scan->next_count;
+     if (scan->next_count > 0) memcpy(scan->states + scan->state_count, scan->next, scan->next_count * sizeof(int));
+     scan->state_count += scan->next_count;
+     return 1;
+ }
+ 
+ // Match an entry of a directory with the given states; leaves the entry's states in next
+ static int scan_ignored(directory_scan *scan, const int *states, int count, const char *name, int is_directory) {
+     if (!scan->matching) return 0;
+     return ignore_step(&scan->cursor, states, count, name, is_directory, scan->next, &scan->next_count);
+ }
+ 
+ static int scan_full_path(char *full_path, const char *dir, const char *name) {
+     int length = snprintf(full_path, MAX_PATH_LENGTH, "%s%c%s", dir, PATH_SEP, name);
+     if (length < 0 || length >= MAX_PATH_LENGTH) {
+         printf("Skipping path too long: %s%c%s\n", dir, PATH_SEP, name);
+         return 0;
+     }
+     return 1;
+ }
+ 
+ // Read one directory, recording its entries and queueing its subdirectories. Ignored
+ // entries are dropped before anything else is done with them, so an ignored subtree is
+ // never opened.
+ static int scan_read_directory(directory_scan *scan, const char *dir, const int *states, int count) {
+     char full_path[MAX_PATH_LENGTH];
+     int ok = 1;
+ #ifdef _WIN32
+     WIN32_FIND_DATA find_data;
+     char search_path[MAX_PATH_LENGTH];
+     
+     snprintf(search_path, MAX_PATH_LENGTH, "%s\\*", dir);
+     HANDLE find_handle = FindFirstFile(search_path, &find_data);
+     if (find_handle == INVALID_HANDLE_VALUE) {
+         printf("Error opening directory %s: %lu\n", dir, GetLastError());
+         return 1;
+     }
+     
+     do {
+         if (strcmp(find_data.cFileName, ".") == 0 || strcmp(find_data.cFileName, "..") == 0)
+             continue;
+         
+         // Links and junctions are not followed, they could lead out of the tree or around in it
+         if (find_data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+             continue;
+         
+         int is_directory = (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+         if (scan_ignored(scan, states, count, find_data.cFileName, is_directory))
+             continue;
+         if (!scan_full_path(full_path, dir, find_data.cFileName))
+             continue;
+         
+         file_info *f = scan_add(scan);
+         if (!f) {
+             ok = 0;
+             break;
+         }
+         strncpy(f->path, full_path, MAX_PATH_LENGTH);
+         
+         // Convert Windows file time to time_t
+         FILETIME ft = find_data.ftLastWriteTime;
+         ULARGE_INTEGER uli;
+         uli.LowPart = ft.dwLowDateTime;
+         uli.HighPart = ft.dwHighDateTime;
+         // Convert to seconds and adjust epoch from 1601 to 1970
+         f->last_modified = (uli.QuadPart / 10000000ULL - 11644473600ULL);
+         // Keep the full 100ns resolution so same-second edits are still visible
+         f->mtime_ns = (long long)(uli.QuadPart - 116444736000000000ULL) * 100;
+         
+         // FindFirstFile exposes no file index, so a hash of the path stands in for the inode
+         f->inode = xxh64(full_path, strlen(full_path), 0) | 1;
+         f->content_hash = 0;
+         f->has_hash = 0;
+         
+         // Get file size
+         if (is_directory) {
+             f->size = 0;
+             f->is_directory = 1;
+         } else {
+             ULARGE_INTEGER file_size;
+             file_size.LowPart = find_data.nFileSizeLow;
+             file_size.HighPart = find_data.nFileSizeHigh;
+             f->size = (long long)file_size.QuadPart;
+             f->is_directory = 0;
+         }
+         
+         if (is_directory && !scan_push(scan, full_path)) {
+             printf("Memory allocation failed\n");
+             ok = 0;
+             break;
+         }
+     } while (FindNextFile(find_handle, &find_data));
+     
+     FindClose(find_handle);
+ #else
+     DIR *d = opendir(dir);
+     if (d == NULL) {
+         printf("Error opening directory %s: %lu\n", dir, last_error());
+         return 1;
+     }
+     
+     struct dirent *entry;
+     while ((entry = readdir(d)) != NULL) {
+         if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+             continue;
+         
+         // The entry type usually comes with the name, so ignored entries are never stat'ed;
+         // only regular files and directories are synced
+         struct stat st;
+         int have_stat = 0;
+         int is_directory;
+         if (entry->d_type == DT_DIR || entry->d_type == DT_REG) {
+             is_directory = entry->d_type == DT_DIR;
+         } else if (entry->d_type == DT_UNKNOWN) {
+             // Stat relative to the open directory instead of resolving the full path again
+             if (fstatat(dirfd(d), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                 continue;
+             if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+                 continue;
+             is_directory = S_ISDIR(st.st_mode);
+             have_stat = 1;
+         } else {
+             continue;
+         }
+         
+         if (scan_ignored(scan, states, count, entry->d_name, is_directory))
+             continue;
+         if (!have_stat && fstatat(dirfd(d), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+             continue;
+         if (S_ISDIR(st.st_mode) != is_directory || (!is_directory && !S_ISREG(st.st_mode)))
+             continue; // Replaced since it was listed
+         if (!scan_full_path(full_path, dir, entry->d_name))
+             continue;
+         
+         file_info *f = scan_add(scan);
+         if (!f) {
+             ok = 0;
+             break;
+         }
+         strncpy(f->path, full_path, MAX_PATH_LENGTH);
+         f->last_modified = st.st_mtime;
+         f->mtime_ns = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+         f->inode = (unsigned long long)st.st_ino;
+         f->content_hash = 0;
+         f->has_hash = 0;
+         f->is_directory = is_directory;
+         f->size = is_directory ? 0 : (long long)st.st_size;
+         
+         if (is_directory && !scan_push(scan, full_path)) {
+             printf("Memory allocation failed\n");
+             ok = 0;
+             break;
+         }
+     }
+     
+     closedir(d);
+ #endif
+     return ok;
+ }
+ 
+ // Scan the tree below dir_path and collect file information, leaving out whatever the
+ // rules ignore (rules may be NULL)
+ void scan_directory(const char *dir_path, const ignore_rules *rules, file_info **files, int *file_count) {
+     directory_scan scan;
+     int *current = NULL;
+     
+     memset(&scan, 0, sizeof(scan));
+     *files = NULL;
+     *file_count = 0;
+     
+     // Normalize the path
+     char* normalized_dir = normalize_path(dir_path);
+     
+     scan.matching = rules && rules->rule_count > 0;
+     if (scan.matching) {
+         current = (int *)malloc(rules->node_count * sizeof(int));
+         scan.next = (int *)malloc(rules->node_count * sizeof(int));
+         if (!current || !scan.next || !ignore_cursor_init(&scan.cursor, rules)) {
+             printf("Memory allocation failed\n");
+             free(current);
+             free(scan.next);
+             free(normalized_dir);
+             return;
+         }
+         scan.next_count = ignore_start(&scan.cursor, scan.next);
+     }
+     
+     int ok = scan_push(&scan, normalized_dir);
+     while (ok && scan.pending_count > 0) {
+         // Take the directory and its states off the stack before its children go on
+         char dir[MAX_PATH_LENGTH];
+         scan_pending *top = &scan.pending[--scan.pending_count];
+         int count = top->state_count;
+         memcpy(dir, top->path, MAX_PATH_LENGTH);
+         if (count > 0) memcpy(current, scan.states + top->state_offset, count * sizeof(int));
+         scan.state_count = top->state_offset;
+         
+         ok = scan_read_directory(&scan, dir, current, count);
+     }
+     
+     free(scan.pending);
+     free(scan.states);
+     free(scan.next);
+     free(scan.cursor.mark);
+     free(current);
+     free(normalized_dir);
+     
+     // Keep scans sorted by path so they can be merged against the snapshot
+     *files = scan.files;
+     *file_count = scan.file_count;
+     if (*file_count > 0) qsort(*files, *file_count, sizeof(file_info), compare_file_paths);
+ }
+ 
+ // Whether the rules ignore a wire path: it, or any directory above it. rules may be NULL.
+ int ignore_rules_match(const ignore_rules *rules, const char *wire_path, int is_directory) {
+     char segment[MAX_PATH_LENGTH];
+     ignore_cursor cursor;
+     int *states, *next;
+     int count, ignored = 0;
+     
+     if (!rules || rules->rule_count == 0) return 0;
+     states = (int *)malloc(rules->node_count * sizeof(int));
+     next = (int *)malloc(rules->node_count * sizeof(int));
+     if (!states || !next || !ignore_cursor_init(&cursor, rules)) {
+         free(states);
+         free(next);
+         return 0;
+     }
+     
+     count = ignore_start(&cursor, states);
+     const char *p = wire_path;
+     while (*p && !ignored) {
+         const char *end = strchr(p, '/');
+         size_t length = end ? (size_t)(end - p) : strlen(p);
+         memcpy(segment, p, length);
+         segment[length] = '\0';
+         
+         int next_count;
+         ignored = ignore_step(&cursor, states, count, segment, end ? 1 : is_directory, next, &next_count);
+         memcpy(states, next, next_count * sizeof(int));
+         count = next_count;
+         p = end ? end + 1 : p + length;
+     }
+     
+     free(states);
+     free(next);
+     free(cursor.mark);
+     return ignored;
+ }
+ 
+ // Look at one path the way a scan would. Returns 1 with f filled for a regular file or a
+ // directory, 0 if there is neither.
+ static int path_stat(const char *path, file_info *f) {
+     memset(f, 0, sizeof(*f));
+     snprintf(f->path, MAX_PATH_LENGTH, "%s", path);
+ #ifdef _WIN32
+     WIN32_FILE_ATTRIBUTE_DATA data;
+     if (!GetFileAttributesEx(path, GetFileExInfoStandard, &data) ||
+         (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+         return 0;
+     }
+     ULARGE_INTEGER uli;
+     uli.LowPart = data.ftLastWriteTime.dwLowDateTime;
+     uli.HighPart = data.ftLastWriteTime.dwHighDateTime;
+     f->last_modified = (uli.QuadPart / 10000000ULL - 11644473600ULL);
+     f->mtime_ns = (long long)(uli.QuadPart - 116444736000000000ULL) * 100;
+     f->inode = xxh64(path, strlen(path), 0) | 1;
+     f->is_directory = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+     if (!f->is_directory) {
+         ULARGE_INTEGER file_size;
+         file_size.LowPart = data.nFileSizeLow;
+         file_size.HighPart = data.nFileSizeHigh;
+         f->size = (long long)file_size.QuadPart;
+     }
+ #else
+     struct stat st;
+     if (lstat(path, &st) != 0 || (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))) return 0;
+     f->last_modified = st.st_mtime;
+     f->mtime_ns = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+     f->inode = (unsigned long long)st.st_ino;
+     f->is_directory = S_ISDIR(st.st_mode);
+     f->size = f->is_directory ? 0 : (long long)st.st_size;
+ #endif
+     return 1;
+ }
+ 
+ // xxHash64 primes
+ #define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+ #define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+ #define XXH_PRIME64_3 0x165667B19E3779F9ULL
+ #define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+ #define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+ 
+ // Streaming xxHash64 state
+ typedef struct {
+     uint64_t total_len;
+     uint64_t v[4];
+     unsigned char mem[32];
+     size_t mem_size;
+     uint64_t seed;
+ } xxh64_state;
+ 
+ static uint64_t xxh_rotl64(uint64_t x, int r) {
+     return (x << r) | (x >> (64 - r));
+ }
+ 
+ static uint64_t xxh_read64(const unsigned char *p) {
+     uint64_t v;
+     memcpy(&v, p, sizeof(v)); // Little-endian hosts only, as is the rest of the protocol
+     return v;
+ }
+ 
+ static uint32_t xxh_read32(const unsigned char *p) {
+     uint32_t v;
+     memcpy(&v, p, sizeof(v));
+     return v;
+ }
+ 
+ static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+     acc += input * XXH_PRIME64_2;
+     acc = xxh_rotl64(acc, 31);
+     return acc * XXH_PRIME64_1;
+ }
+ 
+ static uint64_t xxh64_merge_round(uint64_t acc, uint64_t val) {
+     acc ^= xxh64_round(0, val);
+     return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+ }
+ 
+ static void xxh64_reset(xxh64_state *st, uint64_t seed) {
+     memset(st, 0, sizeof(*st));
+     st->seed = seed;
+     st->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+     st->v[1] = seed + XXH_PRIME64_2;
+     st->v[2] = seed;
+     st->v[3] = seed - XXH_PRIME64_1;
+ }
+ 
+ static void xxh64_update(xxh64_state *st, const void *input, size_t len) {
+     const unsigned char *p = (const unsigned char *)input;
+     const unsigned char *end = p + len;
+     
+     st->total_len += len;
+     
+     // Not enough for a full stripe yet, just buffer it
+     if (st->mem_size + len < 32) {
+         memcpy(st->mem + st->mem_size, p, len);
+         st->mem_size += len;
+         return;
+     }
+     
+     // Complete the buffered stripe first
+     if (st->mem_size) {
+         size_t fill = 32 - st->mem_size;
+         memcpy(st->mem + st->mem_size, p, fill);
+         for (int i = 0; i < 4; i++)
+             st->v[i] = xxh64_round(st->v[i], xxh_read64(st->mem + i * 8));
+         p += fill;
+         st->mem_size = 0;
+     }
+     
+     // Four independent lanes keep the multipliers busy
+     while (p + 32 <= end) {
+         st->v[0] = xxh64_round(st->v[0], xxh_read64(p));
+         st->v[1] = xxh64_round(st->v[1], xxh_read64(p + 8));
+         st->v[2] = xxh64_round(st->v[2], xxh_read64(p + 16));
+         st->v[3] = xxh64_round(st->v[3], xxh_read64(p + 24));
+         p += 32;
+     }
+     
+     if (p < end) {
+         st->mem_size = (size_t)(end - p);
+         memcpy(st->mem, p, st->mem_size);
+     }
+ }
+ 
+ static uint64_t xxh64_digest(const xxh64_state *st) {
+     const unsigned char *p = st->mem;
+     const unsigned char *end = st->mem + st->mem_size;
+     uint64_t h;
+     
+     if (st->total_len >= 32) {
+         h = xxh_rotl64(st->v[0], 1) + xxh_rotl64(st->v[1], 7) +
+             xxh_rotl64(st->v[2], 12) + xxh_rotl64(st->v[3], 18);
+         for (int i = 0; i < 4; i++)
+             h = xxh64_merge_round(h, st->v[i]);
+     } else {
+         h = st->seed + XXH_PRIME64_5;
+     }
+     h += st->total_len;
+     
+     while (p + 8 <= end) {
+         h ^= xxh64_round(0, xxh_read64(p));
+         h = xxh_rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+         p += 8;
+     }
+     if (p + 4 <= end) {
+         h ^= (uint64_t)xxh_read32(p) * XXH_PRIME64_1;
+         h = xxh_rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+         p += 4;
+     }
+     while (p < end) {
+         h ^= (*p) * XXH_PRIME64_5;
+         h = xxh_rotl64(h, 11) * XXH_PRIME64_1;
+         p++;
+     }
+     
+     h ^= h >> 33;
+     h *= XXH_PRIME64_2;
+     h ^= h >> 29;
+     h *= XXH_PRIME64_3;
+     h ^= h >> 32;
+     return h;
+ }
+ 
+ // One-shot xxHash64 of a memory buffer
+ uint64_t xxh64(const void *input, size_t len, uint64_t seed) {
+     xxh64_state st;
+     xxh64_reset(&st, seed);
+     xxh64_update(&st, input, len);
+     return xxh64_digest(&st);
+ }
+ 
+ // Hash the full contents of a file, returns 1 on success
+ int hash_file(const char *path, uint64_t *hash) {
+     FILE *f = fopen(path, "rb");
+     if (!f) {
+         printf("Error opening file for hashing: %s\n", path);
+         return 0;
+     }
+     
+     unsigned char *buffer = (unsigned char *)malloc(HASH_READ_SIZE);
+     if (!buffer) {
+         printf("Memory allocation failed\n");
+         fclose(f);
+         return 0;
+     }
+     
+     xxh64_state st;
+     xxh64_reset(&st, 0);
+     size_t n;
+     while ((n = fread(buffer, 1, HASH_READ_SIZE, f)) > 0) {
+         xxh64_update(&st, buffer, n);
+     }
+     
+     int ok = !ferror(f);
+     free(buffer);
+     fclose(f);
+     
+     if (ok) *hash = xxh64_digest(&st);
+     return ok;
+ }
+ 
+ // Move entries into a fresh table, optionally keeping only those seen by the latest scan
+ static int hash_cache_rebuild(hash_cache *cache, int new_capacity, int only_seen) {
+     hash_cache_entry *entries = (hash_cache_entry *)calloc(new_capacity, sizeof(hash_cache_entry));
+     unsigned char *seen = (unsigned char *)calloc(new_capacity, 1);
+     if (!entries || !seen) {
+         printf("Memory allocation failed\n");
+         free(entries);
+         free(seen);
+         return 0;
+     }
+     
+     cache->count = 0;
+     for (int i = 0; i < cache->capacity; i++) {
+         if (cache->entries[i].inode == 0) continue;
+         if (only_seen && !cache->seen[i]) continue;
+         unsigned int slot = (unsigned int)(cache->entries[i].inode * XXH_PRIME64_1 >> 32) & (new_capacity - 1);
+         while (entries[slot].inode != 0) slot = (slot + 1) & (new_capacity - 1);
+         entries[slot] = cache->entries[i];
+         seen[slot] = cache->seen[i];
+         cache->count++;
+     }
+     
+     free(cache->entries);
+     free(cache->seen);
+     cache->entries = entries;
+     cache->seen = seen;
+     cache->capacity = new_capacity;
+     return 1;
+ }
+ 
+ // Grow the cache table so it stays at most half full. The table always exists afterwards,
+ // even for no entries, so lookups never see a zero capacity.
+ static int hash_cache_reserve(hash_cache *cache, int wanted) {
+     if (wanted < 0 || wanted > INT_MAX / 4) return 0;
+     if (cache->capacity > 0 && wanted * 2 <= cache->capacity) return 1;
+     
+     int new_capacity = cache->capacity ? cache->capacity : 256;
+     while (wanted * 2 > new_capacity) new_capacity *= 2;
+     return hash_cache_rebuild(cache, new_capacity, 0);
+ }
+ 
+ // Find the slot holding an inode, or the free slot where it would go
+ static int hash_cache_slot(const hash_cache *cache, unsigned long long inode) {
+     unsigned int slot = (unsigned int)(inode * XXH_PRIME64_1 >> 32) & (cache->capacity - 1);
+     while (cache->entries[slot].inode != 0 && cache->entries[slot].inode != inode)
+         slot = (slot + 1) & (cache->capacity - 1);
+     return (int)slot;
+ }
+ 
+ // Load a previously saved hash cache; a missing or invalid file just means an empty cache
+ void hash_cache_load(hash_cache *cache, const char *cache_path) {
+     memset(cache, 0, sizeof(*cache));
+     
+     FILE *f = fopen(cache_path, "rb");
+     if (!f) return;
+     
+     // The entry count has to fit in the file; a cache cut short or corrupt is started over
+     uint32_t header[3];
+     long long file_size = -1;
+     if (fseek64(f, 0, SEEK_END) == 0) file_size = (long long)ftell64(f);
+     if (file_size < (long long)sizeof(header) || fseek64(f, 0, SEEK_SET) != 0 ||
+         fread(header, sizeof(header), 1, f) != 1 ||
+         header[0] != HASH_CACHE_MAGIC || header[1] != HASH_CACHE_VERSION ||
+         header[2] > (unsigned long long)(file_size - sizeof(header)) / sizeof(hash_cache_entry) ||
+         !hash_cache_reserve(cache, (int)header[2])) {
+         printf("Ignoring invalid hash cache: %s\n", cache_path);
+         fclose(f);
+         return;
+     }
+     
+     hash_cache_entry entry;
+     for (uint32_t i = 0; i < header[2] && fread(&entry, sizeof(entry), 1, f) == 1; i++) {
+         if (entry.inode == 0) continue;
+         int slot = hash_cache_slot(cache, entry.inode);
+         if (cache->entries[slot].inode == 0) cache->count++;
+         cache->entries[slot] = entry;
+     }
+     
+     fclose(f);
+ }
+ 
+ // Write all cache entries to disk
+ int hash_cache_save(hash_cache *cache, const char *cache_path) {
+     FILE *f = fopen(cache_path, "wb");
+     if (!f) {
+         printf("Error writing hash cache: %s\n", cache_path);
+         return 0;
+     }
+     
+     uint32_t header[3] = { HASH_CACHE_MAGIC, HASH_CACHE_VERSION, (uint32_t)cache->count };
+     int ok = fwrite(header, sizeof(header), 1, f) == 1;
+     for (int i = 0; ok && i < cache->capacity; i++) {
+         if (cache->entries[i].inode != 0)
+             ok = fwrite(&cache->entries[i], sizeof(hash_cache_entry), 1, f) == 1;
+     }
+     
+     if (fclose(f) != 0) ok = 0;
+     if (ok) cache->dirty = 0;
+     return ok;
+ }
+ 
+ void hash_cache_free(hash_cache *cache) {
+     free(cache->entries);
+     free(cache->seen);
+     memset(cache, 0, sizeof(*cache));
+ }
+ 
+ // Fill in content hashes, only rereading files whose (inode, size, mtime_ns) changed
+ void hash_files(file_info *files, int file_count, hash_cache *cache) {
+     int rehashed = 0;
+     
+     if (!hash_cache_reserve(cache, cache->count + file_count)) return;
+     memset(cache->seen, 0, cache->capacity);
+     
+     for (int i = 0; i < file_count; i++) {
+         if (files[i].is_directory) continue;
+         
+         int slot = hash_cache_slot(cache, files[i].inode);
+         hash_cache_entry *entry = &cache->entries[slot];
+         cache->seen[slot] = 1;
+         
+         if (entry->inode == files[i].inode &&
+             entry->size == files[i].size &&
+             entry->mtime_ns == files[i].mtime_ns) {
+             files[i].content_hash = entry->hash;
+             files[i].has_hash = 1;
+             continue;
+         }
+         
+         if (!hash_file(files[i].path, &files[i].content_hash)) continue;
+         files[i].has_hash = 1;
+         rehashed++;
+         
+         if (entry->inode == 0) cache->count++;
+         entry->inode = files[i].inode;
+         entry->size = files[i].size;
+         entry->mtime_ns = files[i].mtime_ns;
+         entry->hash = files[i].content_hash;
+         cache->dirty = 1;
+     }
+     
+     // Drop entries for files that vanished since the previous scan
+     int seen_count = 0;
+     for (int i = 0; i < cache->capacity; i++) seen_count += cache->seen[i];
+     if (cache->count > seen_count && hash_cache_rebuild(cache, cache->capacity, 1))
+         cache->dirty = 1;
+     
+     if (rehashed > 0) printf("Hashed %d changed files\n", rehashed);
+ }
+ 
+ // Decide whether a file present in both scans was modified
+ static int file_changed(const file_info *old_file, const file_info *new_file) {
+     if (new_file->size != old_file->size) return 1;
+     
+     // With content hashes a touched-but-identical file is not a modification
+     if (new_file->has_hash && old_file->has_hash)
+         return new_file->content_hash != old_file->content_hash;
+     
+     return new_file->mtime_ns != old_file->mtime_ns;
+ }
+ 
+ // Compare two directory scans to detect changes
+ // Both scans must be sorted by path, which lets this run as a single merge pass
+ void compare_directories(file_info *old_files, int old_count, 
+                          file_info *new_files, int new_count,
+                          sync_record **changes, int *change_count) {
+     long long start = profile_now();
+     int max_changes = old_count + new_count; // Worst case all files changed
+     *changes = (sync_record *)malloc((max_changes > 0 ? max_changes : 1) * sizeof(sync_record));
+     *change_count = 0;
+     
+     if (!*changes) {
+         printf("Memory allocation failed\n");
+         return;
+     }
+     
+     // Deletes are queued from the back so they are sent after creates and modifies
+     int delete_count = 0;
+     int i = 0, j = 0;
+     while (i < new_count || j < old_count) {
+         int cmp;
+         if (i >= new_count) cmp = 1;
+         else if (j >= old_count) cmp = -1;
+         else cmp = path_compare(new_files[i].path, old_files[j].path);
+         
+         if (cmp < 0) {
+             // New file
+             (*changes)[*change_count].operation = SYNC_CREATE;
+             (*changes)[*change_count].file = new_files[i];
+             (*change_count)++;
+             i++;
+         } else if (cmp > 0) {
+             // Deleted file
+             delete_count++;
+             (*changes)[max_changes - delete_count].operation = SYNC_DELETE;
+             (*changes)[max_changes - delete_count].file = old_files[j];
+             j++;
+         } else {
+             // Check if file was modified
+             if (file_changed(&old_files[j], &new_files[i])) {
+                 (*changes)[*change_count].operation = SYNC_MODIFY;
+                 (*changes)[*change_count].file = new_files[i];
+                 (*change_count)++;
+             }
+             i++;
+             j++;
+         }
+     }
+     
+     // Move the deletes down behind the other changes in reverse path order, so everything
+     // inside a directory is deleted before the directory itself
+     for (int k = 0; k < delete_count; k++) {
+         (*changes)[*change_count] = (*changes)[max_changes - delete_count + k];
+         (*change_count)++;
+     }
+     profile_end(STAGE_DIFF, start);
+ }
+ 
+ // Map a snapshot file; returns 0 if it is missing, invalid or belongs to another directory
+ int snapshot_open(snapshot_index *index, const char *snapshot_path, uint64_t root_hash) {
+     memset(index, 0, sizeof(*index));
+     index->file = INVALID_FILE;
+     
+ #ifdef _WIN32
+     LARGE_INTEGER file_size;
+     index->file = CreateFile(snapshot_path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+                              NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+     if (index->file == INVALID_HANDLE_VALUE) return 0;
+     
+     if (!GetFileSizeEx(index->file, &file_size) || file_size.QuadPart < (LONGLONG)sizeof(snapshot_header)) {
+         snapshot_close(index);
+         return 0;
+     }
+     index->size = (size_t)file_size.QuadPart;
+     
+     index->mapping = CreateFileMapping(index->file, NULL, PAGE_READWRITE, 0, 0, NULL);
+     if (index->mapping == NULL) {
+         printf("Error mapping snapshot: %lu\n", GetLastError());
+         snapshot_close(index);
+         return 0;
+     }
+     
+     index->base = (unsigned char *)MapViewOfFile(index->mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, 0);
+     if (index->base == NULL) {
+         printf("Error mapping snapshot view: %lu\n", GetLastError());
+         snapshot_close(index);
+         return 0;
+     }
+ #else
+     struct stat st;
+     index->file = open(snapshot_path, O_RDWR | O_CLOEXEC);
+     if (index->file == INVALID_FILE) return 0;
+     
+     if (fstat(index->file, &st) != 0 || st.st_size < (off_t)sizeof(snapshot_header)) {
+         snapshot_close(index);
+         return 0;
+     }
+     index->size = (size_t)st.st_size;
+     
+     void *base = mmap(NULL, index->size, PROT_READ | PROT_WRITE, MAP_SHARED, index->file, 0);
+     if (base == MAP_FAILED) {
+         printf("Error mapping snapshot: %lu\n", last_error());
+         snapshot_close(index);
+         return 0;
+     }
+     index->base = (unsigned char *)base;
+ #endif
+     
+     index->header = (snapshot_header *)index->base;
+     index->records = (snapshot_record *)(index->base + sizeof(snapshot_header));
+     index->pool = (const char *)(index->records + index->header->record_count);
+     
+     // Validate before trusting any offsets
+     size_t expected = sizeof(snapshot_header) +
+                       (size_t)index->header->record_count * sizeof(snapshot_record) +
+                       index->header->pool_size;
+     if (index->header->magic != SNAPSHOT_MAGIC ||
+         index->header->version != SNAPSHOT_VERSION ||
+         index->header->root_hash != root_hash ||
+         expected != index->size) {
+         printf("Ignoring stale or invalid snapshot: %s\n", snapshot_path);
+         snapshot_close(index);
+         return 0;
+     }
+     
+     for (uint32_t i = 0; i < index->header->record_count; i++) {
+         const snapshot_record *rec = &index->records[i];
+         if (rec->path_length >= MAX_PATH_LENGTH ||
+             rec->path_offset + (uint64_t)rec->path_length >= index->header->pool_size ||
+             index->pool[rec->path_offset + rec->path_length] != '\0') {
+             printf("Ignoring corrupt snapshot: %s\n", snapshot_path);
+             snapshot_close(index);
+             return 0;
+         }
+     }
+     
+     return 1;
+ }
+ 
+ void snapshot_close(snapshot_index *index) {
+ #ifdef _WIN32
+     if (index->base) UnmapViewOfFile(index->base);
+     if (index->mapping) CloseHandle(index->mapping);
+     if (index->file != INVALID_HANDLE_VALUE && index->file != NULL) CloseHandle(index->file);
+ #else
+     if (index->base) munmap(index->base, index->size);
+     if (index->file != INVALID_FILE) close(index->file);
+ #endif
+     memset(index, 0, sizeof(*index));
+     index->file = INVALID_FILE;
+ }
+ 
+ // Push in-place record updates back to the file
+ static void snapshot_flush(snapshot_index *index) {
+ #ifdef _WIN32
+     FlushViewOfFile(index->base, index->size);
+ #else
+     msync(index->base, index->size, MS_ASYNC);
+ #endif
+ }
+ 
+ static void snapshot_read_record(const snapshot_index *index, const snapshot_record *rec, file_info *f) {
+     memcpy(f->path, index->pool + rec->path_offset, rec->path_length + 1);
+     f->mtime_ns = rec->mtime_ns;
+     f->last_modified = (time_t)(rec->mtime_ns / 1000000000LL);
+     f->size = (long long)rec->size;
+     f->inode = rec->inode;
+     f->content_hash = rec->content_hash;
+     f->has_hash = (rec->flags & SNAPSHOT_HAS_HASH) != 0;
+     f->is_directory = (rec->flags & SNAPSHOT_DIRECTORY) != 0;
+ }
+ 
+ // Expand the mapped records into a sorted file_info array usable as a diff baseline
+ int snapshot_load_files(const snapshot_index *index, file_info **files, int *file_count) {
+     int count = (int)index->header->record_count;
+     
+     *files = (file_info *)malloc((count > 0 ? count : 1) * sizeof(file_info));
+     *file_count = 0;
+     if (!*files) {
+         printf("Memory allocation failed\n");
+         return 0;
+     }
+     
+     // Tombstones of a two-way index are not part of the tree
+     for (int i = 0; i < count; i++) {
+         if (index->records[i].flags & SNAPSHOT_DELETED) continue;
+         snapshot_read_record(index, &index->records[i], &(*files)[(*file_count)++]);
+     }
+     return 1;
+ }
+ 
+ // Expand the mapped records into the entries of a replica index, tombstones included
+ int snapshot_load_entries(const snapshot_index *index, replica_index *replica) {
+     int count = (int)index->header->record_count;
+     
+     replica->entries = (replica_entry *)malloc((count > 0 ? count : 1) * sizeof(replica_entry));
+     replica->count = 0;
+     if (!replica->entries) {
+         printf("Memory allocation failed\n");
+         return 0;
+     }
+     
+     for (int i = 0; i < count; i++) {
+         const snapshot_record *rec = &index->records[i];
+         replica_entry *e = &replica->entries[i];
+         snapshot_read_record(index, rec, &e->file);
+         e->version = rec->version;
+         e->deleted = (rec->flags & SNAPSHOT_DELETED) != 0;
+     }
+     replica->count = count;
+     replica->id = index->header->replica;
+     replica->clock = index->header->clock;
+     return 1;
+ }
+ 
+ static void snapshot_fill_record(snapshot_record *rec, const file_info *f) {
+     rec->mtime_ns = f->mtime_ns;
+     rec->size = f->size;
+     rec->inode = f->inode;
+     rec->content_hash = f->has_hash ? f->content_hash : 0;
+     rec->flags = (f->is_directory ? SNAPSHOT_DIRECTORY : 0) | (f->has_hash ? SNAPSHOT_HAS_HASH : 0);
+     rec->reserved = 0;
+     memset(&rec->version, 0, sizeof(rec->version));
+ }
+ 
+ // Write a complete snapshot to a temp file and swap it into place. The records come from
+ // files, or with their versions from a replica index if one is given.
+ static int snapshot_write(const char *snapshot_path, uint64_t root_hash,
+                           const file_info *files, int file_count, const replica_index *replica) {
+     char temp_path[MAX_PATH_LENGTH];
+     snprintf(temp_path, MAX_PATH_LENGTH, "%s.tmp", snapshot_path);
+     
+     if (replica) file_count = replica->count;
+     snapshot_header header;
+     header.magic = SNAPSHOT_MAGIC;
+     header.version = SNAPSHOT_VERSION;
+     header.record_count = (uint32_t)file_count;
+     header.pool_size = 0;
+     header.root_hash = root_hash;
+     header.replica = replica ? replica->id : 0;
+     header.clock = replica ? replica->clock : 0;
+     for (int i = 0; i < file_count; i++) {
+         const file_info *f = replica ? &replica->entries[i].file : &files[i];
+         header.pool_size += (uint32_t)strlen(f->path) + 1;
+     }
+     
+     FILE *f = fopen(temp_path, "wb");
+     if (!f) {
+         printf("Error writing snapshot: %s\n", temp_path);
+         return 0;
+     }
+     
+     int ok = fwrite(&header, sizeof(header), 1, f) == 1;
+     
+     uint32_t offset = 0;
+     for (int i = 0; ok && i < file_count; i++) {
+         const file_info *file = replica ? &replica->entries[i].file : &files[i];
+         snapshot_record rec;
+         rec.path_offset = offset;
+         rec.path_length = (uint32_t)strlen(file->path);
+         snapshot_fill_record(&rec, file);
+         if (replica) {
+             rec.version = replica->entries[i].version;
+             if (replica->entries[i].deleted) rec.flags |= SNAPSHOT_DELETED;
+         }
+         offset += rec.path_length + 1;
+         ok = fwrite(&rec, sizeof(rec), 1, f) == 1;
+     }
+     
+     for (int i = 0; ok && i < file_count; i++) {
+         const file_info *file = replica ? &replica->entries[i].file : &files[i];
+         ok = fwrite(file->path, strlen(file->path) + 1, 1, f) == 1;
+     }
+     
+     if (fclose(f) != 0) ok = 0;
+     if (!ok) {
+         printf("Error writing snapshot: %s\n", temp_path);
+         file_delete(temp_path);
+         return 0;
+     }
+     
+     if (!file_replace(temp_path, snapshot_path)) {
+         printf("Error replacing snapshot: %lu\n", last_error());
+         return 0;
+     }
+     return 1;
+ }
+ 
+ // Binary search the mapped records for a path
+ static snapshot_record *snapshot_find(snapshot_index *index, const char *path) {
+     int lo = 0, hi = (int)index->header->record_count - 1;
+     while (lo <= hi) {
+         int mid = lo + (hi - lo) / 2;
+         int cmp = path_compare(path, index->pool + index->records[mid].path_offset);
+         if (cmp == 0) return &index->records[mid];
+         if (cmp < 0) hi = mid - 1;
+         else lo = mid + 1;
+     }
+     return NULL;
+ }
+ 
+ // Record an acknowledged state: modifications are patched in place in the mapping,
+ // anything that adds or removes paths rewrites the snapshot
+ int snapshot_commit(snapshot_index *index, const char *snapshot_path, uint64_t root_hash,
+                     file_info *files, int file_count,
+                     sync_record *changes, int change_count) {
+     int in_place = index->base != NULL;
+     
+     for (int i = 0; in_place && i < change_count; i++) {
+         if (changes[i].operation != SYNC_MODIFY ||
+             snapshot_find(index, changes[i].file.path) == NULL) {
+             in_place = 0;
+         }
+     }
+     
+     if (in_place) {
+         for (int i = 0; i < change_count; i++) {
+             snapshot_fill_record(snapshot_find(index, changes[i].file.path), &changes[i].file);
+         }
+         snapshot_flush(index);
+         return 1;
+     }
+     
+     // The mapping has to go before the file underneath it can be replaced
+     snapshot_close(index);
+     if (!snapshot_write(snapshot_path, root_hash, files, file_count, NULL)) return 0;
+     return snapshot_open(index, snapshot_path, root_hash);
+ }
+ 
+ // Send a whole buffer, looping over partial sends
+ int send_all(SOCKET sock, const void *buffer, int length) {
+     const char *p = (const char *)buffer;
+     while (length > 0) {
+         int sent = send(sock, p, length, SEND_FLAGS);
+         if (sent == SOCKET_ERROR) return 0;
+         p += sent;
+         length -= sent;
+     }
+     return 1;
+ }
+ 
+ // Receive exactly length bytes, returns 0 on error or a closed connection
+ int recv_all(SOCKET sock, void *buffer, int length) {
+     char *p = (char *)buffer;
+     while (length > 0) {
+         int received = recv(sock, p, length, 0);
+         if (received == SOCKET_ERROR || received == 0) return 0;
+         p += received;
+         length -= received;
+     }
+     return 1;
+ }
+ 
+ const char *codec_name(uint32_t codec) {
+     switch (codec) {
+         case CODEC_NONE: return "none";
+         case CODEC_LZ4: return "lz4";
+         case CODEC_ZSTD: return "zstd";
+         case CODEC_AUTO: return "auto";
+         default: return "unknown";
+     }
+ }
+ 
+ #define LZ4_HASH_BITS 12
+ #define LZ4_MIN_MATCH 4
+ #define LZ4_LAST_LITERALS 5   // The block format requires the last 5 bytes to be literals
+ #define LZ4_MATCH_LIMIT 12    // ...and the last match to start at least 12 bytes before the end
+ #define LZ4_MAX_OFFSET 65535
+ 
+ // Write an LZ4 length continuation (runs of 255 plus a remainder)
+ static unsigned char *lz4_write_length(unsigned char *op, int length) {
+     while (length >= 255) {
+         *op++ = 255;
+         length -= 255;
+     }
+     *op++ = (unsigned char)length;
+     return op;
+ }
+ 
+ // Greedy LZ4 block compressor; output is compatible with the reference LZ4 block format.
+ // Returns the compressed size, or 0 if it would not fit in dst.
+ int lz4_compress(const unsigned char *src, int src_size, unsigned char *dst, int dst_capacity) {
+     uint32_t table[1 << LZ4_HASH_BITS];
+     const unsigned char *ip = src;
+     const unsigned char *anchor = src;
+     const unsigned char *end = src + src_size;
+     unsigned char *op = dst;
+     unsigned char *op_end = dst + dst_capacity;
+     
+     memset(table, 0, sizeof(table));
+     
+     if (src_size > LZ4_MATCH_LIMIT) {
+         const unsigned char *match_start_limit = end - LZ4_MATCH_LIMIT;
+         const unsigned char *match_end_limit = end - LZ4_LAST_LITERALS;
+         
+         while (ip < match_start_limit) {
+             uint32_t sequence = xxh_read32(ip);
+             uint32_t h = (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+             const unsigned char *ref = src + table[h];
+             table[h] = (uint32_t)(ip - src);
+             
+             if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || xxh_read32(ref) != sequence) {
+                 ip++;
+                 continue;
+             }
+             
+             // Extend the match forwards, then backwards over pending literals
+             const unsigned char *match_end = ip + LZ4_MIN_MATCH;
+             const unsigned char *ref_end = ref + LZ4_MIN_MATCH;
+             while (match_end < match_end_limit && *match_end == *ref_end) {
+                 match_end++;
+                 ref_end++;
+             }
+             while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                 ip--;
+                 ref--;
+             }
+             
+             int literal_length = (int)(ip - anchor);
+             int match_length = (int)(match_end - ip) - LZ4_MIN_MATCH;
+             if (op + 1 + literal_length / 255 + 1 + literal_length + 2 + match_length / 255 + 1 > op_end)
+                 return 0;
+             
+             unsigned char *token = op++;
+             *token = (unsigned char)((literal_length >= 15 ? 15 : literal_length) << 4);
+             if (literal_length >= 15) op = lz4_write_length(op, literal_length - 15);
+             memcpy(op, anchor, literal_length);
+             op += literal_length;
+             
+             uint16_t offset = (uint16_t)(ip - ref);
+             *op++ = (unsigned char)(offset & 0xFF);
+             *op++ = (unsigned char)(offset >> 8);
+             
+             *token |= (unsigned char)(match_length >= 15 ? 15 : match_length);
+             if (match_length >= 15) op = lz4_write_length(op, match_length - 15);
+             
+             ip = match_end;
+             anchor = ip;
+         }
+     }
+     
+     // Trailing literals
+     int literal_length = (int)(end - anchor);
+     if (op + 1 + literal_length / 255 + 1 + literal_length > op_end) return 0;
+     unsigned char *token = op++;
+     *token = (unsigned char)((literal_length >= 15 ? 15 : literal_length) << 4);
+     if (literal_length >= 15) op = lz4_write_length(op, literal_length - 15);
+     memcpy(op, anchor, literal_length);
+     op += literal_length;
+     
+     return (int)(op - dst);
+ }
+ 
+ // Bounds-checked LZ4 block decoder, returns the decoded size or -1 on malformed input
+ int lz4_decompress(const unsigned char *src, int src_size, unsigned char *dst, int dst_capacity) {
+     const unsigned char *ip = src;
+     const unsigned char *ip_end = src + src_size;
+     unsigned char *op = dst;
+     unsigned char *op_end = dst + dst_capacity;
+     
+     while (ip < ip_end) {
+         unsigned int token = *ip++;
+         
+         size_t literal_length = token >> 4;
+         if (literal_length == 15) {
+             unsigned int b;
+             do {
+                 if (ip >= ip_end) return -1;
+                 b = *ip++;
+                 literal_length += b;
+             } while (b == 255);
+         }
+         if (literal_length > (size_t)(ip_end - ip) || literal_length > (size_t)(op_end - op)) return -1;
+         memcpy(op, ip, literal_length);
+         op += literal_length;
+         ip += literal_length;
+         
+         // The final sequence carries literals only
+         if (ip >= ip_end) break;
+         
+         if (ip_end - ip < 2) return -1;
+         size_t offset = ip[0] | (ip[1] << 8);
+         ip += 2;
+         if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+         
+         size_t match_length = token & 15;
+         if (match_length == 15) {
+             unsigned int b;
+             do {
+                 if (ip >= ip_end) return -1;
+                 b = *ip++;
+                 match_length += b;
+             } while (b == 255);
+         }
+         match_length += LZ4_MIN_MATCH;
+         if (match_length > (size_t)(op_end - op)) return -1;
+         
+         // Matches may overlap their own output, so copy byte by byte
+         const unsigned char *match = op - offset;
+         for (size_t k = 0; k < match_length; k++) op[k] = match[k];
+         op += match_length;
+     }
+     
+     return (int)(op - dst);
+ }
+ 
+ // Decode one received chunk, returns the decoded size or -1 on error
+ static int decode_chunk(uint32_t codec, const unsigned char *src, int src_size,
+                         unsigned char *dst, int raw_size) {
+     switch (codec) {
+         case CODEC_NONE:
+             if (src_size != raw_size) return -1;
+             memcpy(dst, src, src_size);
+             return src_size;
+         case CODEC_LZ4:
+             return lz4_decompress(src, src_size, dst, raw_size);
+ #ifdef DSYNC_WITH_ZSTD
+         case CODEC_ZSTD: {
+             size_t result = ZSTD_decompress(dst, raw_size, src, src_size);
+             return ZSTD_isError(result) ? -1 : (int)result;
+         }
+ #endif
+         default:
+             printf("Unsupported codec: %s (%u)\n", codec_name(codec), codec);
+             return -1;
+     }
+ }
+ 
+ // Compress one chunk, picking the codec from a sample when the chunk is worth trying
+ static void compress_chunk(transfer_slot *slot) {
+     long long start = profile_now();
+     compression_codec codec = slot->requested;
+     int encoded_size = 0;
+     
+     slot->skipped = 0;
+     
+     // Zeros in an allocated block cost nothing to send and nothing to store as a hole
+     if (slot->sparse && slot->raw[0] == 0 && memcmp(slot->raw, slot->raw + 1, slot->raw_size - 1) == 0) {
+         slot->header.codec = CHUNK_HOLE;
+         slot->header.encoded_size = 0;
+         slot->header.raw_size = (uint32_t)slot->raw_size;
+         slot->payload = slot->raw;
+         slot->busy_ns = profile_end(STAGE_COMPRESS, start) - start;
+         return;
+     }
+     
+     if (codec != CODEC_NONE) {
+         // A quick LZ4 pass over a sample tells us whether the data compresses at all
+         int sample_size = slot->raw_size < COMPRESS_SAMPLE_SIZE ? slot->raw_size : COMPRESS_SAMPLE_SIZE;
+         int sample_out = lz4_compress(slot->raw, sample_size, slot->encoded, ENCODED_BUFFER_SIZE);
+         double ratio = (sample_out > 0 && sample_size > 0) ? (double)sample_out / sample_size : 1.0;
+         
+         if (ratio > INCOMPRESSIBLE_RATIO) {
+             codec = CODEC_NONE;
+             slot->skipped = 1;
+         } else if (codec == CODEC_AUTO) {
+             codec = (ratio < ZSTD_PREFERRED_RATIO && ZSTD_AVAILABLE) ? CODEC_ZSTD : CODEC_LZ4;
+         }
+     }
+     
+     if (codec == CODEC_LZ4) {
+         encoded_size = lz4_compress(slot->raw, slot->raw_size, slot->encoded, ENCODED_BUFFER_SIZE);
+     }
+ #ifdef DSYNC_WITH_ZSTD
+     else if (codec == CODEC_ZSTD) {
+         size_t result = ZSTD_compress(slot->encoded, ENCODED_BUFFER_SIZE, slot->raw, slot->raw_size, ZSTD_LEVEL);
+         encoded_size = ZSTD_isError(result) ? 0 : (int)result;
+     }
+ #endif
+     
+     // Fall back to the raw bytes whenever compression does not pay off
+     if (codec == CODEC_NONE || encoded_size <= 0 || encoded_size >= slot->raw_size) {
+         slot->header.codec = CODEC_NONE;
+         slot->header.encoded_size = (uint32_t)slot->raw_size;
+         slot->payload = slot->raw;
+     } else {
+         slot->header.codec = (uint32_t)codec;
+         slot->header.encoded_size = (uint32_t)encoded_size;
+         slot->payload = slot->encoded;
+     }
+     slot->header.raw_size = (uint32_t)slot->raw_size;
+     slot->busy_ns = profile_end(STAGE_COMPRESS, start) - start;
+ }
+ 
+ // Compression worker thread
+ static thread_result THREAD_CALL compress_worker(void *arg) {
+     compress_pool *pool = (compress_pool *)arg;
+     
+     mutex_lock(&pool->lock);
+     while (1) {
+         while (pool->queue_count == 0 && !pool->shutting_down) {
+             cond_wait(&pool->work_ready, &pool->lock);
+         }
+         if (pool->queue_count == 0) break; // Shutting down with nothing left to do
+         
+         transfer_slot *slot = pool->queue[pool->queue_head];
+         pool->queue_head = (pool->queue_head + 1) % pool->slot_count;
+         pool->queue_count--;
+         mutex_unlock(&pool->lock);
+         
+         compress_chunk(slot);
+         
+         mutex_lock(&pool->lock);
+         slot->done = 1;
+         cond_broadcast(&pool->work_done);
+     }
+     mutex_unlock(&pool->lock);
+     profile_release();
+     return (thread_result)0;
+ }
+ 
+ // Set up the pipeline; with no workers (or no compression) chunks are handled inline
+ int compress_pool_init(compress_pool *pool, compression_codec codec, int worker_count) {
+     memset(pool, 0, sizeof(*pool));
+     pool->codec = codec;
+     pool->worker_count = (codec == CODEC_NONE) ? 0 : worker_count;
+     
+     // Two chunks in flight per worker keeps them busy while the previous one is sent
+     pool->slot_count = pool->worker_count * 2 + 2;
+     pool->slots = (transfer_slot *)calloc(pool->slot_count, sizeof(transfer_slot));
+     pool->queue = (transfer_slot **)calloc(pool->slot_count, sizeof(transfer_slot *));
+     if (!pool->slots || !pool->queue) {
+         printf("Memory allocation failed\n");
+         free(pool->slots);
+         free(pool->queue);
+         return 0;
+     }
+     
+     mutex_init(&pool->lock);
+     cond_init(&pool->work_ready);
+     cond_init(&pool->work_done);
+     
+     for (int i = 0; i < pool->worker_count; i++) {
+         if (!thread_start(&pool->workers[i], compress_worker, pool)) {
+             printf("Error creating compression worker: %lu\n", last_error());
+             pool->worker_count = i;
+             break;
+         }
+     }
+     
+     // Each slot can have a read plus a header and payload send outstanding
+     io_engine_init(&pool->io, (unsigned)pool->slot_count * 3 + 4);
+     unsigned char *buffers[COMPRESS_MAX_WORKERS * 2 + 2];
+     for (int i = 0; i < pool->slot_count; i++) buffers[i] = pool->slots[i].raw;
+     io_engine_register_buffers(&pool->io, buffers, BUFFER_SIZE, pool->slot_count);
+     
+     return 1;
+ }
+ 
+ void compress_pool_destroy(compress_pool *pool) {
+     mutex_lock(&pool->lock);
+     pool->shutting_down = 1;
+     cond_broadcast(&pool->work_ready);
+     mutex_unlock(&pool->lock);
+     
+     for (int i = 0; i < pool->worker_count; i++) {
+         thread_join(pool->workers[i]);
+     }
+     
+     io_engine_destroy(&pool->io);
+     cond_destroy(&pool->work_ready);
+     cond_destroy(&pool->work_done);
+     mutex_destroy(&pool->lock);
+     free(pool->slots);
+     free(pool->queue);
+     memset(pool, 0, sizeof(*pool));
+ }
+ 
+ // Hand a filled slot to the workers
+ static void compress_pool_submit(compress_pool *pool, transfer_slot *slot) {
+     slot->done = 0;
+     
+     if (pool->worker_count == 0) {
+         compress_chunk(slot);
+         slot->done = 1;
+         return;
+     }
+     
+     mutex_lock(&pool->lock);
+     pool->queue[(pool->queue_head + pool->queue_count) % pool->slot_count] = slot;
+     pool->queue_count++;
+     cond_signal(&pool->work_ready);
+     mutex_unlock(&pool->lock);
+ }
+ 
+ // Block until a submitted slot has been compressed
+ static void compress_pool_wait(compress_pool *pool, transfer_slot *slot) {
+     if (pool->worker_count == 0) return;
+     
+     mutex_lock(&pool->lock);
+     while (!slot->done) {
+         cond_wait(&pool->work_done, &pool->lock);
+     }
+     mutex_unlock(&pool->lock);
+ }
+ 
+ // Print and reset the per-codec counters for the last batch
+ void compress_pool_report(compress_pool *pool) {
+     for (int c = 0; c < CODEC_COUNT; c++) {
+         codec_stats *st = &pool->stats[c];
+         if (st->chunks == 0) continue;
+         
+         double ratio = st->wire_bytes > 0 ? (double)st->raw_bytes / st->wire_bytes : 1.0;
+         double throughput = st->busy_ns > 0 ? (st->raw_bytes / (1024.0 * 1024)) / (st->busy_ns / 1e9) : 0.0;
+         printf("  %-5s %lld chunks, %.2f MB -> %.2f MB (ratio %.2f), %.1f MB/s",
+                codec_name(c), st->chunks,
+                st->raw_bytes / (1024.0 * 1024), st->wire_bytes / (1024.0 * 1024),
+                ratio, throughput);
+         if (st->skipped > 0) printf(", %lld incompressible", st->skipped);
+         printf("\n");
+     }
+     memset(pool->stats, 0, sizeof(pool->stats));
+     
+     if (pool->dedup_chunks > 0) {
+         printf("  dedup %lld of %lld chunks sent, %.2f MB of %.2f MB\n",
+                pool->dedup_sent, pool->dedup_chunks,
+                pool->dedup_sent_bytes / (1024.0 * 1024), pool->dedup_bytes / (1024.0 * 1024));
+     }
+     pool->dedup_chunks = pool->dedup_sent = 0;
+     pool->dedup_bytes = pool->dedup_sent_bytes = 0;
+     
+     if (pool->hole_bytes > 0) {
+         printf("  holes %.2f MB sent as hole frames\n", pool->hole_bytes / (1024.0 * 1024));
+     }
+     pool->hole_bytes = 0;
+ }
+ 
+ // Wait for a slot's previous frame to leave, returns 0 if either send failed
+ static int slot_finish_send(compress_pool *pool, transfer_slot *slot) {
+     if (slot->state != SLOT_SENDING) return 1;
+     
+     io_wait(&pool->io, &slot->header_req);
+     io_wait(&pool->io, &slot->send_req);
+     slot->state = SLOT_IDLE;
+     return slot->header_req.result == (long long)sizeof(chunk_header) &&
+            slot->send_req.result == (long long)slot->header.encoded_size;
+ }
+ 
+ // Let every outstanding read, compression and send on the slots finish
+ static int drain_slots(compress_pool *pool) {
+     int ok = 1;
+     
+     for (int i = 0; i < pool->slot_count; i++) {
+         transfer_slot *slot = &pool->slots[i];
+         if (slot->state == SLOT_READING) io_wait(&pool->io, &slot->read_req);
+         if (slot->state == SLOT_COMPRESSING) compress_pool_wait(pool, slot);
+         if (slot->state == SLOT_SENDING && !slot_finish_send(pool, slot)) ok = 0;
+         slot->state = SLOT_IDLE;
+     }
+     return ok;
+ }
+ 
+ // Gear table for FastCDC, filled deterministically so chunk boundaries are stable across runs
+ static uint64_t cdc_gear[256];
+ 
+ static void cdc_init_gear(void) {
+     static int initialized = 0;
+     if (initialized) return;
+     
+     // splitmix64
+     uint64_t x = 0x6A09E667F3BCC909ULL;
+     for (int i = 0; i < 256; i++) {
+         x += 0x9E3779B97F4A7C15ULL;
+         uint64_t z = x;
+         z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+         z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+         cdc_gear[i] = z ^ (z >> 31);
+     }
+     initialized = 1;
+ }
+ 
+ // FastCDC cut point: a stricter mask before the average size and a looser one after it
+ // pulls chunk sizes towards the average (normalized chunking)
+ static size_t cdc_cut(const unsigned char *src, size_t n) {
+     if (n <= CDC_MIN_SIZE) return n;
+     if (n > CDC_MAX_SIZE) n = CDC_MAX_SIZE;
+     
+     size_t normal = n < CDC_AVG_SIZE ? n : CDC_AVG_SIZE;
+     uint64_t fp = 0;
+     size_t i = CDC_MIN_SIZE;
+     
+     for (; i < normal; i++) {
+         fp = (fp << 1) + cdc_gear[src[i]];
+         if (!(fp & CDC_MASK_S)) return i;
+     }
+     for (; i < n; i++) {
+         fp = (fp << 1) + cdc_gear[src[i]];
+         if (!(fp & CDC_MASK_L)) return i;
+     }
+     return n;
+ }
+ 
+ // 128-bit chunk identity from two independently seeded xxHash64 passes
+ static void chunk_hash(const void *data, size_t len, uint64_t hash[2]) {
+     hash[0] = xxh64(data, len, 0);
+     hash[1] = xxh64(data, len, CHUNK_HASH_SEED);
+ }
+ 
+ // Split a file into content-defined chunks and hash each one
+ int cdc_build_manifest(const char *path, cdc_chunk **chunks, int *chunk_count) {
+     *chunks = NULL;
+     *chunk_count = 0;
+     
+     FILE *f = fopen(path, "rb");
+     if (!f) {
+         printf("Error opening file for chunking: %s\n", path);
+         return 0;
+     }
+     
+     cdc_init_gear();
+     
+     // Window holds at least one maximum-size chunk of lookahead until the end of the file
+     size_t window_size = CDC_MAX_SIZE * 2;
+     unsigned char *window = (unsigned char *)malloc(window_size);
+     int capacity = 64;
+     *chunks = (cdc_chunk *)malloc(capacity * sizeof(cdc_chunk));
+     if (!window || !*chunks) {
+         printf("Memory allocation failed\n");
+         free(window);
+         free(*chunks);
+         *chunks = NULL;
+         fclose(f);
+         return 0;
+     }
+     
+     size_t start = 0, len = 0;
+     long long offset = 0;
+     int eof = 0, ok = 1;
+     
+     while (1) {
+         if (!eof && len < CDC_MAX_SIZE) {
+             // Compact and refill
+             memmove(window, window + start, len);
+             start = 0;
+             size_t n = fread(window + len, 1, window_size - len, f);
+             len += n;
+             if (n == 0) eof = 1;
+             continue;
+         }
+         if (len == 0) break;
+         
+         size_t cut = cdc_cut(window + start, len);
+         
+         if (*chunk_count == capacity) {
+             cdc_chunk *grown = (cdc_chunk *)realloc(*chunks, capacity * 2 * sizeof(cdc_chunk));
+             if (!grown) {
+                 printf("Memory allocation failed\n");
+                 ok = 0;
+                 break;
+             }
+             *chunks = grown;
+             capacity *= 2;
+         }
+         
+         cdc_chunk *chunk = &(*chunks)[(*chunk_count)++];
+         chunk->offset = offset;
+         chunk->length = (uint32_t)cut;
+         chunk_hash(window + start, cut, chunk->hash);
+         
+         start += cut;
+         len -= cut;
+         offset += (long long)cut;
+     }
+     
+     if (ferror(f)) ok = 0;
+     fclose(f);
+     free(window);
+     
+     if (!ok) {
+         free(*chunks);
+         *chunks = NULL;
+         *chunk_count = 0;
+     }
+     return ok;
+ }
+ 
+ // Changes that carry file contents need a stream
+ static int record_has_data(const sync_record *record) {
+     return (record->operation == SYNC_CREATE || record->operation == SYNC_MODIFY) &&
+            !record->file.is_directory;
+ }
+ 
+ static int record_priority(const sync_record *record) {
+     if (!record_has_data(record) || record->file.size == 0) return PRIORITY_METADATA;
+     return record->file.size < SMALL_FILE_LIMIT ? PRIORITY_SMALL : PRIORITY_LARGE;
+ }
+ 
+ static void token_bucket_init(token_bucket *bucket, long long rate) {
+     memset(bucket, 0, sizeof(*bucket));
+     mutex_init(&bucket->lock);
+     bucket->rate = (double)rate;
+     // A tenth of a second of traffic, but always room for a couple of full frames
+     bucket->burst = bucket->rate / 10;
+     if (bucket->burst < 2.0 * ENCODED_BUFFER_SIZE) bucket->burst = 2.0 * ENCODED_BUFFER_SIZE;
+     bucket->tokens = bucket->burst;
+     bucket->last_ns = now_ns();
+ }
+ 
+ // Account for bytes about to be sent, sleeping off any debt first
+ static void token_bucket_take(token_bucket *bucket, long long bytes) {
+     if (bucket->rate <= 0) return;
+     
+     mutex_lock(&bucket->lock);
+     long long now = now_ns();
+     bucket->tokens += (double)(now - bucket->last_ns) * bucket->rate / 1e9;
+     if (bucket->tokens > bucket->burst) bucket->tokens = bucket->burst;
+     bucket->last_ns = now;
+     
+     bucket->tokens -= (double)bytes;
+     double debt = -bucket->tokens;
+     mutex_unlock(&bucket->lock);
+     
+     // Sleep outside the lock; concurrent senders each wait out the debt they see
+     if (debt > 0) sleep_ms((int)(debt * 1000.0 / bucket->rate) + 1);
+ }
+ 
+ // A local path as the other side names it: relative to the synced root, with '/' separators.
+ // wire may be path itself.
+ static void wire_path(const char *root, const char *path, char *wire) {
+     size_t root_length = strlen(root);
+     const char *relative = path;
+     if (strncmp(relative, root, root_length) == 0 && relative[root_length] == PATH_SEP) {
+         relative += root_length + 1;
+     }
+     memmove(wire, relative, strlen(relative) + 1);
+     for (char *p = wire; *p; p++) {
+         if (*p == PATH_SEP) *p = '/';
+     }
+ }
+ 
+ // Lay a record out for the wire, its path made relative to the watched root with '/'
+ static void record_to_wire(const sync_record *change, const char *root, wire_record *wire) {
+     memset(wire, 0, sizeof(*wire));
+     wire_path(root, change->file.path, wire->path);
+     wire->size = change->file.size;
+     wire->last_modified = (int64_t)change->file.last_modified;
+     wire->mtime_ns = change->file.mtime_ns;
+     wire->content_hash = change->file.content_hash;
+     wire->data_size = change->data_size;
+     wire->transfer_id = change->transfer_id;
+     wire->operation = (uint32_t)change->operation;
+     wire->flags = (change->file.is_directory ? RECORD_DIRECTORY : 0) | (change->file.has_hash ? RECORD_HAS_HASH : 0);
+     wire->transfer_mode = change->transfer_mode;
+     wire->stream = change->stream;
+ }
+ 
+ // Turn a received record back into a sync_record; the path stays as it came
+ static void record_from_wire(const wire_record *wire, sync_record *change) {
+     memset(change, 0, sizeof(*change));
+     memcpy(change->file.path, wire->path, MAX_PATH_LENGTH);
+     change->file.path[MAX_PATH_LENGTH - 1] = '\0';
+     change->file.size = wire->size;
+     change->file.last_modified = (time_t)wire->last_modified;
+     change->file.mtime_ns = wire->mtime_ns;
+     change->file.content_hash = wire->content_hash;
+     change->file.has_hash = (wire->flags & RECORD_HAS_HASH) != 0;
+     change->file.is_directory = (wire->flags & RECORD_DIRECTORY) != 0;
+     change->data_size = wire->data_size;
+     change->transfer_id = wire->transfer_id;
+     change->operation = (sync_operation)wire->operation;
+     change->transfer_mode = wire->transfer_mode;
+     change->stream = wire->stream;
+ }
+ 
+ // Send a record with its path made relative to the watched root, using '/' on the wire
+ static int send_record(SOCKET sock, sync_scheduler *sched, const sync_record *change, const char *root) {
+     long long start = profile_now();
+     uint32_t type = MSG_RECORD;
+     wire_record record;
+     record_to_wire(change, root, &record);
+     
+     token_bucket_take(&sched->bucket, sizeof(type) + sizeof(record));
+     if (!send_all(sock, &type, sizeof(type)) || !send_all(sock, &record, sizeof(record))) {
+         printf("Error sending change record: %d\n", WSAGetLastError());
+         return 0;
+     }
+     profile_end(STAGE_SEND, start);
+     return 1;
+ }
+ 
+ // A frame without payload: the end of a stream, or an abort
+ static int send_end_frame(SOCKET sock, int stream, uint32_t codec) {
+     chunk_header frame = { MSG_CHUNK, (uint32_t)stream, codec, 0, 0 };
+     return send_all(sock, &frame, sizeof(frame));
+ }
+ 
+ // Offer the manifest of a stream's file and learn which chunks the server needs
+ static int stream_exchange_manifest(SOCKET sock, sync_scheduler *sched, send_stream *st, compress_pool *pool) {
+     if (!cdc_build_manifest(st->record.file.path, &st->chunks, &st->chunk_count)) {
+         // An empty manifest followed by an abort leaves the server's copy alone
+         uint32_t none = 0;
+         st->eof = 1;
+         st->read_error = 1;
+         return send_all(sock, &none, sizeof(none));
+     }
+     
+     dedup_entry *entries = (dedup_entry *)calloc(st->chunk_count > 0 ? st->chunk_count : 1, sizeof(dedup_entry));
+     st->need = (unsigned char *)malloc(st->chunk_count > 0 ? st->chunk_count : 1);
+     if (!entries || !st->need) {
+         printf("Memory allocation failed\n");
+         free(entries);
+         return 0;
+     }
+     
+     for (int i = 0; i < st->chunk_count; i++) {
+         entries[i].hash[0] = st->chunks[i].hash[0];
+         entries[i].hash[1] = st->chunks[i].hash[1];
+         entries[i].length = st->chunks[i].length;
+     }
+     
+     uint32_t count = (uint32_t)st->chunk_count;
+     token_bucket_take(&sched->bucket, sizeof(count) + st->chunk_count * (long long)sizeof(dedup_entry));
+     int ok = send_all(sock, &count, sizeof(count)) &&
+              send_all(sock, entries, st->chunk_count * (int)sizeof(dedup_entry)) &&
+              recv_all(sock, st->need, st->chunk_count);
+     free(entries);
+     
+     if (!ok) {
+         printf("Error exchanging chunk manifest: %d\n", WSAGetLastError());
+         return 0;
+     }
+     
+     for (int i = 0; i < st->chunk_count; i++) {
+         pool->dedup_chunks++;
+         pool->dedup_bytes += st->chunks[i].length;
+         if (st->need[i]) {
+             pool->dedup_sent++;
+             pool->dedup_sent_bytes += st->chunks[i].length;
+         }
+     }
+     return 1;
+ }
+ 
+ static void range_sender_forget(range_sender *sender, int id);
+ 
+ static void stream_close(sync_scheduler *sched, int id) {
+     send_stream *st = &sched->streams[id];
+     
+     // Range connections may still be reading the file
+     if (st->record.transfer_mode == TRANSFER_RANGES) range_sender_forget(&sched->ranges, id);
+     if (st->file != INVALID_FILE) file_close(st->file);
+     free(st->chunks);
+     free(st->need);
+     memset(st, 0, sizeof(*st));
+     st->file = INVALID_FILE;
+ }
+ 
+ // Names a transfer on the range connections; unique enough that a stale range never matches
+ static uint64_t range_sender_new_id(range_sender *sender) {
+     long long seed[2] = { now_ns(), (long long)++sender->next_id };
+     return xxh64(seed, sizeof(seed), (uint64_t)(uintptr_t)sender);
+ }
+ 
+ static int range_sender_push(range_sender *sender, const range_task *task) {
+     if (sender->task_head > 0 && sender->task_head == sender->task_end) {
+         sender->task_head = 0;
+         sender->task_end = 0;
+     }
+     if (sender->task_end == sender->task_capacity) {
+         int capacity = sender->task_capacity ? sender->task_capacity * 2 : 64;
+         range_task *tasks = (range_task *)realloc(sender->tasks, capacity * sizeof(range_task));
+         if (!tasks) {
+             printf("Memory allocation failed\n");
+             return 0;
+         }
+         sender->tasks = tasks;
+         sender->task_capacity = capacity;
+     }
+     sender->tasks[sender->task_end++] = *task;
+     return 1;
+ }
+ 
+ static thread_result THREAD_CALL range_worker(void *arg);
+ 
+ // Another connection, if the limit allows; called with the lock held. None once stopping:
+ // range_sender_stop only joins the connections there were when it set the flag.
+ static void range_sender_grow(range_sender *sender) {
+     if (sender->stopping || sender->connections >= sender->max_connections) return;
+     if (!thread_start(&sender->workers[sender->connections], range_worker, sender)) {
+         printf("Error starting range connection thread\n");
+         return;
+     }
+     sender->connections++;
+     if (sender->connections > sender->peak_connections) sender->peak_connections = sender->connections;
+ }
+ 
+ // Throughput over the last window decides whether one more connection is worth it: keep
+ // adding while each one raised the rate by PARALLEL_GAIN, stop at the first that did not
+ static void range_sender_measure(range_sender *sender, long long bytes) {
+     long long now = now_ns();
+     sender->window_bytes += bytes;
+     if (now - sender->window_start_ns < PARALLEL_WINDOW_NS) return;
+     
+     double rate = sender->window_bytes * 1e9 / (double)(now - sender->window_start_ns);
+     if (sender->growing) {
+         if (rate >= sender->best_rate * PARALLEL_GAIN) {
+             sender->best_rate = rate;
+             if (sender->task_head < sender->task_end) range_sender_grow(sender);
+         } else {
+             sender->growing = 0;
+         }
+     }
+     if (rate > sender->best_rate) sender->best_rate = rate;
+     sender->window_start_ns = now;
+     sender->window_bytes = 0;
+ }
+ 
+ // Send one range over sock, connecting first if needed. Returns 1 once the server confirmed
+ // it, 0 if it should be tried again, -1 if the file could not be read.
+ static int range_send(range_sender *sender, SOCKET *sock, unsigned char *buffer, file_handle file,
+                       const range_task *task) {
+     if (*sock == INVALID_SOCKET) {
+         *sock = connect_server(sender->server_ip);
+         if (*sock == INVALID_SOCKET) return 0;
+     }
+     
+     range_header header = { MSG_RANGE, 0, task->id, task->offset, task->length };
+     xxh64_state hash;
+     xxh64_reset(&hash, 0);
+     token_bucket_take(sender->bucket, sizeof(header));
+     int ok = send_all(*sock, &header, sizeof(header));
+     
+     for (long long done = 0; ok && done < task->length; ) {
+         int n = task->length - done < BUFFER_SIZE ? (int)(task->length - done) : BUFFER_SIZE;
+         if (file_pread(file, buffer, n, task->offset + done) != n) {
+             // Cutting the connection is the only way to end a range early
+             closesocket(*sock);
+             *sock = INVALID_SOCKET;
+             return -1;
+         }
+         xxh64_update(&hash, buffer, n);
+         token_bucket_take(sender->bucket, n);
+         ok = send_all(*sock, buffer, n);
+         done += n;
+     }
+     
+     uint64_t digest = xxh64_digest(&hash);
+     uint32_t status = 0;
+     if (ok) ok = send_all(*sock, &digest, sizeof(digest)) && recv_all(*sock, &status, sizeof(status));
+     if (!ok) {
+         printf("Range connection lost: %d\n", WSAGetLastError());
+         closesocket(*sock);
+         *sock = INVALID_SOCKET;
+         return 0;
+     }
+     return status == 1;
+ }
+ 
+ // A range connection: takes queued ranges until the sender stops
+ static thread_result THREAD_CALL range_worker(void *arg) {
+     range_sender *sender = (range_sender *)arg;
+     SOCKET sock = INVALID_SOCKET;
+     unsigned char *buffer = (unsigned char *)malloc(BUFFER_SIZE);
+     
+     mutex_lock(&sender->lock);
+     while (1) {
+         while (!sender->stopping && sender->task_head == sender->task_end) {
+             cond_wait(&sender->work_ready, &sender->lock);
+         }
+         if (sender->stopping) break;
+         
+         range_task task = sender->tasks[sender->task_head++];
+         range_file *f = &sender->files[task.file];
+         file_handle file = f->file;
+         f->readers++;
+         mutex_unlock(&sender->lock);
+         
+         int result = buffer ? range_send(sender, &sock, buffer, file, &task) : -1;
+         
+         mutex_lock(&sender->lock);
+         f->readers--;
+         if (f->active && f->id == task.id) {
+             if (result == 1) {
+                 f->ranges_left--;
+                 sender->ranges++;
+                 sender->bytes += task.length;
+                 range_sender_measure(sender, task.length);
+             } else if (result == 0 && ++task.attempts < PARALLEL_RETRIES && range_sender_push(sender, &task)) {
+                 sender->retries++;
+                 cond_signal(&sender->work_ready);
+             } else {
+                 f->failed = 1;
+             }
+         }
+         cond_broadcast(&sender->progress);
+     }
+     mutex_unlock(&sender->lock);
+     
+     if (sock != INVALID_SOCKET) closesocket(sock);
+     free(buffer);
+     return (thread_result)0;
+ }
+ 
+ static void range_sender_init(range_sender *sender, int max_connections, token_bucket *bucket) {
+     memset(sender, 0, sizeof(*sender));
+     sender->max_connections = max_connections;
+     sender->bucket = bucket;
+     sender->growing = 1;
+     mutex_init(&sender->lock);
+     cond_init(&sender->work_ready);
+     cond_init(&sender->progress);
+     for (int id = 0; id < MAX_STREAMS; id++) sender->files[id].file = INVALID_FILE;
+ }
+ 
+ // Queue every range of the file on stream id, which the server now expects under transfer_id
+ static int range_sender_add(range_sender *sender, int id, uint64_t transfer_id, file_handle file, long long size) {
+     int ok = 1;
+     
+     mutex_lock(&sender->lock);
+     if (sender->task_head == sender->task_end) {
+         // Idle time says nothing about the connections, start a fresh window
+         sender->window_start_ns = now_ns();
+         sender->window_bytes = 0;
+     }
+     
+     range_file *f = &sender->files[id];
+     memset(f, 0, sizeof(*f));
+     f->active = 1;
+     f->id = transfer_id;
+     f->file = file;
+     for (long long offset = 0; ok && offset < size; offset += PARALLEL_RANGE_SIZE) {
+         range_task task = { id, transfer_id, offset, size - offset < PARALLEL_RANGE_SIZE ? size - offset : PARALLEL_RANGE_SIZE, 0 };
+         ok = range_sender_push(sender, &task);
+         f->ranges_left++;
+     }
+     
+     if (sender->connections == 0) range_sender_grow(sender);
+     if (sender->connections == 0) ok = 0;
+     cond_broadcast(&sender->work_ready);
+     mutex_unlock(&sender->lock);
+     return ok;
+ }
+ 
+ // Drop the file on stream id and its queued ranges, once no connection is reading it
+ static void range_sender_forget(range_sender *sender, int id) {
+     mutex_lock(&sender->lock);
+     range_file *f = &sender->files[id];
+     if (f->active) {
+         f->active = 0;
+         int kept = sender->task_head;
+         for (int i = sender->task_head; i < sender->task_end; i++) {
+             if (sender->tasks[i].file != id) sender->tasks[kept++] = sender->tasks[i];
+         }
+         sender->task_end = kept;
+         while (f->readers > 0) cond_wait(&sender->progress, &sender->lock);
+     }
+     memset(f, 0, sizeof(*f));
+     f->file = INVALID_FILE;
+     mutex_unlock(&sender->lock);
+ }
+ 
+ // 1 once every range of stream id's file is confirmed, -1 if one could not be sent, else 0
+ static int range_sender_poll(range_sender *sender, int id) {
+     mutex_lock(&sender->lock);
+     range_file *f = &sender->files[id];
+     int state = f->failed ? -1 : f->ranges_left == 0 ? 1 : 0;
+     mutex_unlock(&sender->lock);
+     return state;
+ }
+ 
+ // Wait up to ms for a ranged file to finish, unless one already has
+ static void range_sender_wait(range_sender *sender, int ms) {
+     mutex_lock(&sender->lock);
+     int ready = 0;
+     for (int id = 0; id < MAX_STREAMS; id++) {
+         range_file *f = &sender->files[id];
+         if (f->active && (f->failed || f->ranges_left == 0)) ready = 1;
+     }
+     if (!ready) cond_wait_ms(&sender->progress, &sender->lock, ms);
+     mutex_unlock(&sender->lock);
+ }
+ 
+ // Close the connections at the end of a session; the next one probes its own count again
+ static void range_sender_stop(range_sender *sender) {
+     mutex_lock(&sender->lock);
+     sender->stopping = 1;
+     cond_broadcast(&sender->work_ready);
+     int count = sender->connections;
+     mutex_unlock(&sender->lock);
+     
+     for (int i = 0; i < count; i++) thread_join(sender->workers[i]);
+     
+     mutex_lock(&sender->lock);
+     sender->connections = 0;
+     sender->stopping = 0;
+     sender->growing = 1;
+     sender->best_rate = 0;
+     mutex_unlock(&sender->lock);
+ }
+ 
+ static void range_sender_destroy(range_sender *sender) {
+     range_sender_stop(sender);
+     free(sender->tasks);
+     mutex_destroy(&sender->lock);
+     cond_destroy(&sender->work_ready);
+     cond_destroy(&sender->progress);
+ }
+ 
+ // Print and reset the range counters for the last session
+ static void range_sender_report(range_sender *sender) {
+     if (sender->ranges == 0 && sender->retries == 0) return;
+     printf("  ranges %lld, %.1f MB over up to %d connections, %lld retried\n", sender->ranges,
+            sender->bytes / 1048576.0, sender->peak_connections, sender->retries);
+     sender->ranges = 0;
+     sender->bytes = 0;
+     sender->retries = 0;
+     sender->peak_connections = 0;
+ }
+ 
+ // Announce a job's record on stream id and get its file ready for reading
+ static int stream_open(SOCKET sock, sync_scheduler *sched, int id, const sync_job *job,
+                        const char *root, compress_pool *pool, int dedup, int parallel) {
+     send_stream *st = &sched->streams[id];
+     
+     stream_close(sched, id);
+     st->active = 1;
+     st->priority = job->priority;
+     st->queued_ns = job->queued_ns;
+     st->record = job->record;
+     st->record.stream = id;
+     st->record.data_size = st->record.file.size;
+     st->file = file_open_read(st->record.file.path);
+     
+     // Sparse files skip their holes instead; a manifest would have to read through them
+     int sparse = 0;
+     if (st->file != INVALID_FILE) {
+         long long data_start, data_end;
+         file_next_data(st->file, 0, &data_start, &data_end);
+         sparse = data_start > 0 || data_end < st->record.file.size;
+     }
+     if (dedup && !sparse && st->record.file.size >= DEDUP_MIN_FILE_SIZE) {
+         st->record.transfer_mode = TRANSFER_DEDUP;
+     } else if (parallel && !sparse && st->file != INVALID_FILE && sched->ranges.max_connections > 0 &&
+                st->record.file.size >= PARALLEL_MIN_SIZE) {
+         st->record.transfer_mode = TRANSFER_RANGES;
+         st->record.transfer_id = range_sender_new_id(&sched->ranges);
+     } else {
+         st->record.transfer_mode = TRANSFER_STREAM;
+     }
+     
+     if (!send_record(sock, sched, &st->record, root)) return 0;
+     if (st->record.transfer_mode == TRANSFER_RANGES) {
+         return range_sender_add(&sched->ranges, id, st->record.transfer_id, st->file, st->record.file.size);
+     }
+     if (st->record.transfer_mode == TRANSFER_DEDUP && !stream_exchange_manifest(sock, sched, st, pool)) return 0;
+     if (st->eof) return 1;
+     
+     if (st->file == INVALID_FILE) {
+         // The end frame becomes an abort, telling the server to leave its copy alone
+         printf("Error opening file for reading: %s\n", st->record.file.path);
+         st->eof = 1;
+         st->read_error = 1;
+     }
+     return 1;
+ }
+ 
+ // Send up to max_chunks chunk frames of stream id. Reads for all free slots are submitted
+ // together, handed to the workers as they complete, and each compressed chunk goes out as a
+ // linked header and payload send so the next reads overlap the network. Once the file is done
+ // its end frame follows. Returns 1 when the stream is finished, 0 if it has more, -1 on error.
+ static int stream_send_burst(SOCKET sock, compress_pool *pool, sync_scheduler *sched, int id, int max_chunks) {
+     send_stream *st = &sched->streams[id];
+     int next_read = 0, next_compress = 0, next_send = 0;
+     int ok = 1;
+     transfer_slot *last_sent = NULL;
+     
+     while (ok && ((!st->eof && next_read < max_chunks) || next_send < next_read)) {
+         // Keep the pipeline full: queue reads into every slot whose frame has left
+         while (!st->eof && next_read < max_chunks && next_read - next_send < pool->slot_count) {
+             int index = next_read % pool->slot_count;
+             transfer_slot *slot = &pool->slots[index];
+             long long offset;
+             size_t length;
+             
+             if (!slot_finish_send(pool, slot)) {
+                 ok = 0;
+                 break;
+             }
+             
+             if (st->chunks) {
+                 while (st->next_chunk < st->chunk_count && !st->need[st->next_chunk]) st->next_chunk++;
+                 if (st->next_chunk == st->chunk_count) {
+                     st->eof = 1;
+                     break;
+                 }
+                 offset = st->chunks[st->next_chunk].offset;
+                 length = st->chunks[st->next_chunk].length;
+                 st->next_chunk++;
+             } else {
+                 // Holes between data extents go out as hole frames instead of zeros
+                 if (st->position >= st->data_end) {
+                     long long data_start;
+                     file_next_data(st->file, st->position, &data_start, &st->data_end);
+                     if (data_start > st->position) {
+                         long long hole = data_start - st->position;
+                         if (hole > HOLE_FRAME_MAX) {
+                             hole = HOLE_FRAME_MAX;
+                             st->data_end = 0; // Look again once this frame is out
+                         }
+                         slot->hole = 1;
+                         slot->header.codec = CHUNK_HOLE;
+                         slot->header.raw_size = (uint32_t)hole;
+                         slot->header.encoded_size = 0;
+                         slot->payload = slot->raw;
+                         slot->skipped = 0;
+                         slot->busy_ns = 0;
+                         slot->done = 1;
+                         slot->state = SLOT_COMPRESSING;
+                         st->position += hole;
+                         next_read++;
+                         continue;
+                     }
+                     if (st->data_end <= st->position) {
+                         st->eof = 1;
+                         break;
+                     }
+                 }
+                 offset = st->position;
+                 length = st->data_end - st->position < BUFFER_SIZE ? (size_t)(st->data_end - st->position) : BUFFER_SIZE;
+                 st->position += length;
+             }
+             
+             slot->hole = 0;
+             slot->sparse = st->chunks == NULL;
+             slot->expected = length;
+             slot->state = SLOT_READING;
+             io_submit_read(&pool->io, st->file, index, slot->raw, length, offset, &slot->read_req);
+             next_read++;
+         }
+         io_flush(&pool->io);
+         if (!ok) break;
+         
+         // Hand completed reads to the workers in file order
+         while (next_compress < next_read) {
+             transfer_slot *slot = &pool->slots[next_compress % pool->slot_count];
+             if (slot->hole) {
+                 next_compress++;
+                 continue;
+             }
+             io_wait(&pool->io, &slot->read_req);
+             long long n = slot->read_req.result;
+             
+             // A short read ends a streamed file; for a manifest it means the file changed
+             int last = n < (long long)slot->expected;
+             if (n < 0 || (last && st->chunks)) st->read_error = 1;
+             if (n <= 0 || (last && st->chunks)) {
+                 slot->state = SLOT_IDLE;
+                 n = 0;
+             }
+             
+             if (n > 0) {
+                 slot->raw_size = (int)n;
+                 // Once a file keeps proving incompressible, only re-probe it now and then
+                 slot->requested = (st->skip_streak >= 4 && next_compress % 16 != 0) ? CODEC_NONE : pool->codec;
+                 slot->state = SLOT_COMPRESSING;
+                 compress_pool_submit(pool, slot);
+                 next_compress++;
+             }
+             
+             if (last) {
+                 // Reads queued past the end are discarded
+                 for (int i = next_compress; i < next_read; i++) {
+                     transfer_slot *extra = &pool->slots[i % pool->slot_count];
+                     if (extra->state != SLOT_READING) continue;
+                     io_wait(&pool->io, &extra->read_req);
+                     extra->state = SLOT_IDLE;
+                 }
+                 next_read = next_compress;
+                 st->eof = 1;
+                 break;
+             }
+         }
+         
+         if (next_send == next_read) break;
+         
+         // Send chunks strictly in file order
+         transfer_slot *slot = &pool->slots[next_send % pool->slot_count];
+         compress_pool_wait(pool, slot);
+         next_send++;
+         
+         if (slot->header.codec == CHUNK_HOLE) {
+             pool->hole_bytes += slot->header.raw_size;
+         } else {
+             if (slot->skipped) st->skip_streak++;
+             else if (slot->header.codec != CODEC_NONE) st->skip_streak = 0;
+             
+             codec_stats *stats = &pool->stats[slot->header.codec];
+             stats->chunks++;
+             stats->skipped += slot->skipped;
+             stats->raw_bytes += slot->header.raw_size;
+             stats->wire_bytes += slot->header.encoded_size;
+             stats->busy_ns += slot->busy_ns;
+         }
+         
+         // Independent sends on one socket may complete out of order, so the previous frame
+         // has to be out before the next one is queued
+         if (last_sent && !slot_finish_send(pool, last_sent)) {
+             ok = 0;
+             break;
+         }
+         
+         slot->header.type = MSG_CHUNK;
+         slot->header.stream = (uint32_t)id;
+         token_bucket_take(&sched->bucket, sizeof(chunk_header) + (long long)slot->header.encoded_size);
+         slot->state = SLOT_SENDING;
+         io_submit_send(&pool->io, sock, &slot->header, sizeof(chunk_header), 1, &slot->header_req);
+         io_submit_send(&pool->io, sock, slot->payload, slot->header.encoded_size, 0, &slot->send_req);
+         io_flush(&pool->io);
+         last_sent = slot;
+     }
+     
+     if (!drain_slots(pool)) ok = 0;
+     
+     if (!ok) {
+         printf("Error sending file data: %d\n", WSAGetLastError());
+         return -1;
+     }
+     if (!st->eof) return 0;
+     
+     if (st->read_error) printf("Error reading file: %s\n", st->record.file.path);
+     token_bucket_take(&sched->bucket, sizeof(chunk_header));
+     return send_end_frame(sock, id, st->read_error ? CHUNK_ABORT : CODEC_NONE) ? 1 : -1;
+ }
+ 
+ static int job_before(const sync_job *a, const sync_job *b) {
+     if (a->priority != b->priority) return a->priority < b->priority;
+     // Metadata keeps scan order, so deletes of directories follow the files inside them
+     if (a->priority != PRIORITY_METADATA && a->record.file.size != b->record.file.size) {
+         return a->record.file.size < b->record.file.size;
+     }
+     return a->seq < b->seq;
+ }
+ 
+ static void job_sift_down(sync_scheduler *sched, int i) {
+     while (1) {
+         int child = 2 * i + 1;
+         if (child >= sched->job_count) break;
+         if (child + 1 < sched->job_count && job_before(&sched->jobs[child + 1], &sched->jobs[child])) child++;
+         if (!job_before(&sched->jobs[child], &sched->jobs[i])) break;
+         
+         sync_job tmp = sched->jobs[i];
+         sched->jobs[i] = sched->jobs[child];
+         sched->jobs[child] = tmp;
+         i = child;
+     }
+ }
+ 
+ static int scheduler_push(sync_scheduler *sched, const sync_record *record) {
+     if (sched->job_count == sched->job_capacity) {
+         int capacity = sched->job_capacity ? sched->job_capacity * 2 : 256;
+         sync_job *jobs = (sync_job *)realloc(sched->jobs, capacity * sizeof(sync_job));
+         if (!jobs) {
+             printf("Memory allocation failed\n");
+             return 0;
+         }
+         sched->jobs = jobs;
+         sched->job_capacity = capacity;
+     }
+     
+     int i = sched->job_count++;
+     sync_job *job = &sched->jobs[i];
+     job->record = *record;
+     job->priority = record_priority(record);
+     job->seq = sched->seq++;
+     job->queued_ns = now_ns();
+     
+     while (i > 0) {
+         int parent = (i - 1) / 2;
+         if (!job_before(&sched->jobs[i], &sched->jobs[parent])) break;
+         sync_job tmp = sched->jobs[i];
+         sched->jobs[i] = sched->jobs[parent];
+         sched->jobs[parent] = tmp;
+         i = parent;
+     }
+     return 1;
+ }
+ 
+ static sync_job scheduler_pop(sync_scheduler *sched) {
+     sync_job top = sched->jobs[0];
+     sched->jobs[0] = sched->jobs[--sched->job_count];
+     job_sift_down(sched, 0);
+     return top;
+ }
+ 
+ static int changes_touch(const sync_record *changes, int count, const char *path) {
+     for (int i = 0; i < count; i++) {
+         if (path_compare(changes[i].file.path, path) == 0) return 1;
+     }
+     return 0;
+ }
+ 
+ // Queue changes. A newer change to a path replaces whatever is still pending for it; a file
+ // already being sent is aborted, so the server never sees two streams for one path.
+ int scheduler_enqueue(sync_scheduler *sched, SOCKET sock, sync_record *changes, int count) {
+     if (sched->job_count > 0) {
+         int kept = 0;
+         for (int i = 0; i < sched->job_count; i++) {
+             if (!changes_touch(changes, count, sched->jobs[i].record.file.path)) {
+                 sched->jobs[kept++] = sched->jobs[i];
+             }
+         }
+         sched->job_count = kept;
+         for (int i = kept / 2 - 1; i >= 0; i--) job_sift_down(sched, i);
+     }
+     
+     for (int id = 0; id < MAX_STREAMS; id++) {
+         send_stream *st = &sched->streams[id];
+         if (!st->active || !changes_touch(changes, count, st->record.file.path)) continue;
+         if (!send_end_frame(sock, id, CHUNK_ABORT)) return 0;
+         stream_close(sched, id);
+     }
+     
+     for (int i = 0; i < count; i++) {
+         if (!scheduler_push(sched, &changes[i])) return 0;
+     }
+     return 1;
+ }
+ 
+ void scheduler_init(sync_scheduler *sched, long long bandwidth, int parallel) {
+     memset(sched, 0, sizeof(*sched));
+     for (int id = 0; id < MAX_STREAMS; id++) sched->streams[id].file = INVALID_FILE;
+     token_bucket_init(&sched->bucket, bandwidth);
+     range_sender_init(&sched->ranges, parallel, &sched->bucket);
+ }
+ 
+ // Drop all queued and in-flight work, after a failed connection
+ void scheduler_reset(sync_scheduler *sched) {
+     for (int id = 0; id < MAX_STREAMS; id++) stream_close(sched, id);
+     sched->job_count = 0;
+ }
+ 
+ void scheduler_destroy(sync_scheduler *sched) {
+     scheduler_reset(sched);
+     range_sender_destroy(&sched->ranges);
+     mutex_destroy(&sched->bucket.lock);
+     free(sched->jobs);
+     memset(sched, 0, sizeof(*sched));
+ }
+ 
+ static int scheduler_busy(const sync_scheduler *sched) {
+     if (sched->job_count > 0) return 1;
+     for (int id = 0; id < MAX_STREAMS; id++) {
+         if (sched->streams[id].active) return 1;
+     }
+     return 0;
+ }
+ 
+ // A free stream for a job of this priority, or -1
+ static int scheduler_free_stream(sync_scheduler *sched, int priority) {
+     int free_id = -1, large = 0;
+     for (int id = 0; id < MAX_STREAMS; id++) {
+         if (!sched->streams[id].active) {
+             if (free_id < 0) free_id = id;
+         } else if (sched->streams[id].priority == PRIORITY_LARGE) {
+             large++;
+         }
+     }
+     if (priority == PRIORITY_LARGE && large >= LARGE_STREAMS) return -1;
+     return free_id;
+ }
+ 
+ // Ranged files go out on their own connections and need no bursts
+ static int stream_pickable(const send_stream *st) {
+     return st->active && st->record.transfer_mode != TRANSFER_RANGES;
+ }
+ 
+ // Next stream to send a burst from: round robin among the most urgent open streams
+ static int scheduler_pick(sync_scheduler *sched) {
+     int best = PRIORITY_COUNT, worst = -1;
+     for (int id = 0; id < MAX_STREAMS; id++) {
+         if (!stream_pickable(&sched->streams[id])) continue;
+         if (sched->streams[id].priority < best) best = sched->streams[id].priority;
+         if (sched->streams[id].priority > worst) worst = sched->streams[id].priority;
+     }
+     if (worst < 0) return -1;
+     
+     int wanted = (++sched->bursts % AGING_TURN == 0) ? worst : best;
+     for (int k = 0; k < MAX_STREAMS; k++) {
+         int id = (sched->next_stream + k) % MAX_STREAMS;
+         if (stream_pickable(&sched->streams[id]) && sched->streams[id].priority == wanted) {
+             sched->next_stream = id + 1;
+             return id;
+         }
+     }
+     return -1;
+ }
+ 
+ static void scheduler_finished(sync_scheduler *sched, int priority, long long queued_ns) {
+     long long latency = now_ns() - queued_ns;
+     sched->files[priority]++;
+     sched->latency_ns[priority] += latency;
+     if (latency > sched->max_latency_ns[priority]) sched->max_latency_ns[priority] = latency;
+ }
+ 
+ // Drain the queue over one connection, rescanning the directory as the interval elapses
+ static int scheduler_run(sync_scheduler *sched, SOCKET sock, compress_pool *pool, sync_session *session) {
+     while (scheduler_busy(sched)) {
+         if (now_ns() >= session->next_scan_ns && !session_rescan(session, sched, sock)) return 0;
+         
+         // Start queued work: records without data go straight out, files need a free stream
+         while (sched->job_count > 0) {
+             if (!record_has_data(&sched->jobs[0].record)) {
+                 sync_job job = scheduler_pop(sched);
+                 if (!send_record(sock, sched, &job.record, session->root)) return 0;
+                 scheduler_finished(sched, job.priority, job.queued_ns);
+                 continue;
+             }
+             
+             int id = scheduler_free_stream(sched, sched->jobs[0].priority);
+             if (id < 0) break;
+             sync_job job = scheduler_pop(sched);
+             // Manifests and range connections need a server of our own to answer
+             if (!stream_open(sock, sched, id, &job, session->root, pool,
+                              session->opts->dedup && !session->fanout, !session->fanout)) return 0;
+         }
+         
+         // Ranged files end with a frame on this connection once all their ranges are confirmed;
+         // the server checks it has them all, so a failed one is resent by a later pass
+         for (int id = 0; id < MAX_STREAMS; id++) {
+             send_stream *st = &sched->streams[id];
+             if (!st->active || st->record.transfer_mode != TRANSFER_RANGES) continue;
+             int state = range_sender_poll(&sched->ranges, id);
+             if (state == 0) continue;
+             if (state < 0) printf("Could not send all ranges of %s\n", st->record.file.path);
+             token_bucket_take(&sched->bucket, sizeof(chunk_header));
+             if (!send_end_frame(sock, id, CODEC_NONE)) return 0;
+             scheduler_finished(sched, st->priority, st->queued_ns);
+             stream_close(sched, id);
+         }
+         
+         int id = scheduler_pick(sched);
+         if (id < 0) {
+             // Only ranged files are in flight, wait for one of them without spinning
+             if (scheduler_busy(sched)) range_sender_wait(&sched->ranges, 50);
+             continue;
+         }
+         
+         // One pipeline's worth of chunks per turn keeps latency low without starving the pipeline
+         long long start = profile_now();
+         int result = stream_send_burst(sock, pool, sched, id, pool->slot_count);
+         if (result < 0) return 0;
+         profile_end(STAGE_SEND, start);
+         if (result == 1) {
+             scheduler_finished(sched, sched->streams[id].priority, sched->streams[id].queued_ns);
+             stream_close(sched, id);
+         }
+     }
+     return 1;
+ }
+ 
+ // Print and reset the per-priority latency counters for the last session
+ void scheduler_report(sync_scheduler *sched) {
+     static const char *names[PRIORITY_COUNT] = { "meta", "small", "large" };
+     
+     for (int p = 0; p < PRIORITY_COUNT; p++) {
+         if (sched->files[p] == 0) continue;
+         printf("  %-5s %lld changes, latency avg %.1f ms, max %.1f ms\n", names[p], sched->files[p],
+                sched->latency_ns[p] / 1e6 / sched->files[p], sched->max_latency_ns[p] / 1e6);
+         sched->files[p] = 0;
+         sched->latency_ns[p] = 0;
+         sched->max_latency_ns[p] = 0;
+     }
+ }
+ 
+ static unsigned int chunk_index_bucket(const uint64_t hash[2], int capacity) {
+     return (unsigned int)(hash[0] >> 32) & (capacity - 1);
+ }
+ 
+ // Find the slot holding a hash, or the free slot where it would go
+ static chunk_location *chunk_index_slot(chunk_index *index, const uint64_t hash[2]) {
+     unsigned int slot = chunk_index_bucket(hash, index->capacity);
+     while (index->entries[slot].length != 0 &&
+            (index->entries[slot].hash[0] != hash[0] || index->entries[slot].hash[1] != hash[1])) {
+         slot = (slot + 1) & (index->capacity - 1);
+     }
+     return &index->entries[slot];
+ }
+ 
+ // Grow the chunk table so it stays at most half full, dropping stale entries on the way
+ static int chunk_index_reserve(chunk_index *index, int wanted) {
+     if (wanted * 2 <= index->capacity) return 1;
+     
+     int new_capacity = index->capacity ? index->capacity : 1024;
+     while (wanted * 2 > new_capacity) new_capacity *= 2;
+     
+     chunk_location *entries = (chunk_location *)calloc(new_capacity, sizeof(chunk_location));
+     if (!entries) {
+         printf("Memory allocation failed\n");
+         return 0;
+     }
+     
+     chunk_location *old_entries = index->entries;
+     int old_capacity = index->capacity;
+     index->entries = entries;
+     index->capacity = new_capacity;
+     index->count = 0;
+     
+     for (int i = 0; i < old_capacity; i++) {
+         if (old_entries[i].length == 0 || old_entries[i].path_id < 0) continue;
+         *chunk_index_slot(index, old_entries[i].hash) = old_entries[i];
+         index->count++;
+     }
+     
+     free(old_entries);
+     return 1;
+ }
+ 
+ // Intern a path, returns its id or -1 on allocation failure
+ static int chunk_index_path_id(chunk_index *index, const char *path) {
+     if (index->path_count * 2 >= index->path_slot_capacity) {
+         int new_capacity = index->path_slot_capacity ? index->path_slot_capacity * 2 : 256;
+         int *slots = (int *)malloc(new_capacity * sizeof(int));
+         if (!slots) return -1;
+         for (int i = 0; i < new_capacity; i++) slots[i] = -1;
+         for (int id = 0; id < index->path_count; id++) {
+             unsigned int slot = (unsigned int)xxh64(index->paths[id], strlen(index->paths[id]), 0) & (new_capacity - 1);
+             while (slots[slot] != -1) slot = (slot + 1) & (new_capacity - 1);
+             slots[slot] = id;
+         }
+         free(index->path_slots);
+         index->path_slots = slots;
+         index->path_slot_capacity = new_capacity;
+     }
+     
+     unsigned int slot = (unsigned int)xxh64(path, strlen(path), 0) & (index->path_slot_capacity - 1);
+     while (index->path_slots[slot] != -1) {
+         if (strcmp(index->paths[index->path_slots[slot]], path) == 0) return index->path_slots[slot];
+         slot = (slot + 1) & (index->path_slot_capacity - 1);
+     }
+     
+     if (index->path_count == index->path_capacity) {
+         int new_capacity = index->path_capacity ? index->path_capacity * 2 : 64;
+         char (*paths)[MAX_PATH_LENGTH] = realloc(index->paths, new_capacity * sizeof(*paths));
+         if (!paths) return -1;
+         index->paths = paths;
+         index->path_capacity = new_capacity;
+     }
+     
+     strncpy(index->paths[index->path_count], path, MAX_PATH_LENGTH - 1);
+     index->paths[index->path_count][MAX_PATH_LENGTH - 1] = '\0';
+     index->path_slots[slot] = index->path_count;
+     return index->path_count++;
+ }
+ 
+ // Remember where a chunk lives, replacing any older location
+ static void chunk_index_insert(chunk_index *index, const uint64_t hash[2], int path_id,
+                                long long offset, uint32_t length) {
+     if (path_id < 0 || !chunk_index_reserve(index, index->count + 1)) return;
+     
+     chunk_location *loc = chunk_index_slot(index, hash);
+     if (loc->length == 0) index->count++;
+     loc->hash[0] = hash[0];
+     loc->hash[1] = hash[1];
+     loc->offset = offset;
+     loc->length = length;
+     loc->path_id = path_id;
+     index->dirty = 1;
+ }
+ 
+ // Load a saved index; a missing or invalid file just means starting empty
+ void chunk_index_load(chunk_index *index, const char *index_path) {
+     memset(index, 0, sizeof(*index));
+     
+     FILE *f = fopen(index_path, "rb");
+     if (!f) return;
+     
+     uint32_t header[4];
+     if (fread(header, sizeof(header), 1, f) != 1 ||
+         header[0] != CHUNK_INDEX_MAGIC || header[1] != CHUNK_INDEX_VERSION) {
+         printf("Ignoring invalid chunk index: %s\n", index_path);
+         fclose(f);
+         return;
+     }
+     
+     // Paths are stored length-prefixed, in id order
+     int ok = 1;
+     for (uint32_t i = 0; ok && i < header[2]; i++) {
+         uint16_t length;
+         char path[MAX_PATH_LENGTH];
+         ok = fread(&length, sizeof(length), 1, f) == 1 && length < MAX_PATH_LENGTH &&
+              fread(path, 1, length, f) == length;
+         if (ok) {
+             path[length] = '\0';
+             ok = chunk_index_path_id(index, path) == (int)i;
+         }
+     }
+     
+     chunk_location loc;
+     for (uint32_t i = 0; ok && i < header[3] && fread(&loc, sizeof(loc), 1, f) == 1; i++) {
+         if (loc.length == 0 || loc.path_id < 0 || loc.path_id >= index->path_count) continue;
+         chunk_index_insert(index, loc.hash, loc.path_id, loc.offset, loc.length);
+     }
+     
+     if (!ok) printf("Chunk index %s is truncated, using what was read\n", index_path);
+     fclose(f);
+     index->dirty = 0;
+ }
+ 
+ int chunk_index_save(chunk_index *index, const char *index_path) {
+     FILE *f = fopen(index_path, "wb");
+     if (!f) {
+         printf("Error writing chunk index: %s\n", index_path);
+         return 0;
+     }
+     
+     uint32_t live = 0;
+     for (int i = 0; i < index->capacity; i++) {
+         if (index->entries[i].length != 0 && index->entries[i].path_id >= 0) live++;
+     }
+     
+     uint32_t header[4] = { CHUNK_INDEX_MAGIC, CHUNK_INDEX_VERSION, (uint32_t)index->path_count, live };
+     int ok = fwrite(header, sizeof(header), 1, f) == 1;
+     
+     for (int i = 0; ok && i < index->path_count; i++) {
+         uint16_t length = (uint16_t)strlen(index->paths[i]);
+         ok = fwrite(&length, sizeof(length), 1, f) == 1 && fwrite(index->paths[i], 1, length, f) == length;
+     }
+     
+     for (int i = 0; ok && i < index->capacity; i++) {
+         if (index->entries[i].length != 0 && index->entries[i].path_id >= 0)
+             ok = fwrite(&index->entries[i], sizeof(chunk_location), 1, f) == 1;
+     }
+     
+     if (fclose(f) != 0) ok = 0;
+     if (ok) index->dirty = 0;
+     return ok;
+ }
+ 
+ void chunk_index_free(chunk_index *index) {
+     free(index->entries);
+     free(index->paths);
+     free(index->path_slots);
+     memset(index, 0, sizeof(*index));
+ }
+ 
+ static int read_local_chunk(chunk_index *index, local_reader *reader, const chunk_location *loc,
+                             unsigned char *buffer) {
+     if (reader->file == INVALID_FILE || reader->path_id != loc->path_id) {
+         if (reader->file != INVALID_FILE) file_close(reader->file);
+         reader->file = file_open_read(index->paths[loc->path_id]);
+         reader->path_id = loc->path_id;
+         if (reader->file == INVALID_FILE) return 0;
+     }
+     
+     return file_pread(reader->file, buffer, loc->length, loc->offset) == (long long)loc->length;
+ }
+ 
+ // Next buffer in the ring, waiting for the write that last used it
+ static unsigned char *writer_next_buffer(server_context *ctx) {
+     file_writer *writer = &ctx->writer;
+     int i = writer->next;
+     
+     if (writer->owners[i]) {
+         io_wait(&ctx->io, &writer->requests[i]);
+         if (writer->requests[i].result != (long long)writer->lengths[i]) writer->owners[i]->failed = 1;
+         writer->owners[i] = NULL;
+     }
+     return writer->buffers[i];
+ }
+ 
+ // Queue the filled buffer to be written at offset in the stream's file
+ static void writer_submit_at(server_context *ctx, receive_stream *stream, uint32_t length, long long offset) {
+     file_writer *writer = &ctx->writer;
+     int i = writer->next;
+     
+     if (stream->file != INVALID_FILE) {
+         writer->lengths[i] = length;
+         writer->owners[i] = stream;
+         io_submit_write(&ctx->io, stream->file, i, writer->buffers[i], length, offset,
+                         &writer->requests[i]);
+         io_flush(&ctx->io);
+     }
+     writer->next = (i + 1) % WRITE_DEPTH;
+ }
+ 
+ // Queue the filled buffer to be written at the end of the stream's file
+ static void writer_submit(server_context *ctx, receive_stream *stream, uint32_t length) {
+     writer_submit_at(ctx, stream, length, stream->offset);
+     stream->offset += length;
+ }
+ 
+ // Wait for every queued write, so a file can be closed
+ static void writer_drain(server_context *ctx) {
+     for (int i = 0; i < WRITE_DEPTH; i++) {
+         ctx->writer.next = i;
+         writer_next_buffer(ctx);
+     }
+     ctx->writer.next = 0;
+ }
+ 
+ // Close a stream's file once its writes have landed, returns 0 if any of them failed
+ static int stream_close_file(server_context *ctx, receive_stream *stream) {
+     if (stream->file == INVALID_FILE) return 0;
+     
+     writer_drain(ctx);
+     file_close(stream->file);
+     stream->file = INVALID_FILE;
+     if (stream->failed) printf("Error writing %s\n", stream->target_path);
+     return !stream->failed;
+ }
+ 
+ static void stream_release(receive_stream *stream) {
+     free(stream->entries);
+     free(stream->plan);
+     free(stream->need);
+     memset(stream, 0, sizeof(*stream));
+     stream->file = INVALID_FILE;
+ }
+ 
+ // Take a ranged file away from the range connections once those writing into it are done.
+ // Returns 1 if every range arrived.
+ static int range_unregister(server_context *ctx, receive_stream *stream) {
+     if (!stream->ranged) return 1;
+     stream->ranged = 0;
+     
+     mutex_lock(&ctx->lock);
+     range_transfer *transfer = &ctx->ranges[stream - ctx->streams];
+     transfer->active = 0;
+     while (transfer->writers > 0) cond_wait(&ctx->changed, &ctx->lock);
+     int complete = transfer->received == transfer->range_count;
+     free(transfer->done);
+     memset(transfer, 0, sizeof(*transfer));
+     transfer->file = INVALID_FILE;
+     mutex_unlock(&ctx->lock);
+     return complete;
+ }
+ 
+ // Give up on an unfinished stream; its temp file goes, the target stays as it was
+ static void stream_abandon(server_context *ctx, receive_stream *stream) {
+     range_unregister(ctx, stream);
+     stream_close_file(ctx, stream);
+     if (stream->temp_path[0]) file_delete(stream->temp_path);
+     stream_release(stream);
+ }
+ 
+ // Remember that the directory holding path changed, so the batch syncs it
+ static void mark_dir_dirty(server_context *ctx, const char *path) {
+     char parent[MAX_PATH_LENGTH];
+     
+     memcpy(parent, path, strlen(path) + 1);
+     char *sep = strrchr(parent, PATH_SEP);
+     if (!sep) return;
+     *sep = '\0';
+     
+     for (int i = 0; i < ctx->dirty_dir_count; i++) {
+         if (strcmp(ctx->dirty_dirs[i], parent) == 0) return;
+     }
+     if (ctx->dirty_dir_count == COMMIT_BATCH_DIRS) {
+         // Too many to batch; sync this one right away
+         if (ctx->durability != DURABILITY_NONE) dir_sync(parent);
+         return;
+     }
+     memcpy(ctx->dirty_dirs[ctx->dirty_dir_count++], parent, strlen(parent) + 1);
+ }
+ 
+ static int pending_has(const server_context *ctx, const char *target_path) {
+     for (int i = 0; i < ctx->pending_count; i++) {
+         if (strcmp(ctx->pending[i].target_path, target_path) == 0) return 1;
+     }
+     return 0;
+ }
+ 
+ // Make the batch durable and move its files into place. File data reaches the disk before
+ // any rename, so a rename never exposes contents a crash could lose; directories are synced
+ // last so the renames and deletes survive a crash as well.
+ void server_commit(server_context *ctx) {
+     if (ctx->pending_count == 0 && ctx->dirty_dir_count == 0) return;
+     
+     long long start = profile_now();
+     durability_mode mode = ctx->durability;
+     int file_count = ctx->pending_count;
+     
+     if (mode == DURABILITY_SYNCFS && file_count > 0 && !fs_sync(ctx->target_dir)) {
+         mode = DURABILITY_BATCH; // No syncfs here, sync file by file instead
+     }
+     for (int i = 0; i < file_count; i++) {
+         pending_file *p = &ctx->pending[i];
+         if (mode == DURABILITY_BATCH) {
+             io_submit_fsync(&ctx->io, p->file, &p->sync_req);
+         } else {
+             p->sync_req.result = 0;
+             p->sync_req.done = 1;
+         }
+     }
+     io_flush(&ctx->io);
+     
+     for (int i = 0; i < file_count; i++) {
+         pending_file *p = &ctx->pending[i];
+         io_wait(&ctx->io, &p->sync_req);
+         file_close(p->file);
+         
+         if (p->sync_req.result == 0 && file_replace(p->temp_path, p->target_path)) {
+             ctx->applied++;
+             mark_dir_dirty(ctx, p->target_path);
+             
+             // The new file is now the best local copy of all its chunks
+             if (p->entries) {
+                 int path_id = chunk_index_path_id(&ctx->index, p->target_path);
+                 long long offset = 0;
+                 for (uint32_t j = 0; j < p->count; j++) {
+                     chunk_index_insert(&ctx->index, p->entries[j].hash, path_id, offset, p->entries[j].length);
+                     offset += p->entries[j].length;
+                 }
+             }
+         } else {
+             printf("Error committing %s: %lu\n", p->target_path, last_error());
+             file_delete(p->temp_path);
+             ctx->failed++;
+         }
+         free(p->entries);
+     }
+     ctx->pending_count = 0;
+     ctx->pending_bytes = 0;
+     
+     // A second syncfs covers the renames; otherwise sync each directory that changed
+     int dir_count = 0;
+     if (mode == DURABILITY_BATCH || (mode == DURABILITY_SYNCFS && !fs_sync(ctx->target_dir))) {
+         for (int i = 0; i < ctx->dirty_dir_count; i++) dir_count += dir_sync(ctx->dirty_dirs[i]);
+     }
+     ctx->dirty_dir_count = 0;
+     
+     long long end = profile_end(STAGE_COMMIT, start);
+     printf("Committed %d files, synced %d directories in %.1f ms\n",
+            file_count, dir_count, (end - start) / 1e6);
+ }
+ 
+ // A stream received completely: its temp file joins the batch awaiting commit
+ static void stream_commit(server_context *ctx, receive_stream *stream) {
+     writer_drain(ctx);
+     
+     // A trailing hole still has to count towards the size
+     if (stream->hole_bytes > 0 && stream->file != INVALID_FILE && !file_set_size(stream->file, stream->offset)) {
+         stream->failed = 1;
+     }
+     if (stream->file == INVALID_FILE || stream->failed) {
+         if (stream->failed) printf("Error writing %s\n", stream->target_path);
+         stream_abandon(ctx, stream);
+         ctx->failed++;
+         return;
+     }
+     if (stream->hole_bytes > 0) {
+         printf("Received %s sparse, %.1f of %.1f MB were holes\n", stream->target_path,
+                stream->hole_bytes / 1048576.0, stream->offset / 1048576.0);
+     }
+     
+     pending_file *p = &ctx->pending[ctx->pending_count++];
+     memcpy(p->temp_path, stream->temp_path, sizeof(p->temp_path));
+     memcpy(p->target_path, stream->target_path, sizeof(p->target_path));
+     p->file = stream->file;
+     p->entries = stream->dedup ? stream->entries : NULL;
+     p->count = stream->dedup ? stream->count : 0;
+     if (stream->dedup) stream->entries = NULL;
+     ctx->pending_bytes += stream->offset - stream->hole_bytes;
+     
+     stream->file = INVALID_FILE;
+     stream_release(stream);
+     
+     if (ctx->pending_count == COMMIT_BATCH_FILES || ctx->pending_bytes >= COMMIT_BATCH_BYTES) {
+         server_commit(ctx);
+     }
+ }
+ 
+ int server_context_init(server_context *ctx, const char *target_dir, const char *index_path,
+                         durability_mode durability) {
+     memset(ctx, 0, sizeof(*ctx));
+     ctx->target_dir = target_dir;
+     ctx->replica_path = REPLICA_FILE;
+     ctx->durability = durability;
+     ctx->reader.path_id = -1;
+     ctx->reader.file = INVALID_FILE;
+     for (int i = 0; i < MAX_STREAMS; i++) {
+         ctx->streams[i].file = INVALID_FILE;
+         ctx->ranges[i].file = INVALID_FILE;
+     }
+     mutex_init(&ctx->session_lock);
+     mutex_init(&ctx->lock);
+     cond_init(&ctx->changed);
+     chunk_index_load(&ctx->index, index_path);
+     io_engine_init(&ctx->io, IO_QUEUE_DEPTH);
+     
+     ctx->encoded = (unsigned char *)malloc(ENCODED_BUFFER_SIZE);
+     ctx->scratch = (unsigned char *)malloc(BUFFER_SIZE);
+     ctx->pending = (pending_file *)calloc(COMMIT_BATCH_FILES, sizeof(pending_file));
+     ctx->dirty_dirs = (char (*)[MAX_PATH_LENGTH])calloc(COMMIT_BATCH_DIRS, MAX_PATH_LENGTH);
+     int ok = ctx->encoded && ctx->scratch && ctx->pending && ctx->dirty_dirs;
+     for (int i = 0; i < WRITE_DEPTH; i++) {
+         ctx->writer.buffers[i] = (unsigned char *)malloc(BUFFER_SIZE);
+         ok = ok && ctx->writer.buffers[i];
+     }
+     if (!ok) {
+         printf("Memory allocation failed\n");
+         return 0;
+     }
+     
+     io_engine_register_buffers(&ctx->io, ctx->writer.buffers, BUFFER_SIZE, WRITE_DEPTH);
+     return 1;
+ }
+ 
+ // Abandon whatever a connection left unfinished and commit what it completed
+ void server_end_session(server_context *ctx) {
+     for (int i = 0; i < MAX_STREAMS; i++) {
+         if (ctx->streams[i].active) {
+             printf("Transfer of %s was cut off\n", ctx->streams[i].target_path);
+             stream_abandon(ctx, &ctx->streams[i]);
+             ctx->failed++;
+         }
+     }
+     // What did arrive completely is still worth keeping
+     server_commit(ctx);
+     if (ctx->reader.file != INVALID_FILE) file_close(ctx->reader.file);
+     ctx->reader.file = INVALID_FILE;
+     ctx->reader.path_id = -1;
+ }
+ 
+ void server_context_destroy(server_context *ctx) {
+     server_end_session(ctx);
+     io_engine_destroy(&ctx->io);
+     chunk_index_free(&ctx->index);
+     for (int i = 0; i < WRITE_DEPTH; i++) free(ctx->writer.buffers[i]);
+     free(ctx->encoded);
+     free(ctx->scratch);
+     free(ctx->pending);
+     free(ctx->dirty_dirs);
+     mutex_destroy(&ctx->session_lock);
+     mutex_destroy(&ctx->lock);
+     cond_destroy(&ctx->changed);
+     memset(ctx, 0, sizeof(*ctx));
+ }
+ 
+ // Answer a deduplicated file's manifest and create the temp file it is assembled in.
+ // Only chunks whose local copy still matches are claimed, so assembly can never go wrong.
+ static int stream_begin_dedup(server_context *ctx, SOCKET sock, receive_stream *stream) {
+     chunk_index *index = &ctx->index;
+     uint32_t count;
+     
+     if (!recv_all(sock, &count, sizeof(count)) || count > DEDUP_MAX_CHUNKS) {
+         printf("Error receiving chunk manifest: %d\n", WSAGetLastError());
+         return 0;
+     }
+     
+     stream->count = count;
+     stream->entries = (dedup_entry *)malloc((count > 0 ? count : 1) * sizeof(dedup_entry));
+     stream->plan = (chunk_location *)malloc((count > 0 ? count : 1) * sizeof(chunk_location));
+     stream->need = (unsigned char *)malloc(count > 0 ? count : 1);
+     if (!stream->entries || !stream->plan || !stream->need) {
+         printf("Memory allocation failed\n");
+         return 0;
+     }
+     if (!recv_all(sock, stream->entries, (int)(count * sizeof(dedup_entry))) ||
+         !chunk_index_reserve(index, index->count + (int)count)) {
+         return 0;
+     }
+     
+     uint32_t missing = 0;
+     for (uint32_t i = 0; i < count; i++) {
+         dedup_entry *entry = &stream->entries[i];
+         stream->need[i] = 1;
+         if (entry->length == 0 || entry->length > CDC_MAX_SIZE) {
+             printf("Invalid chunk manifest for %s\n", stream->target_path);
+             return 0;
+         }
+         
+         chunk_location *loc = chunk_index_slot(index, entry->hash);
+         if (loc->length == entry->length && loc->path_id >= 0) {
+             uint64_t hash[2];
+             if (read_local_chunk(index, &ctx->reader, loc, ctx->scratch)) {
+                 chunk_hash(ctx->scratch, loc->length, hash);
+                 if (hash[0] == entry->hash[0] && hash[1] == entry->hash[1]) {
+                     stream->need[i] = 0;
+                     stream->plan[i] = *loc;
+                 }
+             }
+             if (stream->need[i]) {
+                 // The local copy moved or changed, forget it
+                 loc->path_id = -1;
+                 index->dirty = 1;
+             }
+         }
+         missing += stream->need[i];
+     }
+     
+     if (!send_all(sock, stream->need, (int)count)) return 0;
+     printf("Reusing %u of %u chunks for %s\n", count - missing, count, stream->target_path);
+     
+     stream->file = file_create(stream->temp_path);
+     if (stream->file == INVALID_FILE) {
+         printf("Error creating temp file: %lu\n", last_error());
+     }
+     return 1;
+ }
+ 
+ // Create a ranged file's temp file now and hand it to the range connections; the stream
+ // itself only carries the end frame once the client has all ranges confirmed
+ static int stream_begin_ranges(server_context *ctx, receive_stream *stream, const sync_record *change) {
+     long long size = change->data_size;
+     if (size <= 0) {
+         printf("Invalid ranged transfer for %s\n", stream->target_path);
+         return 0;
+     }
+     
+     int range_count = (int)((size + PARALLEL_RANGE_SIZE - 1) / PARALLEL_RANGE_SIZE);
+     unsigned char *done = (unsigned char *)calloc(range_count, 1);
+     if (!done) {
+         printf("Memory allocation failed\n");
+         return 0;
+     }
+     
+     stream->opened = 1;
+     stream->ranged = 1;
+     stream->offset = size;
+     stream->file = file_create(stream->temp_path);
+     if (stream->file == INVALID_FILE) {
+         // Ranges are still registered so they get refused instead of waiting for a file
+         printf("Error creating temp file: %lu\n", last_error());
+     }
+     
+     mutex_lock(&ctx->lock);
+     range_transfer *transfer = &ctx->ranges[change->stream];
+     transfer->active = 1;
+     transfer->id = change->transfer_id;
+     transfer->file = stream->file;
+     transfer->size = size;
+     transfer->done = done;
+     transfer->range_count = range_count;
+     transfer->received = 0;
+     transfer->writers = 0;
+     cond_broadcast(&ctx->changed);
+     mutex_unlock(&ctx->lock);
+     return 1;
+ }
+ 
+ // Open the stream a data-carrying record announces; returns 0 if the connection is out of sync
+ static int stream_begin(server_context *ctx, SOCKET sock, const sync_record *change, const char *target_path) {
+     if (change->stream < 0 || change->stream >= MAX_STREAMS || ctx->streams[change->stream].active) {
+         printf("Invalid stream %d for %s\n", change->stream, target_path);
+         return 0;
+     }
+     
+     receive_stream *stream = &ctx->streams[change->stream];
+     stream_release(stream);
+     stream->active = 1;
+     stream->dedup = change->transfer_mode == TRANSFER_DEDUP;
+     memcpy(stream->target_path, target_path, strlen(target_path) + 1);
+     snprintf(stream->temp_path, sizeof(stream->temp_path), "%s.dsync-tmp", target_path);
+     
+     if (change->transfer_mode == TRANSFER_RANGES) return stream_begin_ranges(ctx, stream, change);
+     return stream->dedup ? stream_begin_dedup(ctx, sock, stream) : 1;
+ }
+ 
+ // Copy a verified run of local chunks, one contiguous range of the reader's file, into the
+ // stream's file at offset. The kernel copies it where it can, reflinking on filesystems that
+ // share extents; otherwise, or for what it left, the data goes through the writer.
+ static void copy_local_run(server_context *ctx, receive_stream *stream, long long source,
+                            long long offset, long long length) {
+     if (length == 0 || stream->file == INVALID_FILE) return;
+     
+     long long copied = file_copy_range(ctx->reader.file, source, stream->file, offset, length);
+     if (copied < 0) {
+         printf("In-kernel copies unavailable, copying local chunks through memory\n");
+         ctx->no_copy_range = 1;
+         copied = 0;
+     }
+     
+     while (copied < length) {
+         uint32_t n = length - copied < BUFFER_SIZE ? (uint32_t)(length - copied) : BUFFER_SIZE;
+         unsigned char *data = writer_next_buffer(ctx);
+         if (file_pread(ctx->reader.file, data, n, source + copied) != (long long)n) {
+             printf("Error reading local chunk for %s\n", stream->target_path);
+             stream->aborted = 1;
+             return;
+         }
+         writer_submit_at(ctx, stream, n, offset + copied);
+         copied += n;
+     }
+ }
+ 
+ // Copy the local chunks that come before the next one the sender has for us. Each one is
+ // verified first, since another stream may have replaced the source since the manifest was
+ // answered; contiguous chunks of one source are then copied as a single run.
+ static void dedup_copy_local(server_context *ctx, receive_stream *stream) {
+     int in_kernel = !ctx->no_copy_range;
+     int run_path = -1;
+     long long run_source = 0, run_offset = 0, run_length = 0;
+     
+     while (!stream->aborted && stream->next < stream->count && !stream->need[stream->next]) {
+         const chunk_location *loc = &stream->plan[stream->next];
+         const dedup_entry *entry = &stream->entries[stream->next];
+         unsigned char *data = in_kernel ? ctx->scratch : writer_next_buffer(ctx);
+         uint64_t hash[2];
+         
+         // The reader only holds one source open, so a run ends where the source changes
+         if (run_length > 0 && (loc->path_id != run_path || loc->offset != run_source + run_length)) {
+             copy_local_run(ctx, stream, run_source, run_offset, run_length);
+             run_length = 0;
+             if (stream->aborted) break;
+         }
+         
+         if (!read_local_chunk(&ctx->index, &ctx->reader, loc, data)) {
+             printf("Error reading local chunk for %s\n", stream->target_path);
+             stream->aborted = 1;
+             break;
+         }
+         chunk_hash(data, entry->length, hash);
+         if (hash[0] != entry->hash[0] || hash[1] != entry->hash[1]) {
+             printf("Local chunk changed while assembling %s\n", stream->target_path);
+             stream->aborted = 1;
+             break;
+         }
+         
+         if (in_kernel) {
+             if (run_length == 0) {
+                 run_path = loc->path_id;
+                 run_source = loc->offset;
+                 run_offset = stream->offset;
+             }
+             run_length += entry->length;
+             stream->offset += entry->length;
+         } else {
+             writer_submit(ctx, stream, entry->length);
+         }
+         stream->next++;
+     }
+     
+     if (!stream->aborted) copy_local_run(ctx, stream, run_source, run_offset, run_length);
+ }
+ 
+ // End frame of a stream: the finished file waits in the batch for its commit
+ static void stream_finish(server_context *ctx, receive_stream *stream) {
+     if (stream->ranged && !range_unregister(ctx, stream) && !stream->aborted) {
+         printf("Missing ranges for %s\n", stream->target_path);
+         stream->aborted = 1;
+     }
+     if (stream->dedup) {
+         dedup_copy_local(ctx, stream);
+         if (!stream->aborted && stream->next != stream->count) {
+             printf("Missing chunks for %s\n", stream->target_path);
+             stream->aborted = 1;
+         }
+     }
+     
+     if (stream->aborted) {
+         stream_abandon(ctx, stream);
+         ctx->failed++;
+         return;
+     }
+     stream_commit(ctx, stream);
+ }
+ 
+ // Handle one chunk frame whose header has been read; returns 0 if the connection is out of sync
+ int receive_chunk(server_context *ctx, SOCKET sock, const chunk_header *header) {
+     if (header->stream >= MAX_STREAMS || !ctx->streams[header->stream].active) {
+         printf("Chunk for unknown stream %u\n", header->stream);
+         return 0;
+     }
+     receive_stream *stream = &ctx->streams[header->stream];
+     
+     if (header->codec == CHUNK_ABORT) {
+         printf("Sender could not read %s, leaving it unchanged\n", stream->target_path);
+         stream_abandon(ctx, stream);
+         return 1;
+     }
+     
+     if (stream->ranged ? header->raw_size != 0 :
+         header->codec == CHUNK_HOLE ? (stream->dedup || header->encoded_size != 0) :
+         (header->raw_size > BUFFER_SIZE || header->encoded_size > ENCODED_BUFFER_SIZE)) {
+         printf("Invalid chunk for %s\n", stream->target_path);
+         return 0;
+     }
+     
+     // Open lazily so an aborted transfer leaves no temp file behind
+     if (!stream->dedup && !stream->opened) {
+         stream->opened = 1;
+         stream->file = file_create(stream->temp_path);
+         if (stream->file == INVALID_FILE) {
+             printf("Error creating temp file: %lu\n", last_error());
+         }
+     }
+     
+     if (header->raw_size == 0) {
+         stream_finish(ctx, stream);
+         return 1;
+     }
+     
+     // A hole is skipped, never written, so the temp file stays sparse there
+     if (header->codec == CHUNK_HOLE) {
+         if (stream->hole_bytes == 0 && stream->file != INVALID_FILE) file_make_sparse(stream->file);
+         stream->offset += header->raw_size;
+         stream->hole_bytes += header->raw_size;
+         return 1;
+     }
+     
+     if (!recv_all(sock, ctx->encoded, (int)header->encoded_size)) {
+         printf("Error receiving file data: %d\n", WSAGetLastError());
+         return 0;
+     }
+     if (stream->aborted) return 1;
+     
+     const dedup_entry *entry = NULL;
+     if (stream->dedup) {
+         dedup_copy_local(ctx, stream);
+         if (stream->aborted) return 1;
+         if (stream->next == stream->count || header->raw_size != stream->entries[stream->next].length) {
+             printf("Chunk does not match the manifest of %s\n", stream->target_path);
+             stream->aborted = 1;
+             return 1;
+         }
+         entry = &stream->entries[stream->next];
+     }
+     
+     // Decode straight into a writer buffer so the disk write overlaps receiving the next frame
+     unsigned char *raw = writer_next_buffer(ctx);
+     int decoded = decode_chunk(header->codec, ctx->encoded, (int)header->encoded_size, raw, (int)header->raw_size);
+     if (decoded != (int)header->raw_size) {
+         printf("Error decoding chunk for %s\n", stream->target_path);
+         return 0;
+     }
+     
+     if (entry) {
+         // Verify what arrived against the manifest before it goes into the index
+         uint64_t hash[2];
+         chunk_hash(raw, header->raw_size, hash);
+         if (hash[0] != entry->hash[0] || hash[1] != entry->hash[1]) {
+             printf("Chunk hash mismatch for %s\n", stream->target_path);
+             stream->aborted = 1;
+             return 1;
+         }
+         stream->next++;
+     }
+     
+     writer_submit(ctx, stream, (uint32_t)decoded);
+     return 1;
+ }
+ 
+ // Join a wire path onto target_dir. Wire paths are relative to the synced root and use '/';
+ // anything absolute or climbing out with ".." is refused.
+ static int resolve_target_path(const char *target_dir, const char *wire_path, char *target_path) {
+     char relative[MAX_PATH_LENGTH];
+     
+     strncpy(relative, wire_path, MAX_PATH_LENGTH - 1);
+     relative[MAX_PATH_LENGTH - 1] = '\0';
+     for (char *p = relative; *p; p++) {
+         if (*p == '/' || *p == '\\') *p = PATH_SEP;
+     }
+     
+     if (relative[0] == '\0' || relative[0] == PATH_SEP || strchr(relative, ':')) return 0;
+     
+     const char *component = relative;
+     while (component) {
+         const char *next = strchr(component, PATH_SEP);
+         size_t length = next ? (size_t)(next - component) : strlen(component);
+         if (length == 2 && component[0] == '.' && component[1] == '.') return 0;
+         component = next ? next + 1 : NULL;
+     }
+     
+     int written = snprintf(target_path, MAX_PATH_LENGTH, "%s%c%s", target_dir, PATH_SEP, relative);
+     return written > 0 && written < MAX_PATH_LENGTH;
+ }
+ 
+ // Apply one received change to the target directory. A file's data arrives later as chunk
+ // frames on its stream. Returns 0 if the connection can no longer be trusted to be in sync.
+ int apply_change(sync_record *change, SOCKET data_socket, server_context *ctx) {
+     char target_path[MAX_PATH_LENGTH];
+     char* normalized_target = normalize_path(ctx->target_dir);
+     size_t root_length = strlen(normalized_target);
+     int ok = 1;
+     
+     change->file.path[MAX_PATH_LENGTH - 1] = '\0';
+     if (!resolve_target_path(normalized_target, change->file.path, target_path)) {
+         printf("Rejecting unsafe path: %s\n", change->file.path);
+         free(normalized_target);
+         ctx->failed++;
+         // File data would follow the record; without a place to put it the stream is lost
+         return change->operation == SYNC_DELETE || change->file.is_directory;
+     }
+     
+     printf("Processing %s -> %s\n", change->file.path, target_path);
+     
+     // A finished copy of this path still awaits its rename, put it in place first
+     if (pending_has(ctx, target_path)) server_commit(ctx);
+     
+     // Make sure the parent directories exist below the target root
+     for (char *p = target_path + root_length + 1; *p; p++) {
+         if (*p == PATH_SEP) {
+             *p = '\0';
+             if (make_dir(target_path)) mark_dir_dirty(ctx, target_path); // Doesn't error if directory exists
+             *p = PATH_SEP;
+         }
+     }
+     
+     switch (change->operation) {
+         case SYNC_CREATE:
+         case SYNC_MODIFY:
+             if (change->file.is_directory) {
+                 // Create directory if it doesn't exist
+                 if (make_dir(target_path)) mark_dir_dirty(ctx, target_path);
+                 ctx->applied++;
+             } else {
+                 // Create or modify file from the chunks that follow on its stream
+                 ok = stream_begin(ctx, data_socket, change, target_path);
+             }
+             break;
+             
+         case SYNC_DELETE:
+             if (change->file.is_directory) {
+                 // Remove directory
+                 remove_dir(target_path);
+             } else {
+                 // Delete file
+                 file_delete(target_path);
+             }
+             mark_dir_dirty(ctx, target_path);
+             ctx->applied++;
+             break;
+     }
+     
+     free(normalized_target);
+     return ok;
+ }
+ 
+ // Listen for sync connections on SERVER_PORT of the given IPv4 address
+ SOCKET server_listen(unsigned long address) {
+     struct sockaddr_in server_addr;
+     
+     // Create socket
+     SOCKET server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+     if (server_socket == INVALID_SOCKET) {
+         printf("Error creating socket: %d\n", WSAGetLastError());
+         return INVALID_SOCKET;
+     }
+     
+     // Configure server address
+     memset(&server_addr, 0, sizeof(server_addr));
+     server_addr.sin_family = AF_INET;
+     server_addr.sin_addr.s_addr = htonl(address);
+     server_addr.sin_port = htons(SERVER_PORT);
+     
+     // Allow quick restarts while old connections sit in TIME_WAIT
+     int reuse = 1;
+     setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
+     
+     // Bind socket
+     if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
+         printf("Error binding socket: %d\n", WSAGetLastError());
+         closesocket(server_socket);
+         return INVALID_SOCKET;
+     }
+     
+     // Listen for connections
+     if (listen(server_socket, 5) == SOCKET_ERROR) {
+         printf("Error listening: %d\n", WSAGetLastError());
+         closesocket(server_socket);
+         return INVALID_SOCKET;
+     }
+     return server_socket;
+ }
+ 
+ // Serve one connection: records and the interleaved chunk frames of their files, until the
+ // session ends. The type of the first message has already been read. Returns 1 if the
+ // session ran to its end and was acknowledged.
+ int server_session(server_context *ctx, SOCKET client_socket, uint32_t type, const char *index_path) {
+     sync_record change;
+     wire_record record;
+     int change_count = 0;
+     int completed = 0;
+     
+     ctx->applied = 0;
+     ctx->failed = 0;
+     while (1) {
+         if (type == MSG_DONE) {
+             // Only acknowledge once everything applied is durable
+             server_end_session(ctx);
+             session_ack ack = { MSG_ACK, ctx->applied, ctx->failed, 0 };
+             printf("Session complete, %d changes, %u applied, %u failed\n",
+                    change_count, ctx->applied, ctx->failed);
+             if (!send_all(client_socket, &ack, sizeof(ack))) {
+                 printf("Error sending acknowledgement: %d\n", WSAGetLastError());
+             } else {
+                 completed = 1;
+             }
+             break;
+         } else if (type == MSG_RECORD) {
+             if (!recv_all(client_socket, &record, sizeof(record))) {
+                 printf("Error receiving change record: %d\n", WSAGetLastError());
+                 break;
+             }
+             record_from_wire(&record, &change);
+             change_count++;
+             
+             // Apply each change as it arrives so file data streams straight to disk
+             long long start = profile_now();
+             if (!apply_change(&change, client_socket, ctx)) {
+                 break;
+             }
+             profile_end(STAGE_APPLY, start);
+         } else if (type == MSG_CHUNK) {
+             chunk_header header;
+             header.type = type;
+             if (!recv_all(client_socket, &header.stream, sizeof(header) - sizeof(header.type))) {
+                 printf("Error receiving chunk header: %d\n", WSAGetLastError());
+                 break;
+             }
+             long long start = profile_now();
+             if (!receive_chunk(ctx, client_socket, &header)) {
+                 break;
+             }
+             profile_end(STAGE_RECEIVE, start);
+         } else {
+             printf("Unknown message type %u\n", type);
+             break;
+         }
+         
+         if (!recv_all(client_socket, &type, sizeof(type))) {
+             printf("Error receiving message: %d\n", WSAGetLastError());
+             break;
+         }
+     }
+     
+     server_end_session(ctx);
+     if (ctx->index.dirty) chunk_index_save(&ctx->index, index_path);
+     return completed;
+ }
+ 
+ // Find the registered transfer a range belongs to, waiting a while for its record to arrive on
+ // the session, and count this connection as writing into it. Returns NULL if the range has no
+ // place to go.
+ static range_transfer *range_claim(server_context *ctx, const range_header *header) {
+     long long deadline = now_ns() + RANGE_WAIT_MS * 1000000LL;
+     range_transfer *transfer = NULL;
+     
+     mutex_lock(&ctx->lock);
+     while (1) {
+         for (int i = 0; i < MAX_STREAMS && !transfer; i++) {
+             if (ctx->ranges[i].active && ctx->ranges[i].id == header->transfer_id) transfer = &ctx->ranges[i];
+         }
+         long long left = deadline - now_ns();
+         if (transfer || left <= 0) break;
+         cond_wait_ms(&ctx->changed, &ctx->lock, (int)(left / 1000000) + 1);
+     }
+     
+     if (!transfer) {
+         printf("Range for unknown transfer %016llx\n", (unsigned long long)header->transfer_id);
+     } else {
+         // Ranges have fixed boundaries, so a resent one can only land where the first did
+         long long index = header->offset / PARALLEL_RANGE_SIZE;
+         long long expected = transfer->size - header->offset;
+         if (expected > PARALLEL_RANGE_SIZE) expected = PARALLEL_RANGE_SIZE;
+         if (header->offset % PARALLEL_RANGE_SIZE != 0 || index >= transfer->range_count ||
+             header->length != expected) {
+             printf("Invalid range at %lld of %lld bytes\n", (long long)header->offset, (long long)header->length);
+             transfer = NULL;
+         } else {
+             transfer->writers++;
+         }
+     }
+     mutex_unlock(&ctx->lock);
+     return transfer;
+ }
+ 
+ static void range_release(server_context *ctx, range_transfer *transfer, long long offset, int written) {
+     mutex_lock(&ctx->lock);
+     int index = (int)(offset / PARALLEL_RANGE_SIZE);
+     if (written && !transfer->done[index]) {
+         transfer->done[index] = 1;
+         transfer->received++;
+     }
+     transfer->writers--;
+     cond_broadcast(&ctx->changed);
+     mutex_unlock(&ctx->lock);
+ }
+ 
+ // Serve a range connection: each range is written where it belongs in its file and answered
+ // with whether it arrived intact. A range without a place to go is read and refused, so the
+ // connection stays usable for the next one. The type of the first message has been read.
+ static void serve_ranges(server_context *ctx, SOCKET sock) {
+     unsigned char *buffer = (unsigned char *)malloc(BUFFER_SIZE);
+     uint32_t type = MSG_RANGE;
+     
+     while (buffer && type == MSG_RANGE) {
+         range_header header;
+         if (!recv_all(sock, &header.reserved, sizeof(header) - sizeof(header.type))) break;
+         if (header.offset < 0 || header.length <= 0 || header.length > PARALLEL_RANGE_SIZE) {
+             printf("Invalid range at %lld of %lld bytes\n", (long long)header.offset, (long long)header.length);
+             break;
+         }
+         
+         range_transfer *transfer = range_claim(ctx, &header);
+         file_handle file = transfer ? transfer->file : INVALID_FILE;
+         int written = file != INVALID_FILE;
+         int connected = 1;
+         xxh64_state hash;
+         xxh64_reset(&hash, 0);
+         
+         for (long long done = 0; done < header.length; ) {
+             int n = header.length - done < BUFFER_SIZE ? (int)(header.length - done) : BUFFER_SIZE;
+             if (!recv_all(sock, buffer, n)) {
+                 connected = 0;
+                 break;
+             }
+             xxh64_update(&hash, buffer, n);
+             if (written && file_pwrite(file, buffer, n, header.offset + done) != n) {
+                 printf("Error writing range at %lld: %lu\n", (long long)header.offset, last_error());
+                 written = 0;
+             }
+             done += n;
+         }
+         
+         uint64_t digest = 0;
+         if (connected && !recv_all(sock, &digest, sizeof(digest))) connected = 0;
+         if (connected && written && digest != xxh64_digest(&hash)) {
+             printf("Range at %lld failed verification\n", (long long)header.offset);
+             written = 0;
+         }
+         if (transfer) range_release(ctx, transfer, header.offset, written && connected);
+         
+         uint32_t status = (uint32_t)written;
+         if (!connected || !send_all(sock, &status, sizeof(status)) || !recv_all(sock, &type, sizeof(type))) break;
+     }
+     free(buffer);
+ }
+ 
+ // A connection served on its own thread
+ typedef struct {
+     server_context *ctx;
+     SOCKET sock;
+     const char *index_path;
+     char client_ip[INET_ADDRSTRLEN];
+ } server_connection;
+ 
+ // Tell range connections, sessions and two-way sessions apart by their first message
+ static thread_result THREAD_CALL serve_connection(void *arg) {
+     server_connection *conn = (server_connection *)arg;
+     server_context *ctx = conn->ctx;
+     uint32_t type;
+     
+     if (!recv_all(conn->sock, &type, sizeof(type))) {
+         printf("Error receiving message: %d\n", WSAGetLastError());
+     } else if (type == MSG_RANGE) {
+         serve_ranges(ctx, conn->sock);
+     } else if (type == MSG_RECONCILE) {
+         mutex_lock(&ctx->session_lock);
+         printf("Two-way connection accepted from %s\n", conn->client_ip);
+         server_reconcile(ctx, conn->sock, conn->index_path);
+         mutex_unlock(&ctx->session_lock);
+     } else {
+         // Sessions share the streams, the batch and the index, so they take turns
+         mutex_lock(&ctx->session_lock);
+         printf("Connection accepted from %s\n", conn->client_ip);
+         server_session(ctx, conn->sock, type, conn->index_path);
+         mutex_unlock(&ctx->session_lock);
+     }
+     closesocket(conn->sock);
+     
+     mutex_lock(&ctx->lock);
+     ctx->connections--;
+     cond_broadcast(&ctx->changed);
+     mutex_unlock(&ctx->lock);
+     free(conn);
+     profile_release();
+     return (thread_result)0;
+ }
+ 
+ // Accept connections until *stop is set, each on a thread of its own, then wait for them
+ void server_run(server_context *ctx, SOCKET listen_socket, const char *index_path, volatile int *stop) {
+     while (1) {
+         struct sockaddr_in client_addr;
+         socklen_t client_len = sizeof(client_addr);
+         SOCKET client_socket = accept(listen_socket, (struct sockaddr *)&client_addr, &client_len);
+         if (*stop) {
+             if (client_socket != INVALID_SOCKET) closesocket(client_socket);
+             break;
+         }
+         if (client_socket == INVALID_SOCKET) {
+             printf("Error accepting connection: %d\n", WSAGetLastError());
+             continue;
+         }
+         
+         server_connection *conn = (server_connection *)malloc(sizeof(server_connection));
+         if (!conn) {
+             printf("Memory allocation failed\n");
+             closesocket(client_socket);
+             continue;
+         }
+         conn->ctx = ctx;
+         conn->sock = client_socket;
+         conn->index_path = index_path;
+         strcpy(conn->client_ip, inet_ntoa(client_addr.sin_addr));
+         
+         mutex_lock(&ctx->lock);
+         ctx->connections++;
+         mutex_unlock(&ctx->lock);
+         
+         thread_handle thread;
+         if (thread_start(&thread, serve_connection, conn)) {
+             thread_detach(thread);
+         } else {
+             printf("Error starting connection thread\n");
+             closesocket(client_socket);
+             free(conn);
+             mutex_lock(&ctx->lock);
+             ctx->connections--;
+             mutex_unlock(&ctx->lock);
+         }
+     }
+     
+     mutex_lock(&ctx->lock);
+     while (ctx->connections > 0) cond_wait(&ctx->changed, &ctx->lock);
+     mutex_unlock(&ctx->lock);
+ }
+ 
+ // Connect to the sync server, INVALID_SOCKET if it cannot be reached
+ SOCKET connect_server(const char *server_ip) {
+     SOCKET sock;
+     struct sockaddr_in server_addr;
+     
+     // Create socket
+     sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+     if (sock == INVALID_SOCKET) {
+         printf("Error creating socket: %d\n", WSAGetLastError());
+         return INVALID_SOCKET;
+     }
+     
+     // Configure server address
+     memset(&server_addr, 0, sizeof(server_addr));
+     server_addr.sin_family = AF_INET;
+     server_addr.sin_addr.s_addr = inet_addr(server_ip);
+     server_addr.sin_port = htons(SERVER_PORT);
+     
+     // Connect to server
+     if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
+         printf("Error connecting to server: %d\n", WSAGetLastError());
+         closesocket(sock);
+         return INVALID_SOCKET;
+     }
+     return sock;
+ }
+ 
+ // Send the scheduler's queue as a session over an open connection and wait for the other
+ // side to acknowledge it. Large files may go out on range connections beside it.
+ int send_queued_changes(sync_scheduler *sched, SOCKET sock, sync_session *session, compress_pool *pool,
+                         session_ack *ack) {
+     // Send every queued change, then close the session
+     uint32_t done = MSG_DONE;
+     int sent = scheduler_run(sched, sock, pool, session) && send_all(sock, &done, sizeof(done));
+     range_sender_stop(&sched->ranges);
+     if (!sent) return 0;
+     
+     compress_pool_report(pool);
+     scheduler_report(sched);
+     range_sender_report(&sched->ranges);
+     
+     // The answer comes once the changes applied are on disk
+     if (!recv_all(sock, ack, sizeof(*ack)) || ack->type != MSG_ACK) {
+         printf("No acknowledgement from server: %d\n", WSAGetLastError());
+         return 0;
+     }
+     return 1;
+ }
+ 
+ // Send the scheduler's queue to the server over one connection, plus range connections for
+ // large files
+ int send_changes_to_server(sync_scheduler *sched, const char *server_ip, sync_session *session,
+                            compress_pool *pool) {
+     SOCKET sock = connect_server(server_ip);
+     if (sock == INVALID_SOCKET) return 0;
+     sched->ranges.server_ip = server_ip;
+     
+     session_ack ack;
+     int sent = send_queued_changes(sched, sock, session, pool, &ack);
+     closesocket(sock);
+     if (!sent) return 0;
+     
+     if (ack.failed > 0) {
+         printf("Server could not apply %u changes\n", ack.failed);
+         return 0;
+     }
+     printf("Server confirmed %u changes durable\n", ack.applied);
+     return 1;
+ }
+ 
+ // One server of a fanned-out session
+ typedef struct {
+     struct fanout *fan;
+     const char *server_ip;
+     SOCKET sock;
+     thread_handle thread;
+     long long position;          // Blocks sent to it so far
+     long long bytes;
+     int sending;                 // A send from the shared buffer is in progress
+     int detached;                // Its connection failed, or it held the others back
+     int acked;                   // It confirmed everything durable
+     session_ack ack;
+     long long finish_ns;
+ } fanout_target;
+ 
+ // A session sent to several servers at once. The scheduler writes the stream to a socket pair
+ // as it would to a server; the relay reads it once into a ring of shared blocks and every
+ // server's thread sends those same blocks at its own pace. A block is reused once all servers
+ // have sent it, so a slow server only holds the others back by the size of the ring.
+ typedef struct fanout {
+     unsigned char *blocks;       // FANOUT_BLOCKS of FANOUT_BLOCK_SIZE
+     int lengths[FANOUT_BLOCKS];
+     long long produced;          // Blocks filled so far
+     int ended;                   // The scheduler is done; produced is final
+     mutex_t lock;
+     cond_t filled;
+     cond_t drained;              // A server sent a block, or dropped out
+     SOCKET input;                // Relay end of the socket pair
+     fanout_target targets[MAX_DESTINATIONS];
+     int target_count;
+ } fanout;
+ 
+ // Leave a server behind; its connection is cut so it abandons the session and keeps its state.
+ // Called with the lock held.
+ static void fanout_detach(fanout *fan, fanout_target *target) {
+     target->detached = 1;
+     socket_shutdown(target->sock);
+     while (target->sending) cond_wait(&fan->drained, &fan->lock);
+     cond_broadcast(&fan->filled);
+ }
+ 
+ // Wait until the next block is free, leaving behind a server that keeps a caught-up one waiting
+ static void fanout_wait_for_block(fanout *fan) {
+     long long stall_start = 0;
+     
+     while (1) {
+         fanout_target *slowest = NULL;
+         long long fastest = -1;
+         for (int i = 0; i < fan->target_count; i++) {
+             fanout_target *t = &fan->targets[i];
+             if (t->detached) continue;
+             if (!slowest || t->position < slowest->position) slowest = t;
+             if (t->position > fastest) fastest = t->position;
+         }
+         if (!slowest || fan->produced - slowest->position < FANOUT_BLOCKS) return;
+         
+         if (fastest == fan->produced) {
+             if (stall_start == 0) {
+                 stall_start = now_ns();
+             } else if (now_ns() - stall_start >= FANOUT_STALL_MS * 1000000LL) {
+                 printf("Server %s is falling behind, it will catch up on its own\n", slowest->server_ip);
+                 fanout_detach(fan, slowest);
+                 stall_start = 0;
+                 continue;
+             }
+         } else {
+             stall_start = 0;
+         }
+         cond_wait_ms(&fan->drained, &fan->lock, 100);
+     }
+ }
+ 
+ // Read the scheduler's stream into the shared blocks until it ends
+ static thread_result THREAD_CALL fanout_relay(void *arg) {
+     fanout *fan = (fanout *)arg;
+     
+     mutex_lock(&fan->lock);
+     while (1) {
+         fanout_wait_for_block(fan);
+         unsigned char *block = fan->blocks + (fan->produced % FANOUT_BLOCKS) * (size_t)FANOUT_BLOCK_SIZE;
+         mutex_unlock(&fan->lock);
+         
+         // Wait for some data, then take whatever else is ready so small frames share a block
+         int length = recv(fan->input, (char *)block, FANOUT_BLOCK_SIZE, 0);
+         if (length > 0) {
+             int more;
+             while (length < FANOUT_BLOCK_SIZE &&
+                    (more = recv_available(fan->input, block + length, FANOUT_BLOCK_SIZE - length)) > 0) {
+                 length += more;
+             }
+         }
+         
+         mutex_lock(&fan->lock);
+         if (length <= 0) break;
+         fan->lengths[fan->produced % FANOUT_BLOCKS] = length;
+         fan->produced++;
+         cond_broadcast(&fan->filled);
+     }
+     fan->ended = 1;
+     cond_broadcast(&fan->filled);
+     mutex_unlock(&fan->lock);
+     return (thread_result)0;
+ }
+ 
+ // Send the shared blocks to one server, then wait for its acknowledgement
+ static thread_result THREAD_CALL fanout_sender(void *arg) {
+     fanout_target *target = (fanout_target *)arg;
+     fanout *fan = target->fan;
+     
+     mutex_lock(&fan->lock);
+     while (!target->detached) {
+         while (!target->detached && !fan->ended && target->position == fan->produced) {
+             cond_wait(&fan->filled, &fan->lock);
+         }
+         if (target->detached || target->position == fan->produced) break;
+         
+         int index = (int)(target->position % FANOUT_BLOCKS);
+         target->sending = 1;
+         mutex_unlock(&fan->lock);
+         
+         int ok = send_all(target->sock, fan->blocks + index * (size_t)FANOUT_BLOCK_SIZE, fan->lengths[index]);
+         
+         mutex_lock(&fan->lock);
+         target->sending = 0;
+         if (ok) {
+             target->position++;
+             target->bytes += fan->lengths[index];
+         } else if (!target->detached) {
+             printf("Error sending to %s: %d\n", target->server_ip, WSAGetLastError());
+             target->detached = 1;
+         }
+         cond_broadcast(&fan->drained);
+     }
+     int detached = target->detached;
+     mutex_unlock(&fan->lock);
+     
+     // The server answers once the changes it applied are on disk
+     if (!detached) {
+         if (!recv_all(target->sock, &target->ack, sizeof(target->ack)) || target->ack.type != MSG_ACK) {
+             printf("No acknowledgement from %s: %d\n", target->server_ip, WSAGetLastError());
+         } else {
+             target->acked = target->ack.failed == 0;
+         }
+     }
+     target->finish_ns = now_ns();
+     return (thread_result)0;
+ }
+ 
+ // Send the scheduler's queue to several servers at once, reading and compressing every file a
+ // single time. acked[i] is set for each server that confirmed all changes durable; the others
+ // keep their previous state. Returns 1 if any server did.
+ int fanout_changes_to_servers(sync_scheduler *sched, sync_destination **destinations, int count,
+                               sync_session *session, compress_pool *pool, int *acked) {
+     fanout fan;
+     SOCKET pair[2];
+     thread_handle relay;
+     long long start = now_ns();
+     int connected = 0, any = 0;
+     
+     memset(&fan, 0, sizeof(fan));
+     for (int i = 0; i < count; i++) {
+         fanout_target *t = &fan.targets[fan.target_count++];
+         acked[i] = 0;
+         t->fan = &fan;
+         t->server_ip = destinations[i]->server_ip;
+         t->sock = connect_server(t->server_ip);
+         t->detached = t->sock == INVALID_SOCKET;
+         connected += !t->detached;
+     }
+     fan.blocks = (unsigned char *)malloc((size_t)FANOUT_BLOCKS * FANOUT_BLOCK_SIZE);
+     if (!fan.blocks || connected == 0 || !socket_pair(pair)) {
+         if (!fan.blocks) printf("Memory allocation failed\n");
+         for (int i = 0; i < fan.target_count; i++) {
+             if (fan.targets[i].sock != INVALID_SOCKET) closesocket(fan.targets[i].sock);
+         }
+         free(fan.blocks);
+         return 0;
+     }
+     
+     fan.input = pair[1];
+     mutex_init(&fan.lock);
+     cond_init(&fan.filled);
+     cond_init(&fan.drained);
+     int relay_started = thread_start(&relay, fanout_relay, &fan);
+     for (int i = 0; i < fan.target_count; i++) {
+         fanout_target *t = &fan.targets[i];
+         if (t->detached) continue;
+         if (!thread_start(&t->thread, fanout_sender, t)) {
+             printf("Error starting sender thread for %s\n", t->server_ip);
+             closesocket(t->sock);
+             t->sock = INVALID_SOCKET;
+             t->detached = 1;
+         }
+     }
+     
+     // Send every queued change, then close the session, exactly as to a single server
+     uint32_t done = MSG_DONE;
+     int sent = relay_started && scheduler_run(sched, pair[0], pool, session) &&
+                send_all(pair[0], &done, sizeof(done));
+     socket_shutdown_send(pair[0]);
+     if (!sent) {
+         // Servers must not take a cut stream for a whole one
+         mutex_lock(&fan.lock);
+         for (int i = 0; i < fan.target_count; i++) {
+             if (!fan.targets[i].detached) fanout_detach(&fan, &fan.targets[i]);
+         }
+         mutex_unlock(&fan.lock);
+     }
+     
+     if (relay_started) thread_join(relay);
+     for (int i = 0; i < fan.target_count; i++) {
+         fanout_target *t = &fan.targets[i];
+         if (t->sock == INVALID_SOCKET) continue;
+         thread_join(t->thread);
+         closesocket(t->sock);
+     }
+     closesocket(pair[0]);
+     closesocket(pair[1]);
+     
+     if (sent) {
+         compress_pool_report(pool);
+         scheduler_report(sched);
+     }
+     for (int i = 0; i < fan.target_count; i++) {
+         fanout_target *t = &fan.targets[i];
+         if (t->acked) {
+             printf("  %s: %.1f MB in %.2f s, %u changes durable\n", t->server_ip, t->bytes / 1048576.0,
+                    (t->finish_ns - start) / 1e9, t->ack.applied);
+         } else if (t->sock != INVALID_SOCKET) {
+             printf("  %s: not confirmed after %.1f MB, %u failed, catching up on a later pass\n",
+                    t->server_ip, t->bytes / 1048576.0, t->ack.failed);
+         }
+         acked[i] = t->acked;
+         any |= t->acked;
+     }
+     
+     mutex_destroy(&fan.lock);
+     cond_destroy(&fan.filled);
+     cond_destroy(&fan.drained);
+     free(fan.blocks);
+     return any;
+ }
+ 
+ // Scan the watched directory, hashing contents when enabled
+ static void scan_files(const char *dir_path, const client_options *opts, const ignore_rules *ignore,
+                        hash_cache *cache, file_info **files, int *file_count) {
+     long long start = profile_now();
+     scan_directory(dir_path, ignore, files, file_count);
+     start = profile_end(STAGE_SCAN, start);
+     if (opts->content_hash) {
+         hash_files(*files, *file_count, cache);
+         profile_end(STAGE_HASH, start);
+         if (cache->dirty) hash_cache_save(cache, opts->hash_cache_path);
+     }
+ }
+ 
+ // Rescan during a session; new changes go to the scheduler and jump ahead of large
+ // transfers still running
+ int session_rescan(sync_session *session, sync_scheduler *sched, SOCKET sock) {
+     file_info *files = NULL;
+     int file_count = 0;
+     sync_record *changes = NULL;
+     int change_count = 0;
+     int ok = 1;
+     
+     session->next_scan_ns = now_ns() + session->opts->interval * 1000000000LL;
+     scan_files(session->dir_path, session->opts, session->ignore, session->cache, &files, &file_count);
+     compare_directories(session->files, session->file_count, files, file_count, &changes, &change_count);
+     
+     if (change_count > 0) {
+         printf("Detected %d more changes during transfer\n", change_count);
+         sync_record *all = (sync_record *)realloc(session->changes,
+                                                   (session->change_count + change_count) * sizeof(sync_record));
+         if (all) {
+             memcpy(all + session->change_count, changes, change_count * sizeof(sync_record));
+             session->changes = all;
+             session->change_count += change_count;
+             ok = scheduler_enqueue(sched, sock, changes, change_count);
+         } else {
+             printf("Memory allocation failed\n");
+             ok = 0;
+         }
+     }
+     
+     free(session->files);
+     session->files = files;
+     session->file_count = file_count;
+     free(changes);
+     return ok;
+ }
+ 
+ // Advance a replica's hybrid logical clock for a change it makes now
+ static uint64_t replica_tick(replica_index *replica) {
+     uint64_t physical = ((uint64_t)time(NULL) * 1000) << 16;
+     replica->clock = replica->clock + 1 > physical ? replica->clock + 1 : physical;
+     return replica->clock;
+ }
+ 
+ // Take in the clock of the other side, so later local changes order after everything seen
+ static void replica_observe(replica_index *replica, uint64_t clock) {
+     if (clock > replica->clock) replica->clock = clock;
+ }
+ 
+ static uint64_t version_get(const version_vector *v, uint64_t replica) {
+     for (int i = 0; i < VERSION_SLOTS; i++) {
+         if (v->slots[i].replica == replica) return v->slots[i].clock;
+     }
+     return 0;
+ }
+ 
+ // Raise a replica's entry. A full vector forgets its oldest entry; at worst that turns a
+ // later comparison into a conflict, and conflicts keep both copies.
+ static void version_set(version_vector *v, uint64_t replica, uint64_t clock) {
+     int slot = -1;
+     for (int i = 0; i < VERSION_SLOTS && slot < 0; i++) {
+         if (v->slots[i].replica == replica) slot = i;
+     }
+     for (int i = 0; i < VERSION_SLOTS && slot < 0; i++) {
+         if (v->slots[i].replica == 0) slot = i;
+     }
+     if (slot < 0) {
+         slot = 0;
+         for (int i = 1; i < VERSION_SLOTS; i++) {
+             if (v->slots[i].clock < v->slots[slot].clock) slot = i;
+         }
+         v->slots[slot].clock = 0;
+     }
+     v->slots[slot].replica = replica;
+     if (clock > v->slots[slot].clock) v->slots[slot].clock = clock;
+ }
+ 
+ static void version_merge(version_vector *into, const version_vector *other) {
+     for (int i = 0; i < VERSION_SLOTS; i++) {
+         if (other->slots[i].replica) version_set(into, other->slots[i].replica, other->slots[i].clock);
+     }
+ }
+ 
+ enum {
+     VERSION_EQUAL,
+     VERSION_NEWER,               // The first has seen everything the second has, and more
+     VERSION_OLDER,
+     VERSION_CONCURRENT           // Each has changes the other has not seen: a conflict
+ };
+ 
+ static int version_compare(const version_vector *a, const version_vector *b) {
+     int a_ahead = 0, b_ahead = 0;
+     for (int i = 0; i < VERSION_SLOTS; i++) {
+         if (a->slots[i].replica && a->slots[i].clock > version_get(b, a->slots[i].replica)) a_ahead = 1;
+         if (b->slots[i].replica && b->slots[i].clock > version_get(a, b->slots[i].replica)) b_ahead = 1;
+     }
+     if (a_ahead && b_ahead) return VERSION_CONCURRENT;
+     if (a_ahead) return VERSION_NEWER;
+     if (b_ahead) return VERSION_OLDER;
+     return VERSION_EQUAL;
+ }
+ 
+ // The most recent change in a version: the highest clock, ties going to the higher replica id
+ static version_slot version_latest(const version_vector *v) {
+     version_slot latest = { 0, 0 };
+     for (int i = 0; i < VERSION_SLOTS; i++) {
+         const version_slot *s = &v->slots[i];
+         if (s->replica && (s->clock > latest.clock || (s->clock == latest.clock && s->replica > latest.replica))) {
+             latest = *s;
+         }
+     }
+     return latest;
+ }
+ 
+ // Digest of an entry as both sides must agree on it: path, kind and version, with the vector's
+ // slots in a canonical order. Local details like mtime stay out.
+ static uint64_t version_digest(uint64_t path_hash, uint32_t flags, const version_vector *v) {
+     struct {
+         uint32_t flags;
+         uint32_t reserved;
+         version_slot slots[VERSION_SLOTS];
+     } canonical;
+     int n = 0;
+     
+     memset(&canonical, 0, sizeof(canonical));
+     canonical.flags = flags & (SNAPSHOT_DIRECTORY | SNAPSHOT_DELETED);
+     for (int i = 0; i < VERSION_SLOTS; i++) {
+         if (!v->slots[i].replica) continue;
+         int j = n++;
+         while (j > 0 && canonical.slots[j - 1].replica > v->slots[i].replica) {
+             canonical.slots[j] = canonical.slots[j - 1];
+             j--;
+         }
+         canonical.slots[j] = v->slots[i];
+     }
+     return xxh64(&canonical, sizeof(canonical), path_hash);
+ }
+ 
+ static uint32_t replica_entry_flags(const replica_entry *e) {
+     return (e->file.is_directory ? SNAPSHOT_DIRECTORY : 0) | (e->deleted ? SNAPSHOT_DELETED : 0);
+ }
+ 
+ static void replica_free(replica_index *replica) {
+     free(replica->entries);
+     replica->entries = NULL;
+     replica->count = 0;
+ }
+ 
+ // Load a replica index, or start an empty one with a new id
+ int replica_load(replica_index *replica, const char *path, uint64_t root_hash) {
+     snapshot_index snapshot;
+     
+     memset(replica, 0, sizeof(*replica));
+     if (snapshot_open(&snapshot, path, root_hash)) {
+         int ok = snapshot_load_entries(&snapshot, replica);
+         snapshot_close(&snapshot);
+         if (!ok) return 0;
+     }
+     
+     // A one-way snapshot has no replica yet; its entries get versions on the first refresh
+     if (replica->id == 0) {
+         struct {
+             long long ns;
+             time_t now;
+             const void *where;
+         } seed = { now_ns(), time(NULL), replica };
+         replica->id = xxh64(&seed, sizeof(seed), root_hash) | 1;
+     }
+     return 1;
+ }
+ 
+ int replica_save(const replica_index *replica, const char *path, uint64_t root_hash) {
+     return snapshot_write(path, root_hash, NULL, 0, replica);
+ }
+ 
+ static int compare_replica_entries(const void *a, const void *b) {
+     return path_compare(((const replica_entry *)a)->file.path, ((const replica_entry *)b)->file.path);
+ }
+ 
+ // Merge sorted entries into the index, replacing those with the same path
+ static int replica_merge(replica_index *replica, replica_entry *updates, int count) {
+     replica_entry *merged = (replica_entry *)malloc((replica->count + count + 1) * sizeof(replica_entry));
+     int n = 0, i = 0, j = 0;
+     
+     if (!merged) {
+         printf("Memory allocation failed\n");
+         return 0;
+     }
+     while (i < replica->count || j < count) {
+         int cmp;
+         if (i >= replica->count) cmp = 1;
+         else if (j >= count) cmp = -1;
+         else cmp = path_compare(replica->entries[i].file.path, updates[j].file.path);
+         
+         if (cmp < 0) {
+             merged[n++] = replica->entries[i++];
+         } else {
+             merged[n++] = updates[j++];
+             if (cmp == 0) i++;
+         }
+     }
+     free(replica->entries);
+     replica->entries = merged;
+     replica->count = n;
+     return 1;
+ }
+ 
+ // Bring the index up to date with a scan of its directory. Whatever changed since the index
+ // last saw it becomes a new version of this replica; a missing path becomes a tombstone.
+ // Returns the number of local changes, -1 on failure.
+ int replica_refresh(replica_index *replica, const file_info *files, int file_count) {
+     replica_entry *next = (replica_entry *)malloc((replica->count + file_count + 1) * sizeof(replica_entry));
+     int n = 0, i = 0, j = 0, changes = 0;
+     
+     if (!next) {
+         printf("Memory allocation failed\n");
+         return -1;
+     }
+     while (i < file_count || j < replica->count) {
+         int cmp;
+         if (i >= file_count) cmp = 1;
+         else if (j >= replica->count) cmp = -1;
+         else cmp = path_compare(files[i].path, replica->entries[j].file.path);
+         
+         replica_entry *e = &next[n++];
+         if (cmp < 0) {
+             // New path
+             memset(e, 0, sizeof(*e));
+             e->file = files[i++];
+             version_set(&e->version, replica->id, replica_tick(replica));
+             changes++;
+         } else if (cmp > 0) {
+             // Gone since the last look; a tombstone stays as it is
+             *e = replica->entries[j++];
+             if (!e->deleted) {
+                 e->deleted = 1;
+                 version_set(&e->version, replica->id, replica_tick(replica));
+                 changes++;
+             }
+         } else {
+             *e = replica->entries[j++];
+             int changed = e->deleted || e->file.is_directory != files[i].is_directory ||
+                           (!e->file.is_directory && file_changed(&e->file, &files[i])) ||
+                           version_latest(&e->version).replica == 0;
+             e->file = files[i++];
+             if (changed) {
+                 e->deleted = 0;
+                 version_set(&e->version, replica->id, replica_tick(replica));
+                 changes++;
+             }
+         }
+     }
+     
+     free(replica->entries);
+     replica->entries = next;
+     replica->count = n;
+     return changes;
+ }
+ 
+ // Take the versions a two-way session settled on, each with the state the session should
+ // have left at its path below root. Only paths holding that state take the new version; any
+ // other keeps its old one, so the next session sees the difference again. Returns the number
+ // of entries taken, -1 on failure.
+ int replica_apply(replica_index *replica, const char *root, const version_entry *finals, int count) {
+     replica_entry *updates = (replica_entry *)malloc((count + 1) * sizeof(replica_entry));
+     char path[MAX_PATH_LENGTH];
+     int n = 0;
+     
+     if (!updates) {
+         printf("Memory allocation failed\n");
+         return -1;
+     }
+     for (int i = 0; i < count; i++) {
+         const version_entry *final = &finals[i];
+         int deleted = (final->flags & SNAPSHOT_DELETED) != 0;
+         int is_directory = (final->flags & SNAPSHOT_DIRECTORY) != 0;
+         file_info now;
+         
+         if (!resolve_target_path(root, final->path, path)) continue;
+         int exists = path_stat(path, &now);
+         if (deleted ? exists : !exists || now.is_directory != is_directory ||
+                                (!is_directory && now.size != (long long)final->size)) {
+             printf("%s changed during the session, keeping it for the next one\n", final->path);
+             continue;
+         }
+         
+         replica_entry *e = &updates[n++];
+         e->file = now;
+         e->file.is_directory = is_directory;
+         e->version = final->version;
+         e->deleted = deleted;
+     }
+     
+     if (n > 0) qsort(updates, n, sizeof(replica_entry), compare_replica_entries);
+     int ok = replica_merge(replica, updates, n);
+     free(updates);
+     return ok ? n : -1;
+ }
+ 
+ // Merkle tree over a replica index. Entries are placed by a hash of their wire path, so a node
+ // at depth d holds the entries whose hash starts with its d-nibble prefix, whatever their
+ // directory. A node's digest is the sum of its entries' digests, which lets any node be
+ // summarized from prefix sums over the entries sorted by hash.
+ typedef struct {
+     uint64_t *keys;              // Path hashes in ascending order
+     uint64_t *sums;              // sums[i]: digests of the first i entries added up
+     int *entries;                // Replica entry behind each key
+     int count;
+ } merkle_tree;
+ 
+ typedef struct {
+     uint64_t key;
+     uint64_t digest;
+     int entry;
+ } merkle_leaf;
+ 
+ static int compare_merkle_leaves(const void *a, const void *b) {
+     uint64_t x = ((const merkle_leaf *)a)->key, y = ((const merkle_leaf *)b)->key;
+     return (x > y) - (x < y);
+ }
+ 
+ static void merkle_free(merkle_tree *tree) {
+     free(tree->keys);
+     free(tree->sums);
+     free(tree->entries);
+     memset(tree, 0, sizeof(*tree));
+ }
+ 
+ static int merkle_build(merkle_tree *tree, const replica_index *replica, const char *root) {
+     merkle_leaf *leaves = (merkle_leaf *)malloc((replica->count + 1) * sizeof(merkle_leaf));
+     char wire[MAX_PATH_LENGTH];
+     
+     memset(tree, 0, sizeof(*tree));
+     tree->keys = (uint64_t *)malloc((replica->count + 1) * sizeof(uint64_t));
+     tree->sums = (uint64_t *)malloc((replica->count + 1) * sizeof(uint64_t));
+     tree->entries = (int *)malloc((replica->count + 1) * sizeof(int));
+     if (!leaves || !tree->keys || !tree->sums || !tree->entries) {
+         printf("Memory allocation failed\n");
+         free(leaves);
+         merkle_free(tree);
+         return 0;
+     }
+     
+     for (int i = 0; i < replica->count; i++) {
+         const replica_entry *e = &replica->entries[i];
+         wire_path(root, e->file.path, wire);
+         leaves[i].key = xxh64(wire, strlen(wire), MERKLE_SEED);
+         leaves[i].digest = version_digest(leaves[i].key, replica_entry_flags(e), &e->version);
+         leaves[i].entry = i;
+     }
+     qsort(leaves, replica->count, sizeof(merkle_leaf), compare_merkle_leaves);
+     
+     tree->sums[0] = 0;
+     for (int i = 0; i < replica->count; i++) {
+         tree->keys[i] = leaves[i].key;
+         tree->sums[i + 1] = tree->sums[i] + leaves[i].digest;
+         tree->entries[i] = leaves[i].entry;
+     }
+     tree->count = replica->count;
+     free(leaves);
+     return 1;
+ }
+ 
+ // First key at or above key
+ static int merkle_lower_bound(const merkle_tree *tree, uint64_t key) {
+     int lo = 0, hi = tree->count;
+     while (lo < hi) {
+         int mid = lo + (hi - lo) / 2;
+         if (tree->keys[mid] < key) lo = mid + 1;
+         else hi = mid;
+     }
+     return lo;
+ }
+ 
+ // The keys a node covers, as a range [*lo, *hi)
+ static void merkle_range(const merkle_tree *tree, const merkle_node_id *node, int *lo, int *hi) {
+     if (node->depth == 0) {
+         *lo = 0;
+         *hi = tree->count;
+         return;
+     }
+     int shift = 64 - 4 * (int)node->depth;
+     uint64_t start = node->prefix << shift;
+     uint64_t end = start + (1ULL << shift) - 1; // Inclusive, so the last node does not wrap
+     *lo = merkle_lower_bound(tree, start);
+     *hi = end == UINT64_MAX ? tree->count : merkle_lower_bound(tree, end + 1);
+ }
+ 
+ static merkle_summary merkle_summarize(const merkle_tree *tree, const merkle_node_id *node) {
+     merkle_summary summary;
+     int lo, hi;
+     merkle_range(tree, node, &lo, &hi);
+     summary.digest = tree->sums[hi] - tree->sums[lo];
+     summary.count = (uint32_t)(hi - lo);
+     summary.reserved = 0;
+     return summary;
+ }
+ 
+ // Ignore rules for a side of a two-way sync: the directory's own ignore file, and the temp
+ // files of transfers in progress
+ static void reconcile_load_ignore(ignore_rules *rules, const char *root) {
+     char path[MAX_PATH_LENGTH];
+     
+     ignore_rules_init(rules);
+     snprintf(path, sizeof(path), "%s%c%s", root, PATH_SEP, IGNORE_FILE);
+     ignore_rules_load(rules, path);
+     ignore_rules_add(rules, "*.dsync-tmp");
+ }
+ 
+ // Receive a count and that many items of size bytes into a new array. Returns NULL on a
+ // broken connection or an unreasonable count; an empty list is a valid one-byte array.
+ static void *recv_items(SOCKET sock, int size, uint32_t *count) {
+     if (!recv_all(sock, count, sizeof(*count))) return NULL;
+     if (*count > RECONCILE_MAX_ITEMS) {
+         printf("Refusing a list of %u items\n", *count);
+         return NULL;
+     }
+     
+     void *items = malloc(*count > 0 ? (size_t)*count * size : 1);
+     if (!items) {
+         printf("Memory allocation failed\n");
+         return NULL;
+     }
+     if (*count > 0 && !recv_all(sock, items, (int)(*count * size))) {
+         free(items);
+         return NULL;
+     }
+     return items;
+ }
+ 
+ static int send_items(SOCKET sock, const void *items, int size, uint32_t count) {
+     return send_all(sock, &count, sizeof(count)) &&
+            (count == 0 || send_all(sock, items, (int)(count * size)));
+ }
+ 
+ // Answer MSG_MERKLE: the summaries of the 16 children of every node asked about
+ static int serve_merkle(SOCKET sock, const merkle_tree *tree) {
+     uint32_t count;
+     merkle_node_id *nodes = (merkle_node_id *)recv_items(sock, sizeof(merkle_node_id), &count);
+     if (!nodes) return 0;
+     
+     merkle_summary *summaries = (merkle_summary *)malloc(((size_t)count * 16 + 1) * sizeof(merkle_summary));
+     int ok = summaries != NULL;
+     for (uint32_t i = 0; ok && i < count; i++) {
+         if (nodes[i].depth >= MERKLE_MAX_DEPTH) {
+             ok = 0;
+             break;
+         }
+         for (int c = 0; c < 16; c++) {
+             merkle_node_id child = { (nodes[i].prefix << 4) | (uint64_t)c, nodes[i].depth + 1, 0 };
+             summaries[i * 16 + c] = merkle_summarize(tree, &child);
+         }
+     }
+     ok = ok && send_all(sock, summaries, (int)(count * 16 * sizeof(merkle_summary)));
+     free(summaries);
+     free(nodes);
+     return ok;
+ }
+ 
+ // Answer MSG_ENTRIES: every entry below the nodes asked about. The peer chooses the nodes, so
+ // their depth is checked and the answer is held to RECONCILE_MAX_ITEMS entries like any list.
+ static int serve_entries(SOCKET sock, const merkle_tree *tree, const replica_index *replica, const char *root) {
+     uint32_t count;
+     size_t total = 0;
+     merkle_node_id *nodes = (merkle_node_id *)recv_items(sock, sizeof(merkle_node_id), &count);
+     if (!nodes) return 0;
+     
+     for (uint32_t i = 0; i < count; i++) {
+         int lo, hi;
+         if (nodes[i].depth > MERKLE_MAX_DEPTH) {
+             free(nodes);
+             return 0;
+         }
+         merkle_range(tree, &nodes[i], &lo, &hi);
+         total += (size_t)(hi - lo);
+     }
+     if (total > RECONCILE_MAX_ITEMS) {
+         printf("Refusing to list %llu entries\n", (unsigned long long)total);
+         free(nodes);
+         return 0;
+     }
+     version_entry *entries = (version_entry *)calloc(total + 1, sizeof(version_entry));
+     int ok = entries != NULL;
+     
+     uint32_t n = 0;
+     for (uint32_t i = 0; ok && i < count; i++) {
+         int lo, hi;
+         merkle_range(tree, &nodes[i], &lo, &hi);
+         for (int k = lo; k < hi; k++) {
+             const replica_entry *e = &replica->entries[tree->entries[k]];
+             version_entry *out = &entries[n++];
+             wire_path(root, e->file.path, out->path);
+             out->size = e->file.size;
+             out->flags = replica_entry_flags(e);
+             out->version = e->version;
+         }
+     }
+     ok = ok && send_items(sock, entries, sizeof(version_entry), n);
+     free(entries);
+     free(nodes);
+     return ok;
+ }
+ 
+ // Answer MSG_HASH: the content hash of each file asked about, 0 if it cannot be read
+ static int serve_hashes(SOCKET sock, const char *root) {
+     uint32_t count;
+     char (*paths)[MAX_PATH_LENGTH] = (char (*)[MAX_PATH_LENGTH])recv_items(sock, MAX_PATH_LENGTH, &count);
+     if (!paths) return 0;
+     
+     uint64_t *hashes = (uint64_t *)malloc((count + 1) * sizeof(uint64_t));
+     char path[MAX_PATH_LENGTH];
+     for (uint32_t i = 0; hashes && i < count; i++) {
+         paths[i][MAX_PATH_LENGTH - 1] = '\0';
+         hashes[i] = 0;
+         if (resolve_target_path(root, paths[i], path)) hash_file(path, &hashes[i]);
+     }
+     int ok = hashes && (count == 0 || send_all(sock, hashes, (int)(count * sizeof(uint64_t))));
+     free(hashes);
+     free(paths);
+     return ok;
+ }
+ 
+ // Carry out MSG_PLAN: move the server's losing copies aside, then send the files the client
+ // takes as a session of their own
+ static int serve_plan(server_context *ctx, SOCKET sock, const char *root, uint32_t codec) {
+     reconcile_plan plan;
+     char from[MAX_PATH_LENGTH], to[MAX_PATH_LENGTH];
+     char from_path[MAX_PATH_LENGTH], to_path[MAX_PATH_LENGTH];
+     
+     if (!recv_all(sock, &plan.rename_count, sizeof(plan) - sizeof(plan.type))) return 0;
+     if (plan.rename_count > RECONCILE_MAX_ITEMS || plan.send_count > RECONCILE_MAX_ITEMS) {
+         printf("Refusing a plan of %u renames and %u files\n", plan.rename_count, plan.send_count);
+         return 0;
+     }
+     
+     for (uint32_t i = 0; i < plan.rename_count; i++) {
+         if (!recv_all(sock, from, sizeof(from)) || !recv_all(sock, to, sizeof(to))) return 0;
+         from[MAX_PATH_LENGTH - 1] = '\0';
+         to[MAX_PATH_LENGTH - 1] = '\0';
+         if (!resolve_target_path(root, from, from_path) || !resolve_target_path(root, to, to_path)) {
+             printf("Rejecting unsafe path: %s\n", from);
+             continue;
+         }
+         printf("Keeping conflicting copy %s as %s\n", from, to);
+         if (!file_replace(from_path, to_path)) {
+             printf("Error renaming %s: %lu\n", from_path, last_error());
+         }
+         mark_dir_dirty(ctx, to_path);
+     }
+     server_commit(ctx);
+     if (plan.send_count == 0) return 1;
+     
+     sync_record *records = (sync_record *)calloc(plan.send_count, sizeof(sync_record));
+     if (!records) {
+         printf("Memory allocation failed\n");
+         return 0;
+     }
+     int record_count = 0;
+     for (uint32_t i = 0; i < plan.send_count; i++) {
+         if (!recv_all(sock, from, sizeof(from))) {
+             free(records);
+             return 0;
+         }
+         from[MAX_PATH_LENGTH - 1] = '\0';
+         file_info f;
+         if (resolve_target_path(root, from, from_path) && path_stat(from_path, &f) && !f.is_directory) {
+             records[record_count].operation = SYNC_CREATE;
+             records[record_count].file = f;
+             record_count++;
+         }
+     }
+     
+     // The files go back the way the client sends its own, but without rescans or range
+     // connections: this side has no server of its own to open them to
+     client_options opts;
+     sync_scheduler sched;
+     compress_pool pool;
+     sync_session session;
+     session_ack ack;
+     int ok = 0;
+     
+     client_options_init(&opts);
+     if (codec > CODEC_AUTO) codec = CODEC_NONE;
+     opts.codec = (compression_codec)codec;
+     if (compress_pool_init(&pool, opts.codec, opts.compress_threads)) {
+         scheduler_init(&sched, 0, 0);
+         memset(&session, 0, sizeof(session));
+         session.dir_path = root;
+         session.root = root;
+         session.opts = &opts;
+         session.next_scan_ns = LLONG_MAX;
+         
+         printf("Sending %d files back\n", record_count);
+         ok = scheduler_enqueue(&sched, INVALID_SOCKET, records, record_count) &&
+              send_queued_changes(&sched, sock, &session, &pool, &ack);
+         if (ok && ack.failed > 0) printf("Client could not apply %u files\n", ack.failed);
+         scheduler_destroy(&sched);
+         compress_pool_destroy(&pool);
+     }
+     free(records);
+     return ok;
+ }
+ 
+ // Serve a two-way session, whose MSG_RECONCILE has been read. The replica index is brought up
+ // to date with the directory first. The client then walks both Merkle trees down to the entries
+ // that differ, decides what each side takes and has the server do its part: move its losing
+ // copies aside, send back the files the client takes, receive the client's changes as a normal
+ // session, and record the versions both sides settled on.
+ void server_reconcile(server_context *ctx, SOCKET sock, const char *index_path) {
+     reconcile_hello hello, reply;
+     replica_index replica;
+     merkle_tree tree;
+     ignore_rules rules;
+     file_info *files = NULL;
+     int file_count = 0;
+     char *root = normalize_path(ctx->target_dir);
+     uint64_t root_hash = xxh64(ctx->target_dir, strlen(ctx->target_dir), 0);
+     
+     if (!recv_all(sock, &hello.codec, sizeof(hello) - sizeof(hello.type)) ||
+         !replica_load(&replica, ctx->replica_path, root_hash)) {
+         free(root);
+         return;
+     }
+     if (hello.replica == replica.id) {
+         printf("Client and server are the same replica\n");
+         replica_free(&replica);
+         free(root);
+         return;
+     }
+     replica_observe(&replica, hello.clock);
+     
+     reconcile_load_ignore(&rules, root);
+     scan_directory(root, &rules, &files, &file_count);
+     ignore_rules_free(&rules);
+     int changes = replica_refresh(&replica, files, file_count);
+     free(files);
+     if (changes < 0 || !merkle_build(&tree, &replica, root)) {
+         replica_free(&replica);
+         free(root);
+         return;
+     }
+     printf("Two-way session with replica %016llx, %d changes here since the last one\n",
+            (unsigned long long)hello.replica, changes);
+     
+     memset(&reply, 0, sizeof(reply));
+     reply.type = MSG_RECONCILE;
+     reply.replica = replica.id;
+     reply.clock = replica.clock;
+     reply.root_digest = tree.sums[tree.count];
+     reply.entry_count = (uint32_t)tree.count;
+     
+     int ok = send_all(sock, &reply, sizeof(reply));
+     int saved = 0;
+     while (ok) {
+         uint32_t type;
+         if (!recv_all(sock, &type, sizeof(type))) break;
+         
+         if (type == MSG_MERKLE) {
+             ok = serve_merkle(sock, &tree);
+         } else if (type == MSG_ENTRIES) {
+             ok = serve_entries(sock, &tree, &replica, root);
+         } else if (type == MSG_HASH) {
+             ok = serve_hashes(sock, root);
+         } else if (type == MSG_PLAN) {
+             ok = serve_plan(ctx, sock, root, hello.codec);
+         } else if (type == MSG_RECORD || type == MSG_CHUNK || type == MSG_DONE) {
+             ok = server_session(ctx, sock, type, index_path);
+         } else if (type == MSG_VERSIONS) {
+             // The last message: take the settled versions and confirm them
+             uint32_t count;
+             version_entry *finals = (version_entry *)recv_items(sock, sizeof(version_entry), &count);
+             if (!finals) break;
+             for (uint32_t i = 0; i < count; i++) finals[i].path[MAX_PATH_LENGTH - 1] = '\0';
+             int applied = replica_apply(&replica, root, finals, (int)count);
+             free(finals);
+             if (applied < 0) break;
+             
+             session_ack ack = { MSG_ACK, (uint32_t)applied, count - (uint32_t)applied, 0 };
+             saved = replica_save(&replica, ctx->replica_path, root_hash);
+             if (saved) send_all(sock, &ack, sizeof(ack));
+             printf("Two-way session complete, %u paths settled\n", (uint32_t)applied);
+             break;
+         } else {
+             printf("Unknown message type %u\n", type);
+             break;
+         }
+     }
+     
+     // Whatever the refresh found stays found, even if the session broke off
+     if (!saved) replica_save(&replica, ctx->replica_path, root_hash);
+     merkle_free(&tree);
+     replica_free(&replica);
+     free(root);
+ }
+ 
+ // A path whose entries differ between the two sides; either entry is NULL if that side
+ // never had the path
+ typedef struct {
+     const char *path;            // Wire path
+     replica_entry *local;
+     const version_entry *remote;
+     int same_content;            // Both sides hold the same bytes
+ } reconcile_item;
+ 
+ // What a two-way session does once every difference is decided
+ typedef struct {
+     sync_record *push;           // Changes the client sends as a normal session
+     int push_count;
+     sync_record *local;          // Deletes and directories applied here, by wire path
+     int local_count;
+     char (*renames)[2][MAX_PATH_LENGTH]; // Server copies moved aside: wire paths from, to
+     int rename_count;
+     char (*pulls)[MAX_PATH_LENGTH]; // Files the server sends back
+     int pull_count;
+     version_entry *finals;       // Versions both sides settle on
+     int final_count;
+     int conflicts;
+ } reconcile_lists;
+ 
+ static int compare_reconcile_items(const void *a, const void *b) {
+     return path_compare(((const reconcile_item *)a)->path, ((const reconcile_item *)b)->path);
+ }
+ 
+ // Deletes first, children before their directories, then everything else parents first
+ static int compare_reconcile_records(const void *a, const void *b) {
+     const sync_record *x = (const sync_record *)a, *y = (const sync_record *)b;
+     int x_delete = x->operation == SYNC_DELETE, y_delete = y->operation == SYNC_DELETE;
+     if (x_delete != y_delete) return y_delete - x_delete;
+     int cmp = path_compare(x->file.path, y->file.path);
+     return x_delete ? -cmp : cmp;
+ }
+ 
+ static int reconcile_add_node(merkle_node_id **list, int *count, int *capacity, const merkle_node_id *node) {
+     if (*count == *capacity) {
+         int grown_capacity = *capacity ? *capacity * 2 : 64;
+         merkle_node_id *grown = (merkle_node_id *)realloc(*list, grown_capacity * sizeof(merkle_node_id));
+         if (!grown) {
+             printf("Memory allocation failed\n");
+             return 0;
+         }
+         *list = grown;
+         *capacity = grown_capacity;
+     }
+     (*list)[(*count)++] = *node;
+     return 1;
+ }
+ 
+ // Walk both Merkle trees down from the root, a level per round trip, to the smallest nodes
+ // that differ
+ static int reconcile_descend(SOCKET sock, const merkle_tree *tree, const reconcile_hello *remote,
+                              merkle_node_id **leaves, int *leaf_count) {
+     merkle_node_id root = { 0, 0, 0 };
+     merkle_summary mine = merkle_summarize(tree, &root);
+     merkle_node_id *expand = NULL, *next = NULL;
+     int expand_count = 0, expand_capacity = 0, next_count = 0, next_capacity = 0, leaf_capacity = 0;
+     merkle_summary *summaries = NULL;
+     int ok = 1;
+     
+     *leaves = NULL;
+     *leaf_count = 0;
+     if (mine.digest == remote->root_digest && mine.count == remote->entry_count) return 1;
+     if (mine.count + remote->entry_count <= MERKLE_LEAF_ENTRIES) {
+         return reconcile_add_node(leaves, leaf_count, &leaf_capacity, &root);
+     }
+     
+     summaries = (merkle_summary *)malloc(MERKLE_BATCH_NODES * 16 * sizeof(merkle_summary));
+     ok = summaries && reconcile_add_node(&expand, &expand_count, &expand_capacity, &root);
+     while (ok && expand_count > 0) {
+         next_count = 0;
+         for (int start = 0; ok && start < expand_count; start += MERKLE_BATCH_NODES) {
+             int n = expand_count - start < MERKLE_BATCH_NODES ? expand_count - start : MERKLE_BATCH_NODES;
+             uint32_t type = MSG_MERKLE;
+             if (!send_all(sock, &type, sizeof(type)) ||
+                 !send_items(sock, expand + start, sizeof(merkle_node_id), (uint32_t)n) ||
+                 !recv_all(sock, summaries, (int)(n * 16 * sizeof(merkle_summary)))) {
+                 printf("Error comparing trees: %d\n", WSAGetLastError());
+                 ok = 0;
+                 break;
+             }
+             
+             for (int i = 0; ok && i < n; i++) {
+                 const merkle_node_id *node = &expand[start + i];
+                 for (int c = 0; ok && c < 16; c++) {
+                     merkle_node_id child = { (node->prefix << 4) | (uint64_t)c, node->depth + 1, 0 };
+                     merkle_summary here = merkle_summarize(tree, &child);
+                     const merkle_summary *there = &summaries[i * 16 + c];
+                     if (here.digest == there->digest && here.count == there->count) continue;
+                     if (here.count + there->count <= MERKLE_LEAF_ENTRIES || child.depth == MERKLE_MAX_DEPTH) {
+                         ok = reconcile_add_node(leaves, leaf_count, &leaf_capacity, &child);
+                     } else {
+                         ok = reconcile_add_node(&next, &next_count, &next_capacity, &child);
+                     }
+                 }
+             }
+         }
+         
+         merkle_node_id *swap = expand;
+         expand = next;
+         next = swap;
+         int swap_capacity = expand_capacity;
+         expand_capacity = next_capacity;
+         next_capacity = swap_capacity;
+         expand_count = next_count;
+     }
+     
+     free(summaries);
+     free(expand);
+     free(next);
+     return ok;
+ }
+ 
+ // Fetch the server's entries below the differing nodes
+ static version_entry *reconcile_fetch_entries(SOCKET sock, const merkle_node_id *leaves, int leaf_count,
+                                               int *count) {
+     version_entry *entries = NULL;
+     *count = 0;
+     
+     for (int start = 0; start < leaf_count; start += MERKLE_BATCH_NODES) {
+         int n = leaf_count - start < MERKLE_BATCH_NODES ? leaf_count - start : MERKLE_BATCH_NODES;
+         uint32_t type = MSG_ENTRIES, received;
+         if (!send_all(sock, &type, sizeof(type)) ||
+             !send_items(sock, leaves + start, sizeof(merkle_node_id), (uint32_t)n)) {
+             free(entries);
+             return NULL;
+         }
+         version_entry *batch = (version_entry *)recv_items(sock, sizeof(version_entry), &received);
+         version_entry *grown = batch ? (version_entry *)realloc(entries, (*count + received + 1) * sizeof(version_entry)) : NULL;
+         if (!grown) {
+             printf("Error receiving entries: %d\n", WSAGetLastError());
+             free(batch);
+             free(entries);
+             return NULL;
+         }
+         entries = grown;
+         if (received > 0) memcpy(entries + *count, batch, received * sizeof(version_entry));
+         free(batch);
+         for (uint32_t i = 0; i < received; i++) entries[*count + i].path[MAX_PATH_LENGTH - 1] = '\0';
+         *count += (int)received;
+     }
+     if (!entries) entries = (version_entry *)malloc(sizeof(version_entry));
+     return entries;
+ }
+ 
+ // Concurrent edits that left both files with the same bytes are no conflict. Files of equal
+ // size are compared by content hash, the server hashing its copies in one round trip.
+ static int reconcile_compare_contents(SOCKET sock, reconcile_item *items, int count) {
+     int *candidates = (int *)malloc((count + 1) * sizeof(int));
+     char (*paths)[MAX_PATH_LENGTH] = NULL;
+     uint64_t *hashes = NULL;
+     int n = 0, ok = 0;
+     
+     if (!candidates) return 0;
+     for (int i = 0; i < count; i++) {
+         const replica_entry *c = items[i].local;
+         const version_entry *s = items[i].remote;
+         if (c && s && !c->deleted && !c->file.is_directory && !(s->flags & (SNAPSHOT_DELETED | SNAPSHOT_DIRECTORY)) &&
+             c->file.size == (long long)s->size && version_compare(&c->version, &s->version) == VERSION_CONCURRENT) {
+             candidates[n++] = i;
+         }
+     }
+     if (n == 0) {
+         free(candidates);
+         return 1;
+     }
+     
+     paths = (char (*)[MAX_PATH_LENGTH])calloc(n, MAX_PATH_LENGTH);
+     hashes = (uint64_t *)malloc(n * sizeof(uint64_t));
+     if (paths && hashes) {
+         uint32_t type = MSG_HASH;
+         for (int i = 0; i < n; i++) snprintf(paths[i], MAX_PATH_LENGTH, "%s", items[candidates[i]].path);
+         ok = send_all(sock, &type, sizeof(type)) && send_items(sock, paths, MAX_PATH_LENGTH, (uint32_t)n) &&
+              recv_all(sock, hashes, (int)(n * sizeof(uint64_t)));
+     }
+     for (int i = 0; ok && i < n; i++) {
+         uint64_t hash;
+         reconcile_item *item = &items[candidates[i]];
+         if (hashes[i] != 0 && hash_file(item->local->file.path, &hash) && hash == hashes[i]) {
+             item->same_content = 1;
+         }
+     }
+     
+     free(candidates);
+     free(paths);
+     free(hashes);
+     return ok;
+ }
+ 
+ static void reconcile_final(reconcile_lists *lists, const char *path, uint32_t flags, long long size,
+                             const version_vector *version) {
+     version_entry *final = &lists->finals[lists->final_count++];
+     memset(final, 0, sizeof(*final));
+     snprintf(final->path, MAX_PATH_LENGTH, "%s", path);
+     final->flags = flags;
+     final->size = size;
+     final->version = *version;
+ }
+ 
+ // Send the client's state of a path; s_live and s_dir describe what the server holds there
+ static void reconcile_push(reconcile_lists *lists, const replica_entry *c, int s_live, int s_dir) {
+     sync_record *record = &lists->push[lists->push_count];
+     memset(record, 0, sizeof(*record));
+     record->file = c->file;
+     
+     if (c->deleted) {
+         if (!s_live) return;
+         record->operation = SYNC_DELETE;
+         record->file.is_directory = s_dir;
+         lists->push_count++;
+         return;
+     }
+     if (s_live && s_dir != c->file.is_directory) {
+         // A file replacing a directory or the other way round; the old one goes first
+         record->operation = SYNC_DELETE;
+         record->file.is_directory = s_dir;
+         lists->push_count++;
+         record = &lists->push[lists->push_count];
+         memset(record, 0, sizeof(*record));
+         record->file = c->file;
+     }
+     record->operation = s_live ? SYNC_MODIFY : SYNC_CREATE;
+     lists->push_count++;
+ }
+ 
+ static void reconcile_local(reconcile_lists *lists, sync_operation operation, const char *path, int is_directory) {
+     sync_record *record = &lists->local[lists->local_count++];
+     memset(record, 0, sizeof(*record));
+     record->operation = operation;
+     snprintf(record->file.path, MAX_PATH_LENGTH, "%s", path);
+     record->file.is_directory = is_directory;
+ }
+ 
+ // Take the server's state of a path; c_live and c_dir describe what the client holds there
+ static void reconcile_take(reconcile_lists *lists, const char *path, int c_live, int c_dir, const version_entry *s) {
+     int s_live = !(s->flags & SNAPSHOT_DELETED), s_dir = (s->flags & SNAPSHOT_DIRECTORY) != 0;
+     
+     if (c_live && (!s_live || c_dir != s_dir)) reconcile_local(lists, SYNC_DELETE, path, c_dir);
+     if (!s_live) return;
+     if (s_dir) {
+         if (!(c_live && c_dir)) reconcile_local(lists, SYNC_CREATE, path, 1);
+     } else {
+         snprintf(lists->pulls[lists->pull_count++], MAX_PATH_LENGTH, "%s", path);
+     }
+ }
+ 
+ // Decide one differing path. A side whose version has seen all of the other's wins outright.
+ // Concurrent changes merge their versions; where both sides still hold different things, a
+ // directory beats a file and of two files the later change wins, while the other is kept
+ // beside it on both sides as <path>.conflict-<replica>-<clock>.
+ static void reconcile_decide(sync_client *client, reconcile_item *item, reconcile_lists *lists) {
+     static const version_vector none;
+     replica_entry *c = item->local;
+     const version_entry *s = item->remote;
+     const version_vector *vc = c ? &c->version : &none;
+     const version_vector *vs = s ? &s->version : &none;
+     int c_live = c && !c->deleted, c_dir = c && c->file.is_directory;
+     int s_live = s && !(s->flags & SNAPSHOT_DELETED), s_dir = s && (s->flags & SNAPSHOT_DIRECTORY);
+     int order = version_compare(vc, vs);
+     
+     if (order == VERSION_EQUAL) return;
+     // Whatever this side ignores stays on the server only
+     if (s_live && !c_live && ignore_rules_match(&client->ignore, item->path, s_dir)) return;
+     
+     if (order == VERSION_NEWER) {
+         reconcile_push(lists, c, s_live, s_dir);
+         reconcile_final(lists, item->path, replica_entry_flags(c), c->file.size, vc);
+         return;
+     }
+     if (order == VERSION_OLDER) {
+         reconcile_take(lists, item->path, c_live, c_dir, s);
+         reconcile_final(lists, item->path, s->flags, s->size, vs);
+         return;
+     }
+     
+     version_vector merged = *vc;
+     version_merge(&merged, vs);
+     version_set(&merged, client->replica.id, replica_tick(&client->replica));
+     
+     if (!c_live && !s_live) {
+         reconcile_final(lists, item->path, replica_entry_flags(c), 0, &merged);
+     } else if (!s_live) {
+         reconcile_push(lists, c, 0, 0);
+         reconcile_final(lists, item->path, replica_entry_flags(c), c->file.size, &merged);
+     } else if (!c_live) {
+         reconcile_take(lists, item->path, 0, 0, s);
+         reconcile_final(lists, item->path, s->flags, s->size, &merged);
+     } else if ((c_dir && s_dir) || item->same_content) {
+         reconcile_final(lists, item->path, replica_entry_flags(c), c->file.size, &merged);
+     } else {
+         version_slot mine = version_latest(vc), theirs = version_latest(vs);
+         int client_wins = c_dir != s_dir ? c_dir :
+                           mine.clock > theirs.clock || (mine.clock == theirs.clock && mine.replica > theirs.replica);
+         version_slot loser = client_wins ? theirs : mine;
+         char side[MAX_PATH_LENGTH];
+         int length = snprintf(side, sizeof(side), "%s.conflict-%08x-%llx", item->path,
+                               (unsigned)(loser.replica & 0xFFFFFFFFu), (unsigned long long)loser.clock);
+         if (length < 0 || length >= MAX_PATH_LENGTH) {
+             printf("Conflict on %s left unresolved, no room for a side copy\n", item->path);
+             return;
+         }
+         
+         // The side copy is a new path, created here and now
+         version_vector side_version;
+         memset(&side_version, 0, sizeof(side_version));
+         version_set(&side_version, client->replica.id, replica_tick(&client->replica));
+         lists->conflicts++;
+         
+         if (client_wins) {
+             printf("Conflict on %s, keeping the server's copy as %s\n", item->path, side);
+             snprintf(lists->renames[lists->rename_count][0], MAX_PATH_LENGTH, "%s", item->path);
+             snprintf(lists->renames[lists->rename_count][1], MAX_PATH_LENGTH, "%s", side);
+             lists->rename_count++;
+             snprintf(lists->pulls[lists->pull_count++], MAX_PATH_LENGTH, "%s", side);
+             reconcile_push(lists, c, 0, 0);
+             reconcile_final(lists, item->path, replica_entry_flags(c), c->file.size, &merged);
+             reconcile_final(lists, side, 0, s->size, &side_version);
+         } else {
+             char side_path[MAX_PATH_LENGTH];
+             replica_entry moved;
+             printf("Conflict on %s, keeping the local copy as %s\n", item->path, side);
+             if (!resolve_target_path(client->root, side, side_path) || !file_replace(c->file.path, side_path) ||
+                 !path_stat(side_path, &moved.file)) {
+                 printf("Error keeping %s aside: %lu\n", c->file.path, last_error());
+                 return;
+             }
+             moved.deleted = 0;
+             reconcile_push(lists, &moved, 0, 0);
+             reconcile_take(lists, item->path, 0, 0, s);
+             reconcile_final(lists, item->path, s->flags, s->size, &merged);
+             reconcile_final(lists, side, 0, moved.file.size, &side_version);
+         }
+     }
+ }
+ 
+ // The paths the two sides disagree on: both sides' entries below the differing nodes,
+ // matched up by path. items point into wires and remote_entries.
+ static int reconcile_collect(sync_client *client, SOCKET sock, const merkle_tree *tree,
+                              const reconcile_hello *remote, reconcile_item **items, int *item_count,
+                              char (**wires)[MAX_PATH_LENGTH], version_entry **remote_entries) {
+     merkle_node_id *leaves = NULL;
+     int leaf_count = 0, remote_count = 0, local_count = 0, n = 0;
+     
+     if (!reconcile_descend(sock, tree, remote, &leaves, &leaf_count)) {
+         free(leaves);
+         return 0;
+     }
+     *remote_entries = reconcile_fetch_entries(sock, leaves, leaf_count, &remote_count);
+     for (int i = 0; i < leaf_count; i++) {
+         int lo, hi;
+         merkle_range(tree, &leaves[i], &lo, &hi);
+         local_count += hi - lo;
+     }
+     *wires = (char (*)[MAX_PATH_LENGTH])malloc((local_count + 1) * (size_t)MAX_PATH_LENGTH);
+     *items = (reconcile_item *)calloc(local_count + remote_count + 1, sizeof(reconcile_item));
+     if (!*remote_entries || !*wires || !*items) {
+         if (*remote_entries) printf("Memory allocation failed\n");
+         free(leaves);
+         return 0;
+     }
+     
+     for (int i = 0; i < leaf_count; i++) {
+         int lo, hi;
+         merkle_range(tree, &leaves[i], &lo, &hi);
+         for (int k = lo; k < hi; k++) {
+             replica_entry *e = &client->replica.entries[tree->entries[k]];
+             wire_path(client->root, e->file.path, (*wires)[n]);
+             (*items)[n].path = (*wires)[n];
+             (*items)[n].local = e;
+             n++;
+         }
+     }
+     for (int i = 0; i < remote_count; i++) {
+         (*items)[n].path = (*remote_entries)[i].path;
+         (*items)[n].remote = &(*remote_entries)[i];
+         n++;
+     }
+     free(leaves);
+     
+     // A path both sides hold sorts into two neighbouring items; fold them into one
+     if (n > 0) qsort(*items, n, sizeof(reconcile_item), compare_reconcile_items);
+     *item_count = 0;
+     for (int i = 0; i < n; i++) {
+         reconcile_item *last = *item_count > 0 ? &(*items)[*item_count - 1] : NULL;
+         if (last && path_compare(last->path, (*items)[i].path) == 0) {
+             if ((*items)[i].local) last->local = (*items)[i].local;
+             if ((*items)[i].remote) last->remote = (*items)[i].remote;
+         } else {
+             (*items)[(*item_count)++] = (*items)[i];
+         }
+     }
+     return 1;
+ }
+ 
+ // Carry out the decisions: local deletes and directories and the server's renames first, then
+ // the files the server sends back, then this side's changes, and finally the versions both
+ // sides record
+ static int reconcile_carry_out(sync_client *client, SOCKET sock, reconcile_lists *lists) {
+     if (lists->local_count > 0) {
+         qsort(lists->local, lists->local_count, sizeof(sync_record), compare_reconcile_records);
+         for (int i = 0; i < lists->local_count; i++) apply_change(&lists->local[i], INVALID_SOCKET, &client->inbound);
+         server_end_session(&client->inbound);
+     }
+     
+     if (lists->rename_count > 0 || lists->pull_count > 0) {
+         reconcile_plan plan = { MSG_PLAN, (uint32_t)lists->rename_count, (uint32_t)lists->pull_count, 0 };
+         if (!send_all(sock, &plan, sizeof(plan)) ||
+             (lists->rename_count > 0 && !send_all(sock, lists->renames, lists->rename_count * (int)sizeof(*lists->renames))) ||
+             (lists->pull_count > 0 && !send_all(sock, lists->pulls, lists->pull_count * (int)sizeof(*lists->pulls)))) {
+             printf("Error sending plan: %d\n", WSAGetLastError());
+             return 0;
+         }
+         uint32_t type;
+         if (lists->pull_count > 0 &&
+             (!recv_all(sock, &type, sizeof(type)) ||
+              !server_session(&client->inbound, sock, type, client->inbound_index_path) ||
+              client->inbound.failed > 0)) {
+             printf("Failed to receive changes from server\n");
+             return 0;
+         }
+     }
+     
+     // This side's changes were settled before the session started, so it does not rescan
+     if (lists->push_count > 0) {
+         sync_session session;
+         session_ack ack;
+         memset(&session, 0, sizeof(session));
+         session.dir_path = client->dir_path;
+         session.root = client->root;
+         session.opts = client->opts;
+         session.ignore = &client->ignore;
+         session.cache = &client->cache;
+         session.next_scan_ns = LLONG_MAX;
+         
+         qsort(lists->push, lists->push_count, sizeof(sync_record), compare_reconcile_records);
+         client->sched.ranges.server_ip = client->destinations[0].server_ip;
+         if (!scheduler_enqueue(&client->sched, INVALID_SOCKET, lists->push, lists->push_count) ||
+             !send_queued_changes(&client->sched, sock, &session, &client->pool, &ack) || ack.failed > 0) {
+             printf("Failed to send changes to server\n");
+             scheduler_reset(&client->sched);
+             return 0;
+         }
+     }
+     
+     uint32_t type = MSG_VERSIONS;
+     session_ack ack;
+     if (!send_all(sock, &type, sizeof(type)) ||
+         !send_items(sock, lists->finals, sizeof(version_entry), (uint32_t)lists->final_count) ||
+         !recv_all(sock, &ack, sizeof(ack)) || ack.type != MSG_ACK) {
+         printf("No acknowledgement from server: %d\n", WSAGetLastError());
+         return 0;
+     }
+     return replica_apply(&client->replica, client->root, lists->finals, lists->final_count) >= 0;
+ }
+ 
+ // Settle everything the two replica indexes disagree on. Returns the number of paths settled,
+ // -1 on failure.
+ static int reconcile_session(sync_client *client, SOCKET sock, const merkle_tree *tree,
+                              const reconcile_hello *remote) {
+     reconcile_item *items = NULL;
+     int item_count = 0;
+     char (*wires)[MAX_PATH_LENGTH] = NULL;
+     version_entry *remote_entries = NULL;
+     reconcile_lists lists;
+     int result = -1;
+     
+     memset(&lists, 0, sizeof(lists));
+     if (reconcile_collect(client, sock, tree, remote, &items, &item_count, &wires, &remote_entries) &&
+         reconcile_compare_contents(sock, items, item_count)) {
+         // Every item adds at most three of anything
+         int capacity = 3 * item_count + 1;
+         lists.push = (sync_record *)malloc(capacity * sizeof(sync_record));
+         lists.local = (sync_record *)malloc(capacity * sizeof(sync_record));
+         lists.renames = (char (*)[2][MAX_PATH_LENGTH])malloc(capacity * sizeof(*lists.renames));
+         lists.pulls = (char (*)[MAX_PATH_LENGTH])malloc(capacity * sizeof(*lists.pulls));
+         lists.finals = (version_entry *)malloc(capacity * sizeof(version_entry));
+         
+         if (!lists.push || !lists.local || !lists.renames || !lists.pulls || !lists.finals) {
+             printf("Memory allocation failed\n");
+         } else {
+             for (int i = 0; i < item_count; i++) reconcile_decide(client, &items[i], &lists);
+             if (reconcile_carry_out(client, sock, &lists)) result = lists.final_count;
+         }
+     }
+     
+     if (result > 0) {
+         printf("Two-way sync settled %d paths: %d sent, %d received, %d conflicts\n", result,
+                lists.push_count, lists.pull_count + lists.local_count, lists.conflicts);
+     }
+     free(items);
+     free(wires);
+     free(remote_entries);
+     free(lists.push);
+     free(lists.local);
+     free(lists.renames);
+     free(lists.pulls);
+     free(lists.finals);
+     return result;
+ }
+ 
+ // One pass of two-way sync with the server: refresh this side's versions from a scan, open a
+ // session and settle every path the two replica indexes disagree on. Returns the number of
+ // paths settled, 0 if the sides already agreed, -1 if the session failed.
+ static int sync_client_reconcile(sync_client *client) {
+     sync_destination *dest = &client->destinations[0];
+     file_info *files = NULL;
+     int file_count = 0;
+     merkle_tree tree;
+     int result = -1;
+     
+     scan_files(client->dir_path, client->opts, &client->ignore, &client->cache, &files, &file_count);
+     int changes = replica_refresh(&client->replica, files, file_count);
+     free(files);
+     if (changes < 0 || !merkle_build(&tree, &client->replica, client->root)) return -1;
+     if (changes > 0) printf("Detected %d changes\n", changes);
+     
+     SOCKET sock = connect_server(dest->server_ip);
+     if (sock != INVALID_SOCKET) {
+         reconcile_hello hello, remote;
+         memset(&hello, 0, sizeof(hello));
+         hello.type = MSG_RECONCILE;
+         hello.codec = (uint32_t)client->opts->codec;
+         hello.replica = client->replica.id;
+         hello.clock = client->replica.clock;
+         hello.root_digest = tree.sums[tree.count];
+         hello.entry_count = (uint32_t)tree.count;
+         
+         if (send_all(sock, &hello, sizeof(hello)) && recv_all(sock, &remote, sizeof(remote)) &&
+             remote.type == MSG_RECONCILE) {
+             replica_observe(&client->replica, remote.clock);
+             result = reconcile_session(client, sock, &tree, &remote);
+         } else {
+             printf("No two-way session with server: %d\n", WSAGetLastError());
+         }
+         closesocket(sock);
+     }
+     
+     // The refresh stands even if the session failed; the next one picks up from it
+     merkle_free(&tree);
+     replica_save(&client->replica, dest->snapshot_path, client->root_hash);
+     return result;
+ }
+ 
+ // Drop one reference to a baseline, freeing it with the last
+ static void baseline_release(sync_baseline *baseline) {
+     if (baseline && --baseline->refs == 0) {
+         free(baseline->files);
+         free(baseline);
+     }
+ }
+ 
+ static int baseline_matches(const sync_baseline *baseline, file_info *files, int file_count) {
+     sync_record *changes = NULL;
+     int change_count = 0;
+     
+     if (baseline->file_count != file_count) return 0;
+     compare_directories(baseline->files, baseline->file_count, files, file_count, &changes, &change_count);
+     free(changes);
+     return change_count == 0;
+ }
+ 
+ // A baseline holding files, which it takes over. Servers whose snapshots hold the same state
+ // share one, so they keep getting their changes together.
+ static sync_baseline *baseline_share(sync_client *client, file_info *files, int file_count) {
+     for (int i = 0; i < client->destination_count; i++) {
+         sync_baseline *other = client->destinations[i].baseline;
+         if (other && baseline_matches(other, files, file_count)) {
+             free(files);
+             other->refs++;
+             return other;
+         }
+     }
+     
+     sync_baseline *baseline = (sync_baseline *)calloc(1, sizeof(sync_baseline));
+     if (!baseline) {
+         printf("Memory allocation failed\n");
+         free(files);
+         return NULL;
+     }
+     baseline->files = files;
+     baseline->file_count = file_count;
+     baseline->refs = 1;
+     return baseline;
+ }
+ 
+ // Compile the ignore rules: the ignore file first, then --ignore patterns, so those win
+ static int sync_client_load_ignore(sync_client *client) {
+     const client_options *opts = client->opts;
+     char default_path[MAX_PATH_LENGTH];
+     const char *path = opts->ignore_file;
+     
+     ignore_rules_init(&client->ignore);
+     if (!path) {
+         snprintf(default_path, sizeof(default_path), "%s%c%s", client->root, PATH_SEP, IGNORE_FILE);
+         path = default_path;
+     }
+     
+     int from_file = ignore_rules_load(&client->ignore, path);
+     if (from_file < 0 && opts->ignore_file) {
+         printf("Error reading ignore file %s: %lu\n", path, last_error());
+         return 0;
+     }
+     for (int i = 0; i < opts->ignore_count; i++) {
+         if (ignore_rules_add(&client->ignore, opts->ignore_patterns[i]) < 0) return 0;
+     }
+     // Files the server sends back are written under temp names first
+     if (opts->two_way) ignore_rules_add(&client->ignore, "*.dsync-tmp");
+     
+     if (client->ignore.rule_count > 0) {
+         printf("Ignore rules: %d", client->ignore.rule_count);
+         if (from_file > 0) printf(" (%d from %s)", from_file, path);
+         printf("\n");
+     }
+     return 1;
+ }
+ 
+ // Set up the client and its baseline: the last acknowledged state if a snapshot has one,
+ // otherwise a fresh scan
+ int sync_client_init(sync_client *client, const char *dir_path, const char *server_list,
+                      const client_options *opts, int *resumed) {
+     memset(client, 0, sizeof(*client));
+     client->dir_path = dir_path;
+     client->opts = opts;
+     client->root_hash = xxh64(dir_path, strlen(dir_path), 0);
+     *resumed = 0;
+     
+     // One server keeps the plain snapshot path; several get one each, named after the server
+     client->server_list = _strdup(server_list);
+     if (!client->server_list) return 0;
+     for (char *ip = strtok(client->server_list, ","); ip; ip = strtok(NULL, ",")) {
+         if (client->destination_count == MAX_DESTINATIONS) {
+             printf("At most %d servers are supported\n", MAX_DESTINATIONS);
+             free(client->server_list);
+             return 0;
+         }
+         client->destinations[client->destination_count++].server_ip = ip;
+     }
+     if (client->destination_count == 0) {
+         printf("No server given\n");
+         free(client->server_list);
+         return 0;
+     }
+     if (opts->two_way && client->destination_count > 1) {
+         printf("Two-way sync works with one server\n");
+         free(client->server_list);
+         return 0;
+     }
+     
+     if (!compress_pool_init(&client->pool, opts->codec, opts->compress_threads)) {
+         free(client->server_list);
+         return 0;
+     }
+     client->root = normalize_path(dir_path);
+     
+     scheduler_init(&client->sched, opts->bandwidth, opts->parallel);
+     
+     if (opts->content_hash) {
+         hash_cache_load(&client->cache, opts->hash_cache_path);
+     }
+     
+     if (!sync_client_load_ignore(client)) {
+         client->destination_count = 0;
+         sync_client_destroy(client);
+         return 0;
+     }
+     
+     // Two-way sync keeps a replica index in place of the snapshot, and applies the server's
+     // changes the way a server applies a client's
+     if (opts->two_way) {
+         sync_destination *dest = &client->destinations[0];
+         snprintf(dest->snapshot_path, sizeof(dest->snapshot_path), "%s", opts->snapshot_path);
+         snprintf(client->inbound_index_path, sizeof(client->inbound_index_path), "%s.chunks", opts->snapshot_path);
+         dest->snapshot.file = INVALID_FILE;
+         if (!replica_load(&client->replica, dest->snapshot_path, client->root_hash) ||
+             !server_context_init(&client->inbound, client->root, client->inbound_index_path, DURABILITY_BATCH)) {
+             sync_client_destroy(client);
+             return 0;
+         }
+         printf("Two-way replica %016llx with %d entries\n", (unsigned long long)client->replica.id,
+                client->replica.count);
+         *resumed = 1;
+         return 1;
+     }
+     
+     sync_baseline *fresh = NULL;
+     for (int i = 0; i < client->destination_count; i++) {
+         sync_destination *dest = &client->destinations[i];
+         file_info *files = NULL;
+         int file_count = 0;
+         
+         snprintf(dest->snapshot_path, sizeof(dest->snapshot_path), client->destination_count == 1 ? "%s" : "%s.%s",
+                  opts->snapshot_path, dest->server_ip);
+         
+         // Resume from the last acknowledged state if we have one, otherwise start from a fresh scan
+         if (snapshot_open(&dest->snapshot, dest->snapshot_path, client->root_hash) &&
+             snapshot_load_files(&dest->snapshot, &files, &file_count)) {
+             if (client->destination_count > 1) printf("%s: ", dest->server_ip);
+             printf("Resuming from snapshot with %d entries\n", file_count);
+             dest->baseline = baseline_share(client, files, file_count);
+             *resumed = 1;
+         } else {
+             snapshot_close(&dest->snapshot);
+             if (!fresh) {
+                 scan_files(dir_path, opts, &client->ignore, &client->cache, &files, &file_count);
+                 fresh = baseline_share(client, files, file_count);
+                 dest->baseline = fresh;
+             } else {
+                 dest->baseline = fresh;
+                 fresh->refs++;
+             }
+             if (fresh) {
+                 snapshot_commit(&dest->snapshot, dest->snapshot_path, client->root_hash,
+                                 fresh->files, fresh->file_count, NULL, 0);
+             }
+         }
+         if (!dest->baseline) {
+             client->destination_count = i;
+             sync_client_destroy(client);
+             return 0;
+         }
+     }
+     return 1;
+ }
+ 
+ // Send what changed since the baseline that the servers in group share. A single server gets
+ // its own connection; several get the same stream through a fan-out. Servers that acknowledge
+ // everything move to the new state together, the others keep theirs and catch up on a later
+ // pass. Returns the number of changes, 0 if nothing changed, -1 if any server missed them.
+ static int sync_group_pass(sync_client *client, sync_destination **group, int count,
+                            const file_info *scan, int scan_count) {
+     const client_options *opts = client->opts;
+     sync_baseline *baseline = group[0]->baseline;
+     sync_record *changes = NULL;
+     int change_count = 0;
+     int acked[MAX_DESTINATIONS];
+     int result = 0;
+     
+     // The session may rescan and replace its copy of the scan
+     file_info *files = (file_info *)malloc((scan_count > 0 ? scan_count : 1) * sizeof(file_info));
+     if (!files) {
+         printf("Memory allocation failed\n");
+         return -1;
+     }
+     if (scan_count > 0) memcpy(files, scan, scan_count * sizeof(file_info));
+     compare_directories(baseline->files, baseline->file_count, files, scan_count, &changes, &change_count);
+     
+     if (change_count == 0) {
+         free(baseline->files);
+         baseline->files = files;
+         baseline->file_count = scan_count;
+         free(changes);
+         return 0;
+     }
+     
+     // Send changes to the servers; the session owns the scan and change list from here on
+     if (count > 1) {
+         printf("Detected %d changes for %d servers\n", change_count, count);
+     } else {
+         printf("Detected %d changes\n", change_count);
+     }
+     sync_session session;
+     session.dir_path = client->dir_path;
+     session.root = client->root;
+     session.opts = opts;
+     session.ignore = &client->ignore;
+     session.cache = &client->cache;
+     session.files = files;
+     session.file_count = scan_count;
+     session.changes = changes;
+     session.change_count = change_count;
+     session.next_scan_ns = now_ns() + opts->interval * 1000000000LL;
+     session.fanout = count > 1;
+     
+     memset(acked, 0, sizeof(acked));
+     if (scheduler_enqueue(&client->sched, INVALID_SOCKET, session.changes, session.change_count)) {
+         if (count == 1) {
+             acked[0] = send_changes_to_server(&client->sched, group[0]->server_ip, &session, &client->pool);
+         } else {
+             fanout_changes_to_servers(&client->sched, group, count, &session, &client->pool, acked);
+         }
+     }
+     
+     sync_baseline *next = NULL;
+     int confirmed = 0;
+     for (int i = 0; i < count; i++) {
+         if (!acked[i]) {
+             result = -1;
              continue;
          }
-         
-         printf("Receiving %d changes\n", change_count);
-         
-         for (int i = 0; i < change_count; i++) {
-             recv_result = recv(client_socket, (char*)&changes[i], sizeof(sync_record), 0);
-             if (recv_result == SOCKET_ERROR || recv_result == 0) {
-                 printf("Error receiving change record: %d\n", WSAGetLastError());
+         confirmed++;
+         if (!next) {
+             next = (sync_baseline *)calloc(1, sizeof(sync_baseline));
+             if (!next) {
+                 printf("Memory allocation failed\n");
+                 result = -1;
                  break;
              }
-             
-             // Receive file data if needed
-             if (changes[i].data_size > 0) {
-                 recv_result = recv(client_socket, changes[i].data, changes[i].data_size, 0);
-                 if (recv_result == SOCKET_ERROR || recv_result == 0) {
-                     printf("Error receiving file data: %d\n", WSAGetLastError());
-                     break;
-                 }
+             next->files = session.files;
+             next->file_count = session.file_count;
+             session.files = NULL;
+         }
+         snapshot_commit(&group[i]->snapshot, group[i]->snapshot_path, client->root_hash,
+                         next->files, next->file_count, session.changes, session.change_count);
+         baseline_release(group[i]->baseline);
+         group[i]->baseline = next;
+         next->refs++;
+     }
+     
+     if (result == 0) {
+         printf("Changes sent to server%s\n", count > 1 ? "s" : "");
+         result = session.change_count;
+     } else {
+         // Keep diffing against the last acknowledged state so nothing is lost
+         if (confirmed > 0) {
+             printf("Changes sent to %d of %d servers, the others catch up later\n", confirmed, count);
+         } else {
+             printf("Failed to send changes to server%s\n", count > 1 ? "s" : "");
+         }
+         scheduler_reset(&client->sched);
+     }
+     
+     // Free changes
+     free(session.files);
+     free(session.changes);
+     return result;
+ }
+ 
+ // Scan once and send whatever changed since the last acknowledged state to every server, or
+ // with two-way sync settle the differences with the server both ways.
+ // Returns the most changes a server acknowledged, 0 if nothing changed, -1 if a session failed.
+ int sync_client_pass(sync_client *client) {
+     file_info *new_files = NULL;
+     int new_count = 0;
+     int handled[MAX_DESTINATIONS];
+     int result = 0;
+     
+     if (client->opts->two_way) return sync_client_reconcile(client);
+     
+     // Scan directory again and detect changes
+     scan_files(client->dir_path, client->opts, &client->ignore, &client->cache, &new_files, &new_count);
+     
+     // Servers in step share a baseline and get one session between them
+     memset(handled, 0, sizeof(handled));
+     for (int i = 0; i < client->destination_count; i++) {
+         sync_destination *group[MAX_DESTINATIONS];
+         int count = 0;
+         if (handled[i]) continue;
+         for (int j = i; j < client->destination_count; j++) {
+             if (!handled[j] && client->destinations[j].baseline == client->destinations[i].baseline) {
+                 group[count++] = &client->destinations[j];
+                 handled[j] = 1;
              }
          }
          
-         // Apply changes to target directory
-         apply_changes(changes, change_count, target_dir);
-         
-         closesocket(client_socket);
+         int changes = sync_group_pass(client, group, count, new_files, new_count);
+         if (changes < 0) result = -1;
+         else if (result >= 0 && changes > result) result = changes;
      }
      
-     closesocket(server_socket);
-     WSACleanup();
-     return 0;
+     // A server that caught up rejoins the others, so they share sessions again
+     for (int i = 1; i < client->destination_count; i++) {
+         sync_destination *dest = &client->destinations[i];
+         for (int j = 0; j < i; j++) {
+             sync_baseline *other = client->destinations[j].baseline;
+             if (other == dest->baseline || !baseline_matches(other, dest->baseline->files, dest->baseline->file_count)) {
+                 continue;
+             }
+             baseline_release(dest->baseline);
+             dest->baseline = other;
+             other->refs++;
+             break;
+         }
+     }
+     
+     free(new_files);
+     return result;
  }
  
- // Convert forward slashes to backslashes for Windows paths
- char* normalize_path(const char* path) {
-     char* normalized = _strdup(path);
-     char* p = normalized;
+ void sync_client_destroy(sync_client *client) {
+     compress_pool_destroy(&client->pool);
+     scheduler_destroy(&client->sched);
+     if (client->opts->content_hash) hash_cache_free(&client->cache);
+     for (int i = 0; i < client->destination_count; i++) {
+         snapshot_close(&client->destinations[i].snapshot);
+         baseline_release(client->destinations[i].baseline);
+     }
+     ignore_rules_free(&client->ignore);
+     replica_free(&client->replica);
+     if (client->inbound.target_dir) server_context_destroy(&client->inbound);
+     free(client->server_list);
+     free(client->root);
+     memset(client, 0, sizeof(*client));
+ }
+ 
+ // Watch directory for changes
+ void watch_directory(const char *dir_path, const char *server_ip, const client_options *opts) {
+     sync_client client;
+     int resume;
      
-     while (*p) {
-         if (*p == '/') *p = '\\';
-         p++;
+     if (!sync_client_init(&client, dir_path, server_ip, opts, &resume)) {
+         return;
      }
      
-     return normalized;
+     while (1) {
+         // Wait for the specified interval; after a restart, catch up right away
+         if (!resume) sleep_seconds(opts->interval);
+         resume = 0;
+         
+         sync_client_pass(&client);
+     }
  }
  
- // Scan a directory and collect file information
- void scan_directory(const char *dir_path, file_info **files, int *file_count) {
-     WIN32_FIND_DATA find_data;
-     HANDLE find_handle;
-     char search_path[MAX_PATH_LENGTH];
-     char full_path[MAX_PATH_LENGTH];
-     
-     *file_count = 0;
-     *files = NULL;
+ // Benchmark harness: the server runs on a loopback thread and the client is driven pass by
+ // pass over synthetic trees, so every operation's write-to-durable time can be measured
+ 
+ typedef struct {
+     int files;                   // Small files, and the size of the churn set
+     int huge_files;
+     int huge_mb;
+     int batch;                   // Operations between sync passes
+     int rounds;                  // Churn passes
+ } bench_config;
+ 
+ // What one scenario cost
+ typedef struct {
+     const char *name;
+     long long files;             // Operations: files and directories created, changed, renamed or deleted
+     long long bytes;             // Data written into the source tree
+     int passes;
+     int failed_passes;
+     long long missing;           // Files the scenario itself expected on the target that differ or are absent
+     long long wall_ns;           // Time spent in sync passes
+     long long cpu_ns;            // Process CPU, client and server, during those passes
+     long long *latency_ns;       // Operation times, turned into write-to-acknowledged latencies
+     int latency_count;
+     int latency_capacity;
+ } bench_result;
+ 
+ typedef struct {
+     server_context ctx;
+     SOCKET listen_socket;
+     const char *index_path;
+     volatile int stop;
+     thread_handle thread;
+ } bench_server;
+ 
+ typedef struct {
+     char src[MAX_PATH_LENGTH];
+     char dst[MAX_PATH_LENGTH];
+     sync_client client;
+     uint64_t rng;
+     unsigned char *buffer;
+     bench_result *result;        // Scenario being measured, NULL while setting one up
+     int pass_start;              // First operation of the current pass
+ } bench_run;
+ 
+ // Tree comparison: every source file must match its copy and nothing else may exist
+ typedef struct {
+     const char *from;
+     const char *to;
+     long long entries;
+     long long mismatched;
+ } bench_compare;
+ 
+ static thread_result THREAD_CALL bench_server_thread(void *arg) {
+     bench_server *server = (bench_server *)arg;
      
-     // Normalize the path
-     char* normalized_dir = normalize_path(dir_path);
+     server_run(&server->ctx, server->listen_socket, server->index_path, &server->stop);
+     return (thread_result)0;
+ }
+ 
+ // Wake the server thread out of accept so it sees the stop flag
+ static void bench_server_stop(bench_server *server) {
+     struct sockaddr_in addr;
      
-     // Prepare the search path
-     snprintf(search_path, MAX_PATH_LENGTH, "%s\\*", normalized_dir);
+     server->stop = 1;
+     memset(&addr, 0, sizeof(addr));
+     addr.sin_family = AF_INET;
+     addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+     addr.sin_port = htons(SERVER_PORT);
      
-     // First count the files
-     find_handle = FindFirstFile(search_path, &find_data);
-     if (find_handle == INVALID_HANDLE_VALUE) {
-         printf("Error opening directory: %lu\n", GetLastError());
-         free(normalized_dir);
-         return;
+     SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+     if (sock != INVALID_SOCKET) {
+         connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+         closesocket(sock);
      }
+     thread_join(server->thread);
+     closesocket(server->listen_socket);
+ }
+ 
+ // xorshift64*, the generated trees only need to be cheap and reproducible
+ static uint64_t bench_random(bench_run *run) {
+     run->rng ^= run->rng >> 12;
+     run->rng ^= run->rng << 25;
+     run->rng ^= run->rng >> 27;
+     return run->rng * 0x2545F4914F6CDD1DULL;
+ }
+ 
+ // Fill the buffer with text-like data that compresses, or with noise that does not
+ static void bench_fill(bench_run *run, size_t length, int text) {
+     static const char letters[] = "etaoin shrdlucm\n";
      
-     do {
-         if (strcmp(find_data.cFileName, ".") == 0 || strcmp(find_data.cFileName, "..") == 0)
-             continue;
-         
-         (*file_count)++;
-     } while (FindNextFile(find_handle, &find_data));
-     
-     FindClose(find_handle);
+     for (size_t i = 0; i < length; i += 8) {
+         uint64_t r = bench_random(run);
+         for (size_t j = i; j < i + 8 && j < length; j++, r >>= 8) {
+             run->buffer[j] = text ? (unsigned char)letters[r & 15] : (unsigned char)r;
+         }
+     }
+ }
+ 
+ // Count an operation of the scenario being measured, stamped with the time it was made
+ static void bench_note(bench_run *run, long long bytes) {
+     bench_result *r = run->result;
+     if (!r) return;
      
-     // Allocate memory for file info
-     *files = (file_info *)malloc(*file_count * sizeof(file_info));
-     if (!*files) {
-         printf("Memory allocation failed\n");
-         free(normalized_dir);
-         *file_count = 0;
-         return;
+     if (r->latency_count == r->latency_capacity) {
+         int capacity = r->latency_capacity ? r->latency_capacity * 2 : 1024;
+         long long *grown = (long long *)realloc(r->latency_ns, capacity * sizeof(long long));
+         if (!grown) return;
+         r->latency_ns = grown;
+         r->latency_capacity = capacity;
+     }
+     r->latency_ns[r->latency_count++] = now_ns();
+     r->files++;
+     r->bytes += bytes;
+ }
+ 
+ static int bench_write_file(bench_run *run, const char *path, long long size, int text) {
+     FILE *f = fopen(path, "wb");
+     if (!f) {
+         printf("Error creating %s\n", path);
+         return 0;
      }
      
-     // Collect file information
-     find_handle = FindFirstFile(search_path, &find_data);
-     if (find_handle == INVALID_HANDLE_VALUE) {
-         printf("Error reopening directory: %lu\n", GetLastError());
-         free(*files);
-         *files = NULL;
-         *file_count = 0;
-         free(normalized_dir);
-         return;
+     int ok = 1;
+     for (long long written = 0; ok && written < size; written += BUFFER_SIZE) {
+         size_t length = size - written < BUFFER_SIZE ? (size_t)(size - written) : BUFFER_SIZE;
+         bench_fill(run, length, text);
+         ok = fwrite(run->buffer, 1, length, f) == length;
      }
+     if (fclose(f) != 0) ok = 0;
      
-     int i = 0;
-     do {
-         if (strcmp(find_data.cFileName, ".") == 0 || strcmp(find_data.cFileName, "..") == 0)
-             continue;
-         
-         if (i >= *file_count) break; // Safety check
-         
-         snprintf(full_path, MAX_PATH_LENGTH, "%s\\%s", normalized_dir, find_data.cFileName);
-         
-         strncpy((*files)[i].path, full_path, MAX_PATH_LENGTH);
-         
-         // Convert Windows file time to time_t
-         FILETIME ft = find_data.ftLastWriteTime;
-         ULARGE_INTEGER uli;
-         uli.LowPart = ft.dwLowDateTime;
-         uli.HighPart = ft.dwHighDateTime;
-         // Convert to seconds and adjust epoch from 1601 to 1970
-         (*files)[i].last_modified = (uli.QuadPart / 10000000ULL - 11644473600ULL);
-         
-         // Get file size
-         if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-             (*files)[i].size = 0;
-             (*files)[i].is_directory = 1;
-         } else {
-             ULARGE_INTEGER file_size;
-             file_size.LowPart = find_data.nFileSizeLow;
-             file_size.HighPart = find_data.nFileSizeHigh;
-             (*files)[i].size = (long)file_size.QuadPart;
-             (*files)[i].is_directory = 0;
-         }
-         
-         i++;
-     } while (FindNextFile(find_handle, &find_data) && i < *file_count);
+     bench_note(run, size);
+     return ok;
+ }
+ 
+ static void bench_path(const bench_run *run, char *path, const char *name, int id) {
+     int length = snprintf(path, MAX_PATH_LENGTH, "%s%c%s_%06d", run->src, PATH_SEP, name, id);
+     if (length < 0 || length >= MAX_PATH_LENGTH) path[0] = '\0';
+ }
+ 
+ // One sync pass; a failed session is resent on the next one, as the watcher would
+ static void bench_sync(bench_run *run) {
+     bench_result *r = run->result;
+     long long start = now_ns();
+     long long cpu = process_cpu_ns();
      
-     FindClose(find_handle);
-     free(normalized_dir);
+     for (int attempt = 0; attempt < BENCH_RETRIES; attempt++) {
+         if (sync_client_pass(&run->client) >= 0) break;
+         if (r) r->failed_passes++;
+     }
      
-     // Update file count if some files were skipped
-     *file_count = i;
+     long long done = now_ns();
+     if (!r) return;
+     r->passes++;
+     r->wall_ns += done - start;
+     r->cpu_ns += process_cpu_ns() - cpu;
+     for (int i = run->pass_start; i < r->latency_count; i++) r->latency_ns[i] = done - r->latency_ns[i];
+     run->pass_start = r->latency_count;
  }
  
- // Compare two directory scans to detect changes
- void compare_directories(file_info *old_files, int old_count, 
-                          file_info *new_files, int new_count,
-                          sync_record **changes, int *change_count) {
-     int max_changes = old_count + new_count; // Worst case all files changed
-     *changes = (sync_record *)malloc(max_changes * sizeof(sync_record));
-     *change_count = 0;
+ // Many small text files, synced a batch at a time
+ static void bench_small(bench_run *run, const bench_config *cfg) {
+     char path[MAX_PATH_LENGTH];
      
-     if (!*changes) {
-         printf("Memory allocation failed\n");
-         return;
+     for (int i = 0; i < cfg->files; i++) {
+         bench_path(run, path, "small", i);
+         bench_write_file(run, path, 1024 + (long long)(bench_random(run) % (15 * 1024)), 1);
+         if ((i + 1) % cfg->batch == 0 || i + 1 == cfg->files) bench_sync(run);
      }
+ }
+ 
+ // A few huge incompressible files, one pass each
+ static void bench_huge(bench_run *run, const bench_config *cfg) {
+     char path[MAX_PATH_LENGTH];
      
-     // Detect new and modified files
-     for (int i = 0; i < new_count; i++) {
-         int found = 0;
-         for (int j = 0; j < old_count; j++) {
-             if (_stricmp(new_files[i].path, old_files[j].path) == 0) {
-                 found = 1;
-                 // Check if file was modified
-                 if (new_files[i].last_modified > old_files[j].last_modified ||
-                     new_files[i].size != old_files[j].size) {
-                     (*changes)[*change_count].operation = SYNC_MODIFY;
-                     (*changes)[*change_count].file = new_files[i];
-                     (*change_count)++;
-                 }
-                 break;
-             }
-         }
+     for (int i = 0; i < cfg->huge_files; i++) {
+         bench_path(run, path, "huge", i);
+         bench_write_file(run, path, (long long)cfg->huge_mb * 1024 * 1024, 0);
+         bench_sync(run);
+     }
+ }
+ 
+ // A chain of nested directories with a handful of files on every level
+ static void bench_deep(bench_run *run, const bench_config *cfg) {
+     char dir[MAX_PATH_LENGTH];
+     char path[MAX_PATH_LENGTH];
+     char copy[MAX_PATH_LENGTH];
+     size_t root_length = strlen(run->src);
+     uint64_t hash, copy_hash;
+     (void)cfg;
+     
+     memcpy(dir, run->src, root_length + 1);
+     for (int level = 0; level < BENCH_DEEP_LEVELS; level++) {
+         size_t length = strlen(dir);
+         snprintf(dir + length, sizeof(dir) - length, "%cdeep_%d", PATH_SEP, level);
+         make_dir(dir);
+         bench_note(run, 0);
          
-         // New file
-         if (!found) {
-             (*changes)[*change_count].operation = SYNC_CREATE;
-             (*changes)[*change_count].file = new_files[i];
-             (*change_count)++;
+         for (int i = 0; i < BENCH_DEEP_FILES; i++) {
+             snprintf(path, sizeof(path), "%s%cfile_%02d", dir, PATH_SEP, i);
+             bench_write_file(run, path, 4096, 1);
          }
      }
+     bench_sync(run);
      
-     // Detect deleted files
-     for (int i = 0; i < old_count; i++) {
-         int found = 0;
-         for (int j = 0; j < new_count; j++) {
-             if (_stricmp(old_files[i].path, new_files[j].path) == 0) {
-                 found = 1;
-                 break;
+     // The tree comparison walks both sides with the scanner under test, so a level the scanner
+     // never reached would be missing from both and still compare equal. Look up every file
+     // the scenario wrote by its own path instead.
+     memcpy(dir, run->src, root_length + 1);
+     for (int level = 0; level < BENCH_DEEP_LEVELS; level++) {
+         size_t length = strlen(dir);
+         snprintf(dir + length, sizeof(dir) - length, "%cdeep_%d", PATH_SEP, level);
+         for (int i = 0; i < BENCH_DEEP_FILES; i++) {
+             snprintf(path, sizeof(path), "%s%cfile_%02d", dir, PATH_SEP, i);
+             snprintf(copy, sizeof(copy), "%s%s", run->dst, path + root_length);
+             if (run->result && (!hash_file(path, &hash) || !hash_file(copy, &copy_hash) || hash != copy_hash)) {
+                 run->result->missing++;
              }
          }
-         
-         // Deleted file
-         if (!found) {
-             (*changes)[*change_count].operation = SYNC_DELETE;
-             (*changes)[*change_count].file = old_files[i];
-             (*change_count)++;
-         }
      }
  }
  
- // Apply changes to a target directory
- void apply_changes(sync_record *changes, int change_count, const char *target_dir) {
-     char target_path[MAX_PATH_LENGTH];
-     char source_path[MAX_PATH_LENGTH];
-     char* normalized_target = normalize_path(target_dir);
-     
-     for (int i = 0; i < change_count; i++) {
-         // Create target path - need to determine relative path
-         char* normalized_source = normalize_path(changes[i].file.path);
-         
-         // Find the base directory in the source path to create relative path
-         const char* relative_path = strstr(normalized_source, "\\");
-         if (relative_path) {
-             // Skip the first backslash
-             relative_path++;
-             
-             // Find the next directory separator
-             while (*relative_path && *relative_path != '\\')
-                 relative_path++;
+ // Mixed creates, modifications, deletes and renames over a set of small files
+ static void bench_churn(bench_run *run, const bench_config *cfg) {
+     char path[MAX_PATH_LENGTH];
+     char other[MAX_PATH_LENGTH];
+     int capacity = cfg->files + cfg->rounds * cfg->batch;
+     int *live = (int *)malloc(capacity * sizeof(int));
+     int live_count = 0;
+     int next_id = 0;
+     
+     if (!live) {
+         printf("Memory allocation failed\n");
+         return;
+     }
+     
+     // The starting set is not part of the measurement
+     bench_result *result = run->result;
+     run->result = NULL;
+     for (int i = 0; i < cfg->files; i++) {
+         bench_path(run, path, "churn", next_id);
+         if (bench_write_file(run, path, 1024 + (long long)(bench_random(run) % (15 * 1024)), 1)) {
+             live[live_count++] = next_id;
+         }
+         next_id++;
+     }
+     bench_sync(run);
+     run->result = result;
+     
+     for (int round = 0; round < cfg->rounds; round++) {
+         for (int op = 0; op < cfg->batch; op++) {
+             int kind = (int)(bench_random(run) % 10);
+             int pick = live_count > 0 ? (int)(bench_random(run) % live_count) : 0;
+             if (live_count == 0) kind = 4;
              
-             if (*relative_path) {
-                 // Skip this separator too to get to the relative path
-                 relative_path++;
-                 snprintf(target_path, MAX_PATH_LENGTH, "%s\\%s", normalized_target, relative_path);
-             } else {
-                 // Just use the filename if we can't find a proper relative path
-                 char* filename = strrchr(normalized_source, '\\');
-                 if (filename) {
-                     filename++; // Skip the backslash
-                     snprintf(target_path, MAX_PATH_LENGTH, "%s\\%s", normalized_target, filename);
-                 } else {
-                     // Fallback to just using the source path directly
-                     strncpy(target_path, normalized_source, MAX_PATH_LENGTH);
+             if (kind < 4) {
+                 // Modify
+                 bench_path(run, path, "churn", live[pick]);
+                 bench_write_file(run, path, 1024 + (long long)(bench_random(run) % (15 * 1024)), 1);
+             } else if (kind < 6) {
+                 // Create
+                 bench_path(run, path, "churn", next_id);
+                 if (bench_write_file(run, path, 1024 + (long long)(bench_random(run) % (15 * 1024)), 1)) {
+                     live[live_count++] = next_id;
                  }
+                 next_id++;
+             } else if (kind < 8) {
+                 // Delete
+                 bench_path(run, path, "churn", live[pick]);
+                 file_delete(path);
+                 bench_note(run, 0);
+                 live[pick] = live[--live_count];
+             } else {
+                 // Rename
+                 bench_path(run, path, "churn", live[pick]);
+                 bench_path(run, other, "churn", next_id);
+                 if (file_replace(path, other)) live[pick] = next_id;
+                 bench_note(run, 0);
+                 next_id++;
              }
-         } else {
-             // Fallback if we can't parse the path
-             strncpy(target_path, normalized_source, MAX_PATH_LENGTH);
-         }
-         
-         printf("Processing %s -> %s\n", normalized_source, target_path);
-         
-         // Make sure the directory exists
-         char* last_slash = strrchr(target_path, '\\');
-         if (last_slash) {
-             *last_slash = '\0'; // Temporarily terminate the string at the directory
-             // Create all directories in the path
-             char* path_segment = target_path;
-             while ((path_segment = strchr(path_segment, '\\')) != NULL) {
-                 *path_segment = '\0'; // Temporarily terminate
-                 _mkdir(target_path); // Doesn't error if directory exists
-                 *path_segment = '\\'; // Restore the slash
-                 path_segment++; // Move past this segment
-             }
-             _mkdir(target_path); // Create the final directory
-             *last_slash = '\\'; // Restore the full path
-         }
-         
-         switch (changes[i].operation) {
-             case SYNC_CREATE:
-             case SYNC_MODIFY:
-                 if (changes[i].file.is_directory) {
-                     // Create directory if it doesn't exist
-                     _mkdir(target_path);
-                 } else {
-                     // Create or modify file
-                     HANDLE file_handle = CreateFile(
-                         target_path,
-                         GENERIC_WRITE,
-                         0,
-                         NULL,
-                         CREATE_ALWAYS,
-                         FILE_ATTRIBUTE_NORMAL,
-                         NULL
-                     );
-                     
-                     if (file_handle != INVALID_HANDLE_VALUE) {
-                         DWORD bytes_written;
-                         WriteFile(
-                             file_handle,
-                             changes[i].data,
-                             (DWORD)changes[i].data_size,
-                             &bytes_written,
-                             NULL
-                         );
-                         CloseHandle(file_handle);
-                     } else {
-                         printf("Error creating/modifying file: %lu\n", GetLastError());
-                     }
-                 }
-                 break;
-                 
-             case SYNC_DELETE:
-                 if (changes[i].file.is_directory) {
-                     // Remove directory
-                     RemoveDirectory(target_path);
-                 } else {
-                     // Delete file
-                     DeleteFile(target_path);
-                 }
-                 break;
          }
-         
-         free(normalized_source);
+         bench_sync(run);
      }
+     free(live);
+ }
+ 
+ // Visit every entry below dir, a directory after its contents
+ static void bench_walk(const char *dir, void (*visit)(const file_info *f, void *arg), void *arg) {
+     file_info *files = NULL;
+     int file_count = 0;
      
-     free(normalized_target);
+     // The scan covers the whole tree in path order, so backwards every directory comes
+     // after its contents
+     scan_directory(dir, NULL, &files, &file_count);
+     for (int i = file_count - 1; i >= 0; i--) {
+         visit(&files[i], arg);
+     }
+     free(files);
  }
  
- // Send changes to the server
- int send_changes_to_server(sync_record *changes, int change_count, const char *server_ip) {
-     SOCKET sock;
-     struct sockaddr_in server_addr;
-     int send_result;
+ static void bench_compare_entry(const file_info *f, void *arg) {
+     bench_compare *c = (bench_compare *)arg;
+     char other[MAX_PATH_LENGTH];
+     uint64_t hash, other_hash;
      
-     // Create socket
-     sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-     if (sock == INVALID_SOCKET) {
-         printf("Error creating socket: %d\n", WSAGetLastError());
-         return 0;
+     c->entries++;
+     if (f->is_directory || !c->to) return;
+     snprintf(other, sizeof(other), "%s%s", c->to, f->path + strlen(c->from));
+     if (!hash_file(f->path, &hash) || !hash_file(other, &other_hash) || hash != other_hash) {
+         c->mismatched++;
      }
+ }
+ 
+ static void bench_remove_entry(const file_info *f, void *arg) {
+     (void)arg;
+     if (f->is_directory) remove_dir(f->path);
+     else file_delete(f->path);
+ }
+ 
+ static int compare_latency(const void *a, const void *b) {
+     long long x = *(const long long *)a, y = *(const long long *)b;
+     return (x > y) - (x < y);
+ }
+ 
+ static double bench_percentile(const bench_result *r, double q) {
+     if (r->latency_count == 0) return 0.0;
+     return r->latency_ns[(int)((r->latency_count - 1) * q)] / 1e6;
+ }
+ 
+ static void bench_report(bench_run *run, bench_result *r) {
+     bench_compare source = { run->src, run->dst, 0, 0 };
+     bench_compare target = { run->dst, NULL, 0, 0 };
+     char cpu[32];
      
-     // Configure server address
-     memset(&server_addr, 0, sizeof(server_addr));
-     server_addr.sin_family = AF_INET;
-     server_addr.sin_addr.s_addr = inet_addr(server_ip);
-     server_addr.sin_port = htons(SERVER_PORT);
+     bench_walk(run->src, bench_compare_entry, &source);
+     bench_walk(run->dst, bench_compare_entry, &target);
+     qsort(r->latency_ns, r->latency_count, sizeof(long long), compare_latency);
      
-     // Connect to server
-     if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
-         printf("Error connecting to server: %d\n", WSAGetLastError());
-         closesocket(sock);
-         return 0;
-     }
+     double seconds = r->wall_ns / 1e9;
+     if (seconds <= 0) seconds = 1e-9;
+     if (r->bytes > 0) snprintf(cpu, sizeof(cpu), "%.2f", (double)r->cpu_ns / r->bytes);
+     else snprintf(cpu, sizeof(cpu), "-");
      
-     // Send number of changes
-     send_result = send(sock, (char*)&change_count, sizeof(change_count), 0);
-     if (send_result == SOCKET_ERROR) {
-         printf("Error sending change count: %d\n", WSAGetLastError());
-         closesocket(sock);
-         return 0;
+     fprintf(stderr, "%-8s %7lld %9.1f %6d %8.3f %8.1f %9.1f %9s %8.2f %8.2f %8.2f %8.2f  ",
+             r->name, r->files, r->bytes / 1048576.0, r->passes, seconds,
+             r->bytes / 1048576.0 / seconds, r->files / seconds, cpu,
+             bench_percentile(r, 0.50), bench_percentile(r, 0.90), bench_percentile(r, 0.99),
+             bench_percentile(r, 1.0));
+     if (source.mismatched == 0 && source.entries == target.entries && r->failed_passes == 0 && r->missing == 0) {
+         fprintf(stderr, "ok\n");
+     } else {
+         fprintf(stderr, "%lld differ, %lld missing, %lld vs %lld entries, %d failed passes\n",
+                 source.mismatched, r->missing, source.entries, target.entries, r->failed_passes);
      }
+ }
+ 
+ // Benchmark main function
+ int bench_main(int argc, char *argv[]) {
+     bench_config cfg = { 2000, 2, 64, 250, 10 };
+     const char *work = BENCH_WORK_DIR;
+     const char *scenario = "all";
+     durability_mode durability = DURABILITY_BATCH;
+     int keep = 0;
+     client_options opts;
      
-     // Send each change
-     for (int i = 0; i < change_count; i++) {
-         // Load file data if needed
-         if ((changes[i].operation == SYNC_CREATE || changes[i].operation == SYNC_MODIFY) &&
-             !changes[i].file.is_directory) {
-             HANDLE file_handle = CreateFile(
-                 changes[i].file.path,
-                 GENERIC_READ,
-                 FILE_SHARE_READ,
-                 NULL,
-                 OPEN_EXISTING,
-                 FILE_ATTRIBUTE_NORMAL,
-                 NULL
-             );
-             
-             if (file_handle != INVALID_HANDLE_VALUE) {
-                 DWORD bytes_read;
-                 ReadFile(
-                     file_handle,
-                     changes[i].data,
-                     BUFFER_SIZE,
-                     &bytes_read,
-                     NULL
-                 );
-                 changes[i].data_size = bytes_read;
-                 CloseHandle(file_handle);
-             } else {
-                 printf("Error opening file for reading: %lu\n", GetLastError());
-                 changes[i].data_size = 0;
-             }
-         } else {
-             changes[i].data_size = 0;
-         }
+     client_options_init(&opts);
+     opts.interval = 3600; // Passes are driven directly, no rescans in the middle of one
+     
+     for (int i = 2; i < argc; i++) {
+         int taken = parse_client_option(&opts, argc, argv, &i);
+         if (taken < 0) return 1;
+         if (taken) continue;
          
-         // Send change record
-         send_result = send(sock, (char*)&changes[i], sizeof(sync_record), 0);
-         if (send_result == SOCKET_ERROR) {
-             printf("Error sending change record: %d\n", WSAGetLastError());
-             closesocket(sock);
-             return 0;
+         if (strcmp(argv[i], "--work") == 0 && i + 1 < argc) {
+             work = argv[++i];
+         } else if (strcmp(argv[i], "--scenario") == 0 && i + 1 < argc) {
+             scenario = argv[++i];
+         } else if (strcmp(argv[i], "--files") == 0 && i + 1 < argc) {
+             cfg.files = atoi(argv[++i]);
+         } else if (strcmp(argv[i], "--huge-files") == 0 && i + 1 < argc) {
+             cfg.huge_files = atoi(argv[++i]);
+         } else if (strcmp(argv[i], "--huge-mb") == 0 && i + 1 < argc) {
+             cfg.huge_mb = atoi(argv[++i]);
+         } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+             cfg.batch = atoi(argv[++i]);
+         } else if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc) {
+             cfg.rounds = atoi(argv[++i]);
+         } else if (strcmp(argv[i], "--sync") == 0 && i + 1 < argc) {
+             if (!parse_durability(argv[++i], &durability)) return 1;
+         } else if (strcmp(argv[i], "--keep") == 0) {
+             keep = 1;
+         } else {
+             printf("Unknown option: %s\n", argv[i]);
+             printf("Usage: %s bench [--work <dir>] [--scenario all|small|huge|deep|churn] "
+                    "[--files <n>] [--huge-files <n>] [--huge-mb <n>] [--batch <n>] [--rounds <n>] "
+                    "[--sync batch|syncfs|none] [--keep] [client options]\n", argv[0]);
+             return 1;
          }
-         
-         // Send file data if needed
-         if (changes[i].data_size > 0) {
-             send_result = send(sock, changes[i].data, (int)changes[i].data_size, 0);
-             if (send_result == SOCKET_ERROR) {
-                 printf("Error sending file data: %d\n", WSAGetLastError());
-                 closesocket(sock);
-                 return 0;
-             }
+     }
+     
+     int all = strcmp(scenario, "all") == 0;
+     if (!all && strcmp(scenario, "small") != 0 && strcmp(scenario, "huge") != 0 &&
+         strcmp(scenario, "deep") != 0 && strcmp(scenario, "churn") != 0) {
+         printf("Unknown scenario: %s\n", scenario);
+         return 1;
+     }
+     if (cfg.files < 1 || cfg.huge_files < 0 || cfg.huge_mb < 1 || cfg.batch < 1 || cfg.rounds < 0) {
+         printf("Invalid benchmark size\n");
+         return 1;
+     }
+     if (strlen(work) > MAX_PATH_LENGTH / 2) {
+         printf("Work directory path too long\n");
+         return 1;
+     }
+     
+     // Never clear out a directory we did not make
+     if (!make_dir(work)) {
+         file_info *files = NULL;
+         int file_count = 0;
+         scan_directory(work, NULL, &files, &file_count);
+         free(files);
+         if (file_count > 0) {
+             printf("Work directory %s is not empty\n", work);
+             return 1;
          }
      }
      
-     closesocket(sock);
-     return 1;
- }
- 
- // Watch directory for changes
- void watch_directory(const char *dir_path, int interval, const char *server_ip) {
-     file_info *old_files = NULL, *new_files = NULL;
-     int old_count = 0, new_count = 0;
-     sync_record *changes = NULL;
-     int change_count = 0;
+     static bench_run run;
+     static bench_server server;
+     char state[MAX_PATH_LENGTH], index_path[MAX_PATH_LENGTH];
+     char hash_cache_path[MAX_PATH_LENGTH], snapshot_path[MAX_PATH_LENGTH], log_path[MAX_PATH_LENGTH];
+     snprintf(run.src, sizeof(run.src), "%s%csrc", work, PATH_SEP);
+     snprintf(run.dst, sizeof(run.dst), "%s%cdst", work, PATH_SEP);
+     snprintf(state, sizeof(state), "%s%cstate", work, PATH_SEP);
+     snprintf(index_path, sizeof(index_path), "%s%cstate%cchunks.idx", work, PATH_SEP, PATH_SEP);
+     snprintf(hash_cache_path, sizeof(hash_cache_path), "%s%cstate%chashcache.bin", work, PATH_SEP, PATH_SEP);
+     snprintf(snapshot_path, sizeof(snapshot_path), "%s%cstate%csnapshot.idx", work, PATH_SEP, PATH_SEP);
+     snprintf(log_path, sizeof(log_path), "%s%cbench.log", work, PATH_SEP);
+     make_dir(run.src);
+     make_dir(run.dst);
+     make_dir(state);
+     opts.hash_cache_path = hash_cache_path;
+     opts.snapshot_path = snapshot_path;
+     run.rng = 0x9E3779B97F4A7C15ULL;
+     run.buffer = (unsigned char *)malloc(BUFFER_SIZE);
      
-     // Initial scan
-     scan_directory(dir_path, &old_files, &old_count);
+     if (!run.buffer || !net_startup()) {
+         free(run.buffer);
+         return 1;
+     }
      
-     while (1) {
-         // Wait for the specified interval
-         Sleep(interval * 1000);
-         
-         // Scan directory again
-         scan_directory(dir_path, &new_files, &new_count);
-         
-         // Detect changes
-         compare_directories(old_files, old_count, new_files, new_count, &changes, &change_count);
+     // Server on a loopback thread
+     server.index_path = index_path;
+     if (!server_context_init(&server.ctx, run.dst, index_path, durability)) {
+         net_cleanup();
+         return 1;
+     }
+     server.listen_socket = server_listen(INADDR_LOOPBACK);
+     if (server.listen_socket == INVALID_SOCKET || !thread_start(&server.thread, bench_server_thread, &server)) {
+         printf("Could not start the loopback server\n");
+         net_cleanup();
+         return 1;
+     }
+     
+     fprintf(stderr, "Benchmark in %s, log in %s\n", work, log_path);
+     fprintf(stderr, "I/O backend: %s, durability: %s, compression: %s, dedup: %s, content hash: %s\n",
+             server.ctx.io.ring_fd >= 0 ? "io_uring" : "synchronous",
+             durability == DURABILITY_BATCH ? "batched fsync" : durability == DURABILITY_SYNCFS ? "syncfs" : "none",
+             codec_name(opts.codec), opts.dedup ? "on" : "off", opts.content_hash ? "on" : "off");
+     fflush(stderr);
+     
+     // Both sides report every file; keep that out of the results
+     if (!freopen(log_path, "w", stdout)) {
+         fprintf(stderr, "Could not open %s\n", log_path);
+     }
+     
+     int resumed;
+     if (sync_client_init(&run.client, run.src, "127.0.0.1", &opts, &resumed)) {
+         static const struct {
+             const char *name;
+             void (*run)(bench_run *run, const bench_config *cfg);
+         } scenarios[] = {
+             { "small", bench_small },
+             { "huge", bench_huge },
+             { "deep", bench_deep },
+             { "churn", bench_churn }
+         };
          
-         // Send changes to server if any
-         if (change_count > 0) {
-             printf("Detected %d changes\n", change_count);
-             if (send_changes_to_server(changes, change_count, server_ip)) {
-                 printf("Changes sent to server\n");
-             } else {
-                 printf("Failed to send changes to server\n");
-             }
+         fprintf(stderr, "%-8s %7s %9s %6s %8s %8s %9s %9s %8s %8s %8s %8s  %s\n",
+                 "scenario", "ops", "MB", "passes", "time s", "MB/s", "files/s", "cpu ns/B",
+                 "p50 ms", "p90 ms", "p99 ms", "max ms", "tree");
+         for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+             if (!all && strcmp(scenario, scenarios[i].name) != 0) continue;
+             
+             bench_result result;
+             memset(&result, 0, sizeof(result));
+             result.name = scenarios[i].name;
+             run.result = &result;
+             run.pass_start = 0;
+             scenarios[i].run(&run, &cfg);
+             run.result = NULL;
+             
+             fflush(stdout);
+             bench_report(&run, &result);
+             free(result.latency_ns);
          }
-         
-         // Free old files and update
-         free(old_files);
-         old_files = new_files;
-         old_count = new_count;
-         new_files = NULL;
-         
-         // Free changes
-         free(changes);
-         changes = NULL;
+         sync_client_destroy(&run.client);
      }
+     
+     bench_server_stop(&server);
+     server_context_destroy(&server.ctx);
+     free(run.buffer);
+     fflush(stdout);
+     
+     if (!keep) {
+         bench_walk(work, bench_remove_entry, NULL);
+         remove_dir(work);
+     }
+     fprintf(stderr, "\n");
+     profile_report(stderr);
+     net_cleanup();
+     return 0;
  }
  
  int main(int argc, char *argv[]) {
      if (argc < 2) {
-         printf("Usage: %s [client|server] [options]\n", argv[0]);
+         printf("Usage: %s [client|server|bench] [options]\n", argv[0]);
          return 1;
      }
      
+     // The profile covers every mode; client and server also report when signalled
+     profile_init();
      if (strcmp(argv[1], "client") == 0) {
+         profile_watch();
          return client_main(argc, argv);
      } else if (strcmp(argv[1], "server") == 0) {
+         profile_watch();
          return server_main(argc, argv);
+     } else if (strcmp(argv[1], "bench") == 0) {
+         return bench_main(argc, argv);
      } else {
          printf("Unknown mode: %s\n", argv[1]);
-         printf("Usage: %s [client|server] [options]\n", argv[0]);
+         printf("Usage: %s [client|server|bench] [options]\n", argv[0]);
          return 1;
      }
  }
\ No newline at end of file
@@ -1,39 +1,763 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <stdarg.h>
 #include <time.h>
+#include <math.h>
+#include <signal.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
 #include <windows.h>
 #include <psapi.h>
 
+// Link with Winsock library
+#pragma comment(lib, "ws2_32.lib")
+
+#define fseek64 _fseeki64
+#define ftell64 _ftelli64
+#define popen _popen
+#define pclose _pclose
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+#include <syslog.h>
+
+typedef unsigned long long DWORDLONG;
+#define fseek64 fseeko
+#define ftell64 ftello
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define closesocket close
+#define WSAGetLastError() errno
+#endif
+
+#define MAX_CORES 256              // Cores reported individually; the aggregate covers all of them
+#define MAX_DISKS 64
+#define MAX_INTERFACES 16          // Network interfaces reported; any beyond are left out
+#define SOFTIRQ_TYPES 10           // Columns of the softirq line of /proc/stat
+#define NETLINK_BUFFER_SIZE 32768  // One receive of an RTM_GETSTATS dump
+#define PROC_BUFFER_SIZE 65536     // Large enough for the cpu lines of /proc/stat on big machines
+#define RING_SLOTS 4096            // Power of two; four seconds of samples at 1 ms
+#define DRAIN_PERIOD_MS 50         // How often the output side empties the ring
+
+#define LOG_MAGIC "RESMON01"
+#define LOG_BLOCK_MAGIC 0x4b4c4252 // "RBLK"
+#define LOG_BLOCK_SIZE 65536       // Every block starts at a fixed offset and decodes on its own
+#define LOG_COLUMNS (6 + MAX_CORES)
+#define ROLLUP_MAGIC "RESROLL1"
+#define ROLLUP_LEVELS 2            // Minutes and hours; the log itself is the finest level
+#define ROLLUP_METRICS 4           // CPU %, memory %, disk read and write rates
+#define ROLLUP_BINS 32
+
+#define MAX_TOP 64                 // Most processes the per-process view lists
+#define MAX_SCAN_WORKERS 8         // Threads reading /proc/[pid] besides the output thread
+#define SCAN_CHUNK 64              // Processes a scan thread claims at a time
+#define FD_RESERVE 256             // Descriptors left for everything but per-process files
+#define MAX_CGROUPS 8192
+#define CGROUP_PATH_SIZE 512
+#define CGROUP_REFRESH_SCANS 10    // Every so many scans idle groups are read anyway
+#define CGROUP_FDS 128             // cpu.stat files kept open, taken out of FD_RESERVE
+#define SCREEN_MAX_ROWS 256
+#define SCREEN_MAX_COLS 512
+#define SCREEN_CELL_MAX_BYTES 28   // Cursor move, colour change and a UTF-8 character
+#define SPARK_POINTS 512           // Seconds of history behind the sparklines
+#define SPARK_PERIOD_MS 1000
+#define METRICS_PAGE_SIZE (8192 + MAX_CORES * 64 + MAX_INTERFACES * 256)
+#define METRICS_REQUEST_SIZE 4096  // Request line and headers; anything longer is refused
+#define MAX_ALERT_RULES 1024
+#define ALERT_METRICS (4 + MAX_CORES) // cpu, mem, read and write rates, then each core
+#define REPLAY_MAX_GAP_MS 5000     // Longer gaps in a recording (the monitor was stopped) play as this
+#define PATTERN_PERIOD_MS 60000    // Cycle of the periodic load patterns
+#define PROFILE_SUB_BITS 4         // 16 histogram buckets per power of two: within 6.25%
+#define PROFILE_BUCKETS ((64 - PROFILE_SUB_BITS + 1) << PROFILE_SUB_BITS)
+
+// Worst case for one sample: an escaped timestamp plus a fully spelled-out value per column
+#define LOG_SAMPLE_MAX_BITS(cores) (69 + (6 + (cores)) * 78)
+
+// Traffic through one network interface since it came up
+typedef struct {
+    char name[16];
+    DWORDLONG rx_bytes;
+    DWORDLONG tx_bytes;
+    DWORDLONG rx_packets;
+    DWORDLONG tx_packets;
+} NetInterface;
+
 // Structure to hold system resource data
 typedef struct {
     time_t timestamp;
+    int timestamp_ms;              // Milliseconds past timestamp
     double cpu_usage;
     double memory_usage_percent;
     DWORDLONG memory_total;
     DWORDLONG memory_available;
     DWORDLONG disk_read_bytes;
     DWORDLONG disk_write_bytes;
-    // Network stats would require additional libraries
+    int core_count;                // Cores in core_usage, 0 if the platform reports none
+    float core_usage[MAX_CORES];
+    int interface_count;           // Interfaces in interfaces, 0 if the platform reports none
+    NetInterface interfaces[MAX_INTERFACES];
+    DWORDLONG context_switches;    // Since boot
+    DWORDLONG softirqs[SOFTIRQ_TYPES]; // Since boot, in the order of softirq_names
+    int procs_running;             // Run queue length, over all CPUs
+    int procs_blocked;             // Tasks waiting for I/O
 } SystemResources;
 
-// Function to get CPU usage (uses PDH in a real implementation)
-double get_cpu_usage() {
-    // This is a simplified version - a real implementation would use PDH
-    // For demonstration, we return a number between 0-100
-    static int last_value = 50;
-    // Generate a value that somewhat resembles real CPU usage patterns
-    int change = rand() % 11 - 5; // -5 to +5
-    last_value += change;
+// What the per-process view ranks by
+typedef enum {
+    SORT_CPU,
+    SORT_RSS,
+    SORT_IO,
+    SORT_SWITCHES
+} ProcessSort;
+
+// Command line settings
+typedef struct {
+    int interval_ms;               // Time between samples
+    const char *log_path;          // Binary log the samples are appended to
+    int top;                       // Processes to list, 0 for no per-process view
+    ProcessSort sort;
+    int cgroups;                   // Control groups to list, 0 for no cgroup view
+    const char *cgroup_root;       // Where cgroup v2 is mounted, NULL to look it up
+    int refresh_hz;                // Display frames per second
+    const char *listen;            // Metrics endpoint: a loopback port or unix:<path>, NULL for none
+    const char *rules_path;        // Alert rules, NULL for no alerting
+    const char *alert_sink;        // file:<path>, pipe:<command> or syslog
+    const char *replay_path;       // Recorded log to play back instead of sampling
+    const char *pattern;           // Synthetic load to generate instead of sampling
+    double speed;                  // Replay rate against the recorded time, 0 for as fast as possible
+    int cores;                     // Cores of generated samples
+    unsigned long long max_samples; // Stop after this many replayed or generated samples, 0 for no limit
+} MonitorOptions;
+
+// Per-process and per-cgroup accounting; only the Linux build has them
+typedef struct ProcessTable ProcessTable;
+typedef struct CgroupTable CgroupTable;
+
+// How well the sampler keeps time. Written by the collector thread only and read by the
+// output side, so every access goes through __atomic with relaxed ordering.
+typedef struct {
+    unsigned long long samples;
+    unsigned long long missed;         // Timer ticks that passed while a sample was being taken
+    unsigned long long dropped;        // Samples thrown away because the ring was full
+    unsigned long long jitter_sum_ns;  // Total lateness of the wakeups behind their deadlines
+    unsigned long long jitter_max_ns;
+} SamplerStats;
+
+// Start of the binary log
+typedef struct {
+    char magic[8];
+    uint32_t block_size;
+    uint32_t core_count;           // Every sample in the log has this many core columns
+    uint64_t reserved[2];
+} LogFileHeader;
+
+// Start of each block; the headers double as the log's index, one per LOG_BLOCK_SIZE
+typedef struct {
+    uint32_t magic;
+    uint32_t count;                // Samples in the block
+    uint32_t bits;                 // Bits of payload in use
+    uint32_t reserved;
+    int64_t first_ms;              // Timestamps of the first and last sample, ms since the epoch
+    int64_t last_ms;
+} LogBlockHeader;
+
+#define LOG_PAYLOAD_SIZE (LOG_BLOCK_SIZE - (int)sizeof(LogBlockHeader))
+
+// Compression state carried from one sample to the next within a block
+typedef struct {
+    int64_t prev_ms;
+    int64_t prev_delta;
+    uint64_t prev[LOG_COLUMNS];
+    unsigned char lead[LOG_COLUMNS];   // Window of meaningful bits last spelled out per column
+    unsigned char trail[LOG_COLUMNS];
+} LogCodec;
+
+// Appends samples to the binary log
+typedef struct {
+    FILE *file;
+    int core_count;
+    long long block;               // Index of the block being filled
+    LogBlockHeader header;
+    unsigned char payload[LOG_PAYLOAD_SIZE];
+    uint32_t flushed;              // Whole payload bytes already written out
+    LogCodec codec;
+} LogWriter;
+
+// A file mapped read-only
+typedef struct {
+    const unsigned char *base;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int file;
+#endif
+} MappedFile;
+
+// A log mapped for reading
+typedef struct {
+    MappedFile map;
+    int core_count;
+    long long block_count;
+} LogReader;
+
+// Walks the samples of one block
+typedef struct {
+    const unsigned char *payload;
+    uint32_t bits;
+    uint32_t position;
+    uint32_t remaining;
+    int core_count;
+    LogCodec codec;
+} LogCursor;
+
+// Rollups: per-minute and per-hour summaries written next to the log while it is recorded
+typedef struct {
+    uint32_t count;
+    float min;
+    float max;
+    uint32_t reserved;
+    double sum;
+    uint32_t histogram[ROLLUP_BINS];   // See rollup_bin for the bin edges
+} RollupStat;
+
+typedef struct {
+    int64_t start_ms;              // Start of the bucket, a multiple of the level's length
+    uint32_t samples;
+    uint32_t reserved;
+    RollupStat stats[ROLLUP_METRICS];
+} RollupRecord;
+
+typedef struct {
+    char magic[8];
+    int64_t level_ms;
+    uint32_t record_size;
+    uint32_t reserved;
+} RollupFileHeader;
+
+// Builds the rollups from the samples as they are logged
+typedef struct {
+    FILE *files[ROLLUP_LEVELS];
+    RollupRecord open[ROLLUP_LEVELS];  // Buckets still taking samples
+    int have_prev;                 // Disk rates need the sample before
+    int64_t prev_ms;
+    uint64_t prev_read;
+    uint64_t prev_write;
+} RollupWriter;
+
+// Colours a cell can be drawn in; attr_escapes holds the codes
+typedef enum {
+    ATTR_NORMAL,
+    ATTR_TITLE,
+    ATTR_DIM,
+    ATTR_LOW,
+    ATTR_MEDIUM,
+    ATTR_HIGH,
+    ATTR_SPARK
+} CellAttr;
+
+// One character position on the terminal
+typedef struct {
+    uint32_t ch;                   // Unicode code point
+    uint32_t attr;                 // A CellAttr
+} Cell;
+
+// Terminal contents. Each frame is drawn into cells, and screen_flush sends escapes only for
+// the cells that differ from shown, which is what the terminal currently displays.
+typedef struct {
+    int rows;
+    int cols;
+    Cell *cells;
+    Cell *shown;
+    int redraw;                    // The terminal contents are unknown; repaint everything
+    int cursor_row;                // Where the terminal cursor is, -1 when unknown
+    int cursor_col;
+    uint32_t attr;                 // Colour the terminal is drawing in
+    char *out;                     // Escapes for one frame, sent with a single write
+    size_t out_len;
+    size_t out_size;
+} Screen;
+
+// History behind the sparklines, one point per SPARK_PERIOD_MS
+typedef struct {
+    float cpu[SPARK_POINTS];
+    float memory[SPARK_POINTS];
+    float read_rate[SPARK_POINTS];
+    float write_rate[SPARK_POINTS];
+    float net_rate[SPARK_POINTS];  // Bytes a second received and sent, over all interfaces
+    int points;                    // Points so far; the newest is at (points - 1) % SPARK_POINTS
+    int64_t point_start_ms;        // Start of the point being gathered
+    double cpu_sum;
+    int cpu_samples;
+    SystemResources point_base;    // Sample the point being gathered started from
+    int rate_count;                // Interfaces with rates over the last point
+    char rate_names[MAX_INTERFACES][16];
+    float rx_rate[MAX_INTERFACES];
+    float tx_rate[MAX_INTERFACES];
+    float packet_rate[MAX_INTERFACES]; // Packets a second, both ways
+    float switch_rate;             // Context switches a second over the last point
+    float softirq_rate[SOFTIRQ_TYPES];
+    SystemResources latest;
+    int have_latest;
+} Dashboard;
+
+// Latest sample in Prometheus text format, for the metrics endpoint. The output side renders
+// each sample into the page scrapes are not reading and then flips current; a scrape pins the
+// page it copies in readers, and a page that is pinned is skipped rather than waited for.
+typedef struct {
+    char *pages[2];
+    size_t lengths[2];
+    int current;                   // Page scrapes copy from
+    int readers[2];                // Scrapes copying each page
+    unsigned long long skipped;    // Updates dropped because a scrape held the spare page
+    unsigned long long scrapes;
+    SOCKET listener;
+    char unix_path[108];           // Socket file to remove on close, empty for TCP
+    char *copy;                    // The server thread's own copy of the page being served
+    int running;
+#ifdef _WIN32
+    HANDLE thread;
+#else
+    pthread_t thread;
+#endif
+} MetricsServer;
+
+// What an alert rule tests
+typedef enum {
+    ALERT_THRESHOLD,               // The value itself
+    ALERT_RATE,                    // Its change per second since the previous sample
+    ALERT_ZSCORE                   // How many deviations it is from its moving average
+} AlertKind;
+
+// One alert rule and its running state; evaluating it touches nothing else
+typedef struct {
+    char name[32];
+    int metric;                    // Index into AlertEngine.values
+    AlertKind kind;
+    int above;                     // Holds above limit, otherwise below it
+    double limit;
+    int sustain;                   // Samples in a row the condition must hold to fire, or fail to resolve
+    double alpha;                  // Weight of a new sample in the moving average (ALERT_ZSCORE)
+    double mean;
+    double variance;
+    unsigned long long seen;       // Samples averaged so far
+    int streak;                    // Samples in a row that disagree with firing
+    int firing;
+} AlertRule;
+
+typedef enum {
+    SINK_FILE,
+    SINK_PIPE,
+    SINK_SYSLOG
+} AlertSinkKind;
+
+// Alert rules, the metric values they are evaluated against and where alerts go
+typedef struct {
+    AlertRule *rules;
+    int rule_count;
+    int metric_count;              // Metrics in values for the current core count
+    double values[ALERT_METRICS];
+    double prev_values[ALERT_METRICS];
+    int64_t prev_ms;
+    DWORDLONG prev_read;
+    DWORDLONG prev_write;
+    int have_prev;
+    int firing;                    // Rules firing now
+    unsigned long long raised;     // Alerts sent, firing and resolved
+    AlertSinkKind sink;
+    FILE *out;                     // File or pipe sink
+} AlertEngine;
+
+// Synthetic load shapes; the level is a fraction of the machine
+typedef enum {
+    PATTERN_STEADY,                // Half load throughout
+    PATTERN_SINE,                  // A wave between 5% and 95%
+    PATTERN_RAMP,                  // Climbs from idle to full, then drops back
+    PATTERN_SPIKE,                 // Mostly idle with a burst at the top of each cycle
+    PATTERN_NOISE,                 // A random walk
+    PATTERN_COUNT
+} LoadPattern;
+
+static const char *pattern_names[PATTERN_COUNT] = {"steady", "sine", "ramp", "spike", "noise"};
+
+// Where samples come from when they are not collected: a recorded log, played straight from its
+// mapping, or a load pattern. Either way a sample is written into the caller's buffer in place.
+typedef struct {
+    int replaying;
+    LogReader reader;
+    LogCursor cursor;
+    long long block;               // Block the cursor is in
+    unsigned long long lost;       // Samples of blocks cut short or corrupt
+    unsigned long long total;      // Samples in the log, or 0 when generating
+    LoadPattern pattern;
+    int core_count;
+    int interval_ms;
+    int64_t start_ms;
+    int64_t ms;                    // Time of the next generated sample
+    double walk;                   // Level of PATTERN_NOISE
+} SampleSource;
+
+// Softirq types as the kernel orders them in /proc/stat and /proc/softirqs
+static const char *softirq_names[SOFTIRQ_TYPES] = {
+    "hi", "timer", "net_tx", "net_rx", "block", "irq_poll", "tasklet", "sched", "hrtimer", "rcu"
+};
+
+// Stages of the monitor's own work that are timed
+typedef enum {
+    STAGE_COLLECT,                 // Taking a sample (collector thread)
+    STAGE_FORMAT,                  // Encoding it into the log, rollups and dashboard
+    STAGE_WRITE,                   // Writing the log and rollups out
+    STAGE_ALERTS,
+    STAGE_SCAN,                    // Process and cgroup scans
+    STAGE_DRAW,
+    STAGE_METRICS,                 // Rendering the metrics page
+    STAGE_COUNT
+} ProfileStage;
+
+// Latencies of one stage, as an HDR histogram: buckets are linear within each power of two, so
+// every value is kept to PROFILE_SUB_BITS significant bits whatever its size. Each stage runs on
+// one thread only, which is the only writer; the report reads through __atomic, relaxed.
+typedef struct {
+    unsigned long long count;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    unsigned long long buckets[PROFILE_BUCKETS];
+} StageHistogram;
+
+typedef struct {
+    StageHistogram stages[STAGE_COUNT];
+    long long start_ns;            // When profiling started, for the share of wall time
+    long long start_cpu_ns;
+} Profiler;
+
+static const char *stage_names[STAGE_COUNT] = {"collect", "format", "write", "alerts", "scan", "draw", "metrics"};
+static Profiler profiler;
+
+static volatile sig_atomic_t stop_requested = 0;
+#ifndef _WIN32
+static volatile sig_atomic_t resize_requested = 0;
+static volatile sig_atomic_t profile_requested = 0;
+#endif
+
+#ifndef _WIN32
+// Busy and total jiffies of a CPU line in /proc/stat
+typedef struct {
+    unsigned long long busy;
+    unsigned long long total;
+} CpuTimes;
+
+// The /proc files read on every sample. They stay open and are read with pread from offset 0,
+// which makes the kernel regenerate them, so a sample costs a few system calls and no opens.
+typedef struct {
+    int stat_fd;
+    int meminfo_fd;
+    int diskstats_fd;
+    int netlink_fd;                // rtnetlink socket for RTM_GETSTATS, -1 if the kernel lacks it
+    int netdev_fd;                 // /proc/net/dev, read instead when there is no netlink
+    uint32_t netlink_seq;
+    char *buffer;
+    char *stat_rest;               // First line after the cpu lines of the /proc/stat just read
+    unsigned char *netlink_buffer;
+    int if_indexes[2 * MAX_INTERFACES]; // Interface names looked up so far, by index
+    char if_names[2 * MAX_INTERFACES][IF_NAMESIZE];
+    int if_known;
+    CpuTimes last_total;
+    CpuTimes last_core[MAX_CORES];
+    int core_count;
+    char disks[MAX_DISKS][32];     // Whole disks from /sys/block; partitions would count twice
+    int disk_count;
+} ProcCollector;
+
+static ProcCollector collector;
+
+// Read a whole /proc file from offset 0, NUL-terminated. Returns its length, -1 on error.
+static int pread_file(int fd, char *buffer, int size) {
+    int length = 0;
+    
+    while (length < size - 1) {
+        ssize_t n = pread(fd, buffer + length, size - 1 - length, length);
+        if (n < 0) return -1;
+        if (n == 0) break;
+        length += (int)n;
+    }
+    buffer[length] = '\0';
+    return length;
+}
+
+// Read a whole /proc file into the collector's buffer
+static int proc_read(int fd) {
+    return pread_file(fd, collector.buffer, PROC_BUFFER_SIZE);
+}
+
+// Start of the line after this one, NULL at the end of the buffer
+static char *next_line(char *line) {
+    char *end = strchr(line, '\n');
+    return end && end[1] ? end + 1 : NULL;
+}
+
+// Parse the jiffies of one "cpu" line; guest time is already part of user and nice
+static int parse_cpu_times(const char *line, CpuTimes *times) {
+    unsigned long long user, nice, system, idle, iowait = 0, irq = 0, softirq = 0, steal = 0;
+    
+    if (sscanf(line, "%llu %llu %llu %llu %llu %llu %llu %llu",
+               &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal) < 4) {
+        return 0;
+    }
+    times->busy = user + nice + system + irq + softirq + steal;
+    times->total = times->busy + idle + iowait;
+    return 1;
+}
+
+// Share of the time between two readings spent busy, in percent
+static double cpu_percent(const CpuTimes *last, const CpuTimes *now) {
+    if (now->total <= last->total) return 0.0;
+    return 100.0 * (double)(now->busy - last->busy) / (double)(now->total - last->total);
+}
+
+// Note the whole disks, so their partitions and other block devices are left out of the totals
+static void find_disks(void) {
+    DIR *dir = opendir("/sys/block");
+    struct dirent *entry;
+    
+    collector.disk_count = 0;
+    if (dir == NULL) return;
+    while ((entry = readdir(dir)) != NULL && collector.disk_count < MAX_DISKS) {
+        if (entry->d_name[0] == '.') continue;
+        if (strncmp(entry->d_name, "loop", 4) == 0 || strncmp(entry->d_name, "ram", 3) == 0) continue;
+        if (strlen(entry->d_name) >= sizeof(collector.disks[0])) continue;
+        strcpy(collector.disks[collector.disk_count++], entry->d_name);
+    }
+    closedir(dir);
+}
+
+static int is_whole_disk(const char *name) {
+    for (int i = 0; i < collector.disk_count; i++) {
+        if (strcmp(collector.disks[i], name) == 0) return 1;
+    }
+    return 0;
+}
+
+// Switch network counters over to /proc/net/dev, for kernels without RTM_GETSTATS (before 4.7)
+static void use_proc_net_dev(void) {
+    if (collector.netlink_fd >= 0) close(collector.netlink_fd);
+    collector.netlink_fd = -1;
+    collector.netdev_fd = open("/proc/net/dev", O_RDONLY | O_CLOEXEC);
+    if (collector.netdev_fd < 0) printf("No /proc/net/dev, network I/O is not reported\n");
+}
+
+// Name of an interface; if_indextoname costs a socket and an ioctl, so each index is looked up once
+static const char *interface_name(int index) {
+    for (int i = 0; i < collector.if_known; i++) {
+        if (collector.if_indexes[i] == index) return collector.if_names[i];
+    }
+    if (collector.if_known == 2 * MAX_INTERFACES) collector.if_known = 0; // Interfaces came and went; start over
+    char *name = collector.if_names[collector.if_known];
+    if (if_indextoname(index, name) == NULL) snprintf(name, IF_NAMESIZE, "if%d", index);
+    collector.if_indexes[collector.if_known++] = index;
+    return name;
+}
+
+// Take the 64-bit link counters of every interface from a single RTM_GETSTATS dump: one send,
+// and normally one receive. Returns 0 if the kernel refused the request.
+static int netlink_stats(NetInterface *interfaces, int *count) {
+    struct {
+        struct nlmsghdr header;
+        struct if_stats_msg stats;
+    } request;
+    
+    memset(&request, 0, sizeof(request));
+    request.header.nlmsg_len = sizeof(request);
+    request.header.nlmsg_type = RTM_GETSTATS;
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.header.nlmsg_seq = ++collector.netlink_seq;
+    request.stats.family = AF_UNSPEC;
+    request.stats.filter_mask = IFLA_STATS_FILTER_BIT(IFLA_STATS_LINK_64);
+    if (send(collector.netlink_fd, &request, sizeof(request), 0) != (ssize_t)sizeof(request)) return 0;
+    
+    for (;;) {
+        ssize_t received = recv(collector.netlink_fd, collector.netlink_buffer, NETLINK_BUFFER_SIZE, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return 0;
+        
+        int length = (int)received;
+        for (struct nlmsghdr *message = (struct nlmsghdr *)collector.netlink_buffer;
+             NLMSG_OK(message, length); message = NLMSG_NEXT(message, length)) {
+            if (message->nlmsg_seq != collector.netlink_seq) continue; // Left over from an earlier dump
+            if (message->nlmsg_type == NLMSG_DONE) return 1;
+            if (message->nlmsg_type == NLMSG_ERROR) return 0;
+            if (message->nlmsg_type != RTM_NEWSTATS || *count == MAX_INTERFACES) continue;
+            
+            struct if_stats_msg *stats = (struct if_stats_msg *)NLMSG_DATA(message);
+            struct rtattr *attr = (struct rtattr *)((char *)stats + NLMSG_ALIGN(sizeof(*stats)));
+            int remaining = (int)message->nlmsg_len - NLMSG_LENGTH(sizeof(*stats));
+            for (; RTA_OK(attr, remaining); attr = RTA_NEXT(attr, remaining)) {
+                if (attr->rta_type != IFLA_STATS_LINK_64) continue;
+                
+                // Older kernels send a shorter structure; the attribute is only 4-byte aligned
+                struct rtnl_link_stats64 link;
+                memset(&link, 0, sizeof(link));
+                size_t size = RTA_PAYLOAD(attr) < sizeof(link) ? RTA_PAYLOAD(attr) : sizeof(link);
+                memcpy(&link, RTA_DATA(attr), size);
+                
+                NetInterface *entry = &interfaces[(*count)++];
+                snprintf(entry->name, sizeof(entry->name), "%s", interface_name((int)stats->ifindex));
+                entry->rx_bytes = link.rx_bytes;
+                entry->tx_bytes = link.tx_bytes;
+                entry->rx_packets = link.rx_packets;
+                entry->tx_packets = link.tx_packets;
+            }
+        }
+    }
+}
+
+// Take the counters from /proc/net/dev: two header lines, then "name: rx fields... tx fields..."
+static void proc_net_dev_stats(NetInterface *interfaces, int *count) {
+    if (proc_read(collector.netdev_fd) < 0) return;
+    
+    for (char *line = collector.buffer; line && *count < MAX_INTERFACES; line = next_line(line)) {
+        char *colon = strchr(line, ':');
+        char *newline = strchr(line, '\n');
+        if (colon == NULL || (newline && colon > newline)) continue;
+        
+        while (*line == ' ') line++;
+        NetInterface *entry = &interfaces[*count];
+        int length = (int)(colon - line) < (int)sizeof(entry->name) - 1 ? (int)(colon - line) : (int)sizeof(entry->name) - 1;
+        unsigned long long rx_bytes, rx_packets, tx_bytes, tx_packets;
+        if (sscanf(colon + 1, "%llu %llu %*u %*u %*u %*u %*u %*u %llu %llu",
+                   &rx_bytes, &rx_packets, &tx_bytes, &tx_packets) != 4) continue;
+        memcpy(entry->name, line, length);
+        entry->name[length] = '\0';
+        entry->rx_bytes = rx_bytes;
+        entry->tx_bytes = tx_bytes;
+        entry->rx_packets = rx_packets;
+        entry->tx_packets = tx_packets;
+        (*count)++;
+    }
+}
+#endif
+
+// Function to open whatever the collectors read on every sample
+int init_collectors() {
+#ifdef _WIN32
+    return 1;
+#else
+    collector.stat_fd = open("/proc/stat", O_RDONLY | O_CLOEXEC);
+    collector.meminfo_fd = open("/proc/meminfo", O_RDONLY | O_CLOEXEC);
+    collector.diskstats_fd = open("/proc/diskstats", O_RDONLY | O_CLOEXEC);
+    collector.buffer = (char *)malloc(PROC_BUFFER_SIZE);
+    collector.netlink_buffer = (unsigned char *)malloc(NETLINK_BUFFER_SIZE);
+    if (collector.stat_fd < 0 || collector.meminfo_fd < 0 || collector.buffer == NULL || collector.netlink_buffer == NULL) {
+        printf("Error opening /proc\n");
+        return 0;
+    }
+    if (collector.diskstats_fd < 0) printf("No /proc/diskstats, disk I/O is not reported\n");
+    find_disks();
+    
+    // Network counters come from one rtnetlink dump per sample; /proc/net/dev is the fallback
+    collector.netdev_fd = -1;
+    collector.netlink_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (collector.netlink_fd < 0) use_proc_net_dev();
+    return 1;
+#endif
+}
+
+// Function to close the collectors
+void close_collectors() {
+#ifndef _WIN32
+    if (collector.stat_fd >= 0) close(collector.stat_fd);
+    if (collector.meminfo_fd >= 0) close(collector.meminfo_fd);
+    if (collector.diskstats_fd >= 0) close(collector.diskstats_fd);
+    if (collector.netlink_fd >= 0) close(collector.netlink_fd);
+    if (collector.netdev_fd >= 0) close(collector.netdev_fd);
+    free(collector.buffer);
+    free(collector.netlink_buffer);
+    memset(&collector, 0, sizeof(collector));
+#endif
+}
+
+// Function to get CPU usage since the last call, overall and per core (percent)
+double get_cpu_usage(float *core_usage, int *core_count) {
+#ifdef _WIN32
+    // Kernel time includes idle time
+    static DWORDLONG last_busy = 0, last_total = 0;
+    FILETIME idle, kernel, user;
+    
+    (void)core_usage; // Per-core times would need NtQuerySystemInformation
+    *core_count = 0;
+    if (!GetSystemTimes(&idle, &kernel, &user)) return 0.0;
+    
+    DWORDLONG idle_time = ((DWORDLONG)idle.dwHighDateTime << 32) | idle.dwLowDateTime;
+    DWORDLONG total = (((DWORDLONG)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) +
+                      (((DWORDLONG)user.dwHighDateTime << 32) | user.dwLowDateTime);
+    DWORDLONG busy = total - idle_time;
+    double usage = total > last_total ? 100.0 * (double)(busy - last_busy) / (double)(total - last_total) : 0.0;
+    
+    last_busy = busy;
+    last_total = total;
+    return usage;
+#else
+    double usage = 0.0;
+    int cores = 0;
+    char *line;
+    
+    // Cores missing from /proc/stat are offline and read as idle
+    memset(core_usage, 0, MAX_CORES * sizeof(float));
+    *core_count = 0;
+    collector.stat_rest = NULL;
+    if (proc_read(collector.stat_fd) < 0) return 0.0;
     
-    if (last_value > 100) last_value = 100;
-    if (last_value < 0) last_value = 0;
+    // The aggregate line comes first, then one line per core, then everything else
+    for (line = collector.buffer; line && strncmp(line, "cpu", 3) == 0; line = next_line(line)) {
+        CpuTimes now;
+        if (line[3] == ' ') {
+            if (parse_cpu_times(line + 3, &now)) {
+                usage = cpu_percent(&collector.last_total, &now);
+                collector.last_total = now;
+            }
+        } else {
+            char *fields;
+            long core = strtol(line + 3, &fields, 10);
+            if (core >= 0 && core < MAX_CORES && parse_cpu_times(fields, &now)) {
+                core_usage[core] = (float)cpu_percent(&collector.last_core[core], &now);
+                collector.last_core[core] = now;
+                if (core + 1 > cores) cores = (int)core + 1;
+            }
+        }
+    }
     
-    return (double)last_value;
+    collector.core_count = cores;
+    collector.stat_rest = line;
+    *core_count = cores;
+    return usage;
+#endif
 }
 
 // Function to get memory information
 void get_memory_info(DWORDLONG *total, DWORDLONG *available, double *percent) {
+#ifdef _WIN32
     MEMORYSTATUSEX memInfo;
     memInfo.dwLength = sizeof(MEMORYSTATUSEX);
     GlobalMemoryStatusEx(&memInfo);
@@ -41,10 +765,38 @@ void get_memory_info(DWORDLONG *total, DWORDLONG *available, double *percent) {
     *total = memInfo.ullTotalPhys;
     *available = memInfo.ullAvailPhys;
     *percent = memInfo.dwMemoryLoad; // Already as a percentage
+#else
+    unsigned long long total_kb = 0, available_kb = 0, free_kb = 0;
+    int have_available = 0;
+    
+    *total = 0;
+    *available = 0;
+    *percent = 0.0;
+    if (proc_read(collector.meminfo_fd) < 0) return;
+    
+    for (char *line = collector.buffer; line; line = next_line(line)) {
+        if (strncmp(line, "MemTotal:", 9) == 0) {
+            total_kb = strtoull(line + 9, NULL, 10);
+        } else if (strncmp(line, "MemFree:", 8) == 0) {
+            free_kb = strtoull(line + 8, NULL, 10);
+        } else if (strncmp(line, "MemAvailable:", 13) == 0) {
+            available_kb = strtoull(line + 13, NULL, 10);
+            have_available = 1;
+            break; // Nothing further down is needed
+        }
+    }
+    
+    // Kernels before 3.14 have no MemAvailable; free memory is the closest there is
+    if (!have_available) available_kb = free_kb;
+    *total = total_kb * 1024;
+    *available = available_kb * 1024;
+    if (total_kb > 0) *percent = 100.0 * (double)(total_kb - available_kb) / (double)total_kb;
+#endif
 }
 
-// Function to get disk I/O information
+// Function to get disk I/O information: bytes read and written since boot
 void get_disk_io(DWORDLONG *read_bytes, DWORDLONG *write_bytes) {
+#ifdef _WIN32
     // In a real implementation, you would use GetDiskIoInformation or similar
     // For demonstration, we return simulated values
     static DWORDLONG last_read = 1000000;
@@ -55,128 +807,3984 @@ void get_disk_io(DWORDLONG *read_bytes, DWORDLONG *write_bytes) {
     
     last_read = *read_bytes;
     last_write = *write_bytes;
+#else
+    *read_bytes = 0;
+    *write_bytes = 0;
+    if (collector.diskstats_fd < 0 || proc_read(collector.diskstats_fd) < 0) return;
+    
+    // major minor name reads merged sectors_read ms writes merged sectors_written ...
+    // Sectors are always 512 bytes here, whatever the device's own sector size
+    for (char *line = collector.buffer; line; line = next_line(line)) {
+        char name[32];
+        unsigned long long sectors_read, sectors_written;
+        if (sscanf(line, "%*u %*u %31s %*u %*u %llu %*u %*u %*u %llu",
+                   name, &sectors_read, &sectors_written) == 3 && is_whole_disk(name)) {
+            *read_bytes += sectors_read * 512;
+            *write_bytes += sectors_written * 512;
+        }
+    }
+#endif
 }
 
-// Function to collect all system resource information
-SystemResources collect_system_resources() {
-    SystemResources res;
+// Function to get network traffic per interface since each came up
+void get_network_io(NetInterface *interfaces, int *count) {
+    *count = 0;
+#ifdef _WIN32
+    (void)interfaces; // Would need GetIfTable2 from iphlpapi
+#else
+    if (collector.netlink_fd >= 0 && !netlink_stats(interfaces, count)) {
+        *count = 0;
+        use_proc_net_dev();
+    }
+    if (collector.netdev_fd >= 0) proc_net_dev_stats(interfaces, count);
+#endif
+}
+
+// Function to get the scheduler counters: context switches, softirqs by type, and the run queue.
+// They are further down the /proc/stat that get_cpu_usage has just read, so it is not read again.
+void get_scheduler_stats(DWORDLONG *context_switches, DWORDLONG *softirqs, int *running, int *blocked) {
+    *context_switches = 0;
+    memset(softirqs, 0, SOFTIRQ_TYPES * sizeof(DWORDLONG));
+    *running = 0;
+    *blocked = 0;
+#ifndef _WIN32
+    for (char *line = collector.stat_rest; line; line = next_line(line)) {
+        if (strncmp(line, "ctxt ", 5) == 0) {
+            *context_switches = strtoull(line + 5, NULL, 10);
+        } else if (strncmp(line, "procs_running ", 14) == 0) {
+            *running = atoi(line + 14);
+        } else if (strncmp(line, "procs_blocked ", 14) == 0) {
+            *blocked = atoi(line + 14);
+        } else if (strncmp(line, "softirq ", 8) == 0) {
+            // The total comes first, then one column per type
+            char *field = line + 8;
+            strtoull(field, &field, 10);
+            for (int i = 0; i < SOFTIRQ_TYPES; i++) {
+                softirqs[i] = strtoull(field, &field, 10);
+            }
+        }
+    }
+    collector.stat_rest = NULL; // The buffer is about to be reused
+#endif
+}
+
+#ifndef _WIN32
+#define FD_CLOSED (-1)
+#define FD_UNAVAILABLE (-2)        // Not readable by us (io of another user's process) or not in this kernel
+
+// One process, with its /proc files held open from one scan to the next
+typedef struct {
+    int pid;
+    int stat_fd;
+    int schedstat_fd;
+    int status_fd;
+    int io_fd;
+    int alive;                     // Read successfully in the last scan
+    int fresh;                     // No earlier totals yet, so no rates
+    unsigned long long start_time; // Tells a reused PID from the process that had it before
+    char name[16];
+    unsigned long long runtime_ns; // Time on the CPU according to the scheduler
+    unsigned long long cpu_ticks;  // Totals as of the last scan
+    unsigned long long io_bytes;
+    unsigned long long switches;
+    unsigned long long rss_bytes;
+    double cpu_percent;            // Rates over the last scan interval
+    double io_rate;
+    double switch_rate;
+} ProcessEntry;
+
+struct ProcessTable {
+    ProcessEntry *entries;         // Sorted by PID
+    ProcessEntry *spare;           // Second array the next scan merges into
+    int count;
+    int capacity;
+    int *pids;
+    int pid_capacity;
+    int proc_fd;
+    int fd_budget;                 // Descriptors still free to keep open, shared by the scan threads
+    long page_size;
+    long ticks_per_second;
+    double elapsed;                // Seconds covered by the rates
+    long long last_scan_ns;
+    double scan_ms;                // Time the last scan took
+    ProcessSort sort;
+    int top_n;
+    int top[MAX_TOP];              // Entries ranked by the sort metric
+    int top_count;
     
-    // Set timestamp
-    res.timestamp = time(NULL);
+    // Scan threads pick up chunks of the table whenever generation moves on
+    pthread_t workers[MAX_SCAN_WORKERS];
+    int worker_count;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t finished;
+    unsigned generation;
+    int busy;
+    int next;
+    int quit;
+};
+
+static long long monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void process_close_fd(ProcessTable *table, int *fd) {
+    if (*fd >= 0) {
+        close(*fd);
+        __atomic_add_fetch(&table->fd_budget, 1, __ATOMIC_RELAXED);
+    }
+    *fd = FD_CLOSED;
+}
+
+static void process_close(ProcessTable *table, ProcessEntry *entry) {
+    process_close_fd(table, &entry->stat_fd);
+    process_close_fd(table, &entry->schedstat_fd);
+    process_close_fd(table, &entry->status_fd);
+    process_close_fd(table, &entry->io_fd);
+}
+
+// Read /proc/<pid>/<name>. A descriptor stays open for the next scan while the budget lasts;
+// past it, the file is opened and closed each time.
+static int process_read(ProcessTable *table, ProcessEntry *entry, int *fd, const char *name,
+                        char *buffer, int size) {
+    char path[32];
     
-    // Collect CPU usage
-    res.cpu_usage = get_cpu_usage();
+    if (*fd == FD_UNAVAILABLE) return -1;
+    if (*fd >= 0) return pread_file(*fd, buffer, size);
     
-    // Collect memory information
-    get_memory_info(&res.memory_total, &res.memory_available, &res.memory_usage_percent);
+    snprintf(path, sizeof(path), "%d/%s", entry->pid, name);
+    int file = openat(table->proc_fd, path, O_RDONLY | O_CLOEXEC);
+    if (file < 0) {
+        if (errno == EACCES || errno == ENOENT) *fd = FD_UNAVAILABLE;
+        return -1;
+    }
+    int length = pread_file(file, buffer, size);
+    if (__atomic_sub_fetch(&table->fd_budget, 1, __ATOMIC_RELAXED) >= 0) {
+        *fd = file;
+    } else {
+        __atomic_add_fetch(&table->fd_budget, 1, __ATOMIC_RELAXED);
+        close(file);
+    }
+    return length;
+}
+
+// Value of a "Name: value" line in /proc/[pid]/status or io
+static unsigned long long proc_field(const char *text, const char *name) {
+    const char *line = strstr(text, name);
+    return line ? strtoull(line + strlen(name), NULL, 10) : 0;
+}
+
+// Refresh one process from its stat, status and io files; run by the scan threads
+static void process_update(ProcessTable *table, ProcessEntry *entry, char *buffer, int size) {
+    unsigned long long utime, stime, start_time;
+    long long rss_pages;
     
-    // Collect disk I/O information
-    get_disk_io(&res.disk_read_bytes, &res.disk_write_bytes);
+    // A failed read on a held descriptor can mean the PID now belongs to another process
+    if (process_read(table, entry, &entry->stat_fd, "stat", buffer, size) < 0) {
+        process_close(table, entry);
+        if (process_read(table, entry, &entry->stat_fd, "stat", buffer, size) < 0) {
+            entry->alive = 0;
+            return;
+        }
+    }
     
-    return res;
+    // The name may hold spaces and parentheses, so the fields start after the last ')'
+    char *open_paren = strchr(buffer, '(');
+    char *close_paren = strrchr(buffer, ')');
+    if (open_paren == NULL || close_paren == NULL || close_paren < open_paren ||
+        sscanf(close_paren + 1, "%*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %llu %llu "
+               "%*s %*s %*s %*s %*s %*s %llu %*s %lld",
+               &utime, &stime, &start_time, &rss_pages) != 4) {
+        entry->alive = 0;
+        return;
+    }
+    
+    if (entry->fresh || start_time != entry->start_time) {
+        int length = (int)(close_paren - open_paren - 1);
+        if (length > (int)sizeof(entry->name) - 1) length = (int)sizeof(entry->name) - 1;
+        memcpy(entry->name, open_paren + 1, length);
+        entry->name[length] = '\0';
+        if (!entry->fresh) {
+            // Same PID, different process: its other files and totals belong to the old one
+            process_close_fd(table, &entry->schedstat_fd);
+            process_close_fd(table, &entry->status_fd);
+            process_close_fd(table, &entry->io_fd);
+            entry->fresh = 1;
+        }
+        entry->start_time = start_time;
+    }
+    
+    // A process that has not run since the last scan cannot have switched or issued I/O, so
+    // most idle processes cost two small reads. Without schedstat every file is read.
+    unsigned long long cpu_ticks = utime + stime;
+    unsigned long long switches = entry->switches, io_bytes = entry->io_bytes;
+    int ran = 1;
+    if (process_read(table, entry, &entry->schedstat_fd, "schedstat", buffer, size) >= 0) {
+        unsigned long long runtime = strtoull(buffer, NULL, 10);
+        ran = entry->fresh || runtime != entry->runtime_ns;
+        entry->runtime_ns = runtime;
+    }
+    if (ran && process_read(table, entry, &entry->status_fd, "status", buffer, size) >= 0) {
+        switches = proc_field(buffer, "\nvoluntary_ctxt_switches:") +
+                   proc_field(buffer, "\nnonvoluntary_ctxt_switches:");
+    }
+    if (ran && process_read(table, entry, &entry->io_fd, "io", buffer, size) >= 0) {
+        io_bytes = proc_field(buffer, "\nread_bytes:") + proc_field(buffer, "\nwrite_bytes:");
+    }
+    
+    if (entry->fresh || table->elapsed <= 0) {
+        entry->cpu_percent = 0;
+        entry->io_rate = 0;
+        entry->switch_rate = 0;
+    } else {
+        entry->cpu_percent = 100.0 * (cpu_ticks - entry->cpu_ticks) / table->ticks_per_second / table->elapsed;
+        entry->io_rate = io_bytes >= entry->io_bytes ? (io_bytes - entry->io_bytes) / table->elapsed : 0;
+        entry->switch_rate = switches >= entry->switches ? (switches - entry->switches) / table->elapsed : 0;
+    }
+    entry->cpu_ticks = cpu_ticks;
+    entry->io_bytes = io_bytes;
+    entry->switches = switches;
+    entry->rss_bytes = rss_pages > 0 ? (unsigned long long)rss_pages * table->page_size : 0;
+    entry->alive = 1;
+    entry->fresh = 0;
 }
 
-// Function to log resource data to a CSV file
-void log_resources_to_file(SystemResources res, FILE *file) {
-    char timestamp_str[30];
-    struct tm *tm_info = localtime(&res.timestamp);
-    strftime(timestamp_str, 30, "%Y-%m-%d %H:%M:%S", tm_info);
+// Claim chunks of the table until none are left
+static void process_scan_chunks(ProcessTable *table) {
+    char buffer[8192];             // /proc/[pid]/status is the largest file read, about 1.5 KB
+    int start;
     
-    fprintf(file, "%s,%.2f,%.2f,%llu,%llu,%llu,%llu\n",
-            timestamp_str,
-            res.cpu_usage,
-            res.memory_usage_percent,
-            res.memory_total,
-            res.memory_available,
-            res.disk_read_bytes,
-            res.disk_write_bytes);
+    while ((start = __atomic_fetch_add(&table->next, SCAN_CHUNK, __ATOMIC_RELAXED)) < table->count) {
+        int end = start + SCAN_CHUNK < table->count ? start + SCAN_CHUNK : table->count;
+        for (int i = start; i < end; i++) {
+            process_update(table, &table->entries[i], buffer, sizeof(buffer));
+        }
+    }
 }
 
-// Function to display current system resources
-void display_current_resources(SystemResources res) {
-    system("cls"); // Clear console
+static void *process_worker(void *arg) {
+    ProcessTable *table = (ProcessTable *)arg;
+    unsigned seen = 0;
     
-    char timestamp_str[30];
-    struct tm *tm_info = localtime(&res.timestamp);
-    strftime(timestamp_str, 30, "%Y-%m-%d %H:%M:%S", tm_info);
+    pthread_mutex_lock(&table->lock);
+    while (1) {
+        while (table->generation == seen && !table->quit) {
+            pthread_cond_wait(&table->start, &table->lock);
+        }
+        if (table->quit) break;
+        seen = table->generation;
+        pthread_mutex_unlock(&table->lock);
+        
+        process_scan_chunks(table);
+        
+        pthread_mutex_lock(&table->lock);
+        if (--table->busy == 0) pthread_cond_signal(&table->finished);
+    }
+    pthread_mutex_unlock(&table->lock);
+    return NULL;
+}
+
+static int compare_pids(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// List the PIDs in /proc, sorted
+static int list_pids(ProcessTable *table) {
+    DIR *dir = opendir("/proc");
+    struct dirent *entry;
+    int count = 0;
     
-    printf("===== SYSTEM RESOURCE MONITOR =====\n");
-    printf("Time: %s\n\n", timestamp_str);
+    if (dir == NULL) return -1;
+    while ((entry = readdir(dir)) != NULL) {
+        char *end;
+        long pid = strtol(entry->d_name, &end, 10);
+        if (*end != '\0' || pid <= 0) continue;
+        if (count == table->pid_capacity) {
+            int capacity = table->pid_capacity ? table->pid_capacity * 2 : 1024;
+            int *pids = (int *)realloc(table->pids, capacity * sizeof(int));
+            if (pids == NULL) break;
+            table->pids = pids;
+            table->pid_capacity = capacity;
+        }
+        table->pids[count++] = (int)pid;
+    }
+    closedir(dir);
+    qsort(table->pids, count, sizeof(int), compare_pids);
+    return count;
+}
+
+// Bring the table in line with the PIDs now in /proc, keeping the open descriptors of
+// processes seen before
+static int process_merge(ProcessTable *table, int pid_count) {
+    if (pid_count > table->capacity) {
+        ProcessEntry *spare = (ProcessEntry *)realloc(table->spare, pid_count * sizeof(ProcessEntry));
+        if (spare == NULL) return 0;
+        table->spare = spare;
+        ProcessEntry *entries = (ProcessEntry *)realloc(table->entries, pid_count * sizeof(ProcessEntry));
+        if (entries == NULL) return 0;
+        table->entries = entries;
+        table->capacity = pid_count;
+    }
     
-    // Display CPU usage with a simple bar graph
-    printf("CPU Usage: %.2f%%\t[", res.cpu_usage);
-    int bars = (int)(res.cpu_usage / 5);
-    for (int i = 0; i < 20; i++) {
-        if (i < bars) {
-            printf("|");
+    int i = 0, j = 0, count = 0;
+    while (i < table->count || j < pid_count) {
+        if (j == pid_count || (i < table->count && table->entries[i].pid < table->pids[j])) {
+            process_close(table, &table->entries[i++]);
+        } else if (i < table->count && table->entries[i].pid == table->pids[j]) {
+            table->spare[count++] = table->entries[i++];
+            j++;
         } else {
-            printf(" ");
+            ProcessEntry *entry = &table->spare[count++];
+            memset(entry, 0, sizeof(*entry));
+            entry->pid = table->pids[j++];
+            entry->stat_fd = FD_CLOSED;
+            entry->schedstat_fd = FD_CLOSED;
+            entry->status_fd = FD_CLOSED;
+            entry->io_fd = FD_CLOSED;
+            entry->fresh = 1;
+        }
+    }
+    
+    ProcessEntry *entries = table->entries;
+    table->entries = table->spare;
+    table->spare = entries;
+    table->count = count;
+    return 1;
+}
+
+static double process_metric(const ProcessEntry *entry, ProcessSort sort) {
+    switch (sort) {
+        case SORT_RSS: return (double)entry->rss_bytes;
+        case SORT_IO: return entry->io_rate;
+        case SORT_SWITCHES: return entry->switch_rate;
+        default: return entry->cpu_percent;
+    }
+}
+
+// Keep the top_n entries by the sort metric, best first
+static void process_rank(ProcessTable *table) {
+    table->top_count = 0;
+    for (int i = 0; i < table->count; i++) {
+        if (!table->entries[i].alive) continue;
+        double value = process_metric(&table->entries[i], table->sort);
+        int position = table->top_count;
+        while (position > 0 && process_metric(&table->entries[table->top[position - 1]], table->sort) < value) {
+            position--;
         }
+        if (position >= table->top_n) continue;
+        int last = table->top_count < table->top_n ? table->top_count : table->top_n - 1;
+        memmove(&table->top[position + 1], &table->top[position], (last - position) * sizeof(int));
+        table->top[position] = i;
+        if (table->top_count < table->top_n) table->top_count++;
+    }
+}
+
+// Function to refresh every process and rank them
+void process_table_scan(ProcessTable *table) {
+    long long start = monotonic_ns();
+    int pid_count = list_pids(table);
+    
+    if (pid_count < 0 || !process_merge(table, pid_count)) {
+        printf("Error listing processes\n");
+        return;
     }
-    printf("]\n\n");
+    table->elapsed = table->last_scan_ns ? (start - table->last_scan_ns) / 1e9 : 0;
+    table->last_scan_ns = start;
     
-    // Display memory usage
-    double used_memory_gb = (res.memory_total - res.memory_available) / (1024.0 * 1024 * 1024);
-    double total_memory_gb = res.memory_total / (1024.0 * 1024 * 1024);
+    // Wake the scan threads and take a share of the work here too
+    pthread_mutex_lock(&table->lock);
+    table->next = 0;
+    table->busy = table->worker_count;
+    table->generation++;
+    pthread_cond_broadcast(&table->start);
+    pthread_mutex_unlock(&table->lock);
     
-    printf("Memory Usage: %.2f%%\t[", res.memory_usage_percent);
-    bars = (int)(res.memory_usage_percent / 5);
-    for (int i = 0; i < 20; i++) {
-        if (i < bars) {
-            printf("|");
-        } else {
-            printf(" ");
+    process_scan_chunks(table);
+    
+    pthread_mutex_lock(&table->lock);
+    while (table->busy > 0) {
+        pthread_cond_wait(&table->finished, &table->lock);
+    }
+    pthread_mutex_unlock(&table->lock);
+    
+    process_rank(table);
+    table->scan_ms = (monotonic_ns() - start) / 1e6;
+}
+
+// Function to set up per-process accounting; returns NULL if it is unavailable
+ProcessTable *process_table_create(int top_n, ProcessSort sort) {
+    ProcessTable *table = (ProcessTable *)calloc(1, sizeof(ProcessTable));
+    struct rlimit limit;
+    sigset_t block, old;
+    
+    if (table == NULL) return NULL;
+    table->top_n = top_n;
+    table->sort = sort;
+    table->page_size = sysconf(_SC_PAGESIZE);
+    table->ticks_per_second = sysconf(_SC_CLK_TCK);
+    table->proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (table->proc_fd < 0) {
+        printf("Error opening /proc\n");
+        free(table);
+        return NULL;
+    }
+    
+    // Holding four descriptors per process needs far more than the usual soft limit
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        if (limit.rlim_cur < limit.rlim_max) {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+            getrlimit(RLIMIT_NOFILE, &limit);
         }
+        rlim_t usable = limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > (1 << 20) ? (1 << 20) : limit.rlim_cur;
+        table->fd_budget = usable > FD_RESERVE ? (int)(usable - FD_RESERVE) : 0;
     }
-    printf("]\n");
-    printf("Memory Used: %.2f GB / %.2f GB\n\n", used_memory_gb, total_memory_gb);
     
-    // Display disk I/O
-    printf("Disk Read: %.2f MB\n", res.disk_read_bytes / (1024.0 * 1024));
-    printf("Disk Write: %.2f MB\n\n", res.disk_write_bytes / (1024.0 * 1024));
+    pthread_mutex_init(&table->lock, NULL);
+    pthread_cond_init(&table->start, NULL);
+    pthread_cond_init(&table->finished, NULL);
     
-    printf("Press Ctrl+C to exit...\n");
+    // One scan thread per further core; Ctrl+C is left to the output thread
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = cores > 1 ? (int)(cores - 1) : 0;
+    if (wanted > MAX_SCAN_WORKERS) wanted = MAX_SCAN_WORKERS;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    while (table->worker_count < wanted &&
+           pthread_create(&table->workers[table->worker_count], NULL, process_worker, table) == 0) {
+        table->worker_count++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return table;
 }
 
-int main() {
-    // Set console title
-    SetConsoleTitle("System Resource Monitor");
+void process_table_destroy(ProcessTable *table) {
+    if (table == NULL) return;
     
-    // Seed random number generator
-    srand((unsigned int)time(NULL));
+    pthread_mutex_lock(&table->lock);
+    table->quit = 1;
+    pthread_cond_broadcast(&table->start);
+    pthread_mutex_unlock(&table->lock);
+    for (int i = 0; i < table->worker_count; i++) {
+        pthread_join(table->workers[i], NULL);
+    }
     
-    // Create log file
-    FILE *log_file = fopen("system_resources.csv", "w");
-    if (log_file == NULL) {
-        printf("Error creating log file\n");
-        return 1;
+    for (int i = 0; i < table->count; i++) {
+        process_close(table, &table->entries[i]);
     }
+    close(table->proc_fd);
+    pthread_mutex_destroy(&table->lock);
+    pthread_cond_destroy(&table->start);
+    pthread_cond_destroy(&table->finished);
+    free(table->entries);
+    free(table->spare);
+    free(table->pids);
+    free(table);
+}
+#endif
+
+#ifndef _WIN32
+// One control group. Only groups with running tasks whose CPU time moved get more than
+// their cpu.stat read; see cgroup_table_scan.
+typedef struct {
+    char path[CGROUP_PATH_SIZE];   // Relative to the hierarchy root, "" for the root itself
+    int cpu_fd;                    // cpu.stat, read on every scan of the group; -1 past CGROUP_FDS
+    int watch_dir;                 // inotify watch for groups created or removed below this one
+    int watch_events;              // inotify watch on cgroup.events, for the populated flag
+    int populated;                 // Tasks in this group or below
+    int subtree_end;               // Index after the last group below this one
+    int scanned;                   // Scan the rates below were worked out in
+    int has_memory;                // memory.current exists (the controller is enabled)
+    int has_io;
+    long long read_ns;             // When the counters were read
+    unsigned long long usage_usec;
+    unsigned long long io_read;    // Summed over devices from io.stat
+    unsigned long long io_write;
+    unsigned long long stall_usec[3]; // PSI "some" totals: cpu, memory, io
+    unsigned long long memory_current;
+    unsigned long long anon;       // From memory.stat, only read for listed groups
+    unsigned long long file;
+    double cpu_percent;
+    double read_rate;
+    double write_rate;
+    double pressure[3];            // Share of the interval some task stalled, in %
+} CgroupEntry;
+
+struct CgroupTable {
+    char root[CGROUP_PATH_SIZE];
+    int root_fd;
+    int inotify_fd;
+    int open_fds;
+    CgroupEntry *entries;          // In pre-order: every group comes before the groups below it
+    int count;
+    int capacity;
+    int sorted;                    // Order and subtree_end are up to date
+    int scans;
+    int *active;                   // Groups read in the last scan
+    int active_count;
+    double scan_ms;
+    int top_n;
+    int top[MAX_TOP];              // Active groups ranked by CPU
+    int top_count;
+};
+
+static const char *pressure_files[3] = {"cpu.pressure", "memory.pressure", "io.pressure"};
+
+// Function to find where the cgroup v2 hierarchy is mounted, from /proc/self/mountinfo
+static int find_cgroup2_root(char *root, size_t size) {
+    char line[1024];
+    int found = 0;
     
-    // Write CSV header
-    fprintf(log_file, "Timestamp,CPU Usage %%,Memory Usage %%,Memory Total,Memory Available,Disk Read Bytes,Disk Write Bytes\n");
+    FILE *file = fopen("/proc/self/mountinfo", "r");
+    if (file == NULL) return 0;
+    while (!found && fgets(line, sizeof(line), file)) {
+        // The filesystem type follows the " - " separator; the mount point is the fifth field
+        char *separator = strstr(line, " - ");
+        char mount_point[CGROUP_PATH_SIZE];
+        if (separator && strncmp(separator + 3, "cgroup2 ", 8) == 0 &&
+            sscanf(line, "%*s %*s %*s %*s %511s", mount_point) == 1 && strlen(mount_point) < size) {
+            strcpy(root, mount_point);
+            found = 1;
+        }
+    }
+    fclose(file);
+    return found;
+}
+
+// Function to build the path of a file in a group, relative to the root
+static void cgroup_file(const CgroupEntry *entry, const char *name, char *path, size_t size) {
+    snprintf(path, size, "%s%s%s", entry->path, entry->path[0] ? "/" : "", name);
+}
+
+// Function to build the path of a child group; 0 if it would not fit
+static int cgroup_child(const char *parent, const char *name, char *path) {
+    size_t parent_length = strlen(parent);
+    size_t name_length = strlen(name);
     
-    printf("System Resource Monitor Started\n");
-    printf("Logging to system_resources.csv\n");
+    if (parent_length + name_length + 2 > CGROUP_PATH_SIZE) return 0;
+    memcpy(path, parent, parent_length);
+    if (parent_length) path[parent_length++] = '/';
+    memcpy(path + parent_length, name, name_length + 1);
+    return 1;
+}
+
+// Function to read a file of a group into buffer; -1 if the group does not have it
+static int cgroup_read(CgroupTable *table, const CgroupEntry *entry, const char *name, char *buffer, int size) {
+    char path[CGROUP_PATH_SIZE + 32];
     
-    while (1) {
-        // Collect system resources
-        SystemResources resources = collect_system_resources();
-        
-        // Display in console
-        display_current_resources(resources);
-        
-        // Log to file
-        log_resources_to_file(resources, log_file);
-        
-        // Flush file buffer to ensure data is written
-        fflush(log_file);
-        
-        // Wait for 1 second
-        Sleep(1000);
+    cgroup_file(entry, name, path, sizeof(path));
+    int fd = openat(table->root_fd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int length = pread_file(fd, buffer, size);
+    close(fd);
+    return length;
+}
+
+static void cgroup_read_populated(CgroupTable *table, CgroupEntry *entry) {
+    char buffer[256];
+    if (cgroup_read(table, entry, "cgroup.events", buffer, sizeof(buffer)) > 0) {
+        entry->populated = strstr(buffer, "populated 1") != NULL;
+    }
+}
+
+static void cgroup_close(CgroupTable *table, CgroupEntry *entry) {
+    if (entry->cpu_fd >= 0) {
+        close(entry->cpu_fd);
+        table->open_fds--;
     }
+    if (entry->watch_dir >= 0) inotify_rm_watch(table->inotify_fd, entry->watch_dir);
+    if (entry->watch_events >= 0) inotify_rm_watch(table->inotify_fd, entry->watch_events);
+}
+
+// Function to add a group and, since groups below it may predate the watch, everything below it
+static void cgroup_add(CgroupTable *table, const char *path) {
+    char full[2 * CGROUP_PATH_SIZE];
     
-    // Close log file (this won't actually execute due to infinite loop)
-    fclose(log_file);
+    if (table->count == MAX_CGROUPS) return;
+    if (table->count == table->capacity) {
+        int capacity = table->capacity ? table->capacity * 2 : 64;
+        CgroupEntry *entries = (CgroupEntry *)realloc(table->entries, capacity * sizeof(CgroupEntry));
+        int *active = (int *)realloc(table->active, capacity * sizeof(int));
+        if (entries) table->entries = entries;
+        if (active) table->active = active;
+        if (entries == NULL || active == NULL) return;
+        table->capacity = capacity;
+    }
     
+    CgroupEntry *entry = &table->entries[table->count];
+    memset(entry, 0, sizeof(*entry));
+    strcpy(entry->path, path);
+    entry->scanned = -1;
+    
+    cgroup_file(entry, "cpu.stat", full, sizeof(full));
+    entry->cpu_fd = table->open_fds < CGROUP_FDS ? openat(table->root_fd, full, O_RDONLY | O_CLOEXEC) : -1;
+    if (entry->cpu_fd >= 0) table->open_fds++;
+    snprintf(full, sizeof(full), "%s%s%s", table->root, path[0] ? "/" : "", path);
+    entry->watch_dir = inotify_add_watch(table->inotify_fd, full, IN_CREATE | IN_DELETE | IN_ONLYDIR);
+    strcat(full, "/cgroup.events");
+    entry->watch_events = inotify_add_watch(table->inotify_fd, full, IN_MODIFY);
+    entry->populated = 1;
+    cgroup_read_populated(table, entry);
+    table->count++;
+    table->sorted = 0;
+    
+    // Every subdirectory of a group is a group
+    int dir_fd = path[0] ? openat(table->root_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : dup(table->root_fd);
+    DIR *dir = dir_fd >= 0 ? fdopendir(dir_fd) : NULL;
+    if (dir == NULL) {
+        if (dir_fd >= 0) close(dir_fd);
+        return;
+    }
+    struct dirent *child;
+    while ((child = readdir(dir)) != NULL) {
+        if (child->d_type != DT_DIR || child->d_name[0] == '.') continue;
+        char child_path[CGROUP_PATH_SIZE];
+        if (cgroup_child(path, child->d_name, child_path)) cgroup_add(table, child_path);
+    }
+    closedir(dir);
+}
+
+// Paths compared with '/' lowest, so a group sorts straight after its parent and all its
+// descendants sort before its next sibling
+static int compare_cgroup_paths(const void *a, const void *b) {
+    const unsigned char *x = (const unsigned char *)((const CgroupEntry *)a)->path;
+    const unsigned char *y = (const unsigned char *)((const CgroupEntry *)b)->path;
+    
+    while (*x && *x == *y) {
+        x++;
+        y++;
+    }
+    int cx = *x == '/' ? 1 : *x;
+    int cy = *y == '/' ? 1 : *y;
+    return cx - cy;
+}
+
+static int is_below(const CgroupEntry *group, const CgroupEntry *other) {
+    size_t length = strlen(group->path);
+    if (length == 0) return other->path[0] != '\0';
+    return strncmp(other->path, group->path, length) == 0 && other->path[length] == '/';
+}
+
+// Function to put the groups in pre-order and find where each subtree ends
+static void cgroup_sort(CgroupTable *table) {
+    int stack[CGROUP_PATH_SIZE / 2];
+    int depth = 0;
+    
+    qsort(table->entries, table->count, sizeof(CgroupEntry), compare_cgroup_paths);
+    for (int i = 0; i < table->count; i++) {
+        while (depth > 0 && !is_below(&table->entries[stack[depth - 1]], &table->entries[i])) {
+            table->entries[stack[--depth]].subtree_end = i;
+        }
+        stack[depth++] = i;
+    }
+    while (depth > 0) {
+        table->entries[stack[--depth]].subtree_end = table->count;
+    }
+    table->sorted = 1;
+}
+
+static int cgroup_by_path(CgroupTable *table, const char *path) {
+    for (int i = 0; i < table->count; i++) {
+        if (strcmp(table->entries[i].path, path) == 0) return i;
+    }
+    return -1;
+}
+
+// Function to apply what inotify reported: groups created, groups removed, populated changes.
+// Without events this is a single read that fails with EAGAIN.
+static void cgroup_watch_events(CgroupTable *table) {
+    char buffer[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+    
+    while ((length = read(table->inotify_fd, buffer, sizeof(buffer))) > 0) {
+        for (char *next = buffer; next < buffer + length; ) {
+            struct inotify_event *event = (struct inotify_event *)next;
+            next += sizeof(struct inotify_event) + event->len;
+            
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Events were lost: start over from the root
+                for (int i = 0; i < table->count; i++) {
+                    cgroup_close(table, &table->entries[i]);
+                }
+                table->count = 0;
+                cgroup_add(table, "");
+                continue;
+            }
+            int index = -1;
+            for (int i = 0; i < table->count && index < 0; i++) {
+                if (table->entries[i].watch_dir == event->wd || table->entries[i].watch_events == event->wd) index = i;
+            }
+            if (index < 0) continue;
+            
+            CgroupEntry *parent = &table->entries[index];
+            if (event->wd == parent->watch_events) {
+                cgroup_read_populated(table, parent);
+                continue;
+            }
+            if (!(event->mask & IN_ISDIR) || event->len == 0) continue;
+            char path[CGROUP_PATH_SIZE];
+            if (!cgroup_child(parent->path, event->name, path)) continue;
+            if (event->mask & IN_CREATE) {
+                if (cgroup_by_path(table, path) < 0) cgroup_add(table, path);
+            } else if (event->mask & IN_DELETE) {
+                int gone = cgroup_by_path(table, path);
+                if (gone >= 0) {
+                    cgroup_close(table, &table->entries[gone]);
+                    table->entries[gone] = table->entries[--table->count];
+                    table->sorted = 0;
+                }
+            }
+        }
+    }
+}
+
+// Value of a "name value" line, as in cpu.stat and memory.stat
+static unsigned long long cgroup_field(const char *text, const char *name) {
+    size_t length = strlen(name);
+    for (const char *line = text; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL) {
+        if (strncmp(line, name, length) == 0 && line[length] == ' ') return strtoull(line + length + 1, NULL, 10);
+    }
+    return 0;
+}
+
+// Function to read everything but memory.stat for a group whose CPU time moved
+static void cgroup_update(CgroupTable *table, CgroupEntry *entry, unsigned long long usage, long long now) {
+    char buffer[4096];
+    double seconds = entry->read_ns ? (now - entry->read_ns) / 1e9 : 0;
+    
+    unsigned long long io_read = 0;
+    unsigned long long io_write = 0;
+    entry->has_io = cgroup_read(table, entry, "io.stat", buffer, sizeof(buffer)) >= 0;
+    if (entry->has_io) {
+        for (char *field = strstr(buffer, "rbytes="); field; field = strstr(field + 7, "rbytes=")) {
+            io_read += strtoull(field + 7, NULL, 10);
+        }
+        for (char *field = strstr(buffer, "wbytes="); field; field = strstr(field + 7, "wbytes=")) {
+            io_write += strtoull(field + 7, NULL, 10);
+        }
+    }
+    
+    unsigned long long stall[3] = {0, 0, 0};
+    for (int i = 0; i < 3; i++) {
+        if (cgroup_read(table, entry, pressure_files[i], buffer, sizeof(buffer)) < 0) continue;
+        char *total = strstr(buffer, "total=");
+        if (total) stall[i] = strtoull(total + 6, NULL, 10);
+    }
+    
+    entry->has_memory = cgroup_read(table, entry, "memory.current", buffer, sizeof(buffer)) >= 0;
+    entry->memory_current = entry->has_memory ? strtoull(buffer, NULL, 10) : 0;
+    
+    if (seconds > 0) {
+        entry->cpu_percent = usage >= entry->usage_usec ? (usage - entry->usage_usec) / (seconds * 1e4) : 0;
+        entry->read_rate = io_read >= entry->io_read ? (io_read - entry->io_read) / seconds : 0;
+        entry->write_rate = io_write >= entry->io_write ? (io_write - entry->io_write) / seconds : 0;
+        for (int i = 0; i < 3; i++) {
+            entry->pressure[i] = stall[i] >= entry->stall_usec[i] ? (stall[i] - entry->stall_usec[i]) / (seconds * 1e4) : 0;
+        }
+    }
+    entry->usage_usec = usage;
+    entry->io_read = io_read;
+    entry->io_write = io_write;
+    memcpy(entry->stall_usec, stall, sizeof(stall));
+    entry->read_ns = now;
+    entry->scanned = table->scans;
+}
+
+// Function to rank the groups read this scan by CPU
+static void cgroup_rank(CgroupTable *table) {
+    table->top_count = 0;
+    for (int i = 0; i < table->active_count; i++) {
+        int index = table->active[i];
+        double value = table->entries[index].cpu_percent;
+        int slot = table->top_count < table->top_n ? table->top_count++ : table->top_n;
+        while (slot > 0 && table->entries[table->top[slot - 1]].cpu_percent < value) {
+            if (slot < table->top_n) table->top[slot] = table->top[slot - 1];
+            slot--;
+        }
+        if (slot < table->top_n) table->top[slot] = index;
+    }
+}
+
+// Function to take a scan of the hierarchy. A group with no tasks below it cannot use CPU, so
+// its subtree is skipped; so is the subtree of a group whose cpu.stat usage did not move,
+// since a group's usage includes everything below it. The cost follows the groups that are
+// busy, not the size of the hierarchy. Every CGROUP_REFRESH_SCANS scans everything is read,
+// to pick up memory reclaimed from idle groups.
+void cgroup_table_scan(CgroupTable *table) {
+    char buffer[1024];
+    long long start = monotonic_ns();
+    int full = table->scans % CGROUP_REFRESH_SCANS == 0;
+    
+    cgroup_watch_events(table);
+    if (!table->sorted) cgroup_sort(table);
+    
+    table->active_count = 0;
+    for (int i = 0; i < table->count; ) {
+        CgroupEntry *entry = &table->entries[i];
+        if (!entry->populated && !full && entry->read_ns) {
+            i = entry->subtree_end;
+            continue;
+        }
+        
+        int length = entry->cpu_fd >= 0 ? pread_file(entry->cpu_fd, buffer, sizeof(buffer))
+                                        : cgroup_read(table, entry, "cpu.stat", buffer, sizeof(buffer));
+        unsigned long long usage = length > 0 ? cgroup_field(buffer, "usage_usec") : 0;
+        if (usage == entry->usage_usec && entry->read_ns && !full) {
+            i = entry->subtree_end;
+            continue;
+        }
+        cgroup_update(table, entry, usage, start);
+        table->active[table->active_count++] = i;
+        i++;
+    }
+    
+    // Only the listed groups get their memory broken down
+    cgroup_rank(table);
+    for (int i = 0; i < table->top_count; i++) {
+        CgroupEntry *entry = &table->entries[table->top[i]];
+        if (!entry->has_memory || cgroup_read(table, entry, "memory.stat", buffer, sizeof(buffer)) < 0) continue;
+        entry->anon = cgroup_field(buffer, "anon");
+        entry->file = cgroup_field(buffer, "file");
+    }
+    table->scans++;
+    table->scan_ms = (monotonic_ns() - start) / 1e6;
+}
+
+CgroupTable *cgroup_table_create(const char *root, int top_n) {
+    CgroupTable *table = (CgroupTable *)calloc(1, sizeof(CgroupTable));
+    if (table == NULL) return NULL;
+    
+    if (root) {
+        snprintf(table->root, sizeof(table->root), "%s", root);
+    } else if (!find_cgroup2_root(table->root, sizeof(table->root))) {
+        printf("No cgroup v2 hierarchy is mounted\n");
+        free(table);
+        return NULL;
+    }
+    table->top_n = top_n;
+    table->root_fd = open(table->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    table->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (table->root_fd < 0 || table->inotify_fd < 0) {
+        printf("Error opening cgroup hierarchy %s\n", table->root);
+        if (table->root_fd >= 0) close(table->root_fd);
+        if (table->inotify_fd >= 0) close(table->inotify_fd);
+        free(table);
+        return NULL;
+    }
+    cgroup_add(table, "");
+    return table;
+}
+
+void cgroup_table_destroy(CgroupTable *table) {
+    if (table == NULL) return;
+    
+    for (int i = 0; i < table->count; i++) {
+        cgroup_close(table, &table->entries[i]);
+    }
+    close(table->inotify_fd);
+    close(table->root_fd);
+    free(table->entries);
+    free(table->active);
+    free(table);
+}
+#endif
+
+// Function to collect all system resource information
+SystemResources collect_system_resources() {
+    SystemResources res;
+    struct timespec now;
+    
+    // Set timestamp
+    timespec_get(&now, TIME_UTC);
+    res.timestamp = now.tv_sec;
+    res.timestamp_ms = (int)(now.tv_nsec / 1000000);
+    
+    // Collect CPU usage
+    res.cpu_usage = get_cpu_usage(res.core_usage, &res.core_count);
+    
+    // Collect scheduler counters, from the same read of /proc/stat as the CPU usage
+    get_scheduler_stats(&res.context_switches, res.softirqs, &res.procs_running, &res.procs_blocked);
+    
+    // Collect memory information
+    get_memory_info(&res.memory_total, &res.memory_available, &res.memory_usage_percent);
+    
+    // Collect disk I/O information
+    get_disk_io(&res.disk_read_bytes, &res.disk_write_bytes);
+    
+    // Collect network traffic
+    get_network_io(res.interfaces, &res.interface_count);
+    
+    return res;
+}
+
+// Function to write the CSV header, with a column for each core
+void log_header_to_file(int core_count, FILE *file) {
+    fprintf(file, "Timestamp,CPU Usage %%,Memory Usage %%,Memory Total,Memory Available,Disk Read Bytes,Disk Write Bytes");
+    for (int i = 0; i < core_count; i++) {
+        fprintf(file, ",CPU%d %%", i);
+    }
+    fprintf(file, "\n");
+}
+
+// Function to log resource data to a CSV file
+void log_resources_to_file(const SystemResources *res, int core_count, FILE *file) {
+    char timestamp_str[30];
+    struct tm *tm_info = localtime(&res->timestamp);
+    strftime(timestamp_str, 30, "%Y-%m-%d %H:%M:%S", tm_info);
+    
+    fprintf(file, "%s.%03d,%.2f,%.2f,%llu,%llu,%llu,%llu",
+            timestamp_str,
+            res->timestamp_ms,
+            res->cpu_usage,
+            res->memory_usage_percent,
+            res->memory_total,
+            res->memory_available,
+            res->disk_read_bytes,
+            res->disk_write_bytes);
+    
+    // Columns stay fixed even if a core goes offline
+    for (int i = 0; i < core_count; i++) {
+        fprintf(file, ",%.2f", i < res->core_count ? res->core_usage[i] : 0.0);
+    }
+    fprintf(file, "\n");
+}
+
+// Binary log. Timestamps are stored as Gorilla delta-of-deltas, and every other column as the
+// Gorilla XOR of its value with the previous one, keeping only the meaningful bits. Percentages
+// are kept in hundredths, the precision the CSV had, so they XOR as small integers rather than
+// as doubles with noisy mantissas. Blocks are independent, so a reader can start at any of them.
+
+static void put_bits(unsigned char *payload, uint32_t *position, uint64_t value, int count) {
+    while (count > 0) {
+        int room = 8 - (int)(*position & 7);
+        int take = count < room ? count : room;
+        unsigned bits = (unsigned)(value >> (count - take)) & ((1u << take) - 1);
+        payload[*position >> 3] |= (unsigned char)(bits << (room - take));
+        *position += take;
+        count -= take;
+    }
+}
+
+// Returns 0 if the block's payload runs out first
+static int get_bits(LogCursor *cursor, int count, uint64_t *value) {
+    *value = 0;
+    if (cursor->position + count > cursor->bits) return 0;
+    while (count > 0) {
+        int room = 8 - (int)(cursor->position & 7);
+        int take = count < room ? count : room;
+        unsigned byte = cursor->payload[cursor->position >> 3];
+        *value = (*value << take) | ((byte >> (room - take)) & ((1u << take) - 1));
+        cursor->position += take;
+        count -= take;
+    }
+    return 1;
+}
+
+static void codec_reset(LogCodec *codec) {
+    memset(codec, 0, sizeof(*codec));
+    memset(codec->lead, 64, sizeof(codec->lead)); // No window yet
+}
+
+static int leading_zeros(uint64_t x) {
+    int n = 0;
+    while (!(x & (1ULL << 63))) {
+        x <<= 1;
+        n++;
+    }
+    return n;
+}
+
+static int trailing_zeros(uint64_t x) {
+    int n = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+}
+
+// The columns of a sample as 64-bit words
+static void sample_to_words(const SystemResources *res, int core_count, uint64_t *words) {
+    words[0] = (uint64_t)(res->cpu_usage * 100 + 0.5);
+    words[1] = (uint64_t)(res->memory_usage_percent * 100 + 0.5);
+    words[2] = res->memory_total;
+    words[3] = res->memory_available;
+    words[4] = res->disk_read_bytes;
+    words[5] = res->disk_write_bytes;
+    for (int i = 0; i < core_count; i++) {
+        words[6 + i] = i < res->core_count ? (uint64_t)(res->core_usage[i] * 100 + 0.5) : 0;
+    }
+}
+
+static void words_to_sample(const uint64_t *words, int core_count, int64_t ms, SystemResources *res) {
+    res->timestamp = (time_t)(ms / 1000);
+    res->timestamp_ms = (int)(ms % 1000);
+    res->cpu_usage = words[0] / 100.0;
+    res->memory_usage_percent = words[1] / 100.0;
+    res->memory_total = words[2];
+    res->memory_available = words[3];
+    res->disk_read_bytes = words[4];
+    res->disk_write_bytes = words[5];
+    res->core_count = core_count;
+    for (int i = 0; i < core_count; i++) {
+        res->core_usage[i] = (float)(words[6 + i] / 100.0);
+    }
+}
+
+// Delta-of-delta buckets from the Gorilla paper, widened to 64 bits for the escape
+static void encode_timestamp(LogCodec *codec, unsigned char *payload, uint32_t *position, int64_t ms) {
+    int64_t delta = ms - codec->prev_ms;
+    int64_t dod = delta - codec->prev_delta;
+    uint64_t zigzag = ((uint64_t)dod << 1) ^ (uint64_t)(dod >> 63);
+    
+    if (dod == 0) {
+        put_bits(payload, position, 0, 1);
+    } else if (zigzag < (1ULL << 7)) {
+        put_bits(payload, position, 0x2, 2);
+        put_bits(payload, position, zigzag, 7);
+    } else if (zigzag < (1ULL << 9)) {
+        put_bits(payload, position, 0x6, 3);
+        put_bits(payload, position, zigzag, 9);
+    } else if (zigzag < (1ULL << 12)) {
+        put_bits(payload, position, 0xe, 4);
+        put_bits(payload, position, zigzag, 12);
+    } else if (zigzag < (1ULL << 32)) {
+        put_bits(payload, position, 0x1e, 5);
+        put_bits(payload, position, zigzag, 32);
+    } else {
+        put_bits(payload, position, 0x1f, 5);
+        put_bits(payload, position, zigzag, 64);
+    }
+    codec->prev_ms = ms;
+    codec->prev_delta = delta;
+}
+
+static int decode_timestamp(LogCursor *cursor, int64_t *ms) {
+    static const int widths[] = {7, 9, 12, 32};
+    LogCodec *codec = &cursor->codec;
+    uint64_t bit, zigzag = 0;
+    int prefix = 0;
+    
+    // Count the 1 bits of the prefix, up to four
+    while (prefix < 4) {
+        if (!get_bits(cursor, 1, &bit)) return 0;
+        if (!bit) break;
+        prefix++;
+    }
+    if (prefix == 4) {
+        if (!get_bits(cursor, 1, &bit) || !get_bits(cursor, bit ? 64 : 32, &zigzag)) return 0;
+    } else if (prefix > 0 && !get_bits(cursor, widths[prefix - 1], &zigzag)) {
+        return 0;
+    }
+    
+    int64_t dod = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+    codec->prev_delta += dod;
+    codec->prev_ms += codec->prev_delta;
+    *ms = codec->prev_ms;
+    return 1;
+}
+
+// Gorilla XOR: '0' for a repeat, '10' and the meaningful bits when they fit the previous
+// window, otherwise '11', the leading zero count, the length and the bits
+static void encode_value(LogCodec *codec, unsigned char *payload, uint32_t *position, int column, uint64_t value) {
+    uint64_t x = value ^ codec->prev[column];
+    codec->prev[column] = value;
+    
+    if (x == 0) {
+        put_bits(payload, position, 0, 1);
+        return;
+    }
+    
+    int lead = leading_zeros(x);
+    int trail = trailing_zeros(x);
+    if (lead >= codec->lead[column] && trail >= codec->trail[column]) {
+        put_bits(payload, position, 0x2, 2);
+        put_bits(payload, position, x >> codec->trail[column], 64 - codec->lead[column] - codec->trail[column]);
+    } else {
+        int length = 64 - lead - trail;
+        put_bits(payload, position, 0x3, 2);
+        put_bits(payload, position, (uint64_t)lead, 6);
+        put_bits(payload, position, (uint64_t)(length - 1), 6);
+        put_bits(payload, position, x >> trail, length);
+        codec->lead[column] = (unsigned char)lead;
+        codec->trail[column] = (unsigned char)trail;
+    }
+}
+
+static int decode_value(LogCursor *cursor, int column, uint64_t *value) {
+    LogCodec *codec = &cursor->codec;
+    uint64_t control, x, lead, length;
+    
+    if (!get_bits(cursor, 1, &control)) return 0;
+    if (control) {
+        if (!get_bits(cursor, 1, &control)) return 0;
+        if (control) {
+            if (!get_bits(cursor, 6, &lead) || !get_bits(cursor, 6, &length)) return 0;
+            length++;
+            if (lead + length > 64) return 0;
+            codec->lead[column] = (unsigned char)lead;
+            codec->trail[column] = (unsigned char)(64 - lead - length);
+        } else if (codec->lead[column] == 64) {
+            return 0; // Refers to a window that was never set
+        }
+        if (!get_bits(cursor, 64 - codec->lead[column] - codec->trail[column], &x)) return 0;
+        codec->prev[column] ^= x << codec->trail[column];
+    }
+    *value = codec->prev[column];
+    return 1;
+}
+
+// Decode the next sample of the block; returns 0 at its end or if the block is corrupt
+int log_cursor_next(LogCursor *cursor, SystemResources *res) {
+    uint64_t words[LOG_COLUMNS];
+    int64_t ms;
+    
+    if (cursor->remaining == 0 || !decode_timestamp(cursor, &ms)) return 0;
+    for (int i = 0; i < 6 + cursor->core_count; i++) {
+        if (!decode_value(cursor, i, &words[i])) return 0;
+    }
+    cursor->remaining--;
+    words_to_sample(words, cursor->core_count, ms, res);
+    return 1;
+}
+
+// Write the block header and the payload bytes that changed since the last flush
+int log_flush(LogWriter *writer) {
+    long long offset = (long long)sizeof(LogFileHeader) + writer->block * LOG_BLOCK_SIZE;
+    uint32_t end = (writer->header.bits + 7) / 8;
+    
+    if (writer->header.count == 0) return 1;
+    if (fseek64(writer->file, offset, SEEK_SET) != 0 ||
+        fwrite(&writer->header, sizeof(writer->header), 1, writer->file) != 1) {
+        return 0;
+    }
+    if (end > writer->flushed) {
+        if (fseek64(writer->file, offset + (long long)sizeof(writer->header) + writer->flushed, SEEK_SET) != 0 ||
+            fwrite(writer->payload + writer->flushed, end - writer->flushed, 1, writer->file) != 1) {
+            return 0;
+        }
+    }
+    
+    // The last byte may still be partly filled, so it is written again next time
+    writer->flushed = writer->header.bits / 8;
+    return fflush(writer->file) == 0;
+}
+
+static void log_start_block(LogWriter *writer, long long block) {
+    writer->block = block;
+    memset(&writer->header, 0, sizeof(writer->header));
+    writer->header.magic = LOG_BLOCK_MAGIC;
+    memset(writer->payload, 0, sizeof(writer->payload));
+    writer->flushed = 0;
+    codec_reset(&writer->codec);
+}
+
+// Carry on filling the last block of an existing log, so restarts do not leave half-empty
+// blocks behind. Decoding it rebuilds the compression state the previous run ended with.
+static int log_resume_block(LogWriter *writer, long long block) {
+    long long offset = (long long)sizeof(LogFileHeader) + block * LOG_BLOCK_SIZE;
+    LogCursor cursor;
+    SystemResources res;
+    
+    log_start_block(writer, block);
+    if (fseek64(writer->file, offset, SEEK_SET) != 0 ||
+        fread(&writer->header, sizeof(writer->header), 1, writer->file) != 1 ||
+        writer->header.magic != LOG_BLOCK_MAGIC || writer->header.count == 0 ||
+        writer->header.bits + LOG_SAMPLE_MAX_BITS(writer->core_count) > LOG_PAYLOAD_SIZE * 8 ||
+        fread(writer->payload, (writer->header.bits + 7) / 8, 1, writer->file) != 1) {
+        return 0;
+    }
+    
+    memset(&cursor, 0, sizeof(cursor));
+    cursor.payload = writer->payload;
+    cursor.bits = writer->header.bits;
+    cursor.remaining = writer->header.count;
+    cursor.core_count = writer->core_count;
+    codec_reset(&cursor.codec);
+    while (log_cursor_next(&cursor, &res)) continue;
+    if (cursor.remaining > 0 || cursor.position != writer->header.bits) return 0;
+    
+    writer->codec = cursor.codec;
+    writer->flushed = writer->header.bits / 8;
+    return 1;
+}
+
+// Function to open the binary log, appending to it if it already exists with the same layout
+int log_open_writer(LogWriter *writer, const char *path, int core_count) {
+    LogFileHeader header;
+    long long block = 0;
+    
+    memset(writer, 0, sizeof(*writer));
+    writer->core_count = core_count;
+    writer->file = fopen(path, "r+b");
+    if (writer->file != NULL) {
+        if (fread(&header, sizeof(header), 1, writer->file) != 1 ||
+            memcmp(header.magic, LOG_MAGIC, sizeof(header.magic)) != 0 ||
+            header.block_size != LOG_BLOCK_SIZE) {
+            printf("Not a resource log: %s\n", path);
+            fclose(writer->file);
+            return 0;
+        }
+        if ((int)header.core_count != core_count) {
+            printf("%s was recorded with %u cores, this machine has %d\n", path, header.core_count, core_count);
+            fclose(writer->file);
+            return 0;
+        }
+        
+        fseek64(writer->file, 0, SEEK_END);
+        long long data = (long long)ftell64(writer->file) - (long long)sizeof(header);
+        block = (data + LOG_BLOCK_SIZE - 1) / LOG_BLOCK_SIZE;
+        if (block > 0 && log_resume_block(writer, block - 1)) return 1;
+    } else {
+        writer->file = fopen(path, "w+b");
+        if (writer->file == NULL) {
+            printf("Error creating log file\n");
+            return 0;
+        }
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+        header.block_size = LOG_BLOCK_SIZE;
+        header.core_count = (uint32_t)core_count;
+        if (fwrite(&header, sizeof(header), 1, writer->file) != 1 || fflush(writer->file) != 0) {
+            printf("Error writing log file\n");
+            fclose(writer->file);
+            return 0;
+        }
+    }
+    
+    log_start_block(writer, block);
+    return 1;
+}
+
+// Function to append one sample to the binary log; it reaches the file at the next log_flush
+int log_append(LogWriter *writer, const SystemResources *res) {
+    uint64_t words[LOG_COLUMNS];
+    int64_t ms = (int64_t)res->timestamp * 1000 + res->timestamp_ms;
+    int columns = 6 + writer->core_count;
+    
+    if (writer->header.bits + LOG_SAMPLE_MAX_BITS(writer->core_count) > LOG_PAYLOAD_SIZE * 8) {
+        if (!log_flush(writer)) return 0;
+        log_start_block(writer, writer->block + 1);
+    }
+    
+    sample_to_words(res, writer->core_count, words);
+    encode_timestamp(&writer->codec, writer->payload, &writer->header.bits, ms);
+    for (int i = 0; i < columns; i++) {
+        encode_value(&writer->codec, writer->payload, &writer->header.bits, i, words[i]);
+    }
+    
+    if (writer->header.count == 0) writer->header.first_ms = ms;
+    writer->header.last_ms = ms;
+    writer->header.count++;
+    return 1;
+}
+
+void log_close_writer(LogWriter *writer) {
+    if (writer == NULL || writer->file == NULL) return;
+    if (!log_flush(writer)) printf("Error writing log file\n");
+    fclose(writer->file);
+    writer->file = NULL;
+}
+
+void unmap_file(MappedFile *map) {
+#ifdef _WIN32
+    if (map->base) UnmapViewOfFile(map->base);
+    if (map->mapping) CloseHandle(map->mapping);
+    if (map->file != INVALID_HANDLE_VALUE) CloseHandle(map->file);
+#else
+    if (map->base) munmap((void *)map->base, map->size);
+    if (map->file >= 0) close(map->file);
+#endif
+    memset(map, 0, sizeof(*map));
+#ifdef _WIN32
+    map->file = INVALID_HANDLE_VALUE;
+#else
+    map->file = -1;
+#endif
+}
+
+// Map a whole file read-only. Returns 1 on success, 0 if it is shorter than min_size,
+// -1 if it cannot be opened or mapped.
+int map_file(MappedFile *map, const char *path, size_t min_size) {
+    memset(map, 0, sizeof(*map));
+    
+#ifdef _WIN32
+    LARGE_INTEGER file_size;
+    map->file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (map->file == INVALID_HANDLE_VALUE) return -1;
+    if (!GetFileSizeEx(map->file, &file_size) || file_size.QuadPart < (LONGLONG)min_size ||
+        file_size.QuadPart == 0) {
+        unmap_file(map);
+        return 0;
+    }
+    map->size = (size_t)file_size.QuadPart;
+    map->mapping = CreateFileMapping(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (map->mapping != NULL) {
+        map->base = (const unsigned char *)MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+#else
+    struct stat st;
+    map->file = open(path, O_RDONLY | O_CLOEXEC);
+    if (map->file < 0) return -1;
+    if (fstat(map->file, &st) != 0 || st.st_size < (off_t)min_size || st.st_size == 0) {
+        unmap_file(map);
+        return 0;
+    }
+    map->size = (size_t)st.st_size;
+    void *base = mmap(NULL, map->size, PROT_READ, MAP_SHARED, map->file, 0);
+    map->base = base == MAP_FAILED ? NULL : (const unsigned char *)base;
+#endif
+    if (map->base == NULL) {
+        unmap_file(map);
+        return -1;
+    }
+    return 1;
+}
+
+void log_close_reader(LogReader *reader) {
+    unmap_file(&reader->map);
+}
+
+// Function to map a binary log for reading
+int log_open_reader(LogReader *reader, const char *path) {
+    memset(reader, 0, sizeof(*reader));
+    int mapped = map_file(&reader->map, path, sizeof(LogFileHeader));
+    if (mapped < 0) {
+        printf("Error opening %s\n", path);
+        return 0;
+    }
+    
+    const LogFileHeader *header = (const LogFileHeader *)reader->map.base;
+    if (mapped == 0 || memcmp(header->magic, LOG_MAGIC, sizeof(header->magic)) != 0 ||
+        header->block_size != LOG_BLOCK_SIZE || header->core_count > MAX_CORES) {
+        printf("Not a resource log: %s\n", path);
+        log_close_reader(reader);
+        return 0;
+    }
+    reader->core_count = (int)header->core_count;
+    reader->block_count = (long long)((reader->map.size - sizeof(LogFileHeader) + LOG_BLOCK_SIZE - 1) / LOG_BLOCK_SIZE);
+    return 1;
+}
+
+// Header of a block, or NULL if it was never written
+const LogBlockHeader *log_block(const LogReader *reader, long long block) {
+    size_t offset = sizeof(LogFileHeader) + (size_t)block * LOG_BLOCK_SIZE;
+    
+    if (block < 0 || block >= reader->block_count || offset + sizeof(LogBlockHeader) > reader->map.size) return NULL;
+    const LogBlockHeader *header = (const LogBlockHeader *)(reader->map.base + offset);
+    if (header->magic != LOG_BLOCK_MAGIC || header->bits > LOG_PAYLOAD_SIZE * 8) return NULL;
+    return header;
+}
+
+// Position a cursor at the first sample of a block; returns 0 if the block is unusable
+int log_cursor_init(LogCursor *cursor, const LogReader *reader, long long block) {
+    const LogBlockHeader *header = log_block(reader, block);
+    
+    memset(cursor, 0, sizeof(*cursor));
+    if (header == NULL) return 0;
+    cursor->payload = (const unsigned char *)(header + 1);
+    cursor->bits = header->bits;
+    
+    // A log cut short mid-block still yields the samples that made it to disk
+    size_t available = reader->map.size - ((const unsigned char *)cursor->payload - reader->map.base);
+    if (available * 8 < cursor->bits) cursor->bits = (uint32_t)(available * 8);
+    cursor->remaining = header->count;
+    cursor->core_count = reader->core_count;
+    codec_reset(&cursor->codec);
+    return 1;
+}
+
+// Function to write a binary log out as CSV in the original system_resources.csv format
+int export_log_to_csv(const char *log_path, const char *csv_path) {
+    LogReader reader;
+    LogCursor cursor;
+    SystemResources res;
+    unsigned long long samples = 0;
+    
+    if (!log_open_reader(&reader, log_path)) return 0;
+    FILE *file = fopen(csv_path, "w");
+    if (file == NULL) {
+        printf("Error creating %s\n", csv_path);
+        log_close_reader(&reader);
+        return 0;
+    }
+    
+    log_header_to_file(reader.core_count, file);
+    for (long long block = 0; block < reader.block_count; block++) {
+        if (!log_cursor_init(&cursor, &reader, block)) continue;
+        while (log_cursor_next(&cursor, &res)) {
+            log_resources_to_file(&res, reader.core_count, file);
+            samples++;
+        }
+        if (cursor.remaining > 0) printf("Block %lld is cut short or corrupt, %u samples lost\n", block, cursor.remaining);
+    }
+    
+    int ok = fclose(file) == 0;
+    printf("Exported %llu samples from %s (%zu bytes, %.1f bytes per sample) to %s\n",
+           samples, log_path, reader.map.size, samples ? (double)reader.map.size / samples : 0.0, csv_path);
+    log_close_reader(&reader);
+    return ok;
+}
+
+// Function to open a recorded log, or set up a load pattern, to take samples from
+int sample_source_open(SampleSource *source, const MonitorOptions *opts) {
+    memset(source, 0, sizeof(*source));
+    if (opts->replay_path) {
+        if (!log_open_reader(&source->reader, opts->replay_path)) return 0;
+        source->replaying = 1;
+        source->core_count = source->reader.core_count;
+        source->block = -1;        // The empty cursor moves on to block 0 at the first sample
+        for (long long block = 0; block < source->reader.block_count; block++) {
+            const LogBlockHeader *header = log_block(&source->reader, block);
+            if (header) source->total += header->count;
+        }
+        return 1;
+    }
+    
+    for (int i = 0; i < PATTERN_COUNT; i++) {
+        if (strcmp(opts->pattern, pattern_names[i]) == 0) {
+            struct timespec now;
+            timespec_get(&now, TIME_UTC);
+            source->pattern = (LoadPattern)i;
+            source->core_count = opts->cores;
+            source->interval_ms = opts->interval_ms;
+            source->start_ms = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+            source->ms = source->start_ms;
+            source->walk = 0.5;
+            return 1;
+        }
+    }
+    printf("Unknown pattern: %s (use steady, sine, ramp, spike or noise)\n", opts->pattern);
+    return 0;
+}
+
+void sample_source_close(SampleSource *source) {
+    if (source->replaying) log_close_reader(&source->reader);
+}
+
+// Load of a pattern t seconds in, from 0 to 1
+static double pattern_level(SampleSource *source, double t) {
+    double phase = fmod(t * 1000, PATTERN_PERIOD_MS) / PATTERN_PERIOD_MS;
+    
+    switch (source->pattern) {
+    case PATTERN_SINE:
+        return 0.5 + 0.45 * sin(2 * 3.14159265358979 * phase);
+    case PATTERN_RAMP:
+        return phase;
+    case PATTERN_SPIKE:
+        return phase >= 0.9 ? 0.98 : 0.05;
+    case PATTERN_NOISE:
+        source->walk += ((double)rand() / RAND_MAX - 0.5) * 0.1;
+        if (source->walk < 0) source->walk = 0;
+        if (source->walk > 1) source->walk = 1;
+        return source->walk;
+    default:
+        return 0.5;
+    }
+}
+
+// Function to make up the next sample of a pattern. Counters carry on from the sample already in
+// res, so every call has to be given the same buffer.
+static void generate_sample(SampleSource *source, SystemResources *res) {
+    double seconds = source->interval_ms / 1000.0;
+    double level = pattern_level(source, (source->ms - source->start_ms) / 1000.0);
+    
+    res->timestamp = (time_t)(source->ms / 1000);
+    res->timestamp_ms = (int)(source->ms % 1000);
+    source->ms += source->interval_ms;
+    
+    // Cores follow the pattern a little out of step with one another
+    res->core_count = source->core_count;
+    res->cpu_usage = 0;
+    for (int i = 0; i < source->core_count; i++) {
+        double core = level + 0.1 * sin(i + (source->ms - source->start_ms) / 1000.0);
+        core = core < 0 ? 0 : core > 1 ? 1 : core;
+        res->core_usage[i] = (float)(core * 100);
+        res->cpu_usage += core * 100 / source->core_count;
+    }
+    
+    res->memory_total = 16ULL << 30;
+    res->memory_usage_percent = 20 + 60 * level;
+    res->memory_available = (DWORDLONG)(res->memory_total * (1 - res->memory_usage_percent / 100));
+    res->disk_read_bytes += (DWORDLONG)(level * 200e6 * seconds);
+    res->disk_write_bytes += (DWORDLONG)(level * 100e6 * seconds);
+    
+    res->interface_count = 1;
+    NetInterface *net = &res->interfaces[0];
+    memcpy(net->name, "gen0", 5);
+    net->rx_bytes += (DWORDLONG)(level * 100e6 * seconds);
+    net->tx_bytes += (DWORDLONG)(level * 25e6 * seconds);
+    net->rx_packets += (DWORDLONG)(level * 70e3 * seconds);
+    net->tx_packets += (DWORDLONG)(level * 20e3 * seconds);
+    
+    res->context_switches += (DWORDLONG)((1000 + level * 20000) * source->core_count * seconds);
+    for (int i = 0; i < SOFTIRQ_TYPES; i++) {
+        res->softirqs[i] += (DWORDLONG)((100 + level * 1000 * (i + 1)) * seconds);
+    }
+    res->procs_running = (int)(level * source->core_count + 0.5);
+    res->procs_blocked = level > 0.8 ? 2 : 0;
+}
+
+// Function to take the next sample, decoded or generated into res; returns 0 when a replay ends.
+// Replayed samples only carry what the log records, so the rest of res keeps whatever it held.
+int sample_source_next(SampleSource *source, SystemResources *res) {
+    if (!source->replaying) {
+        generate_sample(source, res);
+        return 1;
+    }
+    while (!log_cursor_next(&source->cursor, res)) {
+        source->lost += source->cursor.remaining;
+        if (++source->block >= source->reader.block_count) return 0;
+        log_cursor_init(&source->cursor, &source->reader, source->block);
+    }
+    return 1;
+}
+
+static const int64_t rollup_level_ms[ROLLUP_LEVELS] = {60000, 3600000};
+static const char *rollup_suffix[ROLLUP_LEVELS] = {".1m", ".1h"};
+static const char *metric_names[ROLLUP_METRICS] = {"cpu", "mem", "read", "write"};
+static const char *metric_units[ROLLUP_METRICS] = {"%", "%", "B/s", "B/s"};
+
+static void rollup_path(char *path, size_t size, const char *log_path, int level) {
+    snprintf(path, size, "%s%s", log_path, rollup_suffix[level]);
+}
+
+// Percentages get even bins over 0-100; rates get one bin per power of two, up to 2^31 B/s
+static int rollup_bin(int metric, double value) {
+    int bin;
+    
+    if (metric < 2) {
+        bin = (int)(value * ROLLUP_BINS / 100);
+    } else {
+        double edge = 1;
+        for (bin = 0; bin < ROLLUP_BINS - 1 && value >= edge; bin++) {
+            edge *= 2;
+        }
+    }
+    if (bin < 0) return 0;
+    return bin < ROLLUP_BINS ? bin : ROLLUP_BINS - 1;
+}
+
+static void rollup_bin_edges(int metric, int bin, double *low, double *high) {
+    if (metric < 2) {
+        *low = bin * 100.0 / ROLLUP_BINS;
+        *high = (bin + 1) * 100.0 / ROLLUP_BINS;
+    } else {
+        // Bin 0 is an idle device; anything under 1 B/s is reported as zero
+        *low = bin == 0 ? 0 : (double)(1ULL << (bin - 1));
+        *high = bin == 0 ? 0 : (double)(1ULL << bin);
+    }
+}
+
+static void stat_add_value(RollupStat *stat, int metric, double value) {
+    if (stat->count == 0 || value < stat->min) stat->min = (float)value;
+    if (stat->count == 0 || value > stat->max) stat->max = (float)value;
+    stat->count++;
+    stat->sum += value;
+    stat->histogram[rollup_bin(metric, value)]++;
+}
+
+static void stat_merge(RollupStat *into, const RollupStat *from) {
+    if (from->count == 0) return;
+    if (into->count == 0 || from->min < into->min) into->min = from->min;
+    if (into->count == 0 || from->max > into->max) into->max = from->max;
+    into->count += from->count;
+    into->sum += from->sum;
+    for (int i = 0; i < ROLLUP_BINS; i++) {
+        into->histogram[i] += from->histogram[i];
+    }
+}
+
+// Percentile from a histogram, interpolated within its bin and kept inside the known min and max
+static double stat_percentile(const RollupStat *stat, int metric, double q) {
+    double target = q * stat->count;
+    double seen = 0;
+    
+    for (int bin = 0; bin < ROLLUP_BINS; bin++) {
+        if (stat->histogram[bin] == 0 || seen + stat->histogram[bin] < target) {
+            seen += stat->histogram[bin];
+            continue;
+        }
+        double low, high;
+        rollup_bin_edges(metric, bin, &low, &high);
+        if (low < stat->min) low = stat->min;
+        if (high > stat->max) high = stat->max;
+        return low + (high - low) * (target - seen) / stat->histogram[bin];
+    }
+    return stat->max;
+}
+
+// The rollup metrics of a sample. Rates come from the previous sample; returns which metrics are set.
+static int sample_metrics(RollupWriter *rollups, const SystemResources *res, int64_t ms, double *values) {
+    int set = 0x3;
+    
+    values[0] = res->cpu_usage;
+    values[1] = res->memory_usage_percent;
+    if (rollups->have_prev && ms > rollups->prev_ms &&
+        res->disk_read_bytes >= rollups->prev_read && res->disk_write_bytes >= rollups->prev_write) {
+        double seconds = (ms - rollups->prev_ms) / 1000.0;
+        values[2] = (res->disk_read_bytes - rollups->prev_read) / seconds;
+        values[3] = (res->disk_write_bytes - rollups->prev_write) / seconds;
+        set |= 0xc;
+    }
+    rollups->have_prev = 1;
+    rollups->prev_ms = ms;
+    rollups->prev_read = res->disk_read_bytes;
+    rollups->prev_write = res->disk_write_bytes;
+    return set;
+}
+
+static int rollup_write_open(RollupWriter *rollups, int level) {
+    if (rollups->open[level].samples == 0) return 1;
+    int ok = fwrite(&rollups->open[level], sizeof(RollupRecord), 1, rollups->files[level]) == 1;
+    memset(&rollups->open[level], 0, sizeof(RollupRecord));
+    return ok;
+}
+
+// Function to open the rollup files beside a log; truncate starts them over
+int rollup_open_writer(RollupWriter *rollups, const char *log_path, int truncate) {
+    char path[1024];
+    
+    memset(rollups, 0, sizeof(*rollups));
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        RollupFileHeader header;
+        rollup_path(path, sizeof(path), log_path, level);
+        
+        // Rollups are derived data, so a file that does not match is simply started over
+        FILE *file = truncate ? NULL : fopen(path, "r+b");
+        if (file != NULL &&
+            (fread(&header, sizeof(header), 1, file) != 1 ||
+             memcmp(header.magic, ROLLUP_MAGIC, sizeof(header.magic)) != 0 ||
+             header.level_ms != rollup_level_ms[level] || header.record_size != sizeof(RollupRecord))) {
+            fclose(file);
+            file = NULL;
+        }
+        if (file != NULL) {
+            // Append after the last whole record, dropping one cut short by a crash
+            fseek64(file, 0, SEEK_END);
+            long long records = ((long long)ftell64(file) - (long long)sizeof(header)) / (long long)sizeof(RollupRecord);
+            fseek64(file, (long long)sizeof(header) + records * (long long)sizeof(RollupRecord), SEEK_SET);
+        } else {
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, ROLLUP_MAGIC, sizeof(header.magic));
+            header.level_ms = rollup_level_ms[level];
+            header.record_size = sizeof(RollupRecord);
+            file = fopen(path, "wb");
+            if (file == NULL || fwrite(&header, sizeof(header), 1, file) != 1) {
+                printf("Error creating %s\n", path);
+                if (file) fclose(file);
+                rollups->files[level] = NULL;
+                for (int i = 0; i < level; i++) {
+                    fclose(rollups->files[i]);
+                }
+                return 0;
+            }
+        }
+        rollups->files[level] = file;
+    }
+    return 1;
+}
+
+// Function to add a sample to the open buckets, writing out any bucket it closes
+int rollup_add(RollupWriter *rollups, const SystemResources *res) {
+    int64_t ms = (int64_t)res->timestamp * 1000 + res->timestamp_ms;
+    double values[ROLLUP_METRICS];
+    int set = sample_metrics(rollups, res, ms, values);
+    int ok = 1;
+    
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        RollupRecord *record = &rollups->open[level];
+        int64_t start = ms - ((ms % rollup_level_ms[level]) + rollup_level_ms[level]) % rollup_level_ms[level];
+        if (record->samples > 0 && record->start_ms != start) ok &= rollup_write_open(rollups, level);
+        record->start_ms = start;
+        record->samples++;
+        for (int metric = 0; metric < ROLLUP_METRICS; metric++) {
+            if (set & (1 << metric)) stat_add_value(&record->stats[metric], metric, values[metric]);
+        }
+    }
+    return ok;
+}
+
+int rollup_flush(RollupWriter *rollups) {
+    int ok = 1;
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        ok &= fflush(rollups->files[level]) == 0;
+    }
+    return ok;
+}
+
+// Function to write out the partial buckets and close the files. A later run may add a
+// second record for the same bucket; queries merge them.
+int rollup_close_writer(RollupWriter *rollups) {
+    int ok = 1;
+    if (rollups == NULL) return 1;
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        if (rollups->files[level] == NULL) continue;
+        ok &= rollup_write_open(rollups, level);
+        ok &= fclose(rollups->files[level]) == 0;
+        rollups->files[level] = NULL;
+    }
+    return ok;
+}
+
+// Function to build the rollups of an existing log from scratch
+int rebuild_rollups(const char *log_path) {
+    LogReader reader;
+    LogCursor cursor;
+    SystemResources res;
+    RollupWriter rollups;
+    unsigned long long samples = 0;
+    
+    if (!log_open_reader(&reader, log_path)) return 0;
+    if (!rollup_open_writer(&rollups, log_path, 1)) {
+        log_close_reader(&reader);
+        return 0;
+    }
+    
+    int ok = 1;
+    for (long long block = 0; block < reader.block_count && ok; block++) {
+        if (!log_cursor_init(&cursor, &reader, block)) continue;
+        while (log_cursor_next(&cursor, &res) && ok) {
+            ok = rollup_add(&rollups, &res);
+            samples++;
+        }
+    }
+    ok &= rollup_close_writer(&rollups);
+    log_close_reader(&reader);
+    printf("Rolled up %llu samples from %s\n", samples, log_path);
+    return ok;
+}
+
+// One window of query output
+typedef struct {
+    int64_t start_ms;
+    uint32_t samples;
+    RollupStat stat;
+    double *values;                // Raw values for exact percentiles, when scanning the log
+    int value_count;
+    int value_capacity;
+} QueryWindow;
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void print_window(QueryWindow *window, int metric) {
+    static const double quantiles[3] = {0.50, 0.95, 0.99};
+    char timestamp_str[30];
+    time_t start = (time_t)(window->start_ms / 1000);
+    double p[3];
+    
+    if (window->stat.count == 0) return;
+    if (window->values) {
+        qsort(window->values, window->value_count, sizeof(double), compare_doubles);
+        for (int i = 0; i < 3; i++) {
+            int rank = (int)(quantiles[i] * window->value_count + 0.999999);
+            p[i] = window->values[rank > 0 ? rank - 1 : 0];
+        }
+    } else {
+        for (int i = 0; i < 3; i++) {
+            p[i] = stat_percentile(&window->stat, metric, quantiles[i]);
+        }
+    }
+    
+    strftime(timestamp_str, 30, "%Y-%m-%d %H:%M:%S", localtime(&start));
+    printf("%-20s %9u %12.2f %12.2f %12.2f %12.2f %12.2f %12.2f\n",
+           timestamp_str,
+           window->samples,
+           window->stat.min,
+           window->stat.max,
+           window->stat.sum / window->stat.count,
+           p[0], p[1], p[2]);
+}
+
+static void window_reset(QueryWindow *window, int64_t start_ms) {
+    double *values = window->values;
+    int capacity = window->value_capacity;
+    memset(window, 0, sizeof(*window));
+    window->start_ms = start_ms;
+    window->values = values;
+    window->value_capacity = capacity;
+}
+
+static int64_t window_start(int64_t ms, int64_t window_ms) {
+    return ms - ((ms % window_ms) + window_ms) % window_ms;
+}
+
+// Query from the mapped rollup file of one level: binary search to the first bucket, then a
+// sequential scan, merging buckets into windows
+static int query_rollups(const char *path, int metric, int64_t from_ms, int64_t to_ms, int64_t window_ms) {
+    MappedFile map;
+    QueryWindow window;
+    
+    if (map_file(&map, path, sizeof(RollupFileHeader)) <= 0) return 0;
+    memset(&window, 0, sizeof(window));
+    
+    const RollupFileHeader *header = (const RollupFileHeader *)map.base;
+    if (memcmp(header->magic, ROLLUP_MAGIC, sizeof(header->magic)) != 0 ||
+        header->record_size != sizeof(RollupRecord)) {
+        printf("Ignoring invalid rollup file %s\n", path);
+        unmap_file(&map);
+        return 0;
+    }
+    const RollupRecord *records = (const RollupRecord *)(map.base + sizeof(RollupFileHeader));
+    size_t count = (map.size - sizeof(RollupFileHeader)) / sizeof(RollupRecord);
+    
+    // First bucket starting at or after from_ms
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (records[middle].start_ms < from_ms) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    
+    window_reset(&window, window_start(from_ms, window_ms));
+    for (size_t i = low; i < count && records[i].start_ms < to_ms; i++) {
+        int64_t start = window_start(records[i].start_ms, window_ms);
+        if (start != window.start_ms) {
+            print_window(&window, metric);
+            window_reset(&window, start);
+        }
+        window.samples += records[i].samples;
+        stat_merge(&window.stat, &records[i].stats[metric]);
+    }
+    print_window(&window, metric);
+    unmap_file(&map);
+    return 1;
+}
+
+// Query by decoding the log itself, for windows finer than the rollups; percentiles are exact
+static int query_log(const char *log_path, int metric, int64_t from_ms, int64_t to_ms, int64_t window_ms) {
+    LogReader reader;
+    LogCursor cursor;
+    SystemResources res;
+    RollupWriter rates;            // Only tracks the previous sample for the disk rates
+    QueryWindow window;
+    double values[ROLLUP_METRICS];
+    
+    if (!log_open_reader(&reader, log_path)) return 0;
+    memset(&rates, 0, sizeof(rates));
+    memset(&window, 0, sizeof(window));
+    window_reset(&window, window_start(from_ms, window_ms));
+    
+    // Blocks are in time order, so their headers find the first one to decode
+    long long low = 0, high = reader.block_count;
+    while (low < high) {
+        long long middle = (low + high) / 2;
+        const LogBlockHeader *header = log_block(&reader, middle);
+        if (header && header->count > 0 && header->last_ms < from_ms) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    
+    int done = 0;
+    for (long long block = low > 0 ? low - 1 : 0; block < reader.block_count && !done; block++) {
+        if (!log_cursor_init(&cursor, &reader, block)) continue;
+        while (log_cursor_next(&cursor, &res)) {
+            int64_t ms = (int64_t)res.timestamp * 1000 + res.timestamp_ms;
+            int set = sample_metrics(&rates, &res, ms, values);
+            if (ms < from_ms || !(set & (1 << metric))) continue;
+            if (ms >= to_ms) {
+                done = 1;
+                break;
+            }
+            
+            int64_t start = window_start(ms, window_ms);
+            if (start != window.start_ms) {
+                print_window(&window, metric);
+                window_reset(&window, start);
+            }
+            if (window.value_count == window.value_capacity) {
+                int capacity = window.value_capacity ? window.value_capacity * 2 : 1024;
+                double *grown = (double *)realloc(window.values, capacity * sizeof(double));
+                if (grown == NULL) {
+                    printf("Memory allocation failed\n");
+                    free(window.values);
+                    log_close_reader(&reader);
+                    return 0;
+                }
+                window.values = grown;
+                window.value_capacity = capacity;
+            }
+            window.values[window.value_count++] = values[metric];
+            window.samples++;
+            stat_add_value(&window.stat, metric, values[metric]);
+        }
+    }
+    print_window(&window, metric);
+    free(window.values);
+    log_close_reader(&reader);
+    return 1;
+}
+
+// Function to answer a range query, from the coarsest rollup level the window allows
+int query_log_range(const char *log_path, const char *metric_name, int64_t from_ms, int64_t to_ms, int64_t window_ms) {
+    char path[1024];
+    int metric = -1;
+    
+    for (int i = 0; i < ROLLUP_METRICS; i++) {
+        if (strcmp(metric_name, metric_names[i]) == 0) metric = i;
+    }
+    if (metric < 0) {
+        printf("Unknown metric: %s (use cpu, mem, read or write)\n", metric_name);
+        return 0;
+    }
+    
+    printf("%-20s %9s %12s %12s %12s %12s %12s %12s\n", "Window", "Samples", "Min", "Max", "Avg", "P50", "P95", "P99");
+    for (int level = ROLLUP_LEVELS - 1; level >= 0; level--) {
+        if (window_ms % rollup_level_ms[level] != 0) continue;
+        rollup_path(path, sizeof(path), log_path, level);
+        if (query_rollups(path, metric, window_start(from_ms, rollup_level_ms[level]), to_ms, window_ms)) {
+            printf("(%s in %s, from the %s rollups)\n", metric_name, metric_units[metric], rollup_suffix[level] + 1);
+            return 1;
+        }
+    }
+    
+    // No usable rollups: the log has the detail
+    if (!query_log(log_path, metric, from_ms, to_ms, window_ms)) return 0;
+    printf("(%s in %s, from the log)\n", metric_name, metric_units[metric]);
+    return 1;
+}
+
+// Function to read a --from or --to time: "now", -<n>s/m/h/d, seconds since the epoch,
+// or local "YYYY-MM-DD HH:MM[:SS]"
+int parse_time(const char *text, int64_t *ms) {
+    time_t now = time(NULL);
+    struct tm tm_info;
+    char *end;
+    
+    if (strcmp(text, "now") == 0) {
+        *ms = (int64_t)now * 1000;
+        return 1;
+    }
+    if (text[0] == '-') {
+        long long amount = strtoll(text + 1, &end, 10);
+        int64_t unit = *end == 'm' ? 60 : *end == 'h' ? 3600 : *end == 'd' ? 86400 : *end == 's' || *end == '\0' ? 1 : 0;
+        if (unit && end != text + 1 && (*end == '\0' || end[1] == '\0')) {
+            *ms = ((int64_t)now - amount * unit) * 1000;
+            return 1;
+        }
+    } else {
+        long long seconds = strtoll(text, &end, 10);
+        if (*end == '\0' && end != text) {
+            *ms = (int64_t)seconds * 1000;
+            return 1;
+        }
+        memset(&tm_info, 0, sizeof(tm_info));
+        int fields = sscanf(text, "%d-%d-%d%*c%d:%d:%d", &tm_info.tm_year, &tm_info.tm_mon, &tm_info.tm_mday,
+                            &tm_info.tm_hour, &tm_info.tm_min, &tm_info.tm_sec);
+        if (fields == 3 || fields >= 5) {
+            tm_info.tm_year -= 1900;
+            tm_info.tm_mon -= 1;
+            tm_info.tm_isdst = -1;
+            *ms = (int64_t)mktime(&tm_info) * 1000;
+            return 1;
+        }
+    }
+    printf("Unknown time: %s\n", text);
+    return 0;
+}
+
+// Function to find an alert metric: cpu, mem, read, write or cpu<N> for a core
+static int parse_alert_metric(const char *name) {
+    for (int i = 0; i < ROLLUP_METRICS; i++) {
+        if (strcmp(name, metric_names[i]) == 0) return i;
+    }
+    if (strncmp(name, "cpu", 3) == 0 && name[3] >= '0' && name[3] <= '9') {
+        char *end;
+        long core = strtol(name + 3, &end, 10);
+        if (*end == '\0' && core < MAX_CORES) return ROLLUP_METRICS + (int)core;
+    }
+    return -1;
+}
+
+// Function to describe an alert metric, for messages
+static void alert_metric_name(int metric, char *name, size_t size) {
+    if (metric < ROLLUP_METRICS) {
+        snprintf(name, size, "%s", metric_names[metric]);
+    } else {
+        snprintf(name, size, "cpu%d", metric - ROLLUP_METRICS);
+    }
+}
+
+// Function to read one rule:
+//   <name> <metric> [rate|zscore] >|< <limit> [for <samples>] [alpha <weight>]
+static int parse_alert_rule(char *line, AlertRule *rule) {
+    char *words[12];
+    int count = 0;
+    
+    for (char *word = strtok(line, " \t\r\n"); word && count < 12; word = strtok(NULL, " \t\r\n")) {
+        words[count++] = word;
+    }
+    if (count < 4 || strlen(words[0]) >= sizeof(rule->name)) return 0;
+    
+    memset(rule, 0, sizeof(*rule));
+    strcpy(rule->name, words[0]);
+    rule->metric = parse_alert_metric(words[1]);
+    rule->kind = ALERT_THRESHOLD;
+    rule->sustain = 1;
+    rule->alpha = 0.05;
+    if (rule->metric < 0) return 0;
+    
+    int next = 2;
+    if (strcmp(words[next], "rate") == 0) {
+        rule->kind = ALERT_RATE;
+        next++;
+    } else if (strcmp(words[next], "zscore") == 0) {
+        rule->kind = ALERT_ZSCORE;
+        next++;
+    }
+    if (next + 1 >= count || (strcmp(words[next], ">") != 0 && strcmp(words[next], "<") != 0)) return 0;
+    rule->above = words[next][0] == '>';
+    
+    char *end;
+    rule->limit = strtod(words[next + 1], &end);
+    if (*end != '\0') return 0;
+    for (next += 2; next < count; next += 2) {
+        if (next + 1 >= count) return 0;
+        if (strcmp(words[next], "for") == 0) {
+            rule->sustain = atoi(words[next + 1]);
+            if (rule->sustain < 1) return 0;
+        } else if (strcmp(words[next], "alpha") == 0) {
+            rule->alpha = strtod(words[next + 1], &end);
+            if (*end != '\0' || rule->alpha <= 0 || rule->alpha >= 1) return 0;
+        } else {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to load alert rules, one per line; # starts a comment
+static int load_alert_rules(AlertEngine *engine, const char *path) {
+    char line[256];
+    int line_number = 0;
+    
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        printf("Error opening rules file %s\n", path);
+        return 0;
+    }
+    engine->rules = (AlertRule *)calloc(MAX_ALERT_RULES, sizeof(AlertRule));
+    if (engine->rules == NULL) {
+        fclose(file);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+        if (strspn(line, " \t\r\n") == strlen(line)) continue;
+        
+        if (engine->rule_count == MAX_ALERT_RULES) {
+            printf("%s:%d: more than %d rules\n", path, line_number, MAX_ALERT_RULES);
+            fclose(file);
+            return 0;
+        }
+        if (!parse_alert_rule(line, &engine->rules[engine->rule_count])) {
+            printf("%s:%d: expected <name> <metric> [rate|zscore] >|< <limit> [for <n>] [alpha <a>]\n",
+                   path, line_number);
+            fclose(file);
+            return 0;
+        }
+        engine->rule_count++;
+    }
+    fclose(file);
+    return 1;
+}
+
+// Function to open where alerts go: file:<path> appends, pipe:<command> writes to a command's
+// input, syslog logs to the system log
+static int open_alert_sink(AlertEngine *engine, const char *spec) {
+    if (strncmp(spec, "file:", 5) == 0) {
+        engine->sink = SINK_FILE;
+        engine->out = fopen(spec + 5, "a");
+    } else if (strncmp(spec, "pipe:", 5) == 0) {
+        engine->sink = SINK_PIPE;
+#ifdef _WIN32
+        engine->out = popen(spec + 5, "w");
+#else
+        // Ctrl+C reaches the whole foreground group; the command should outlive it and get
+        // the alerts sent while shutting down. A command that exits costs us its alerts, not
+        // the monitor.
+        char *command = (char *)malloc(strlen(spec) + 16);
+        if (command) {
+            sprintf(command, "trap '' INT; %s", spec + 5);
+            engine->out = popen(command, "w");
+            free(command);
+        }
+        signal(SIGPIPE, SIG_IGN);
+#endif
+    } else if (strcmp(spec, "syslog") == 0) {
+#ifdef _WIN32
+        printf("The syslog sink is only available on Linux\n");
+        return 0;
+#else
+        engine->sink = SINK_SYSLOG;
+        openlog("resource_monitor", LOG_PID, LOG_DAEMON);
+        return 1;
+#endif
+    } else {
+        printf("Unknown alert sink: %s (use file:<path>, pipe:<command> or syslog)\n", spec);
+        return 0;
+    }
+    if (engine->out == NULL) {
+        printf("Error opening alert sink %s\n", spec);
+        return 0;
+    }
+    return 1;
+}
+
+void alert_engine_destroy(AlertEngine *engine) {
+    if (engine == NULL) return;
+    
+    if (engine->sink == SINK_PIPE && engine->out) {
+        pclose(engine->out);
+    } else if (engine->out) {
+        fclose(engine->out);
+    }
+#ifndef _WIN32
+    if (engine->sink == SINK_SYSLOG) closelog();
+#endif
+    free(engine->rules);
+    free(engine);
+}
+
+AlertEngine *alert_engine_create(const char *rules_path, const char *sink) {
+    AlertEngine *engine = (AlertEngine *)calloc(1, sizeof(AlertEngine));
+    if (engine == NULL) return NULL;
+    
+    engine->sink = SINK_FILE;
+    if (!load_alert_rules(engine, rules_path) || !open_alert_sink(engine, sink)) {
+        alert_engine_destroy(engine);
+        return NULL;
+    }
+    return engine;
+}
+
+// Function to send one alert; these are rare, so the sink is flushed every time
+static void send_alert(AlertEngine *engine, const AlertRule *rule, const SystemResources *res, double value) {
+    char timestamp_str[30];
+    char metric[16];
+    char message[160];
+    static const char *kinds[] = {"", " rate", " zscore"};
+    
+    alert_metric_name(rule->metric, metric, sizeof(metric));
+    snprintf(message, sizeof(message), "%s %s: %s%s %.2f (rule %s %g for %d sample%s)",
+             rule->firing ? "FIRING" : "RESOLVED", rule->name, metric, kinds[rule->kind], value,
+             rule->above ? ">" : "<", rule->limit, rule->sustain, rule->sustain == 1 ? "" : "s");
+    engine->raised++;
+#ifndef _WIN32
+    if (engine->sink == SINK_SYSLOG) {
+        syslog(rule->firing ? LOG_WARNING : LOG_NOTICE, "%s", message);
+        return;
+    }
+#endif
+    struct tm *tm_info = localtime(&res->timestamp);
+    strftime(timestamp_str, 30, "%Y-%m-%d %H:%M:%S", tm_info);
+    fprintf(engine->out, "%s.%03d %s\n", timestamp_str, res->timestamp_ms, message);
+    fflush(engine->out);
+}
+
+// Function to evaluate every rule against a sample. Metric values are worked out once for
+// the sample; after that each rule costs a few comparisons and, for z-scores, one EWMA update.
+void evaluate_alerts(AlertEngine *engine, const SystemResources *res) {
+    int64_t ms = (int64_t)res->timestamp * 1000 + res->timestamp_ms;
+    double seconds = engine->have_prev ? (ms - engine->prev_ms) / 1000.0 : 0;
+    double *values = engine->values;
+    
+    values[0] = res->cpu_usage;
+    values[1] = res->memory_usage_percent;
+    values[2] = seconds > 0 && res->disk_read_bytes >= engine->prev_read ?
+                (res->disk_read_bytes - engine->prev_read) / seconds : 0;
+    values[3] = seconds > 0 && res->disk_write_bytes >= engine->prev_write ?
+                (res->disk_write_bytes - engine->prev_write) / seconds : 0;
+    for (int i = 0; i < res->core_count; i++) {
+        values[ROLLUP_METRICS + i] = res->core_usage[i];
+    }
+    engine->metric_count = ROLLUP_METRICS + res->core_count;
+    
+    // Rates need one interval behind them
+    if (seconds > 0) {
+        for (int i = 0; i < engine->rule_count; i++) {
+            AlertRule *rule = &engine->rules[i];
+            if (rule->metric >= engine->metric_count) continue;
+            
+            double value = values[rule->metric];
+            if (rule->kind == ALERT_RATE) {
+                value = (value - engine->prev_values[rule->metric]) / seconds;
+            } else if (rule->kind == ALERT_ZSCORE) {
+                if (rule->seen++ == 0) {
+                    rule->mean = value;
+                    continue;
+                }
+                
+                // Score against the average so far, then fold the sample in
+                double diff = value - rule->mean;
+                double deviation = sqrt(rule->variance);
+                double increment = rule->alpha * diff;
+                value = deviation > 0 ? diff / deviation : 0;
+                rule->mean += increment;
+                rule->variance = (1 - rule->alpha) * (rule->variance + diff * increment);
+                
+                // Until about 1/alpha samples are in, the average says little
+                if (rule->seen < 1 / rule->alpha) continue;
+            }
+            
+            // Firing and resolving both take sustain samples in a row, so a noisy value does not flap
+            int holds = rule->above ? value > rule->limit : value < rule->limit;
+            rule->streak = holds != rule->firing ? rule->streak + 1 : 0;
+            if (rule->streak >= rule->sustain) {
+                rule->firing = holds;
+                rule->streak = 0;
+                engine->firing += holds ? 1 : -1;
+                send_alert(engine, rule, res, value);
+            }
+        }
+    }
+    
+    memcpy(engine->prev_values, values, engine->metric_count * sizeof(double));
+    engine->prev_ms = ms;
+    engine->prev_read = res->disk_read_bytes;
+    engine->prev_write = res->disk_write_bytes;
+    engine->have_prev = 1;
+}
+
+// Escape codes for each CellAttr; every one resets first, so they never depend on the last
+static const char *attr_escapes[] = {
+    "\033[0m",
+    "\033[0;1m",
+    "\033[0;2m",
+    "\033[0;32m",
+    "\033[0;33m",
+    "\033[0;31m",
+    "\033[0;36m"
+};
+
+// Eighths of a cell, lowest to full, for the sparklines
+static const uint32_t spark_levels[8] = {0x2581, 0x2582, 0x2583, 0x2584, 0x2585, 0x2586, 0x2587, 0x2588};
+
+#ifndef _WIN32
+static void handle_resize(int sig) {
+    (void)sig;
+    resize_requested = 1;
+}
+#endif
+
+// Function to get the terminal size; fails when output is not a terminal
+static int terminal_size(int *rows, int *cols) {
+#ifdef _WIN32
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    if (!GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &info)) return 0;
+    *rows = info.srWindow.Bottom - info.srWindow.Top + 1;
+    *cols = info.srWindow.Right - info.srWindow.Left + 1;
+#else
+    struct winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) < 0 || size.ws_row == 0 || size.ws_col == 0) return 0;
+    *rows = size.ws_row;
+    *cols = size.ws_col;
+#endif
+    return 1;
+}
+
+// Function to size the screen model to the terminal. A new size means a full repaint.
+static int screen_resize(Screen *screen) {
+    int rows = 24;
+    int cols = 80;
+    
+    terminal_size(&rows, &cols);
+    if (rows > SCREEN_MAX_ROWS) rows = SCREEN_MAX_ROWS;
+    if (cols > SCREEN_MAX_COLS) cols = SCREEN_MAX_COLS;
+    if (screen->cells && rows == screen->rows && cols == screen->cols) return 1;
+    
+    // The output buffer holds the worst case, a frame where every cell changes
+    size_t out_size = (size_t)rows * cols * SCREEN_CELL_MAX_BYTES + 64;
+    Cell *cells = (Cell *)calloc((size_t)rows * cols, sizeof(Cell));
+    Cell *shown = (Cell *)calloc((size_t)rows * cols, sizeof(Cell));
+    char *out = (char *)malloc(out_size);
+    if (cells == NULL || shown == NULL || out == NULL) {
+        free(cells);
+        free(shown);
+        free(out);
+        return 0;
+    }
+    free(screen->cells);
+    free(screen->shown);
+    free(screen->out);
+    screen->rows = rows;
+    screen->cols = cols;
+    screen->cells = cells;
+    screen->shown = shown;
+    screen->out = out;
+    screen->out_len = 0;
+    screen->out_size = out_size;
+    screen->redraw = 1;
+    return 1;
+}
+
+static void screen_append(Screen *screen, const char *text, size_t length) {
+    if (screen->out_len + length > screen->out_size) return;
+    memcpy(screen->out + screen->out_len, text, length);
+    screen->out_len += length;
+}
+
+static void screen_append_char(Screen *screen, uint32_t ch) {
+    char bytes[3];
+    
+    if (ch < 0x80) {
+        bytes[0] = (char)ch;
+        screen_append(screen, bytes, 1);
+    } else if (ch < 0x800) {
+        bytes[0] = (char)(0xc0 | ch >> 6);
+        bytes[1] = (char)(0x80 | (ch & 0x3f));
+        screen_append(screen, bytes, 2);
+    } else {
+        bytes[0] = (char)(0xe0 | ch >> 12);
+        bytes[1] = (char)(0x80 | (ch >> 6 & 0x3f));
+        bytes[2] = (char)(0x80 | (ch & 0x3f));
+        screen_append(screen, bytes, 3);
+    }
+}
+
+// Function to send the pending escapes to the terminal in one write
+static void screen_write(Screen *screen) {
+    size_t done = 0;
+    
+#ifdef _WIN32
+    HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+    while (done < screen->out_len) {
+        DWORD written;
+        if (!WriteFile(console, screen->out + done, (DWORD)(screen->out_len - done), &written, NULL)) break;
+        done += written;
+    }
+#else
+    while (done < screen->out_len) {
+        ssize_t written = write(STDOUT_FILENO, screen->out + done, screen->out_len - done);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        done += (size_t)written;
+    }
+#endif
+    // After a short write nobody knows what the terminal shows
+    if (done < screen->out_len) screen->redraw = 1;
+    screen->out_len = 0;
+}
+
+// Function to take over the terminal: alternate screen, cursor hidden
+Screen *screen_open(void) {
+    Screen *screen = (Screen *)calloc(1, sizeof(Screen));
+    if (screen == NULL || !screen_resize(screen)) {
+        free(screen);
+        return NULL;
+    }
+    
+#ifdef _WIN32
+    // Escapes and UTF-8 need to be switched on in the Windows console
+    HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD mode;
+    if (GetConsoleMode(console, &mode)) SetConsoleMode(console, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+    SetConsoleOutputCP(CP_UTF8);
+#else
+    signal(SIGWINCH, handle_resize);
+#endif
+    
+    // Anything printf left buffered has to reach the terminal before the first frame
+    fflush(stdout);
+    const char *enter = "\033[?1049h\033[?25l";
+    screen_append(screen, enter, strlen(enter));
+    screen_write(screen);
+    return screen;
+}
+
+// Function to give the terminal back as it was
+void screen_close(Screen *screen) {
+    if (screen == NULL) return;
+    
+    const char *leave = "\033[0m\033[?25h\033[?1049l";
+    screen->out_len = 0;
+    screen_append(screen, leave, strlen(leave));
+    screen_write(screen);
+#ifndef _WIN32
+    signal(SIGWINCH, SIG_DFL);
+#endif
+    free(screen->cells);
+    free(screen->shown);
+    free(screen->out);
+    free(screen);
+}
+
+// Function to start a frame: follow a resized terminal and blank every cell
+static int screen_begin(Screen *screen) {
+#ifdef _WIN32
+    if (!screen_resize(screen)) return 0;
+#else
+    if (resize_requested) {
+        resize_requested = 0;
+        if (!screen_resize(screen)) return 0;
+    }
+#endif
+    for (int i = 0; i < screen->rows * screen->cols; i++) {
+        screen->cells[i].ch = ' ';
+        screen->cells[i].attr = ATTR_NORMAL;
+    }
+    return 1;
+}
+
+static void screen_put(Screen *screen, int row, int col, uint32_t ch, CellAttr attr) {
+    if (row < 0 || row >= screen->rows || col < 0 || col >= screen->cols) return;
+    screen->cells[row * screen->cols + col].ch = ch;
+    screen->cells[row * screen->cols + col].attr = attr;
+}
+
+// Function to draw formatted text; returns the column after it
+static int screen_text(Screen *screen, int row, int col, CellAttr attr, const char *format, ...) {
+    char text[SCREEN_MAX_COLS + 1];
+    va_list args;
+    
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    for (const char *c = text; *c; c++) {
+        screen_put(screen, row, col++, (unsigned char)*c, attr);
+    }
+    return col;
+}
+
+// Green, yellow or red by how high a percentage is
+static CellAttr level_attr(double percent) {
+    if (percent >= 90) return ATTR_HIGH;
+    if (percent >= 70) return ATTR_MEDIUM;
+    return ATTR_LOW;
+}
+
+// Function to draw a bar of width characters for a percentage; returns the column after it
+static int screen_bar(Screen *screen, int row, int col, double percent, int width) {
+    int bars = (int)(percent * width / 100);
+    CellAttr attr = level_attr(percent);
+    
+    screen_put(screen, row, col++, '[', ATTR_NORMAL);
+    for (int i = 0; i < width; i++) {
+        screen_put(screen, row, col++, i < bars ? '|' : ' ', attr);
+    }
+    screen_put(screen, row, col++, ']', ATTR_NORMAL);
+    return col;
+}
+
+// Function to draw the newest points of a history from col to the right edge. Values are
+// scaled to scale, or to the largest point shown when scale is 0.
+static void screen_sparkline(Screen *screen, int row, int col, const float *history, int points, double scale) {
+    int width = screen->cols - 1 - col;
+    int count = points < width ? points : width;
+    
+    if (count <= 0) return;
+    if (count > SPARK_POINTS) count = SPARK_POINTS;
+    if (scale <= 0) {
+        for (int i = points - count; i < points; i++) {
+            if (history[i % SPARK_POINTS] > scale) scale = history[i % SPARK_POINTS];
+        }
+        if (scale <= 0) scale = 1;
+    }
+    for (int i = 0; i < count; i++) {
+        int level = (int)(history[(points - count + i) % SPARK_POINTS] / scale * 7 + 0.5);
+        if (level < 0) level = 0;
+        if (level > 7) level = 7;
+        screen_put(screen, row, col + width - count + i, spark_levels[level], ATTR_SPARK);
+    }
+}
+
+// Function to send the frame to the terminal: cursor moves, colour changes and characters for
+// the cells that changed since the last one, all in a single write
+static void screen_flush(Screen *screen) {
+    char move[32];
+    
+    if (screen->redraw) {
+        screen_append(screen, "\033[0m\033[2J", 8);
+        for (int i = 0; i < screen->rows * screen->cols; i++) {
+            screen->shown[i].ch = ' ';
+            screen->shown[i].attr = ATTR_NORMAL;
+        }
+        screen->attr = ATTR_NORMAL;
+        screen->cursor_row = -1;
+        screen->redraw = 0;
+    }
+    
+    for (int row = 0; row < screen->rows; row++) {
+        for (int col = 0; col < screen->cols; col++) {
+            Cell *cell = &screen->cells[row * screen->cols + col];
+            Cell *shown = &screen->shown[row * screen->cols + col];
+            if (cell->ch == shown->ch && cell->attr == shown->attr) continue;
+            
+            // A short gap of unchanged cells in the current colour is cheaper to rewrite than to jump
+            int gap = col - screen->cursor_col;
+            if (row == screen->cursor_row && gap > 0 && gap <= 4) {
+                for (int i = col - gap; i < col && gap; i++) {
+                    if (screen->shown[row * screen->cols + i].attr != screen->attr) gap = 0;
+                }
+            } else {
+                gap = 0;
+            }
+            if (gap) {
+                for (int i = col - gap; i < col; i++) {
+                    screen_append_char(screen, screen->shown[row * screen->cols + i].ch);
+                }
+            } else if (row != screen->cursor_row || col != screen->cursor_col) {
+                int length = snprintf(move, sizeof(move), "\033[%d;%dH", row + 1, col + 1);
+                screen_append(screen, move, (size_t)length);
+            }
+            if (cell->attr != screen->attr) {
+                screen_append(screen, attr_escapes[cell->attr], strlen(attr_escapes[cell->attr]));
+                screen->attr = cell->attr;
+            }
+            screen_append_char(screen, cell->ch);
+            *shown = *cell;
+            screen->cursor_row = row;
+            screen->cursor_col = col + 1;
+        }
+    }
+    if (screen->out_len) screen_write(screen);
+}
+
+// Growth of a counter, 0 if it went backwards (a device or interface was reset)
+static DWORDLONG counter_delta(DWORDLONG now, DWORDLONG then) {
+    return now >= then ? now - then : 0;
+}
+
+// Function to work out the network and scheduler rates over a point that just closed
+static void dashboard_rates(Dashboard *board, const SystemResources *res, double seconds) {
+    const SystemResources *base = &board->point_base;
+    double total = 0;
+    
+    board->rate_count = res->interface_count;
+    for (int i = 0; i < res->interface_count; i++) {
+        const NetInterface *now = &res->interfaces[i];
+        const NetInterface *then = NULL;
+        
+        // Interfaces keep their order unless one came or went
+        if (i < base->interface_count && strcmp(base->interfaces[i].name, now->name) == 0) then = &base->interfaces[i];
+        for (int j = 0; then == NULL && j < base->interface_count; j++) {
+            if (strcmp(base->interfaces[j].name, now->name) == 0) then = &base->interfaces[j];
+        }
+        memcpy(board->rate_names[i], now->name, sizeof(board->rate_names[i]));
+        board->rx_rate[i] = then ? (float)(counter_delta(now->rx_bytes, then->rx_bytes) / seconds) : 0;
+        board->tx_rate[i] = then ? (float)(counter_delta(now->tx_bytes, then->tx_bytes) / seconds) : 0;
+        board->packet_rate[i] = then ? (float)((counter_delta(now->rx_packets, then->rx_packets) +
+                                                counter_delta(now->tx_packets, then->tx_packets)) / seconds) : 0;
+        total += board->rx_rate[i] + board->tx_rate[i];
+    }
+    board->net_rate[board->points % SPARK_POINTS] = (float)total;
+    board->switch_rate = (float)(counter_delta(res->context_switches, base->context_switches) / seconds);
+    for (int i = 0; i < SOFTIRQ_TYPES; i++) {
+        board->softirq_rate[i] = (float)(counter_delta(res->softirqs[i], base->softirqs[i]) / seconds);
+    }
+}
+
+// Function to add a sample to the dashboard; sparkline points close every SPARK_PERIOD_MS
+void dashboard_add(Dashboard *board, const SystemResources *res) {
+    int64_t ms = (int64_t)res->timestamp * 1000 + res->timestamp_ms;
+    
+    if (!board->have_latest) {
+        board->point_start_ms = ms;
+        board->point_base = *res;
+    } else if (ms - board->point_start_ms >= SPARK_PERIOD_MS) {
+        double seconds = (ms - board->point_start_ms) / 1000.0;
+        int slot = board->points % SPARK_POINTS;
+        board->cpu[slot] = board->cpu_samples ? (float)(board->cpu_sum / board->cpu_samples) : 0;
+        board->memory[slot] = (float)board->latest.memory_usage_percent;
+        board->read_rate[slot] = (float)(counter_delta(res->disk_read_bytes, board->point_base.disk_read_bytes) / seconds);
+        board->write_rate[slot] = (float)(counter_delta(res->disk_write_bytes, board->point_base.disk_write_bytes) / seconds);
+        dashboard_rates(board, res, seconds);
+        board->points++;
+        board->point_start_ms = ms;
+        board->point_base = *res;
+        board->cpu_sum = 0;
+        board->cpu_samples = 0;
+    }
+    board->cpu_sum += res->cpu_usage;
+    board->cpu_samples++;
+    board->latest = *res;
+    board->have_latest = 1;
+}
+
+// Function to describe how well the sampler kept time
+static void format_sampler_stats(const SamplerStats *stats, char *text, size_t size) {
+    unsigned long long samples = __atomic_load_n(&stats->samples, __ATOMIC_RELAXED);
+    unsigned long long jitter_sum = __atomic_load_n(&stats->jitter_sum_ns, __ATOMIC_RELAXED);
+    
+    snprintf(text, size, "Samples: %llu  Missed ticks: %llu  Dropped: %llu  Jitter: avg %.1f us, max %.1f us",
+             samples,
+             __atomic_load_n(&stats->missed, __ATOMIC_RELAXED),
+             __atomic_load_n(&stats->dropped, __ATOMIC_RELAXED),
+             samples ? jitter_sum / 1000.0 / samples : 0.0,
+             __atomic_load_n(&stats->jitter_max_ns, __ATOMIC_RELAXED) / 1000.0);
+}
+
+// Function to print how well the sampler kept time
+void print_sampler_stats(const SamplerStats *stats) {
+    char text[160];
+    format_sampler_stats(stats, text, sizeof(text));
+    printf("%s\n", text);
+}
+
+#ifndef _WIN32
+// Function to list the busiest processes from row on; returns the row after them
+static int display_top_processes(Screen *screen, int row, const ProcessTable *table) {
+    static const char *sort_names[] = {"CPU", "memory", "I/O", "context switches"};
+    
+    screen_text(screen, row++, 0, ATTR_NORMAL, "Processes: %d  (by %s, scanned in %.1f ms)",
+                table->count, sort_names[table->sort], table->scan_ms);
+    screen_text(screen, row++, 0, ATTR_TITLE, "%7s  %-15s %7s %10s %10s %9s",
+                "PID", "NAME", "CPU%", "RSS MB", "IO KB/s", "CSW/s");
+    for (int i = 0; i < table->top_count; i++) {
+        const ProcessEntry *entry = &table->entries[table->top[i]];
+        screen_text(screen, row++, 0, ATTR_NORMAL, "%7d  %-15s %7.1f %10.1f %10.1f %9.0f",
+                    entry->pid,
+                    entry->name,
+                    entry->cpu_percent,
+                    entry->rss_bytes / (1024.0 * 1024),
+                    entry->io_rate / 1024,
+                    entry->switch_rate);
+    }
+    return row + 1;
+}
+
+// Function to list the busiest control groups; groups left out of the last scan were idle
+static int display_cgroups(Screen *screen, int row, const CgroupTable *table) {
+    screen_text(screen, row++, 0, ATTR_NORMAL, "Cgroups: %d  (%d busy, scanned in %.1f ms)",
+                table->count, table->active_count, table->scan_ms);
+    screen_text(screen, row++, 0, ATTR_TITLE, "%7s %9s %9s %9s %9s %6s %6s %6s  %s",
+                "CPU%", "MEM MB", "ANON MB", "RD KB/s", "WR KB/s", "PSIcpu", "PSImem", "PSIio", "PATH");
+    for (int i = 0; i < table->top_count; i++) {
+        const CgroupEntry *entry = &table->entries[table->top[i]];
+        double worst = entry->pressure[0];
+        for (int j = 1; j < 3; j++) {
+            if (entry->pressure[j] > worst) worst = entry->pressure[j];
+        }
+        screen_text(screen, row++, 0, level_attr(worst), "%7.1f %9.1f %9.1f %9.1f %9.1f %6.1f %6.1f %6.1f  /%s",
+                    entry->cpu_percent,
+                    entry->memory_current / (1024.0 * 1024),
+                    entry->anon / (1024.0 * 1024),
+                    entry->read_rate / 1024,
+                    entry->write_rate / 1024,
+                    entry->pressure[0],
+                    entry->pressure[1],
+                    entry->pressure[2],
+                    entry->path);
+    }
+    return row + 1;
+}
+#endif
+
+// Function to list the alert rules firing now
+static int display_alerts(Screen *screen, int row, const AlertEngine *alerts) {
+    int col = screen_text(screen, row, 0, alerts->firing ? ATTR_HIGH : ATTR_NORMAL, "Alerts: %d of %d rules firing%s",
+                          alerts->firing, alerts->rule_count, alerts->firing ? ":" : "");
+    for (int i = 0; i < alerts->rule_count && col < screen->cols; i++) {
+        if (alerts->rules[i].firing) col = screen_text(screen, row, col, ATTR_HIGH, " %s", alerts->rules[i].name);
+    }
+    return row + 2;
+}
+
+// Function to display current system resources; stats, processes, cgroups and alerts are NULL when not kept
+void display_current_resources(Screen *screen, const Dashboard *board, const SamplerStats *stats,
+                               const ProcessTable *processes, const CgroupTable *cgroups, const AlertEngine *alerts) {
+    const SystemResources *res = &board->latest;
+    int newest = (board->points + SPARK_POINTS - 1) % SPARK_POINTS;
+    int row = 0;
+    
+    if (!screen_begin(screen)) return;
+    
+    char timestamp_str[30];
+    struct tm *tm_info = localtime(&res->timestamp);
+    strftime(timestamp_str, 30, "%Y-%m-%d %H:%M:%S", tm_info);
+    
+    screen_text(screen, row++, 0, ATTR_TITLE, "===== SYSTEM RESOURCE MONITOR =====");
+    screen_text(screen, row++, 0, ATTR_NORMAL, "Time: %s.%03d", timestamp_str, res->timestamp_ms);
+    row++;
+    
+    // CPU usage with its bar and history, then the cores as many to a line as fit
+    int col = screen_text(screen, row, 0, ATTR_NORMAL, "CPU Usage:    %6.2f%% ", res->cpu_usage);
+    col = screen_bar(screen, row, col, res->cpu_usage, 20);
+    screen_sparkline(screen, row++, col + 2, board->cpu, board->points, 100);
+    int per_line = screen->cols / 28 > 0 ? screen->cols / 28 : 1;
+    for (int i = 0; i < res->core_count; i++) {
+        col = screen_text(screen, row, (i % per_line) * 28, ATTR_NORMAL, "  cpu%-3d %5.1f%% ", i, res->core_usage[i]);
+        screen_bar(screen, row, col, res->core_usage[i], 10);
+        if (i % per_line == per_line - 1 || i == res->core_count - 1) row++;
+    }
+    row++;
+    
+    // Memory usage
+    double used_memory_gb = (res->memory_total - res->memory_available) / (1024.0 * 1024 * 1024);
+    double total_memory_gb = res->memory_total / (1024.0 * 1024 * 1024);
+    
+    col = screen_text(screen, row, 0, ATTR_NORMAL, "Memory Usage: %6.2f%% ", res->memory_usage_percent);
+    col = screen_bar(screen, row, col, res->memory_usage_percent, 20);
+    screen_sparkline(screen, row++, col + 2, board->memory, board->points, 100);
+    screen_text(screen, row++, 0, ATTR_NORMAL, "Memory Used: %.2f GB / %.2f GB", used_memory_gb, total_memory_gb);
+    row++;
+    
+    // Disk I/O: totals, the rate over the last point, and the rate history
+    double read_rate = board->points ? board->read_rate[newest] : 0;
+    double write_rate = board->points ? board->write_rate[newest] : 0;
+    col = screen_text(screen, row, 0, ATTR_NORMAL, "Disk Read:  %10.2f MB %9.2f MB/s",
+                      res->disk_read_bytes / (1024.0 * 1024), read_rate / (1024 * 1024));
+    screen_sparkline(screen, row++, col + 2, board->read_rate, board->points, 0);
+    col = screen_text(screen, row, 0, ATTR_NORMAL, "Disk Write: %10.2f MB %9.2f MB/s",
+                      res->disk_write_bytes / (1024.0 * 1024), write_rate / (1024 * 1024));
+    screen_sparkline(screen, row++, col + 2, board->write_rate, board->points, 0);
+    row++;
+    
+    // Network traffic per interface, and what the scheduler is doing
+    if (res->interface_count > 0) {
+        double net_rate = board->points ? board->net_rate[newest] : 0;
+        col = screen_text(screen, row, 0, ATTR_NORMAL, "Network:   %3d interfaces %9.2f MB/s",
+                          res->interface_count, net_rate / (1024 * 1024));
+        screen_sparkline(screen, row++, col + 2, board->net_rate, board->points, 0);
+        for (int i = 0; i < board->rate_count; i++) {
+            screen_text(screen, row++, 0, ATTR_NORMAL, "  %-15s rx %10.1f KB/s  tx %10.1f KB/s %10.0f pkt/s",
+                        board->rate_names[i], board->rx_rate[i] / 1024, board->tx_rate[i] / 1024, board->packet_rate[i]);
+        }
+        row++;
+    }
+    if (res->context_switches > 0) {
+        screen_text(screen, row++, 0, ATTR_NORMAL, "Run queue: %d  Blocked: %d  Context switches: %.0f/s",
+                    res->procs_running, res->procs_blocked, board->switch_rate);
+        col = screen_text(screen, row, 0, ATTR_NORMAL, "Softirqs/s:");
+        for (int i = 0; i < SOFTIRQ_TYPES && col < screen->cols; i++) {
+            if (board->softirq_rate[i] >= 0.5f) {
+                col = screen_text(screen, row, col, ATTR_NORMAL, " %s %.0f", softirq_names[i], board->softirq_rate[i]);
+            }
+        }
+        row += 2;
+    }
+    
+    if (alerts) row = display_alerts(screen, row, alerts);
+#ifndef _WIN32
+    if (processes) row = display_top_processes(screen, row, processes);
+    if (cgroups) row = display_cgroups(screen, row, cgroups);
+#else
+    (void)processes;
+    (void)cgroups;
+#endif
+    
+    if (stats) {
+        char text[160];
+        format_sampler_stats(stats, text, sizeof(text));
+        screen_text(screen, row++, 0, ATTR_DIM, "%s", text);
+        row++;
+    }
+    
+    screen_text(screen, row, 0, ATTR_DIM, "Press Ctrl+C to exit...");
+    screen_flush(screen);
+}
+
+// Function to add formatted text to a metrics page; a line that does not fit fills the page
+static void page_append(char *page, size_t size, size_t *length, const char *format, ...) {
+    va_list args;
+    
+    if (*length >= size) return;
+    va_start(args, format);
+    int written = vsnprintf(page + *length, size - *length, format, args);
+    va_end(args);
+    if (written < 0 || (size_t)written >= size - *length) {
+        page[*length] = '\0';
+        *length = size;
+    } else {
+        *length += (size_t)written;
+    }
+}
+
+// Function to escape a label value; interface names may hold quotes and backslashes.
+// escaped needs room for twice the length of text.
+static void label_escape(const char *text, char *escaped) {
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\') *escaped++ = '\\';
+        *escaped++ = *text;
+    }
+    *escaped = '\0';
+}
+
+// Function to render a sample in Prometheus text format; stats is NULL when not kept
+static size_t format_metrics(char *page, size_t size, const SystemResources *res, const SamplerStats *stats) {
+    size_t length = 0;
+    
+    page_append(page, size, &length,
+                "# HELP resmon_cpu_usage_percent CPU time in use over the last sample interval.\n"
+                "# TYPE resmon_cpu_usage_percent gauge\n"
+                "resmon_cpu_usage_percent %.2f\n",
+                res->cpu_usage);
+    if (res->core_count > 0) {
+        page_append(page, size, &length,
+                    "# HELP resmon_core_usage_percent CPU time in use per core over the last sample interval.\n"
+                    "# TYPE resmon_core_usage_percent gauge\n");
+        for (int i = 0; i < res->core_count; i++) {
+            page_append(page, size, &length, "resmon_core_usage_percent{core=\"%d\"} %.1f\n", i, res->core_usage[i]);
+        }
+    }
+    page_append(page, size, &length,
+                "# HELP resmon_memory_total_bytes Physical memory.\n"
+                "# TYPE resmon_memory_total_bytes gauge\n"
+                "resmon_memory_total_bytes %llu\n"
+                "# HELP resmon_memory_available_bytes Memory available without swapping.\n"
+                "# TYPE resmon_memory_available_bytes gauge\n"
+                "resmon_memory_available_bytes %llu\n"
+                "# HELP resmon_memory_usage_percent Share of physical memory in use.\n"
+                "# TYPE resmon_memory_usage_percent gauge\n"
+                "resmon_memory_usage_percent %.2f\n"
+                "# HELP resmon_disk_read_bytes_total Bytes read from whole disks.\n"
+                "# TYPE resmon_disk_read_bytes_total counter\n"
+                "resmon_disk_read_bytes_total %llu\n"
+                "# HELP resmon_disk_written_bytes_total Bytes written to whole disks.\n"
+                "# TYPE resmon_disk_written_bytes_total counter\n"
+                "resmon_disk_written_bytes_total %llu\n"
+                "# HELP resmon_sample_timestamp_seconds When the sample was taken.\n"
+                "# TYPE resmon_sample_timestamp_seconds gauge\n"
+                "resmon_sample_timestamp_seconds %lld.%03d\n",
+                (unsigned long long)res->memory_total,
+                (unsigned long long)res->memory_available,
+                res->memory_usage_percent,
+                (unsigned long long)res->disk_read_bytes,
+                (unsigned long long)res->disk_write_bytes,
+                (long long)res->timestamp, res->timestamp_ms);
+    
+    static const char *network_series[4][2] = {
+        {"resmon_network_receive_bytes_total", "Bytes received per interface."},
+        {"resmon_network_transmit_bytes_total", "Bytes sent per interface."},
+        {"resmon_network_receive_packets_total", "Packets received per interface."},
+        {"resmon_network_transmit_packets_total", "Packets sent per interface."}
+    };
+    for (int series = 0; series < 4 && res->interface_count > 0; series++) {
+        page_append(page, size, &length, "# HELP %s %s\n# TYPE %s counter\n",
+                    network_series[series][0], network_series[series][1], network_series[series][0]);
+        for (int i = 0; i < res->interface_count; i++) {
+            const NetInterface *entry = &res->interfaces[i];
+            DWORDLONG values[4] = {entry->rx_bytes, entry->tx_bytes, entry->rx_packets, entry->tx_packets};
+            char name[2 * sizeof(entry->name)];
+            label_escape(entry->name, name);
+            page_append(page, size, &length, "%s{interface=\"%s\"} %llu\n",
+                        network_series[series][0], name, (unsigned long long)values[series]);
+        }
+    }
+    if (res->context_switches > 0) {
+        page_append(page, size, &length,
+                    "# HELP resmon_context_switches_total Context switches since boot.\n"
+                    "# TYPE resmon_context_switches_total counter\n"
+                    "resmon_context_switches_total %llu\n"
+                    "# HELP resmon_procs_running Tasks runnable or running, over all CPUs.\n"
+                    "# TYPE resmon_procs_running gauge\n"
+                    "resmon_procs_running %d\n"
+                    "# HELP resmon_procs_blocked Tasks waiting for I/O.\n"
+                    "# TYPE resmon_procs_blocked gauge\n"
+                    "resmon_procs_blocked %d\n"
+                    "# HELP resmon_softirqs_total Softirqs handled since boot, by type.\n"
+                    "# TYPE resmon_softirqs_total counter\n",
+                    (unsigned long long)res->context_switches, res->procs_running, res->procs_blocked);
+        for (int i = 0; i < SOFTIRQ_TYPES; i++) {
+            page_append(page, size, &length, "resmon_softirqs_total{type=\"%s\"} %llu\n",
+                        softirq_names[i], (unsigned long long)res->softirqs[i]);
+        }
+    }
+    if (stats) {
+        page_append(page, size, &length,
+                    "# HELP resmon_samples_total Samples taken.\n"
+                    "# TYPE resmon_samples_total counter\n"
+                    "resmon_samples_total %llu\n"
+                    "# HELP resmon_missed_ticks_total Sample timer ticks that passed while a sample was being taken.\n"
+                    "# TYPE resmon_missed_ticks_total counter\n"
+                    "resmon_missed_ticks_total %llu\n"
+                    "# HELP resmon_dropped_samples_total Samples thrown away because output fell behind.\n"
+                    "# TYPE resmon_dropped_samples_total counter\n"
+                    "resmon_dropped_samples_total %llu\n"
+                    "# HELP resmon_jitter_max_seconds Latest a sample has been behind its deadline.\n"
+                    "# TYPE resmon_jitter_max_seconds gauge\n"
+                    "resmon_jitter_max_seconds %.6f\n",
+                    __atomic_load_n(&stats->samples, __ATOMIC_RELAXED),
+                    __atomic_load_n(&stats->missed, __ATOMIC_RELAXED),
+                    __atomic_load_n(&stats->dropped, __ATOMIC_RELAXED),
+                    __atomic_load_n(&stats->jitter_max_ns, __ATOMIC_RELAXED) / 1e9);
+    }
+    return length;
+}
+
+// Function to publish a sample to the metrics endpoint. Only the output side calls this, and
+// it never waits: if a scrape still holds the spare page the sample is skipped.
+void metrics_publish(MetricsServer *server, const SystemResources *res, const SamplerStats *stats) {
+    int spare = !__atomic_load_n(&server->current, __ATOMIC_SEQ_CST);
+    
+    if (__atomic_load_n(&server->readers[spare], __ATOMIC_SEQ_CST) != 0) {
+        server->skipped++;
+        return;
+    }
+    server->lengths[spare] = format_metrics(server->pages[spare], METRICS_PAGE_SIZE, res, stats);
+    __atomic_store_n(&server->current, spare, __ATOMIC_SEQ_CST);
+}
+
+// Function to copy the current page for a scrape. The page is pinned first and current
+// checked again, so a page the output side has started rewriting is never copied.
+static size_t metrics_copy(MetricsServer *server) {
+    int page;
+    
+    for (;;) {
+        page = __atomic_load_n(&server->current, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&server->readers[page], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&server->current, __ATOMIC_SEQ_CST) == page) break;
+        __atomic_sub_fetch(&server->readers[page], 1, __ATOMIC_SEQ_CST);
+    }
+    size_t length = server->lengths[page];
+    memcpy(server->copy, server->pages[page], length);
+    __atomic_sub_fetch(&server->readers[page], 1, __ATOMIC_SEQ_CST);
+    return length;
+}
+
+static int send_all(SOCKET sock, const char *data, size_t length) {
+    while (length > 0) {
+#ifdef _WIN32
+        int sent = send(sock, data, (int)length, 0);
+#else
+        // A scraper that hung up should fail the send, not kill the monitor with SIGPIPE
+        int sent = (int)send(sock, data, length, MSG_NOSIGNAL);
+#endif
+        if (sent <= 0) return 0;
+        data += sent;
+        length -= (size_t)sent;
+    }
+    return 1;
+}
+
+// Function to answer one scrape: read the request, send the page or an error and hang up
+static void metrics_serve(MetricsServer *server, SOCKET client) {
+    char request[METRICS_REQUEST_SIZE];
+    char header[256];
+    int received = 0;
+    
+    // A client that never finishes its request only holds the endpoint for a second
+#ifdef _WIN32
+    DWORD timeout = 1000;
+#else
+    struct timeval timeout = {1, 0};
+#endif
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+    
+    // Read up to the blank line that ends the headers
+    request[0] = '\0';
+    while (received < (int)sizeof(request) - 1) {
+        int n = (int)recv(client, request + received, sizeof(request) - 1 - received, 0);
+        if (n <= 0) break;
+        received += n;
+        request[received] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+    }
+    if (received == 0) {
+        closesocket(client);
+        return;
+    }
+    
+    const char *status = "200 OK";
+    const char *body = server->copy;
+    size_t length = 0;
+    if (strncmp(request, "GET ", 4) != 0) {
+        status = "405 Method Not Allowed";
+    } else if (strncmp(request + 4, "/metrics ", 9) != 0 && strncmp(request + 4, "/ ", 2) != 0) {
+        status = "404 Not Found";
+    } else {
+        length = metrics_copy(server);
+        __atomic_add_fetch(&server->scrapes, 1, __ATOMIC_RELAXED);
+    }
+    int header_length = snprintf(header, sizeof(header),
+                                 "HTTP/1.0 %s\r\n"
+                                 "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                                 "Content-Length: %zu\r\n"
+                                 "Connection: close\r\n\r\n",
+                                 status, length);
+    if (send_all(client, header, (size_t)header_length)) send_all(client, body, length);
+    closesocket(client);
+}
+
+// Metrics thread: serve scrapes one at a time, waking now and then to see whether to stop
+#ifdef _WIN32
+static DWORD WINAPI metrics_thread(LPVOID arg) {
+#else
+static void *metrics_thread(void *arg) {
+#endif
+    MetricsServer *server = (MetricsServer *)arg;
+    
+    while (__atomic_load_n(&server->running, __ATOMIC_ACQUIRE)) {
+        fd_set ready;
+        struct timeval wait = {0, 200000};
+        FD_ZERO(&ready);
+        FD_SET(server->listener, &ready);
+        if (select((int)server->listener + 1, &ready, NULL, NULL, &wait) <= 0) continue;
+        
+        SOCKET client = accept(server->listener, NULL, NULL);
+        if (client != INVALID_SOCKET) metrics_serve(server, client);
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+// Function to stop the metrics endpoint and remove its socket file
+void metrics_close(MetricsServer *server) {
+    if (server == NULL) return;
+    
+    if (server->running) {
+        __atomic_store_n(&server->running, 0, __ATOMIC_RELEASE);
+#ifdef _WIN32
+        WaitForSingleObject(server->thread, INFINITE);
+        CloseHandle(server->thread);
+#else
+        pthread_join(server->thread, NULL);
+#endif
+    }
+    if (server->listener != INVALID_SOCKET) closesocket(server->listener);
+#ifndef _WIN32
+    if (server->unix_path[0]) unlink(server->unix_path);
+#endif
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    free(server->pages[0]);
+    free(server->pages[1]);
+    free(server->copy);
+    free(server);
+}
+
+// Function to bind the listening socket: a port on the loopback address, or unix:<path>
+static SOCKET metrics_listen(MetricsServer *server, const char *address) {
+    SOCKET listener;
+    
+    if (strncmp(address, "unix:", 5) == 0) {
+#ifdef _WIN32
+        (void)server;
+        printf("unix: endpoints are only available on Linux\n");
+        return INVALID_SOCKET;
+#else
+        struct sockaddr_un addr;
+        struct stat st;
+        const char *path = address + 5;
+        if (path[0] == '\0' || strlen(path) >= sizeof(addr.sun_path)) {
+            printf("Invalid socket path: %s\n", path);
+            return INVALID_SOCKET;
+        }
+        
+        // A socket left behind by an earlier run is replaced, anything else is not touched
+        if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener == INVALID_SOCKET || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR) {
+            printf("Error binding %s: %d\n", path, WSAGetLastError());
+            if (listener != INVALID_SOCKET) closesocket(listener);
+            return INVALID_SOCKET;
+        }
+        strcpy(server->unix_path, path);
+#endif
+    } else {
+        struct sockaddr_in addr;
+        int port = atoi(address);
+        if (port < 1 || port > 65535) {
+            printf("Invalid port: %s\n", address);
+            return INVALID_SOCKET;
+        }
+        
+        // Loopback only: the endpoint is for scrapers on this host
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons((unsigned short)port);
+        listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (listener != INVALID_SOCKET) {
+            int reuse = 1;
+            setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
+        }
+        if (listener == INVALID_SOCKET || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR) {
+            printf("Error binding port %d: %d\n", port, WSAGetLastError());
+            if (listener != INVALID_SOCKET) closesocket(listener);
+            return INVALID_SOCKET;
+        }
+    }
+    
+    if (listen(listener, 16) == SOCKET_ERROR) {
+        printf("Error listening: %d\n", WSAGetLastError());
+        closesocket(listener);
+        return INVALID_SOCKET;
+    }
+    return listener;
+}
+
+// Function to start the metrics endpoint on its own thread
+MetricsServer *metrics_open(const char *address) {
+    MetricsServer *server = (MetricsServer *)calloc(1, sizeof(MetricsServer));
+    if (server == NULL) return NULL;
+    
+#ifdef _WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        printf("WSAStartup failed\n");
+        free(server);
+        return NULL;
+    }
+#endif
+    server->listener = INVALID_SOCKET;
+    server->pages[0] = (char *)malloc(METRICS_PAGE_SIZE);
+    server->pages[1] = (char *)malloc(METRICS_PAGE_SIZE);
+    server->copy = (char *)malloc(METRICS_PAGE_SIZE);
+    if (server->pages[0] == NULL || server->pages[1] == NULL || server->copy == NULL) {
+        metrics_close(server);
+        return NULL;
+    }
+    
+    server->listener = metrics_listen(server, address);
+    if (server->listener == INVALID_SOCKET) {
+        metrics_close(server);
+        return NULL;
+    }
+    
+    server->running = 1;
+#ifdef _WIN32
+    server->thread = CreateThread(NULL, 0, metrics_thread, server, 0, NULL);
+    if (server->thread == NULL) server->running = 0;
+#else
+    // Signals are for the output thread
+    sigset_t block, old;
+    sigfillset(&block);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    if (pthread_create(&server->thread, NULL, metrics_thread, server) != 0) server->running = 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+#endif
+    if (!server->running) {
+        printf("Error starting the metrics thread\n");
+        metrics_close(server);
+        return NULL;
+    }
+    return server;
+}
+
+// Ctrl+C ends the sampling loop so the log is flushed and closed
+static void handle_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+// Self-profiling. Clock reads are CLOCK_MONOTONIC_RAW (QueryPerformanceCounter on Windows),
+// which stay in user space and are not slewed by NTP; a timed stage costs two of them.
+
+// Function to read the profiling clock, in nanoseconds
+static long long profile_now(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (long long)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+#endif
+}
+
+// CPU time of the whole process, all threads
+static long long process_cpu_ns(void) {
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) return 0;
+    return (long long)((((DWORDLONG)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) +
+                       (((DWORDLONG)user.dwHighDateTime << 32) | user.dwLowDateTime)) * 100;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+#endif
+}
+
+void profile_start(void) {
+    memset(&profiler, 0, sizeof(profiler));
+    profiler.start_ns = profile_now();
+    profiler.start_cpu_ns = process_cpu_ns();
+}
+
+// Bucket of a duration: values below 2^PROFILE_SUB_BITS have one each, larger ones are
+// grouped by their highest bit and split by the PROFILE_SUB_BITS bits after it
+static int profile_bucket(unsigned long long ns) {
+    if (ns < (1ULL << PROFILE_SUB_BITS)) return (int)ns;
+    int shift = 63 - __builtin_clzll(ns) - PROFILE_SUB_BITS;
+    return ((shift + 1) << PROFILE_SUB_BITS) + (int)((ns >> shift) & ((1ULL << PROFILE_SUB_BITS) - 1));
+}
+
+// Largest duration that falls in a bucket
+static unsigned long long profile_bucket_high(int bucket) {
+    int group = bucket >> PROFILE_SUB_BITS;
+    unsigned long long sub = bucket & ((1 << PROFILE_SUB_BITS) - 1);
+    if (group == 0) return sub;
+    return (((1ULL << PROFILE_SUB_BITS) + sub + 1) << (group - 1)) - 1;
+}
+
+// Function to record a stage that began at start; returns the time it ended, so the next
+// stage can start from it without another clock read. Only the stage's own thread calls this.
+static long long profile_end(ProfileStage stage, long long start) {
+    StageHistogram *histogram = &profiler.stages[stage];
+    long long end = profile_now();
+    unsigned long long ns = end > start ? (unsigned long long)(end - start) : 0;
+    int bucket = profile_bucket(ns);
+    
+    __atomic_store_n(&histogram->buckets[bucket], histogram->buckets[bucket] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->total_ns, histogram->total_ns + ns, __ATOMIC_RELAXED);
+    if (ns > histogram->max_ns) __atomic_store_n(&histogram->max_ns, ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->count, histogram->count + 1, __ATOMIC_RELAXED);
+    return end;
+}
+
+// Duration with a unit that keeps it short
+static void format_ns(char *text, size_t size, double ns) {
+    if (ns < 1e3) {
+        snprintf(text, size, "%.0fns", ns);
+    } else if (ns < 1e6) {
+        snprintf(text, size, "%.1fus", ns / 1e3);
+    } else if (ns < 1e9) {
+        snprintf(text, size, "%.1fms", ns / 1e6);
+    } else {
+        snprintf(text, size, "%.2fs", ns / 1e9);
+    }
+}
+
+// Function to write the profile: the process's CPU time against the wall clock, then each stage's
+// latency percentiles and its share of the wall clock. Safe to call while the stages run.
+void profile_report(FILE *out) {
+    double wall_ns = (double)(profile_now() - profiler.start_ns);
+    double cpu_ns = (double)(process_cpu_ns() - profiler.start_cpu_ns);
+    static const double quantiles[4] = {0.50, 0.90, 0.99, 0.999};
+    
+    fprintf(out, "Self-profile over %.1f s: %.3f%% of a CPU (%.1f ms of CPU time)\n",
+            wall_ns / 1e9, wall_ns > 0 ? 100.0 * cpu_ns / wall_ns : 0.0, cpu_ns / 1e6);
+    fprintf(out, "  %-8s %10s %8s %8s %8s %8s %8s %8s %7s\n",
+            "stage", "count", "mean", "p50", "p90", "p99", "p99.9", "max", "wall%");
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        const StageHistogram *histogram = &profiler.stages[stage];
+        unsigned long long count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+        unsigned long long total_ns = __atomic_load_n(&histogram->total_ns, __ATOMIC_RELAXED);
+        if (count == 0) continue;
+        
+        // Percentiles are reported as the top of their bucket, so they never understate
+        char text[6][16];
+        unsigned long long max_ns = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+        unsigned long long seen = 0;
+        int next = 0;
+        format_ns(text[0], sizeof(text[0]), (double)total_ns / count);
+        for (int bucket = 0; bucket < PROFILE_BUCKETS && next < 4; bucket++) {
+            seen += __atomic_load_n(&histogram->buckets[bucket], __ATOMIC_RELAXED);
+            while (next < 4 && seen >= (unsigned long long)ceil(quantiles[next] * count)) {
+                unsigned long long high = profile_bucket_high(bucket);
+                format_ns(text[1 + next], sizeof(text[0]), (double)(high < max_ns ? high : max_ns));
+                next++;
+            }
+        }
+        while (next < 4) snprintf(text[1 + next++], sizeof(text[0]), "-");
+        format_ns(text[5], sizeof(text[0]), (double)max_ns);
+        fprintf(out, "  %-8s %10llu %8s %8s %8s %8s %8s %8s %6.3f%%\n",
+                stage_names[stage], count, text[0], text[1], text[2], text[3], text[4], text[5],
+                wall_ns > 0 ? 100.0 * total_ns / wall_ns : 0.0);
+    }
+}
+
+#ifndef _WIN32
+// SIGUSR1 asks for the profile; the output side writes it, never the handler
+static void handle_profile(int sig) {
+    (void)sig;
+    profile_requested = 1;
+}
+
+// Function to append the profile to <log>.profile, which does not disturb the display
+static void profile_dump(const char *log_path) {
+    char path[1024];
+    
+    snprintf(path, sizeof(path), "%s.profile", log_path);
+    FILE *file = fopen(path, "a");
+    if (file == NULL) return;
+    time_t now = time(NULL);
+    char timestamp_str[30];
+    strftime(timestamp_str, 30, "%Y-%m-%d %H:%M:%S", localtime(&now));
+    fprintf(file, "=== %s ===\n", timestamp_str);
+    profile_report(file);
+    fclose(file);
+}
+#endif
+
+// Everything samples are handed to on the output side
+typedef struct {
+    const MonitorOptions *opts;
+    LogWriter *log;                // NULL when replaying or generating without --log
+    RollupWriter *rollups;
+    ProcessTable *processes;       // NULL without --top
+    CgroupTable *cgroups;          // NULL without --cgroups
+    Screen *screen;                // Open while run_sampler runs
+    Dashboard *dashboard;
+    MetricsServer *metrics;        // NULL without --listen
+    AlertEngine *alerts;           // NULL without --rules
+    long long scan_ns;             // When processes and cgroups were last scanned
+} MonitorOutput;
+
+// Log a sample and add it to what the display shows
+static void output_sample(MonitorOutput *out, const SystemResources *res) {
+    long long start = profile_now();
+    if (out->log && (!log_append(out->log, res) || !rollup_add(out->rollups, res))) printf("Error writing log file\n");
+    dashboard_add(out->dashboard, res);
+    start = profile_end(STAGE_FORMAT, start);
+    if (out->alerts) {
+        evaluate_alerts(out->alerts, res);
+        profile_end(STAGE_ALERTS, start);
+    }
+}
+
+// Draw a frame from the newest sample. The process and cgroup lists only change about once a
+// second; scanning /proc and /sys at the frame rate would cost more than everything else together.
+static void output_frame(MonitorOutput *out, const SamplerStats *stats) {
+    if (!out->dashboard->have_latest) return;
+#ifndef _WIN32
+    long long now = monotonic_ns();
+    if ((out->processes || out->cgroups) && (out->scan_ns == 0 || now - out->scan_ns >= 1000000000LL)) {
+        long long start = profile_now();
+        if (out->processes) process_table_scan(out->processes);
+        if (out->cgroups) cgroup_table_scan(out->cgroups);
+        profile_end(STAGE_SCAN, start);
+        out->scan_ns = now;
+    }
+#endif
+    long long start = profile_now();
+    display_current_resources(out->screen, out->dashboard, stats, out->processes, out->cgroups, out->alerts);
+    profile_end(STAGE_DRAW, start);
+}
+
+// Hand what has been logged so far to the files, and the newest sample to the metrics endpoint
+static void output_flush(MonitorOutput *out, const SamplerStats *stats) {
+    long long start = profile_now();
+    if (out->log && (!log_flush(out->log) || !rollup_flush(out->rollups))) printf("Error writing log file\n");
+    start = profile_end(STAGE_WRITE, start);
+    if (out->metrics && out->dashboard->have_latest) {
+        metrics_publish(out->metrics, &out->dashboard->latest, stats);
+        profile_end(STAGE_METRICS, start);
+    }
+}
+
+#ifdef _WIN32
+// Sample on the calling thread; Sleep only has about 15 ms resolution, so short intervals run slow.
+// Frames follow the samples here, at most refresh_hz of them a second.
+int run_sampler(MonitorOutput *out) {
+    unsigned long long frame_ms = 1000 / out->opts->refresh_hz;
+    unsigned long long next_frame = GetTickCount64();
+    
+    out->screen = screen_open();
+    if (out->screen == NULL) {
+        printf("Error setting up the display\n");
+        return 0;
+    }
+    while (!stop_requested) {
+        Sleep(out->opts->interval_ms);
+        
+        long long start = profile_now();
+        SystemResources resources = collect_system_resources();
+        profile_end(STAGE_COLLECT, start);
+        output_sample(out, &resources);
+        
+        output_flush(out, NULL);
+        if (GetTickCount64() >= next_frame) {
+            output_frame(out, NULL);
+            next_frame = GetTickCount64() + frame_ms;
+        }
+    }
+    screen_close(out->screen);
+    out->screen = NULL;
+    return 1;
+}
+#else
+// Samples handed from the collector thread to the output side. Single producer, single
+// consumer: only the collector moves head and only the output side moves tail, so neither
+// ever waits for the other. Each index sits on its own cache line.
+typedef struct {
+    SystemResources *slots;
+    unsigned long long head __attribute__((aligned(64)));
+    unsigned long long tail __attribute__((aligned(64)));
+} SampleRing;
+
+typedef struct {
+    SampleRing ring;
+    SamplerStats stats;
+    const MonitorOptions *opts;
+    int timer_fd;
+    int running;
+} Sampler;
+
+static long long timespec_ns(const struct timespec *ts) {
+    return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+// Single-writer counter update, so the output side reads whole values
+static void stat_add(unsigned long long *counter, unsigned long long amount) {
+    __atomic_store_n(counter, *counter + amount, __ATOMIC_RELAXED);
+}
+
+// Collector thread: wake on every timer tick, measure how late the wakeup was and push a sample.
+// It never blocks on output; when the ring is full the sample is dropped and counted.
+static void *collector_thread(void *arg) {
+    Sampler *sampler = (Sampler *)arg;
+    SampleRing *ring = &sampler->ring;
+    SamplerStats *stats = &sampler->stats;
+    long long interval_ns = sampler->opts->interval_ms * 1000000LL;
+    struct timespec now;
+    struct itimerspec spec;
+    
+    // Absolute deadlines on CLOCK_MONOTONIC, so lateness never accumulates into drift
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long deadline = timespec_ns(&now) + interval_ns;
+    spec.it_value.tv_sec = deadline / 1000000000LL;
+    spec.it_value.tv_nsec = deadline % 1000000000LL;
+    spec.it_interval.tv_sec = interval_ns / 1000000000LL;
+    spec.it_interval.tv_nsec = interval_ns % 1000000000LL;
+    if (timerfd_settime(sampler->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        printf("Error starting sample timer\n");
+        return NULL;
+    }
+    
+    while (__atomic_load_n(&sampler->running, __ATOMIC_ACQUIRE)) {
+        unsigned long long expirations;
+        if (read(sampler->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (!__atomic_load_n(&sampler->running, __ATOMIC_ACQUIRE)) break;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        
+        // More than one expiration means ticks went by without a sample
+        deadline += (long long)(expirations - 1) * interval_ns;
+        long long late = timespec_ns(&now) - deadline;
+        if (late < 0) late = 0;
+        deadline += interval_ns;
+        
+        stat_add(&stats->missed, expirations - 1);
+        stat_add(&stats->jitter_sum_ns, (unsigned long long)late);
+        if ((unsigned long long)late > stats->jitter_max_ns) {
+            __atomic_store_n(&stats->jitter_max_ns, (unsigned long long)late, __ATOMIC_RELAXED);
+        }
+        
+        // Collect straight into the free slot and publish it
+        unsigned long long head = ring->head;
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= RING_SLOTS) {
+            stat_add(&stats->dropped, 1);
+            continue;
+        }
+        long long start = profile_now();
+        ring->slots[head & (RING_SLOTS - 1)] = collect_system_resources();
+        profile_end(STAGE_COLLECT, start);
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+        stat_add(&stats->samples, 1);
+    }
+    return NULL;
+}
+
+// Output everything the collector has published so far, flushing once for the batch
+static void drain_ring(Sampler *sampler, MonitorOutput *out) {
+    SampleRing *ring = &sampler->ring;
+    unsigned long long tail = ring->tail;
+    unsigned long long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    
+    if (tail == head) return;
+    while (tail != head) {
+        output_sample(out, &ring->slots[tail & (RING_SLOTS - 1)]);
+        
+        // Hand the slot back only once it has been written out
+        __atomic_store_n(&ring->tail, ++tail, __ATOMIC_RELEASE);
+    }
+    output_flush(out, &sampler->stats);
+}
+
+// Sample on a dedicated thread driven by timerfd, and write the samples out from this one.
+// Slow disk or terminal writes only delay the output, never the sample timing.
+int run_sampler(MonitorOutput *out) {
+    Sampler sampler;
+    pthread_t thread;
+    sigset_t block, old;
+    
+    memset(&sampler, 0, sizeof(sampler));
+    sampler.opts = out->opts;
+    sampler.running = 1;
+    sampler.ring.slots = (SystemResources *)calloc(RING_SLOTS, sizeof(SystemResources));
+    sampler.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    out->screen = screen_open();
+    if (sampler.ring.slots == NULL || sampler.timer_fd < 0 || out->screen == NULL) {
+        screen_close(out->screen);
+        out->screen = NULL;
+        printf("Error setting up the sampler\n");
+        free(sampler.ring.slots);
+        if (sampler.timer_fd >= 0) close(sampler.timer_fd);
+        return 0;
+    }
+    
+    // Ctrl+C, terminal resizes and profile requests should land here, not interrupt the collector mid-sample
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    sigaddset(&block, SIGWINCH);
+    sigaddset(&block, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    int started = pthread_create(&thread, NULL, collector_thread, &sampler) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!started) {
+        screen_close(out->screen);
+        out->screen = NULL;
+        printf("Error starting the collector thread\n");
+        free(sampler.ring.slots);
+        close(sampler.timer_fd);
+        return 0;
+    }
+    
+    // Wake for every frame, or every DRAIN_PERIOD_MS when frames are further apart than that
+    long long frame_ns = 1000000000LL / out->opts->refresh_hz;
+    long long period_ns = frame_ns < DRAIN_PERIOD_MS * 1000000LL ? frame_ns : DRAIN_PERIOD_MS * 1000000LL;
+    long long wake = monotonic_ns();
+    long long next_frame = wake;
+    while (!stop_requested) {
+        wake += period_ns;
+        struct timespec until = {wake / 1000000000LL, wake % 1000000000LL};
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+        drain_ring(&sampler, out);
+        if (profile_requested) {
+            profile_requested = 0;
+            profile_dump(out->opts->log_path);
+        }
+        
+        long long now = monotonic_ns();
+        if (now >= next_frame) {
+            output_frame(out, &sampler.stats);
+            next_frame += frame_ns;
+            if (next_frame < now) next_frame = now + frame_ns;
+        }
+        
+        // After a stall (a slow terminal, a stopped process) carry on from now instead of catching up
+        if (wake < now - period_ns) wake = now;
+    }
+    screen_close(out->screen);
+    out->screen = NULL;
+    
+    // Fire the timer at once so the collector sees it should stop without waiting out an interval
+    struct itimerspec now = {{0, 0}, {0, 1}};
+    __atomic_store_n(&sampler.running, 0, __ATOMIC_RELEASE);
+    timerfd_settime(sampler.timer_fd, 0, &now, NULL);
+    pthread_join(thread, NULL);
+    drain_ring(&sampler, out);
+    
+    printf("\n");
+    print_sampler_stats(&sampler.stats);
+    free(sampler.ring.slots);
+    close(sampler.timer_fd);
+    return 1;
+}
+#endif
+
+// Function to sleep for a while, in nanoseconds
+static void pause_ns(long long ns) {
+    if (ns <= 0) return;
+#ifdef _WIN32
+    Sleep((DWORD)((ns + 999999) / 1000000));
+#else
+    struct timespec span = {ns / 1000000000LL, ns % 1000000000LL};
+    nanosleep(&span, NULL);
+#endif
+}
+
+// Feed replayed or generated samples through the same output as live ones. Samples are let out
+// when their recorded time comes round, scaled by --speed, and in batches of up to one drain
+// period as fast as the output takes them at --speed max. Pacing is on the profiling clock,
+// which both platforms have at full resolution.
+int run_replay(MonitorOutput *out, SampleSource *source) {
+    SamplerStats stats;
+    SystemResources res;
+    double speed = out->opts->speed;
+    
+    memset(&stats, 0, sizeof(stats));
+    memset(&res, 0, sizeof(res));
+    out->screen = screen_open();
+    if (out->screen == NULL) {
+        printf("Error setting up the display\n");
+        return 0;
+    }
+    
+    long long frame_ns = 1000000000LL / out->opts->refresh_hz;
+    long long period_ns = frame_ns < DRAIN_PERIOD_MS * 1000000LL ? frame_ns : DRAIN_PERIOD_MS * 1000000LL;
+    long long start = profile_now();
+    long long wake = start;
+    long long next_frame = start;
+    int more = sample_source_next(source, &res);
+    int64_t first_ms = (int64_t)res.timestamp * 1000 + res.timestamp_ms;
+    int64_t last_ms = first_ms;
+    
+    while (more && !stop_requested) {
+        long long now = profile_now();
+        long long batch_end = now + period_ns;
+        unsigned long long batch = 0;
+        
+        while (more) {
+            int64_t ms = (int64_t)res.timestamp * 1000 + res.timestamp_ms;
+            if (ms - last_ms > REPLAY_MAX_GAP_MS) first_ms += ms - last_ms - REPLAY_MAX_GAP_MS;
+            last_ms = ms;
+            if (speed > 0) {
+                if (start + (long long)((ms - first_ms) * 1e6 / speed) > now) break;
+            } else if ((batch & 255) == 255 && profile_now() >= batch_end) {
+                break;
+            }
+            
+            output_sample(out, &res);
+            batch++;
+            stats.samples++;
+            more = (out->opts->max_samples == 0 || stats.samples < out->opts->max_samples) &&
+                   sample_source_next(source, &res);
+        }
+        if (batch > 0) output_flush(out, &stats);
+#ifndef _WIN32
+        if (profile_requested) {
+            profile_requested = 0;
+            profile_dump(out->opts->log_path);
+        }
+#endif
+        
+        now = profile_now();
+        if (now >= next_frame) {
+            output_frame(out, &stats);
+            next_frame += frame_ns;
+            if (next_frame < now) next_frame = now + frame_ns;
+        }
+        if (speed > 0) {
+            wake += period_ns;
+            if (wake < now - period_ns) wake = now;
+            pause_ns(wake - now);
+        }
+    }
+    
+    // The last frame shows where the replay ended
+    output_frame(out, &stats);
+    screen_close(out->screen);
+    out->screen = NULL;
+    
+    double seconds = (profile_now() - start) / 1e9;
+    printf("\n%s %llu samples in %.2f s (%.0f samples/s)\n", source->replaying ? "Replayed" : "Generated",
+           stats.samples, seconds, seconds > 0 ? stats.samples / seconds : 0.0);
+    if (source->lost) printf("%llu samples lost to blocks cut short or corrupt\n", source->lost);
+    return 1;
+}
+
+// Function to close whatever the samples came from
+static void close_sources(SampleSource *source) {
+    if (source) {
+        sample_source_close(source);
+        free(source);
+    } else {
+        close_collectors();
+    }
+}
+
+// Function to read the --sort metric
+static int parse_sort(const char *name, ProcessSort *sort) {
+    if (strcmp(name, "cpu") == 0) {
+        *sort = SORT_CPU;
+    } else if (strcmp(name, "rss") == 0) {
+        *sort = SORT_RSS;
+    } else if (strcmp(name, "io") == 0) {
+        *sort = SORT_IO;
+    } else if (strcmp(name, "ctxsw") == 0) {
+        *sort = SORT_SWITCHES;
+    } else {
+        printf("Unknown sort: %s (use cpu, rss, io or ctxsw)\n", name);
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    MonitorOptions opts;
+    const char *export_path = NULL;
+    const char *csv_path = "system_resources.csv";
+    const char *query_path = NULL;
+    const char *rollup_log = NULL;
+    const char *metric = "cpu";
+    int64_t window_ms = 3600000;
+    int64_t from_ms = 0;
+    int64_t to_ms = INT64_MAX;
+    int log_given = 0;
+    opts.interval_ms = 1000;
+    opts.log_path = "system_resources.log";
+    opts.top = 0;
+    opts.sort = SORT_CPU;
+    opts.cgroups = 0;
+    opts.cgroup_root = NULL;
+    opts.refresh_hz = 30;
+    opts.listen = NULL;
+    opts.rules_path = NULL;
+    opts.alert_sink = "file:alerts.log";
+    opts.replay_path = NULL;
+    opts.pattern = NULL;
+    opts.speed = 1;
+    opts.cores = 4;
+    opts.max_samples = 0;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--interval-ms") == 0 && i + 1 < argc) {
+            opts.interval_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--log") == 0 && i + 1 < argc) {
+            opts.log_path = argv[++i];
+            log_given = 1;
+        } else if (strcmp(argv[i], "--export") == 0 && i + 1 < argc) {
+            export_path = argv[++i];
+        } else if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc) {
+            csv_path = argv[++i];
+        } else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+            opts.top = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sort") == 0 && i + 1 < argc) {
+            if (!parse_sort(argv[++i], &opts.sort)) return 1;
+        } else if (strcmp(argv[i], "--cgroups") == 0 && i + 1 < argc) {
+            opts.cgroups = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cgroup-root") == 0 && i + 1 < argc) {
+            opts.cgroup_root = argv[++i];
+        } else if (strcmp(argv[i], "--refresh-hz") == 0 && i + 1 < argc) {
+            opts.refresh_hz = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+            opts.listen = argv[++i];
+        } else if (strcmp(argv[i], "--rules") == 0 && i + 1 < argc) {
+            opts.rules_path = argv[++i];
+        } else if (strcmp(argv[i], "--alert-sink") == 0 && i + 1 < argc) {
+            opts.alert_sink = argv[++i];
+        } else if (strcmp(argv[i], "--query") == 0 && i + 1 < argc) {
+            query_path = argv[++i];
+        } else if (strcmp(argv[i], "--metric") == 0 && i + 1 < argc) {
+            metric = argv[++i];
+        } else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc) {
+            window_ms = atoll(argv[++i]) * 1000;
+        } else if (strcmp(argv[i], "--from") == 0 && i + 1 < argc) {
+            if (!parse_time(argv[++i], &from_ms)) return 1;
+        } else if (strcmp(argv[i], "--to") == 0 && i + 1 < argc) {
+            if (!parse_time(argv[++i], &to_ms)) return 1;
+        } else if (strcmp(argv[i], "--rollup") == 0 && i + 1 < argc) {
+            rollup_log = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            opts.replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--generate") == 0 && i + 1 < argc) {
+            opts.pattern = argv[++i];
+        } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            i++;
+            opts.speed = strcmp(argv[i], "max") == 0 ? 0 : atof(argv[i]);
+            if (opts.speed <= 0 && strcmp(argv[i], "max") != 0) {
+                printf("--speed takes a factor such as 1 or 10, or max\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--cores") == 0 && i + 1 < argc) {
+            opts.cores = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            opts.max_samples = strtoull(argv[++i], NULL, 10);
+        } else {
+            printf("Unknown option: %s\n", argv[i]);
+            printf("Usage: %s [--interval-ms <n>] [--log <path>] [--top <n>] [--sort cpu|rss|io|ctxsw] "
+                   "[--refresh-hz <n>] [--listen <port>|unix:<path>]\n"
+                   "       %*s [--cgroups <n> [--cgroup-root <path>]] "
+                   "[--rules <path> [--alert-sink file:<path>|pipe:<command>|syslog]]\n",
+                   argv[0], (int)strlen(argv[0]), "");
+            printf("       %s --export <log> [--csv <path>]\n", argv[0]);
+            printf("       %s --query <log> [--metric cpu|mem|read|write] [--window <seconds>] "
+                   "[--from <time>] [--to <time>]\n", argv[0]);
+            printf("       %s --rollup <log>\n", argv[0]);
+            printf("       %s --replay <log> | --generate steady|sine|ramp|spike|noise [--cores <n>]\n"
+                   "       %*s [--speed <factor>|max] [--samples <n>] [--log <path>] and the display, --listen and --rules options\n",
+                   argv[0], (int)strlen(argv[0]), "");
+            return 1;
+        }
+    }
+    
+    // Export, query and rollup modes work on a recorded log and exit
+    if (export_path) {
+        return export_log_to_csv(export_path, csv_path) ? 0 : 1;
+    }
+    if (query_path) {
+        if (window_ms <= 0 || from_ms >= to_ms) {
+            printf("Invalid query range\n");
+            return 1;
+        }
+        return query_log_range(query_path, metric, from_ms, to_ms, window_ms) ? 0 : 1;
+    }
+    if (rollup_log) {
+        return rebuild_rollups(rollup_log) ? 0 : 1;
+    }
+    if (opts.interval_ms < 1) {
+        printf("Invalid interval\n");
+        return 1;
+    }
+    if (opts.refresh_hz < 1 || opts.refresh_hz > 1000) {
+        printf("--refresh-hz takes 1 to 1000 frames a second\n");
+        return 1;
+    }
+    if (opts.top < 0 || opts.top > MAX_TOP) {
+        printf("--top takes 1 to %d processes\n", MAX_TOP);
+        return 1;
+    }
+    if (opts.cgroups < 0 || opts.cgroups > MAX_TOP) {
+        printf("--cgroups takes 1 to %d groups\n", MAX_TOP);
+        return 1;
+    }
+    if (opts.replay_path && opts.pattern) {
+        printf("Replay a log or generate a pattern, not both\n");
+        return 1;
+    }
+    if ((opts.replay_path || opts.pattern) && (opts.top > 0 || opts.cgroups > 0)) {
+        printf("The process and cgroup views only show the live system\n");
+        return 1;
+    }
+    if (opts.cores < 1 || opts.cores > MAX_CORES) {
+        printf("--cores takes 1 to %d cores\n", MAX_CORES);
+        return 1;
+    }
+    if (opts.replay_path && log_given && strcmp(opts.replay_path, opts.log_path) == 0) {
+        printf("Replayed samples cannot be logged into the log they come from\n");
+        return 1;
+    }
+#ifdef _WIN32
+    if (opts.top > 0) {
+        printf("The per-process view needs /proc and is only available on Linux\n");
+        return 1;
+    }
+    if (opts.cgroups > 0) {
+        printf("The cgroup view needs cgroup v2 and is only available on Linux\n");
+        return 1;
+    }
+#endif
+    
+#ifdef _WIN32
+    // Set console title
+    SetConsoleTitle("System Resource Monitor");
+#endif
+    
+    // Seed random number generator
+    srand((unsigned int)time(NULL));
+    
+    // Replayed and generated samples stand in for the collectors; they are only logged with --log
+    SampleSource *source = NULL;
+    int core_count;
+    if (opts.replay_path || opts.pattern) {
+        source = (SampleSource *)malloc(sizeof(SampleSource));
+        if (source == NULL || !sample_source_open(source, &opts)) {
+            free(source);
+            return 1;
+        }
+        core_count = source->core_count;
+    } else {
+        if (!init_collectors()) {
+            return 1;
+        }
+        
+        // The first reading only sets the baseline for CPU usage, and fixes the log's core columns
+        SystemResources resources = collect_system_resources();
+        core_count = resources.core_count;
+    }
+    
+    // Open log file
+    LogWriter *log = NULL;
+    RollupWriter *rollups = NULL;
+    if (source == NULL || log_given) {
+        log = (LogWriter *)malloc(sizeof(LogWriter));
+        if (log == NULL || !log_open_writer(log, opts.log_path, core_count)) {
+            free(log);
+            close_sources(source);
+            return 1;
+        }
+        
+        rollups = (RollupWriter *)malloc(sizeof(RollupWriter));
+        if (rollups == NULL || !rollup_open_writer(rollups, opts.log_path, 0)) {
+            free(rollups);
+            log_close_writer(log);
+            free(log);
+            close_sources(source);
+            return 1;
+        }
+    }
+    
+    Dashboard *dashboard = (Dashboard *)calloc(1, sizeof(Dashboard));
+    MetricsServer *metrics = NULL;
+    AlertEngine *alerts = NULL;
+    if (dashboard && opts.listen) metrics = metrics_open(opts.listen);
+    if (dashboard && opts.rules_path) alerts = alert_engine_create(opts.rules_path, opts.alert_sink);
+    if (dashboard == NULL || (opts.listen && metrics == NULL) || (opts.rules_path && alerts == NULL)) {
+        if (dashboard == NULL) printf("Error setting up the display\n");
+        metrics_close(metrics);
+        alert_engine_destroy(alerts);
+        free(dashboard);
+        rollup_close_writer(rollups);
+        free(rollups);
+        log_close_writer(log);
+        free(log);
+        close_sources(source);
+        return 1;
+    }
+    
+    MonitorOutput out;
+    memset(&out, 0, sizeof(out));
+    out.opts = &opts;
+    out.log = log;
+    out.rollups = rollups;
+    out.dashboard = dashboard;
+    out.metrics = metrics;
+    out.alerts = alerts;
+#ifndef _WIN32
+    if (opts.top > 0) out.processes = process_table_create(opts.top, opts.sort);
+    if (opts.cgroups > 0) out.cgroups = cgroup_table_create(opts.cgroup_root, opts.cgroups);
+#endif
+    
+    printf("System Resource Monitor Started\n");
+    if (source && source->replaying) {
+        printf("Replaying %llu samples from %s", source->total, opts.replay_path);
+    } else if (source) {
+        printf("Generating a %s load on %d cores, a sample every %d ms", opts.pattern, core_count, opts.interval_ms);
+    }
+    if (source && opts.speed > 0) printf(" at %gx\n", opts.speed);
+    if (source && opts.speed <= 0) printf(" as fast as they go\n");
+    if (log && source) printf("Logging to %s\n", opts.log_path);
+    if (log && !source) printf("Logging to %s every %d ms\n", opts.log_path, opts.interval_ms);
+    if (metrics) printf("Serving metrics on %s\n", opts.listen);
+    if (alerts) printf("Evaluating %d alert rules, alerts to %s\n", alerts->rule_count, opts.alert_sink);
+    
+    signal(SIGINT, handle_stop);
+    signal(SIGTERM, handle_stop);
+#ifndef _WIN32
+    signal(SIGUSR1, handle_profile);
+#endif
+    profile_start();
+    int ok = source ? run_replay(&out, source) : run_sampler(&out);
+    profile_report(stdout);
+    
+    // Close log file
+    log_close_writer(log);
+    free(log);
+    if (!rollup_close_writer(rollups)) printf("Error writing rollups\n");
+    free(rollups);
+    if (metrics) {
+        printf("Metrics: %llu scrapes, %llu updates skipped while a scrape held the page\n",
+               __atomic_load_n(&metrics->scrapes, __ATOMIC_RELAXED), metrics->skipped);
+    }
+    metrics_close(metrics);
+    if (alerts) printf("Alerts: %llu sent\n", alerts->raised);
+    alert_engine_destroy(alerts);
+    free(dashboard);
+#ifndef _WIN32
+    process_table_destroy(out.processes);
+    cgroup_table_destroy(out.cgroups);
+#endif
+    close_sources(source);
+    
+    return ok ? 0 : 1;
+}